@@ -25,10 +25,14 @@
 #ifndef _LIBLATTUTIL_H
 #define	_LIBLATTUTIL_H
 
+#include <limits.h>
 #include <stdbool.h>
 #include <sys/queue.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
 
 #include <sqlite3.h>
 #include <ucl.h>
@@ -46,11 +50,296 @@ typedef struct _sqlite_ctx sqlite_ctx_t;
 
 #define LATTUTIL_SQL_FLAG_LOG_QUERY	0x1
 
+/* Query flag: reset the statement after each exec instead of finalizing */
+#define LATTUTIL_SQL_QUERY_FLAG_REUSE	0x1
+
 #define	LATTUTIL_SQL_FLAG_ISSET(q, f) (((q)->lsq_flags & f) == f)
 
+#define LATTUTIL_LOG_ASYNC_BLOCK	0
+#define LATTUTIL_LOG_ASYNC_DROP_NEWEST	1
+#define LATTUTIL_LOG_ASYNC_DROP_OLDEST	2
+
+#define LATTUTIL_LOG_ASYNC_MSGSZ	1024
+
+#define	LATTUTIL_LOG_DECODE_TIMESTAMPS	0x1
+
+#define	LATTUTIL_LOG_SHM_PID		0x1
+
+#define	LATTUTIL_LOG_COMPRESS_NONE	0
+#define	LATTUTIL_LOG_COMPRESS_ROTATED	1
+#define	LATTUTIL_LOG_COMPRESS_STREAM	2
+
+#define	LATTUTIL_SYSLOG_RFC3164		0
+#define	LATTUTIL_SYSLOG_RFC5424		1
+
+/*
+ * Line prefix flags for the text backends. LATTUTIL_LOG_PREFIX_MSEC
+ * implies LATTUTIL_LOG_PREFIX_TIME.
+ */
+#define	LATTUTIL_LOG_PREFIX_TIME	0x01
+#define	LATTUTIL_LOG_PREFIX_MSEC	0x02
+#define	LATTUTIL_LOG_PREFIX_HOSTNAME	0x04
+#define	LATTUTIL_LOG_PREFIX_PROGNAME	0x08
+#define	LATTUTIL_LOG_PREFIX_PID		0x10
+
+#define	LATTUTIL_LOG_PREFIX_MAX		384
+
+/*
+ * Value types for lattutil_log_kv(). Integers of type LATTUTIL_KV_INT
+ * are passed as int, LATTUTIL_KV_INT64 and LATTUTIL_KV_UINT64 as
+ * int64_t and uint64_t, LATTUTIL_KV_BOOL as int.
+ */
+#define	LATTUTIL_KV_STRING		0
+#define	LATTUTIL_KV_INT			1
+#define	LATTUTIL_KV_INT64		2
+#define	LATTUTIL_KV_UINT64		3
+#define	LATTUTIL_KV_DOUBLE		4
+#define	LATTUTIL_KV_BOOL		5
+
+typedef enum _lllog_level {
+	LATTUTIL_LOG_LEVEL_DEBUG = 0,
+	LATTUTIL_LOG_LEVEL_ERR,
+	LATTUTIL_LOG_LEVEL_INFO,
+	LATTUTIL_LOG_LEVEL_WARN,
+	LATTUTIL_LOG_LEVEL_MAX
+} lattutil_log_level_t;
+
+/*
+ * Flag or'd into the level handed to an emit handler when the message
+ * is a complete record, such as a JSON object, that must be written
+ * without the level prefix.
+ */
+#define	LATTUTIL_LOG_LEVEL_RAW		0x80
+#define	LATTUTIL_LOG_LEVEL_BASE(l)	\
+    ((lattutil_log_level_t)((l) & ~LATTUTIL_LOG_LEVEL_RAW))
+
+#define	LATTUTIL_LOG_LEVEL_MASK(l)	(1U << LATTUTIL_LOG_LEVEL_BASE(l))
+#define	LATTUTIL_LOG_LEVELS_ALL		\
+    (LATTUTIL_LOG_LEVEL_MASK(LATTUTIL_LOG_LEVEL_MAX) - 1)
+
+/*
+ * Calls made through the LATTUTIL_LOG_* macros below with a constant
+ * verbosity lower than LATTUTIL_LOG_MIN_VERBOSITY are compiled out.
+ * Release builds can define this before including this header.
+ * Messages logged with a verbosity of -1 are always compiled in.
+ */
+#ifndef LATTUTIL_LOG_MIN_VERBOSITY
+#define	LATTUTIL_LOG_MIN_VERBOSITY	INT_MIN
+#endif
+
+/*
+ * The verbosity and level mask may be changed while other threads are
+ * logging, so they are always read with relaxed atomic loads.
+ */
+#define	LATTUTIL_LOG_VERBOSITY(logp)					\
+    __atomic_load_n(&(logp)->ll_verbosity, __ATOMIC_RELAXED)
+#define	LATTUTIL_LOG_LEVELS(logp)					\
+    __atomic_load_n(&(logp)->ll_levels, __ATOMIC_RELAXED)
+
+/*
+ * Determine whether a message would be logged without calling into
+ * the backend. Both arguments may be evaluated more than once.
+ */
+#define	LATTUTIL_LOG_WANTED(logp, l, v)					\
+    ((((v) == -1) || ((v) >= LATTUTIL_LOG_MIN_VERBOSITY &&		\
+    (v) >= LATTUTIL_LOG_VERBOSITY(logp))) &&				\
+    (LATTUTIL_LOG_LEVELS(logp) & LATTUTIL_LOG_LEVEL_MASK(l)))
+
+/*
+ * Logging wrappers that evaluate the format arguments only if the
+ * message passes the verbosity and level checks.
+ */
+#define	LATTUTIL_LOG_DEBUG(logp, v, ...) do {				\
+	if (LATTUTIL_LOG_WANTED((logp), LATTUTIL_LOG_LEVEL_DEBUG, (v)))	\
+		(logp)->ll_log_debug((logp), (v), __VA_ARGS__);		\
+} while (0)
+
+#define	LATTUTIL_LOG_ERR(logp, v, ...) do {				\
+	if (LATTUTIL_LOG_WANTED((logp), LATTUTIL_LOG_LEVEL_ERR, (v)))	\
+		(logp)->ll_log_err((logp), (v), __VA_ARGS__);		\
+} while (0)
+
+#define	LATTUTIL_LOG_INFO(logp, v, ...) do {				\
+	if (LATTUTIL_LOG_WANTED((logp), LATTUTIL_LOG_LEVEL_INFO, (v)))	\
+		(logp)->ll_log_info((logp), (v), __VA_ARGS__);		\
+} while (0)
+
+#define	LATTUTIL_LOG_WARN(logp, v, ...) do {				\
+	if (LATTUTIL_LOG_WANTED((logp), LATTUTIL_LOG_LEVEL_WARN, (v)))	\
+		(logp)->ll_log_warn((logp), (v), __VA_ARGS__);		\
+} while (0)
+
+/*
+ * Per-call-site switches. Sites logged through LATTUTIL_LOG_SITE_*
+ * describe themselves in the lattutil_log_sites section and can be
+ * turned off, left to the usual verbosity and level checks (on), or
+ * forced to log regardless of verbosity (force) at runtime. Debug
+ * sites start off, all others start on. A site that is off costs one
+ * load and one branch, and its arguments are not evaluated.
+ *
+ * Each executable or shared object that uses the site macros must
+ * expand LATTUTIL_LOG_SITES_MODULE() once at file scope.
+ */
+#define	LATTUTIL_LOG_SITE_OFF		0
+#define	LATTUTIL_LOG_SITE_ON		1
+#define	LATTUTIL_LOG_SITE_FORCE		2
+
+typedef struct _lllog_site {
+	const char		*lls_file;
+	const char		*lls_func;
+	const char		*lls_fmt;
+	unsigned int		 lls_line;
+	lattutil_log_level_t	 lls_level;
+	int			 lls_state;
+} lattutil_log_site_t;
+
+/*
+ * The explicit alignment keeps the compiler from padding the section
+ * between descriptors, so it can be walked as an array.
+ */
+#define	LATTUTIL_LOG_SITE_CALL(logp, l, cb, v, fmt, ...) do {		\
+	static lattutil_log_site_t _lattutil_site			\
+	    __attribute__((section("lattutil_log_sites"), used,	\
+	    aligned(sizeof(void *)))) = {				\
+		.lls_file = __FILE__,					\
+		.lls_func = __func__,					\
+		.lls_fmt = (fmt),					\
+		.lls_line = __LINE__,					\
+		.lls_level = (l),					\
+		.lls_state = ((l) == LATTUTIL_LOG_LEVEL_DEBUG) ?	\
+		    LATTUTIL_LOG_SITE_OFF : LATTUTIL_LOG_SITE_ON,	\
+	};								\
+	int _lattutil_state;						\
+									\
+	_lattutil_state = __atomic_load_n(&_lattutil_site.lls_state,	\
+	    __ATOMIC_RELAXED);						\
+	if (_lattutil_state != LATTUTIL_LOG_SITE_OFF) {			\
+		if (_lattutil_state == LATTUTIL_LOG_SITE_FORCE)		\
+			(logp)->cb((logp), -1, (fmt), ##__VA_ARGS__);	\
+		else if (LATTUTIL_LOG_WANTED((logp), (l), (v)))		\
+			(logp)->cb((logp), (v), (fmt), ##__VA_ARGS__);	\
+	}								\
+} while (0)
+
+#define	LATTUTIL_LOG_SITE_DEBUG(logp, v, fmt, ...)			\
+    LATTUTIL_LOG_SITE_CALL(logp, LATTUTIL_LOG_LEVEL_DEBUG, ll_log_debug, \
+    v, fmt, ##__VA_ARGS__)
+#define	LATTUTIL_LOG_SITE_ERR(logp, v, fmt, ...)			\
+    LATTUTIL_LOG_SITE_CALL(logp, LATTUTIL_LOG_LEVEL_ERR, ll_log_err,	\
+    v, fmt, ##__VA_ARGS__)
+#define	LATTUTIL_LOG_SITE_INFO(logp, v, fmt, ...)			\
+    LATTUTIL_LOG_SITE_CALL(logp, LATTUTIL_LOG_LEVEL_INFO, ll_log_info,	\
+    v, fmt, ##__VA_ARGS__)
+#define	LATTUTIL_LOG_SITE_WARN(logp, v, fmt, ...)			\
+    LATTUTIL_LOG_SITE_CALL(logp, LATTUTIL_LOG_LEVEL_WARN, ll_log_warn,	\
+    v, fmt, ##__VA_ARGS__)
+
+/*
+ * The linker defines the bounds of the section in every module that
+ * has at least one site; the weak references keep modules without
+ * sites linking. The destructor takes the sites out of the registry
+ * before a shared object holding them is unloaded.
+ */
+#define	LATTUTIL_LOG_SITES_MODULE()					\
+extern lattutil_log_site_t __start_lattutil_log_sites[]			\
+    __attribute__((weak, visibility("hidden")));			\
+extern lattutil_log_site_t __stop_lattutil_log_sites[]			\
+    __attribute__((weak, visibility("hidden")));			\
+									\
+static void __attribute__((constructor))				\
+_lattutil_log_sites_module(void)					\
+{									\
+									\
+	lattutil_log_sites_register(__start_lattutil_log_sites,	\
+	    __stop_lattutil_log_sites);					\
+}									\
+									\
+static void __attribute__((destructor))					\
+_lattutil_log_sites_module_fini(void)					\
+{									\
+									\
+	lattutil_log_sites_unregister(__start_lattutil_log_sites);	\
+}
+
 typedef ssize_t (*log_cb)(struct _lllog *, int, const char *, ...);
+typedef ssize_t (*log_emit)(struct _lllog *, lattutil_log_level_t,
+    const char *, size_t);
 typedef void (*log_close)(struct _lllog *);
 
+/*
+ * Compression codec for the file backend. llc_open starts a stream
+ * writing to the descriptor, which the stream then owns, at the given
+ * level (zero or less for the codec's default). llc_flush pushes out
+ * everything written so far in a form a reader can decode, and
+ * llc_close finishes the stream and closes the descriptor.
+ */
+typedef struct _lllog_codec {
+	const char	*llc_name;
+	const char	*llc_suffix;
+	void		*(*llc_open)(int, int);
+	bool		 (*llc_write)(void *, const void *, size_t);
+	bool		 (*llc_flush)(void *);
+	bool		 (*llc_close)(void *);
+} lattutil_log_codec_t;
+
+extern const lattutil_log_codec_t lattutil_log_codec_gzip;
+
+typedef struct _lllog_file_opts {
+	size_t				 llfo_bufsz;
+	unsigned int			 llfo_flush_ms;
+	unsigned int			 llfo_flush_levels;
+	uint64_t			 llfo_rotate_size;
+	time_t				 llfo_rotate_interval;
+	mode_t				 llfo_mode;
+	int				 llfo_compress;
+	const lattutil_log_codec_t	*llfo_codec;
+	int				 llfo_codec_level;
+} lattutil_log_file_opts_t;
+
+typedef struct _lllog_file_stats {
+	uint64_t	 llfst_rotate_failures;
+} lattutil_log_file_stats_t;
+
+typedef struct _lllog_filter_opts {
+	unsigned int	 llfl_rate;
+	unsigned int	 llfl_burst;
+	unsigned int	 llfl_levels;
+	bool		 llfl_coalesce;
+} lattutil_log_filter_opts_t;
+
+typedef struct _lllog_filter_stats {
+	uint64_t	 llfs_ratelimited;
+	uint64_t	 llfs_coalesced;
+} lattutil_log_filter_stats_t;
+
+typedef struct _lllog_sqlite_opts {
+	const char	*llso_table;
+	size_t		 llso_batch;
+	unsigned int	 llso_flush_ms;
+	size_t		 llso_max_pending;
+	int		 llso_policy;
+} lattutil_log_sqlite_opts_t;
+
+typedef struct _lattutil_log_shm_collector lattutil_log_shm_collector_t;
+
+typedef struct _lllog_shm_stats {
+	uint64_t	 llsh_received;
+	uint64_t	 llsh_lost;
+	uint64_t	 llsh_reaped;
+} lattutil_log_shm_stats_t;
+
+typedef struct _lllog_sqlite_stats {
+	uint64_t	 llss_written;
+	uint64_t	 llss_dropped;
+	uint64_t	 llss_errors;
+} lattutil_log_sqlite_stats_t;
+
+typedef struct _lllog_alloc_stats {
+	uint64_t	 llas_scratch_allocs;
+	uint64_t	 llas_fallback_allocs;
+	uint64_t	 llas_bytes;
+} lattutil_log_alloc_stats_t;
+
 /*
  * Though we export the underlying data structure, using the API is
  * preferred over directly accessing the ABI.
@@ -64,8 +353,123 @@ typedef struct _llconfig {
 	const ucl_object_t	*l_rootobj;
 	void			*l_aux;
 	size_t			 l_auxsz;
+	void			*l_map;
+	size_t			 l_mapsz;
 } lattutil_config_path_t;
 
+typedef struct _lattutil_config_index lattutil_config_index_t;
+typedef struct _lattutil_config_watch lattutil_config_watch_t;
+typedef struct _lattutil_config_snapshot lattutil_config_snapshot_t;
+
+/*
+ * A precompiled configuration path. The path string is borrowed and
+ * must outlive the key; a string literal is the usual case.
+ */
+typedef struct _llconfig_key {
+	const char	*lck_path;
+	size_t		 lck_len;
+	uint64_t	 lck_hash;
+} lattutil_config_key_t;
+
+#define	LATTUTIL_CONFIG_BIND_STRICT	0x1
+
+#define	LATTUTIL_CONFIG_FIELD_REQUIRED	0x1
+
+typedef enum _llconfig_type {
+	LATTUTIL_CONFIG_TYPE_NONE = 0,
+	LATTUTIL_CONFIG_TYPE_INT,	/* int */
+	LATTUTIL_CONFIG_TYPE_INT64,	/* int64_t */
+	LATTUTIL_CONFIG_TYPE_BOOL,	/* bool */
+	LATTUTIL_CONFIG_TYPE_DOUBLE,	/* double */
+	LATTUTIL_CONFIG_TYPE_STRING,	/* const char *, borrowed */
+	LATTUTIL_CONFIG_TYPE_OBJECT,	/* nested struct */
+	LATTUTIL_CONFIG_TYPE_ARRAY,	/* element pointer and size_t count */
+} lattutil_config_type_t;
+
+typedef struct _llconfig_field lattutil_config_field_t;
+typedef struct _lattutil_config_binding lattutil_config_binding_t;
+
+/*
+ * A field validator is given the value just bound, in place, and
+ * returns false to reject it. For arrays it is called per element.
+ */
+typedef bool (*lattutil_config_validate_cb)(const lattutil_config_field_t *,
+    const void *);
+typedef void (*lattutil_config_report_cb)(const char *, const char *,
+    void *);
+
+/*
+ * One entry of a binding schema; a schema is an array of these ending
+ * with LATTUTIL_CONFIG_FIELD_END. lcf_key names a member of the
+ * current UCL object. OBJECT fields bind a nested struct at
+ * lcf_offset with the schema lcf_fields. ARRAY fields store an
+ * allocated array of lcf_elemtype at lcf_offset and its length in the
+ * size_t at lcf_countoff; lcf_elemsz is only needed for arrays of
+ * objects, whose schema is lcf_fields.
+ */
+struct _llconfig_field {
+	const char			*lcf_key;
+	lattutil_config_type_t		 lcf_type;
+	size_t				 lcf_offset;
+	int				 lcf_flags;
+	int64_t				 lcf_def_int;
+	double				 lcf_def_double;
+	const char			*lcf_def_string;
+	lattutil_config_validate_cb	 lcf_validate;
+	const lattutil_config_field_t	*lcf_fields;
+	lattutil_config_type_t		 lcf_elemtype;
+	size_t				 lcf_elemsz;
+	size_t				 lcf_countoff;
+};
+
+/*
+ * Schema entry helpers. Extra designated initializers, such as
+ * .lcf_flags or .lcf_validate, may follow the required arguments.
+ */
+#define	LATTUTIL_CONFIG_FIELD_INT(type, member, key, def, ...)		\
+	{ .lcf_key = (key), .lcf_type = LATTUTIL_CONFIG_TYPE_INT,	\
+	  .lcf_offset = offsetof(type, member), .lcf_def_int = (def),	\
+	  __VA_ARGS__ }
+#define	LATTUTIL_CONFIG_FIELD_INT64(type, member, key, def, ...)	\
+	{ .lcf_key = (key), .lcf_type = LATTUTIL_CONFIG_TYPE_INT64,	\
+	  .lcf_offset = offsetof(type, member), .lcf_def_int = (def),	\
+	  __VA_ARGS__ }
+#define	LATTUTIL_CONFIG_FIELD_BOOL(type, member, key, def, ...)		\
+	{ .lcf_key = (key), .lcf_type = LATTUTIL_CONFIG_TYPE_BOOL,	\
+	  .lcf_offset = offsetof(type, member), .lcf_def_int = (def),	\
+	  __VA_ARGS__ }
+#define	LATTUTIL_CONFIG_FIELD_DOUBLE(type, member, key, def, ...)	\
+	{ .lcf_key = (key), .lcf_type = LATTUTIL_CONFIG_TYPE_DOUBLE,	\
+	  .lcf_offset = offsetof(type, member), .lcf_def_double = (def),\
+	  __VA_ARGS__ }
+#define	LATTUTIL_CONFIG_FIELD_STRING(type, member, key, def, ...)	\
+	{ .lcf_key = (key), .lcf_type = LATTUTIL_CONFIG_TYPE_STRING,	\
+	  .lcf_offset = offsetof(type, member), .lcf_def_string = (def),\
+	  __VA_ARGS__ }
+#define	LATTUTIL_CONFIG_FIELD_OBJECT(type, member, key, schema, ...)	\
+	{ .lcf_key = (key), .lcf_type = LATTUTIL_CONFIG_TYPE_OBJECT,	\
+	  .lcf_offset = offsetof(type, member), .lcf_fields = (schema),	\
+	  __VA_ARGS__ }
+#define	LATTUTIL_CONFIG_FIELD_ARRAY(type, member, count, key, elemtype,	\
+    ...)								\
+	{ .lcf_key = (key), .lcf_type = LATTUTIL_CONFIG_TYPE_ARRAY,	\
+	  .lcf_offset = offsetof(type, member),				\
+	  .lcf_countoff = offsetof(type, count),			\
+	  .lcf_elemtype = (elemtype), __VA_ARGS__ }
+#define	LATTUTIL_CONFIG_FIELD_END	{ .lcf_key = NULL }
+
+typedef void (*lattutil_config_watch_cb)(lattutil_config_watch_t *,
+    lattutil_config_snapshot_t *, void *);
+
+/*
+ * A logging object may be shared by any number of threads once its
+ * backend is initialized. Each record is assembled in a per-thread
+ * buffer and written with a single write(2) or equivalent, so records
+ * never interleave, and no lock is taken on the logging path unless
+ * the backend itself buffers (file, binary, direct syslog). The
+ * verbosity and level mask may be changed at any time; initializing a
+ * different backend or freeing the object may not race with logging.
+ */
 typedef struct _lllog {
 	uint64_t	 ll_version;
 	int		 ll_verbosity;
@@ -80,7 +484,27 @@ typedef struct _lllog {
 	log_cb		 ll_log_info;
 	log_cb		 ll_log_warn;
 
+	/*
+	 * Write an already-formatted message, bypassing the
+	 * verbosity check. Used by backends that wrap other backends.
+	 */
+	log_emit	 ll_log_emit;
+
 	log_close	 ll_log_close;
+
+	/*
+	 * Mask of enabled levels. Handlers for disabled levels are
+	 * swapped for the dummy handlers and stashed in ll_log_saved.
+	 */
+	unsigned int	 ll_levels;
+	log_cb		 ll_log_saved[LATTUTIL_LOG_LEVEL_MAX];
+
+	/*
+	 * Line prefixes of the text backends, one per level, rendered
+	 * by lattutil_log_set_prefix().
+	 */
+	unsigned int	 ll_prefix_flags;
+	char		*ll_prefixes[LATTUTIL_LOG_LEVEL_MAX];
 } lattutil_log_t;
 
 typedef struct _lattutil_sql_ctx {
@@ -110,156 +534,1154 @@ typedef struct _lattutil_sqlite_query {
 	uint64_t		 lsq_flags;
 } lattutil_sqlite_query_t;
 
-#ifdef __cplusplus
-extern "C" {
-#endif
+typedef enum _lattutil_sqlite_param_type {
+	LATTUTIL_SQL_PARAM_INT,
+	LATTUTIL_SQL_PARAM_STRING,
+	LATTUTIL_SQL_PARAM_BLOB,
+	LATTUTIL_SQL_PARAM_TIME,
+} lattutil_sqlite_param_type_t;
+
+typedef struct _lattutil_sqlite_catalog lattutil_sqlite_catalog_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Find a configuration file in a set of given paths
+ *
+ * This function iterates through the set of paths, looking for the
+ * passed-in configuration file name. If the configuration file is
+ * found, a UCL parser instance is created and the file is loaded by
+ * UCL.
+ *
+ * @param Set of paths
+ * @param Number of paths in set
+ * @param Configuration file name
+ * @return Pointer to struct that contains information about the
+ * 	config file on success, NULL on error.
+ */
+lattutil_config_path_t *lattutil_find_config(const char **, size_t, const char *,
+    int);
+
+/**
+ * Free a given lattutil_config_path_t object
+ *
+ * In order to prevent UAF vulnerabilities, the structure is zeroed
+ * after all its members have been freed. Additionally, the pointer to
+ * the structure is set to NULL.
+ *
+ * @param A pointer to the to-be-freed object
+ */
+void lattutil_free_config_path(lattutil_config_path_t **);
+
+/**
+ * Find a configuration file and parse it from a memory mapping
+ *
+ * Behaves like lattutil_find_config, but maps a regular file
+ * read-only, with the size recorded in l_sb, and parses it in
+ * libucl's zero-copy mode instead of reading it into a heap buffer
+ * first. The descriptor is still kept in l_fd. The tree refers into
+ * the mapping, so indexes, bindings, and references to it must be
+ * released before the config path object is freed. String values
+ * are copied out of the mapping when first read with
+ * ucl_object_tostring; lattutil_config_index_new does that for every
+ * string up front.
+ *
+ * The mapping is not a snapshot. While the tree is alive, the file
+ * must only be replaced by renaming a new file over it; truncating
+ * or rewriting it in place can make reads of the tree return the new
+ * bytes or fault with SIGBUS. Keys are read from the mapping too, so
+ * this holds even after every string has been copied out.
+ *
+ * @param Set of paths
+ * @param Number of paths in set
+ * @param Configuration file name
+ * @param Flags passed to open(2)
+ * @return Pointer to struct that contains information about the
+ * 	config file on success, NULL on error.
+ */
+lattutil_config_path_t *lattutil_find_config_mapped(const char **, size_t,
+    const char *, int);
+
+/**
+ * Find a configuration file and load it from a precompiled image
+ *
+ * Behaves like lattutil_find_config_mapped, but first tries the image
+ * at the given path, as written by lattutil_config_image_write. The
+ * image is used only if it was compiled from the file that was found,
+ * with the same device, inode, size, and modification time, and its
+ * checksum matches. It is mapped read-only and parsed in place, so
+ * processes loading the same image share one copy of it. Otherwise
+ * the file itself is parsed. The same lifetime rules as for
+ * lattutil_find_config_mapped apply either way.
+ *
+ * @param Set of paths
+ * @param Number of paths in set
+ * @param Configuration file name
+ * @param Flags passed to open(2)
+ * @param Path to the image
+ * @return Pointer to struct that contains information about the
+ * 	config file on success, NULL on error.
+ */
+lattutil_config_path_t *lattutil_find_config_image(const char **, size_t,
+    const char *, int, const char *);
+
+/**
+ * Find and merge every layer of a configuration
+ *
+ * Where lattutil_find_config stops at the first path holding the
+ * file, this loads the file from every path, along with the *.conf
+ * fragments in each path's fragment directory. Layers apply from the
+ * last path to the first, each main file before its own fragments,
+ * and fragments in byte order of their names. A later layer merges
+ * into the result: objects under the same key merge recursively, and
+ * any other value, including an array, replaces the earlier one.
+ *
+ * The files are parsed in parallel, then merged in that fixed order.
+ * The call fails if any file fails to parse or no path holds the main
+ * file. l_path, l_fd, and l_sb describe the main file from the first
+ * path that has one, and there is no parser. A watcher would reload
+ * that file alone, so the result is not meant for
+ * lattutil_config_watch_new.
+ *
+ * @param Set of paths, highest priority first
+ * @param Number of paths in set
+ * @param Configuration file name
+ * @param Fragment directory, relative to each path, or NULL for none
+ * @param Flags passed to open(2) for the main file
+ * @param Number of parser threads, or 0 for the default
+ * @return Pointer to struct that contains information about the
+ * 	config file on success, NULL on error.
+ */
+lattutil_config_path_t *lattutil_find_config_layered(const char **, size_t,
+    const char *, const char *, int, unsigned int);
+
+/**
+ * Compile a parsed configuration file into an image
+ *
+ * Serializes the tree as msgpack behind a header that records the
+ * identity of the source file, from l_sb. The image is written to a
+ * temporary file and renamed into place, with the source's
+ * permissions. Images are in host byte order.
+ *
+ * @param The config path object
+ * @param Path to the image
+ * @return True on success, false on error
+ */
+bool lattutil_config_image_write(const lattutil_config_path_t *,
+    const char *);
+
+/**
+ * Check whether an image is current for a configuration file
+ *
+ * @param The config path object
+ * @param Path to the image
+ * @return True if lattutil_find_config_image would use the image for
+ * 	the file this object was loaded from
+ */
+bool lattutil_config_image_current(const lattutil_config_path_t *,
+    const char *);
+
+/**
+ * Set the auxiliary members of the config context object
+ *
+ * @param The config object
+ * @param The auxiliary data
+ * @param The size of the auxiliary data
+ */
+void lattutil_config_set_aux(lattutil_config_path_t *, void *, size_t);
+
+/**
+ * Get the auxiliary members of the config context object
+ *
+ * @param The config object
+ * @param[out] Optional output variable to store the recorded size of
+ *     the auxiliary member.
+ * @return The auxiliary member
+ */
+void *lattutil_config_get_aux(lattutil_config_path_t *, size_t *);
+
+/**
+ * Get the ABI version of the config path object
+ *
+ * @param The config path object
+ * @return The version number
+ */
+uint64_t lattutil_config_get_version(lattutil_config_path_t *);
+
+/**
+ * Return the fully-qualified path of the config file
+ *
+ * @param A pointer to the lattutil_config_path_t object
+ * @return The path of the config file
+ */
+char *lattutil_config_path_path(lattutil_config_path_t *);
+
+/**
+ * Return the file descriptor of the opened config
+ *
+ * @param A pointer to the lattutil_config_path_t object
+ * @return The file descriptor
+ */
+int lattutil_config_path_fd(lattutil_config_path_t *);
+
+/**
+ * Look for a string-typed variable in a UCL configuration tree.
+ *
+ * @param UCL object root
+ * @param Path within the UCL object root
+ * @param Default value to set if path is not found
+ * @return A copy of the value if found, of the default value if not,
+ * or a zero-length string if there is no default. The caller frees
+ * the result.
+ */
+char *lattutil_find_config_string(const ucl_object_t *, const char *,
+    const char *);
+
+/**
+ * Look for an integer-typed variable in a UCL configuration tree.
+ *
+ * @param UCL object root
+ * @param Path within the UCL object root
+ * @param Default value to set if path is not found
+ * @return The value if found, default value if not
+ */
+int64_t lattutil_find_config_int(const ucl_object_t *, const char *,
+    int64_t);
+
+/**
+ * Build a path index of a UCL configuration tree
+ *
+ * Every path that ucl_object_lookup_path would accept is hashed once
+ * into a flat table, so later lookups neither split the path nor walk
+ * the tree. The index holds a reference to the tree; objects and
+ * strings returned from it are valid until the index is freed.
+ *
+ * @param UCL object root
+ * @return The index on success, NULL on error
+ */
+lattutil_config_index_t *lattutil_config_index_new(const ucl_object_t *);
+
+/**
+ * Free a configuration index
+ *
+ * @param Pointer to the index
+ */
+void lattutil_config_index_free(lattutil_config_index_t **);
+
+/**
+ * Get the number of paths in a configuration index
+ *
+ * @param The index
+ * @return The number of indexed paths
+ */
+size_t lattutil_config_index_count(const lattutil_config_index_t *);
+
+/**
+ * Precompile a dotted configuration path into a key
+ *
+ * @param The key to initialize
+ * @param The path, which must outlive the key
+ */
+void lattutil_config_key_init(lattutil_config_key_t *, const char *);
+
+/**
+ * Look up a precompiled key in a configuration index
+ *
+ * @param The index
+ * @param The key
+ * @return The UCL object, or NULL if the path does not exist
+ */
+const ucl_object_t *lattutil_config_index_lookup(
+    const lattutil_config_index_t *, const lattutil_config_key_t *);
+
+/**
+ * Look up a dotted path in a configuration index
+ *
+ * @param The index
+ * @param The path
+ * @return The UCL object, or NULL if the path does not exist
+ */
+const ucl_object_t *lattutil_config_index_find(
+    const lattutil_config_index_t *, const char *);
+
+/**
+ * Look up a string-typed variable in a configuration index
+ *
+ * The result is borrowed, not copied.
+ *
+ * @param The index
+ * @param The key
+ * @param Default value if the path is missing or not a string
+ * @param If not NULL, set to the length of the result
+ * @return The value, valid until the index is freed, or the default
+ */
+const char *lattutil_config_index_string(const lattutil_config_index_t *,
+    const lattutil_config_key_t *, const char *, size_t *);
+
+/**
+ * Look up an integer-typed variable in a configuration index
+ *
+ * @param The index
+ * @param The key
+ * @param Default value if the path is missing or not numeric
+ * @return The value or the default
+ */
+int64_t lattutil_config_index_int(const lattutil_config_index_t *,
+    const lattutil_config_key_t *, int64_t);
+
+/**
+ * Look up a boolean-typed variable in a configuration index
+ *
+ * @param The index
+ * @param The key
+ * @param Default value if the path is missing or not a boolean
+ * @return The value or the default
+ */
+bool lattutil_config_index_bool(const lattutil_config_index_t *,
+    const lattutil_config_key_t *, bool);
+
+/**
+ * Look up a floating point variable in a configuration index
+ *
+ * @param The index
+ * @param The key
+ * @param Default value if the path is missing or not numeric
+ * @return The value or the default
+ */
+double lattutil_config_index_double(const lattutil_config_index_t *,
+    const lattutil_config_key_t *, double);
+
+/**
+ * Bind a configuration file into a struct
+ *
+ * Fills dst from the tree in a single pass, following a schema of
+ * lattutil_config_field_t entries. Every field first gets its default,
+ * then each member of the configuration is matched to its field,
+ * converted, and validated. Each problem is passed to the report
+ * callback, if any, with the dotted path and a description. Unknown
+ * keys are reported too, and are an error with
+ * LATTUTIL_CONFIG_BIND_STRICT.
+ *
+ * Strings are borrowed from the tree and arrays are allocated; both
+ * stay valid until the returned binding is freed. To pick up a
+ * reload, bind the new tree into a fresh struct and free the old
+ * binding once nothing uses the old struct.
+ *
+ * @param The config path object
+ * @param The schema
+ * @param The struct to fill
+ * @param Flags
+ * @param Report callback, or NULL
+ * @param Argument passed to the report callback
+ * @return The binding on success, NULL if any field failed to bind,
+ * in which case dst is left partly filled
+ */
+lattutil_config_binding_t *lattutil_config_bind(
+    const lattutil_config_path_t *, const lattutil_config_field_t *,
+    void *, int, lattutil_config_report_cb, void *);
+
+/**
+ * Bind a UCL object into a struct
+ *
+ * Same as lattutil_config_bind, for a tree that did not come from a
+ * config path object, such as a config watcher snapshot.
+ *
+ * @param UCL object root
+ * @param The schema
+ * @param The struct to fill
+ * @param Flags
+ * @param Report callback, or NULL
+ * @param Argument passed to the report callback
+ * @return The binding on success, NULL on error
+ */
+lattutil_config_binding_t *lattutil_config_bind_object(const ucl_object_t *,
+    const lattutil_config_field_t *, void *, int,
+    lattutil_config_report_cb, void *);
+
+/**
+ * Free a binding, and the strings and arrays bound through it
+ *
+ * @param Pointer to the binding
+ */
+void lattutil_config_binding_free(lattutil_config_binding_t **);
+
+/**
+ * Watch a configuration file and reload it when it changes
+ *
+ * The file found by lattutil_find_config is watched with inotify(7)
+ * or kqueue(2). Changes are parsed on a background thread and, if the
+ * new file parses, published as a new snapshot. A file that fails to
+ * parse leaves the previous snapshot in place. The first snapshot
+ * shares the config path object's tree, unless the file was loaded
+ * with lattutil_find_config_mapped.
+ *
+ * @param The config path object
+ * @return The watcher on success, NULL on error
+ */
+lattutil_config_watch_t *lattutil_config_watch_new(
+    const lattutil_config_path_t *);
+
+/**
+ * Register a function to call after each reload
+ *
+ * Callbacks run on the watcher thread, in registration order, with
+ * the new snapshot. The snapshot is only valid during the call unless
+ * the callback acquires its own reference. Callbacks must not reload
+ * the watcher or register further callbacks.
+ *
+ * @param The watcher
+ * @param The callback
+ * @param Argument passed to the callback
+ * @return True on success, false on error
+ */
+bool lattutil_config_watch_add_cb(lattutil_config_watch_t *,
+    lattutil_config_watch_cb, void *);
+
+/**
+ * Reload the configuration file now
+ *
+ * @param The watcher
+ * @return True if the file was parsed and published, false if not
+ */
+bool lattutil_config_watch_reload(lattutil_config_watch_t *);
+
+/**
+ * Acquire a reference to the current configuration snapshot
+ *
+ * This never blocks and takes no lock. The snapshot and its UCL tree
+ * stay valid, and unchanged, until released, however many reloads
+ * happen in the meantime.
+ *
+ * @param The watcher
+ * @return The current snapshot, to be released with
+ * lattutil_config_snapshot_release
+ */
+lattutil_config_snapshot_t *lattutil_config_watch_acquire(
+    lattutil_config_watch_t *);
+
+/**
+ * Get the generation of the current snapshot
+ *
+ * This is a single atomic load. Code that holds on to a snapshot can
+ * compare it with lattutil_config_snapshot_generation and only
+ * re-acquire when the configuration actually changed.
+ *
+ * @param The watcher
+ * @return The current generation, starting at 1
+ */
+uint64_t lattutil_config_watch_generation(lattutil_config_watch_t *);
+
+/**
+ * Get the number of reloads that failed to read or parse the file
+ *
+ * @param The watcher
+ * @return The number of failed reloads
+ */
+uint64_t lattutil_config_watch_errors(lattutil_config_watch_t *);
+
+/**
+ * Stop watching and free the watcher
+ *
+ * Snapshots acquired earlier remain valid until released.
+ *
+ * @param Pointer to the watcher
+ */
+void lattutil_config_watch_free(lattutil_config_watch_t **);
+
+/**
+ * Get the UCL tree of a configuration snapshot
+ *
+ * @param The snapshot
+ * @return The root UCL object
+ */
+const ucl_object_t *lattutil_config_snapshot_root(
+    const lattutil_config_snapshot_t *);
+
+/**
+ * Get the path index of a configuration snapshot
+ *
+ * Every snapshot is indexed when it is parsed, so readers never pay
+ * for it.
+ *
+ * @param The snapshot
+ * @return The index, valid until the snapshot is released
+ */
+const lattutil_config_index_t *lattutil_config_snapshot_index(
+    const lattutil_config_snapshot_t *);
+
+/**
+ * Get the generation of a configuration snapshot
+ *
+ * @param The snapshot
+ * @return The generation
+ */
+uint64_t lattutil_config_snapshot_generation(
+    const lattutil_config_snapshot_t *);
+
+/**
+ * Release a configuration snapshot
+ *
+ * @param Pointer to the snapshot
+ */
+void lattutil_config_snapshot_release(lattutil_config_snapshot_t **);
+
+/**
+ * Initialize logger
+ *
+ * @param Path
+ * @param Verbosity
+ * @return Pointer to the logging object
+ */
+lattutil_log_t *lattutil_log_init(char *, int);
+
+/**
+ * Free logger
+ *
+ * The underlying variable is set to NULL.
+ *
+ * @param Double pointer to the logging object
+ */
+void lattutil_log_free(lattutil_log_t **);
+
+/**
+ * Get the ABI version number of the log object
+ *
+ * @param The log object
+ * @return The ABI version number
+ */
+uint64_t lattutil_log_get_version(lattutil_log_t *);
+
+/**
+ * Initialize syslog-based logging
+ *
+ * @param Logging object
+ * @param syslog(3) logopt
+ * @param syslog(3) facility
+ * @return True on success, False otherwise
+ */
+bool lattutil_log_syslog_init(lattutil_log_t *, int, int);
+
+/**
+ * Initialize direct syslog logging
+ *
+ * Unlike lattutil_log_syslog_init, this does not go through the libc
+ * syslog(3) functions. Each caller formats its frame without a lock
+ * and queues it in a preallocated ring; one caller at a time sends
+ * the queued frames straight to syslogd's local datagram socket, so
+ * frames from concurrent callers go out together in one batch. The
+ * socket is never allowed to block the caller. Frames it cannot take
+ * right away stay queued for a later call; if the queue fills up,
+ * the oldest frames are dropped. RFC 5424 frames carry the logger
+ * name cut to the 48 characters allowed in APP-NAME.
+ *
+ * @param Logging object
+ * @param Path of the syslogd socket, or NULL for _PATH_LOG
+ * @param syslog(3) facility
+ * @param Frame format (LATTUTIL_SYSLOG_RFC3164 or LATTUTIL_SYSLOG_RFC5424)
+ * @return True on success, False otherwise
+ */
+bool lattutil_log_syslog_direct_init(lattutil_log_t *, const char *, int,
+    int);
+
+/**
+ * Get the number of frames dropped by a direct syslog logger
+ *
+ * @param Logging object
+ * @return Number of dropped frames
+ */
+uint64_t lattutil_log_syslog_direct_dropped(lattutil_log_t *);
+
+/**
+ * Initialize NULL logging
+ *
+ * This is the default logger. It simply discards all logging
+ * messages.
+ *
+ * @param Logging object
+ */
+void lattutil_log_dummy_init(lattutil_log_t *);
+
+/**
+ * Initialize stdio-based logging
+ *
+ * @param Logging object
+ * @return True on success, False otherwise
+ */
+bool lattutil_log_stdio_init(lattutil_log_t *);
+
+/**
+ * Initialize asynchronous logging
+ *
+ * Messages are formatted on the calling thread into a bounded ring
+ * and written to the inner logging object by a background thread.
+ * Messages longer than LATTUTIL_LOG_ASYNC_MSGSZ are truncated. The
+ * verbosity of the asynchronous logging object is used; the inner
+ * object's verbosity is ignored.
+ *
+ * The asynchronous logging object takes ownership of the inner
+ * logging object. Freeing the asynchronous logging object flushes
+ * the ring before the inner object is closed and freed.
+ *
+ * @param Logging object
+ * @param Inner logging object that messages are drained to
+ * @param Ring capacity in messages (rounded up to a power of two)
+ * @param Overflow policy (LATTUTIL_LOG_ASYNC_*)
+ * @return True on success, False otherwise
+ */
+bool lattutil_log_async_init(lattutil_log_t *, lattutil_log_t *, size_t,
+    int);
+
+/**
+ * Get the number of messages dropped by an asynchronous logger
+ *
+ * @param Logging object
+ * @return Number of dropped messages
+ */
+uint64_t lattutil_log_async_dropped(lattutil_log_t *);
+
+/**
+ * Fill in the default file logging options
+ *
+ * Records are buffered in 64 KiB, flushed every second and
+ * immediately for errors, and the file is never rotated or
+ * compressed.
+ *
+ * @param[out] Options
+ */
+void lattutil_log_file_default_opts(lattutil_log_file_opts_t *);
+
+/**
+ * Initialize file-based logging
+ *
+ * The file is opened in append mode. Records are batched in a
+ * user-space buffer that is flushed when full, when a record of one
+ * of the llfo_flush_levels arrives, and every llfo_flush_ms
+ * milliseconds. If llfo_rotate_size or llfo_rotate_interval are
+ * non-zero, the file is renamed with a timestamp suffix and reopened
+ * by a background thread once it grows past that size or age. If
+ * the rename fails, rotation by size or age is not attempted again
+ * for 30 seconds.
+ *
+ * llfo_compress selects compression with llfo_codec (gzip if NULL)
+ * at llfo_codec_level. LATTUTIL_LOG_COMPRESS_ROTATED compresses each
+ * rotated file and removes the original. LATTUTIL_LOG_COMPRESS_STREAM
+ * writes the file itself as a compressed stream, so the path should
+ * carry the codec's suffix; the rotation size then counts
+ * uncompressed bytes. Compression always runs on a background thread
+ * at the lowest priority, never on a thread that logs.
+ *
+ * @param Logging object
+ * @param Path of the log file
+ * @param Options, or NULL for the defaults
+ * @return True on success, False otherwise
+ */
+bool lattutil_log_file_init(lattutil_log_t *, const char *,
+    const lattutil_log_file_opts_t *);
+
+/**
+ * Request that the log file be reopened
+ *
+ * Use this after an external tool has moved the file away. The file
+ * is reopened by the background thread within one flush interval.
+ * Only an atomic flag is set, so this is safe to call from a signal
+ * handler.
+ *
+ * @param Logging object
+ * @return True on success, False if this is not a file logger
+ */
+bool lattutil_log_file_reopen(lattutil_log_t *);
+
+/**
+ * Request that the log file be rotated
+ *
+ * Like lattutil_log_file_reopen, this is safe to call from a signal
+ * handler and takes effect within one flush interval.
+ *
+ * @param Logging object
+ * @return True on success, False if this is not a file logger
+ */
+bool lattutil_log_file_rotate(lattutil_log_t *);
+
+/**
+ * Write out all buffered records of a file logger
+ *
+ * @param Logging object
+ * @return True on success, False otherwise
+ */
+bool lattutil_log_file_flush(lattutil_log_t *);
+
+/**
+ * Get the counters of a file logger
+ *
+ * llfst_rotate_failures counts rotations that could not rename or
+ * reopen the file.
+ *
+ * @param Logging object
+ * @param[out] Counters
+ * @return True on success, False if this is not a file logger
+ */
+bool lattutil_log_file_stats(lattutil_log_t *, lattutil_log_file_stats_t *);
+
+/**
+ * Initialize binary logging
+ *
+ * Messages are not formatted. Instead, each record holds the call
+ * site's id, a timestamp, and the raw argument values. The format
+ * string of each call site is written once, the first time the site
+ * logs. Call sites are identified by the address of the format
+ * string, so format strings should be string literals. Formats that
+ * cannot be deferred (%n, wide characters, more than 16 arguments,
+ * conversions of 64 characters or more), and messages with a string
+ * argument longer than 4096 bytes, are formatted and stored as text.
+ * A formatted message that does not fit in the 128 KiB record buffer
+ * is cut short and marked as truncated when decoded.
+ *
+ * The level functions return the number of payload bytes recorded
+ * rather than the length of the message.
+ *
+ * @param Logging object
+ * @param Path of the binary log file (truncated)
+ * @return True on success, False otherwise
+ */
+bool lattutil_log_binary_init(lattutil_log_t *, const char *);
+
+/**
+ * Write out all buffered records of a binary logger
+ *
+ * @param Logging object
+ * @return True on success, False otherwise
+ */
+bool lattutil_log_binary_flush(lattutil_log_t *);
+
+/**
+ * Decode a binary log
+ *
+ * Each record is printed as the stdio backend would have printed it.
+ *
+ * @param Binary log stream
+ * @param Output stream
+ * @param Flags (LATTUTIL_LOG_DECODE_TIMESTAMPS to prefix each line with
+ *     the time the message was logged)
+ * @return True on success, False on a malformed or truncated log
+ */
+bool lattutil_log_binary_decode(FILE *, FILE *, int);
+
+/**
+ * Get the heap allocation counters of the text backends
+ *
+ * The counters cover every thread and every logging object. Growing
+ * a thread's scratch buffer counts as a scratch allocation. Messages
+ * too large for the scratch buffer count as fallback allocations.
+ * Once the scratch buffers have warmed up, neither counter should
+ * move.
+ *
+ * @param[out] Counters
+ */
+void lattutil_log_get_alloc_stats(lattutil_log_alloc_stats_t *);
+
+/**
+ * Format a message the way the logging backends do
+ *
+ * Behaves like vsnprintf(3), whose output it always matches. %s, %c,
+ * %d, %i, %u, %x, %X, %p, and %%, optionally with the l, ll, or z
+ * length modifiers, are handled without going through stdio. Any
+ * other conversion, flag, width, or precision makes the whole message
+ * fall back to vsnprintf(3).
+ *
+ * @param Output buffer
+ * @param Size of the output buffer
+ * @param Format string
+ * @param Arguments
+ * @return The length of the full message, or -1 on error
+ */
+int lattutil_log_vsnprintf(char *, size_t, const char *, va_list);
+
+/**
+ * Format a message the way the logging backends do
+ *
+ * @see lattutil_log_vsnprintf
+ */
+int lattutil_log_snprintf(char *, size_t, const char *, ...)
+    __attribute__((format(printf, 3, 4)));
+
+/**
+ * Fill in the default filter options
+ *
+ * Each call site may log 10 messages per second with bursts of 20 at
+ * every level, and identical consecutive messages are coalesced.
+ *
+ * @param[out] Options
+ */
+void lattutil_log_filter_default_opts(lattutil_log_filter_opts_t *);
+
+/**
+ * Initialize flight recorder logging
+ *
+ * Records are written into a ring of fixed-size slots in a shared
+ * memory mapping of the file, without any system call, so the most
+ * recent records survive a crash or SIGKILL. Each slot holds up to
+ * 231 bytes of message; longer messages are truncated. If the file
+ * already holds a ring of the same size, its records are kept.
+ *
+ * @param Logging object
+ * @param Path to the ring file
+ * @param Size of the ring in bytes
+ * @return True on success, False otherwise
+ */
+bool lattutil_log_mmap_init(lattutil_log_t *, const char *, size_t);
 
 /**
- * Find a configuration file in a set of given paths
+ * Get the number of records dropped because the ring lapped a
+ * writer that had not finished yet
  *
- * This function iterates through the set of paths, looking for the
- * passed-in configuration file name. If the configuration file is
- * found, a UCL parser instance is created and the file is loaded by
- * UCL.
+ * @param Logging object
+ * @return The number of dropped records
+ */
+uint64_t lattutil_log_mmap_dropped(lattutil_log_t *);
+
+/**
+ * Print the records of a flight recorder file, oldest first
  *
- * @param Set of paths
- * @param Number of paths in set
- * @param Configuration file name
- * @return Pointer to struct that contains information about the
- * 	config file on success, NULL on error.
+ * The file may belong to a process that is still running or has died.
+ * Records are printed in the same form as the stdio backend. If flags
+ * contains LATTUTIL_LOG_DECODE_TIMESTAMPS, each line is preceded by
+ * the local time the record was written.
+ *
+ * @param Path to the ring file
+ * @param Output stream
+ * @param Flags
+ * @return True on success, False if the file is not a flight recorder
  */
-lattutil_config_path_t *lattutil_find_config(const char **, size_t, const char *,
-    int);
+bool lattutil_log_mmap_dump(const char *, FILE *, int);
 
 /**
- * Free a given lattutil_config_path_t object
+ * Initialize filtered logging
  *
- * In order to prevent UAF vulnerabilities, the structure is zeroed
- * after all its members have been freed. Additionally, the pointer to
- * the structure is set to NULL.
+ * Messages pass through a per-call-site token bucket allowing
+ * llfl_rate messages per second with bursts of llfl_burst, applied to
+ * the levels in llfl_levels. Call sites are identified by the address
+ * of the format string. The check happens before the message is
+ * formatted. A rate of zero disables rate limiting. When a site gets
+ * through again after being limited, a note with the number of
+ * suppressed messages is logged first.
  *
- * @param A pointer to the to-be-freed object
+ * If llfl_coalesce is set, identical consecutive messages are logged
+ * once, followed by a "last message repeated N times" record when a
+ * different message arrives or the logger is freed.
+ *
+ * The filtering logging object takes ownership of the inner object.
+ *
+ * @param Logging object
+ * @param Inner logging object that surviving messages are written to
+ * @param Options, or NULL for the defaults
+ * @return True on success, False otherwise
  */
-void lattutil_free_config_path(lattutil_config_path_t **);
+bool lattutil_log_filter_init(lattutil_log_t *, lattutil_log_t *,
+    const lattutil_log_filter_opts_t *);
 
 /**
- * Set the auxiliary members of the config context object
+ * Get the suppression counters of a filtering logger
  *
- * @param The config object
- * @param The auxiliary data
- * @param The size of the auxiliary data
+ * @param Logging object
+ * @param[out] Counters
+ * @return True on success, False if this is not a filtering logger
  */
-void lattutil_config_set_aux(lattutil_config_path_t *, void *, size_t);
+bool lattutil_log_filter_stats(lattutil_log_t *,
+    lattutil_log_filter_stats_t *);
 
 /**
- * Get the auxiliary members of the config context object
+ * Initialize fan-out logging
  *
- * @param The config object
- * @param[out] Optional output variable to store the recorded size of
- *     the auxiliary member.
- * @return The auxiliary member
+ * Each message is formatted once and handed to every sink whose own
+ * verbosity threshold and level mask accept it. Sinks must be added
+ * before the object is shared between threads.
+ *
+ * @param Logging object
+ * @return True on success, False otherwise
  */
-void *lattutil_config_get_aux(lattutil_config_path_t *, size_t *);
+bool lattutil_log_tee_init(lattutil_log_t *);
 
 /**
- * Get the ABI version of the config path object
+ * Add a sink to a fan-out logging object
  *
- * @param The config path object
- * @return The version number
+ * The sink's verbosity and levels are taken at the time it is added.
+ * Up to eight sinks are supported. The fan-out logging object takes
+ * ownership of the sink.
+ *
+ * @param Fan-out logging object
+ * @param Sink logging object
+ * @return True on success, False otherwise
  */
-uint64_t lattutil_config_get_version(lattutil_config_path_t *);
+bool lattutil_log_tee_add(lattutil_log_t *, lattutil_log_t *);
 
 /**
- * Return the fully-qualified path of the config file
+ * Create a shared-memory ring and a collector thread draining it
  *
- * @param A pointer to the lattutil_config_path_t object
- * @return The path of the config file
+ * Producer processes attach to the ring with lattutil_log_shm_init or
+ * lattutil_log_shm_init_fd and log into it without system calls. The
+ * collector thread writes their records, in ring order, to the inner
+ * logging object, which the collector takes ownership of. Records
+ * longer than 488 bytes are truncated.
+ *
+ * With a name, the ring is a POSIX shared memory object that any
+ * process can attach to; an existing object of that name is replaced.
+ * Without one, the ring is anonymous and producers must inherit its
+ * descriptor, as prefork workers do.
+ *
+ * Each producer numbers its records, so records lost to a full ring
+ * are detected. The collector logs a warning with the number of
+ * records each producer lost, and counts them in the statistics.
+ *
+ * @param Name of the shared memory object, or NULL for an anonymous
+ *        ring
+ * @param Number of slots
+ * @param Inner logging object
+ * @param Flags: LATTUTIL_LOG_SHM_PID prefixes each record with the
+ *        producer's pid
+ * @return The collector, or NULL on error
  */
-char *lattutil_config_path_path(lattutil_config_path_t *);
+lattutil_log_shm_collector_t *lattutil_log_shm_collector_new(const char *,
+    size_t, lattutil_log_t *, int);
 
 /**
- * Return the file descriptor of the opened config
+ * Get the descriptor of a collector's ring, for producers to inherit
  *
- * @param A pointer to the lattutil_config_path_t object
- * @return The file descriptor
+ * @param Collector
+ * @return The descriptor
  */
-int lattutil_config_path_fd(lattutil_config_path_t *);
+int lattutil_log_shm_collector_fd(lattutil_log_shm_collector_t *);
 
 /**
- * Look for a string-typed variable in a UCL configuration tree.
+ * Get the counters of a collector
  *
- * @param UCL object root
- * @param Path within the UCL object root
- * @param Default value to set if path is not found
- * @return The value if found, default value or zero-length string on
- * error.
+ * llsh_reaped counts slots skipped because their producer died while
+ * writing them, or stalled for a second before marking the slot as
+ * its own; such a producer drops its record when it resumes.
+ *
+ * @param Collector
+ * @param[out] Counters
+ * @return True on success, False otherwise
  */
-char *lattutil_find_config_string(const ucl_object_t *, const char *,
-    const char *);
+bool lattutil_log_shm_collector_stats(lattutil_log_shm_collector_t *,
+    lattutil_log_shm_stats_t *);
 
 /**
- * Look for an integer-typed variable in a UCL configuration tree.
+ * Drain the ring, stop the collector, and free it and its inner
+ * logging object
  *
- * @param UCL object root
- * @param Path within the UCL object root
- * @param Default value to set if path is not found
- * @return The value if found, default value if not
+ * Only the process that created the collector may free it; forked
+ * producers just exit.
+ *
+ * @param Pointer to the collector
  */
-int64_t find_config_int(const ucl_object_t *, const char *, int64_t);
+void lattutil_log_shm_collector_free(lattutil_log_shm_collector_t **);
 
 /**
- * Initialize logger
+ * Initialize logging into a named shared-memory ring
  *
- * @param Path
- * @param Verbosity
- * @return Pointer to the logging object
+ * Must be called in the process that logs, after any fork(2), since
+ * records are tagged with the pid at the time of the call. When the
+ * ring is full, LATTUTIL_LOG_ASYNC_BLOCK waits for the collector and
+ * LATTUTIL_LOG_ASYNC_DROP_NEWEST drops the record.
+ *
+ * @param Logging object
+ * @param Name the collector was created with
+ * @param Overflow policy
+ * @return True on success, False otherwise
  */
-lattutil_log_t *lattutil_log_init(char *, int);
+bool lattutil_log_shm_init(lattutil_log_t *, const char *, int);
 
 /**
- * Free logger
+ * Initialize logging into a shared-memory ring given its descriptor
  *
- * The underlying variable is set to NULL.
+ * @see lattutil_log_shm_init
  *
- * @param Double pointer to the logging object
+ * @param Logging object
+ * @param Descriptor from lattutil_log_shm_collector_fd
+ * @param Overflow policy
+ * @return True on success, False otherwise
  */
-void lattutil_log_free(lattutil_log_t **);
+bool lattutil_log_shm_init_fd(lattutil_log_t *, int, int);
 
 /**
- * Get the ABI version number of the log object
+ * Get the number of records this producer dropped because the ring
+ * was full
  *
- * @param The log object
- * @return The ABI version number
+ * @param Logging object
+ * @return Number of dropped records
  */
-uint64_t lattutil_log_get_version(lattutil_log_t *);
+uint64_t lattutil_log_shm_dropped(lattutil_log_t *);
 
 /**
- * Initialize syslog-based logging
+ * Fill in the default SQLite logging options
+ *
+ * Records go to the "log" table in transactions of up to 1024
+ * records, committed at least every 250 milliseconds. Up to 65536
+ * records are queued before logging threads block.
+ *
+ * @param[out] Options
+ */
+void lattutil_log_sqlite_default_opts(lattutil_log_sqlite_opts_t *);
+
+/**
+ * Initialize SQLite logging
+ *
+ * Records are written to the llso_table table of the database at the
+ * given path, which is created if needed with the columns id, ts
+ * (microseconds since the epoch), level, and msg. Logging threads only
+ * queue records. A background thread inserts them with one prepared
+ * statement, in transactions of up to llso_batch records, at least
+ * every llso_flush_ms milliseconds. Once llso_max_pending records are
+ * queued, llso_policy decides whether logging threads wait
+ * (LATTUTIL_LOG_ASYNC_BLOCK) or the record is dropped
+ * (LATTUTIL_LOG_ASYNC_DROP_NEWEST).
+ *
+ * The database is switched to WAL mode, so it can be queried while
+ * the logger is writing.
  *
  * @param Logging object
- * @param syslog(3) logopt
- * @param syslog(3) facility
+ * @param Path to the database
+ * @param Options, or NULL for the defaults
  * @return True on success, False otherwise
  */
-bool lattutil_log_syslog_init(lattutil_log_t *, int, int);
+bool lattutil_log_sqlite_init(lattutil_log_t *, const char *,
+    const lattutil_log_sqlite_opts_t *);
 
 /**
- * Initialize NULL logging
+ * Wait until every record queued so far is committed
  *
- * This is the default logger. It simply discards all logging
- * messages.
+ * @param Logging object
+ * @return True on success, False if this is not a SQLite logger
+ */
+bool lattutil_log_sqlite_flush(lattutil_log_t *);
+
+/**
+ * Get the counters of a SQLite logger
  *
  * @param Logging object
+ * @param[out] Counters
+ * @return True on success, False if this is not a SQLite logger
  */
-void lattutil_log_dummy_init(lattutil_log_t *);
+bool lattutil_log_sqlite_stats(lattutil_log_t *,
+    lattutil_log_sqlite_stats_t *);
 
 /**
- * Initialize stdio-based logging
+ * Log a structured record
+ *
+ * The record is written as a single JSON object of the form
+ * {"level":"INFO","msg":"...","key":value,...} and goes through the
+ * same verbosity and level checks as the other logging functions.
+ * The message is followed by (key, type, value) triplets and a NULL
+ * key, for example:
+ *
+ *     lattutil_log_kv(logp, LATTUTIL_LOG_LEVEL_INFO, 1, "request",
+ *         "path", LATTUTIL_KV_STRING, path,
+ *         "status", LATTUTIL_KV_INT, 200, NULL);
+ *
+ * Works with every backend that has an emit handler.
+ *
+ * @param Logging object
+ * @param Level
+ * @param Verbosity level of the record
+ * @param Message, or NULL to omit the msg key
+ * @return The number of bytes written, or -1 on error
+ */
+ssize_t lattutil_log_kv(lattutil_log_t *, lattutil_log_level_t, int,
+    const char *, ...);
+
+/**
+ * Log a structured record, taking the key-value list as a va_list
+ *
+ * @see lattutil_log_kv
+ */
+ssize_t lattutil_log_vkv(lattutil_log_t *, lattutil_log_level_t, int,
+    const char *, va_list);
+
+/**
+ * Set the line prefix of the text backends (stdio and file)
+ *
+ * Lines are prefixed with the local time, optionally with
+ * milliseconds, the host name, the program name, and the pid, in that
+ * order, followed by the level tag:
+ *
+ *     2026-01-02T03:04:05.678 host prog[123]: INFO: message
+ *
+ * The program name is the basename of the logging object's path, or
+ * the name of the running program if it has none. Everything but the
+ * time is rendered once by this call, and the time is only
+ * reformatted once per second per thread using a coarse clock. The
+ * pid is not updated after fork. Call this before the object is
+ * shared between threads. Flags of zero restore the plain prefix.
  *
  * @param Logging object
+ * @param LATTUTIL_LOG_PREFIX_* flags
  * @return True on success, False otherwise
  */
-bool lattutil_log_stdio_init(lattutil_log_t *);
+bool lattutil_log_set_prefix(lattutil_log_t *, unsigned int);
+
+/**
+ * Register the call sites of a module
+ *
+ * Called by the constructor that LATTUTIL_LOG_SITES_MODULE() expands
+ * to. Registering the same module twice is harmless. At most 64
+ * modules can be registered; past that, the module is refused and a
+ * warning goes to syslog(3), and its sites keep their initial state.
+ *
+ * @param First site of the module
+ * @param End of the module's sites
+ * @return True on success, False if the registry is full
+ */
+bool lattutil_log_sites_register(lattutil_log_site_t *,
+    lattutil_log_site_t *);
+
+/**
+ * Unregister the call sites of a module
+ *
+ * Called by the destructor that LATTUTIL_LOG_SITES_MODULE() expands
+ * to, so that a shared object can be unloaded.
+ *
+ * @param First site of the module, as passed to
+ *        lattutil_log_sites_register
+ * @return True if the module was registered, False otherwise
+ */
+bool lattutil_log_sites_unregister(lattutil_log_site_t *);
+
+/**
+ * Set the state of every call site matching a query
+ *
+ * A query is a space-separated list of terms, all of which must
+ * match: file=GLOB (matched against the basename unless the pattern
+ * has a slash), func=GLOB, fmt=SUBSTRING, line=N or line=N-M, and
+ * level=debug|err|info|warn. An empty query matches every site.
+ *
+ * @param Query
+ * @param LATTUTIL_LOG_SITE_OFF, LATTUTIL_LOG_SITE_ON, or
+ *        LATTUTIL_LOG_SITE_FORCE
+ * @return The number of matching sites, or -1 on a malformed query
+ */
+ssize_t lattutil_log_sites_set(const char *, int);
+
+/**
+ * Apply a call site control file
+ *
+ * Each line is a state (off, on, or force) followed by a query, as
+ * for lattutil_log_sites_set. Lines are applied in order. Blank lines
+ * and lines starting with # are ignored. The file can be loaded again
+ * at any time, for instance from a SIGHUP handler's main loop.
+ *
+ * @param Path to the control file
+ * @return True if every line was applied, False otherwise
+ */
+bool lattutil_log_sites_load(const char *);
+
+/**
+ * Print every registered call site and its state
+ *
+ * @param Output stream
+ */
+void lattutil_log_sites_dump(FILE *);
 
 /**
  * Determine if the logging subsystem is ready to receive messages
@@ -285,6 +1707,27 @@ int lattutil_log_verbosity(lattutil_log_t *);
  */
 int lattutil_log_set_verbosity(lattutil_log_t *, int);
 
+/**
+ * Get the mask of enabled levels
+ *
+ * @param Logging object
+ * @return Mask of LATTUTIL_LOG_LEVEL_MASK() bits
+ */
+unsigned int lattutil_log_levels(lattutil_log_t *);
+
+/**
+ * Set the mask of enabled levels
+ *
+ * The handlers of disabled levels are replaced with the dummy
+ * handlers, so messages logged at those levels cost a single call
+ * that does no work. Re-enabling a level restores its handler.
+ *
+ * @param Logging object
+ * @param Mask of LATTUTIL_LOG_LEVEL_MASK() bits
+ * @return The previous mask
+ */
+unsigned int lattutil_log_set_levels(lattutil_log_t *, unsigned int);
+
 /**
  * Set the auxiliary members of the logging context object
  *
@@ -500,7 +1943,238 @@ const char *lattutil_sqlite_get_column_string(const ucl_object_t *, size_t);
  */
 int64_t lattutil_sqlite_get_column_int(const ucl_object_t *, size_t, int64_t);
 
+/**
+ * Prepare a catalog of statements declared in configuration
+ *
+ * Each key of the section names a statement, and its value is an
+ * object with the SQL text in "sql", the parameter types in
+ * "params", an array of "int", "string", "blob", or "time", and
+ * optionally the number of result columns in "columns". Every
+ * statement is prepared once, up front, and checked: the SQL must
+ * compile against the current schema, hold a single statement, take
+ * as many parameters as are declared, and return the declared number
+ * of columns. A name declared more than once is an error, not an
+ * override. Every failure is logged through the context's logger,
+ * and any failure fails the whole catalog. The time taken is logged
+ * as one phase and kept for lattutil_sqlite_catalog_prepare_time.
+ *
+ * Statement IDs are their positions in byte order of their names.
+ * The catalog, like the context, must not be used from more than one
+ * thread at a time, and must be freed before the context.
+ *
+ * @param The lattutil SQLite3 context object
+ * @param The UCL object holding the statements
+ * @return The catalog on success, NULL on error
+ */
+lattutil_sqlite_catalog_t *lattutil_sqlite_catalog_new(
+    lattutil_sqlite_ctx_t *, const ucl_object_t *);
+
+/**
+ * Free a catalog and finalize its statements
+ *
+ * @param Double pointer to the catalog
+ */
+void lattutil_sqlite_catalog_free(lattutil_sqlite_catalog_t **);
+
+/**
+ * Get the number of statements in a catalog
+ *
+ * @param The catalog
+ * @return The number of statements
+ */
+size_t lattutil_sqlite_catalog_count(const lattutil_sqlite_catalog_t *);
+
+/**
+ * Look up the ID of a statement by name
+ *
+ * Resolve names once, at startup, and execute by ID afterwards.
+ *
+ * @param The catalog
+ * @param The statement name
+ * @return The statement ID, or -1 if there is no such statement
+ */
+ssize_t lattutil_sqlite_catalog_id(const lattutil_sqlite_catalog_t *,
+    const char *);
+
+/**
+ * Get the query object of a statement
+ *
+ * The query can be bound and executed with the lattutil_sqlite_bind
+ * and lattutil_sqlite_exec functions like any other. It is reset,
+ * not finalized, by each exec, and its result holds the rows of the
+ * last exec. It must not be freed by the caller.
+ *
+ * @param The catalog
+ * @param The statement ID
+ * @return The query object, or NULL if the ID is out of range
+ */
+lattutil_sqlite_query_t *lattutil_sqlite_catalog_query(
+    const lattutil_sqlite_catalog_t *, size_t);
+
+/**
+ * Bind the parameters of a statement and execute it
+ *
+ * The parameters follow the ID, one per declared parameter, as an
+ * int64_t for "int", a const char * for "string", a void * and a
+ * size_t for "blob", and a time_t for "time". The types are read with
+ * va_arg and nothing converts them: an "int" parameter must be an
+ * int64_t even when the value would fit an int, so cast literals and
+ * narrower variables, as in (int64_t)42. The rows are available from
+ * lattutil_sqlite_catalog_query until the next exec.
+ *
+ * @param The catalog
+ * @param The statement ID
+ * @return Whether the statement executed successfully
+ */
+bool lattutil_sqlite_catalog_exec(lattutil_sqlite_catalog_t *, size_t,
+    ...);
+
+/**
+ * Get the time it took to prepare and check a catalog
+ *
+ * @param The catalog
+ * @return The time in nanoseconds
+ */
+uint64_t lattutil_sqlite_catalog_prepare_time(
+    const lattutil_sqlite_catalog_t *);
+
 #ifdef _lattutil_internal
+typedef struct _lllog_buf {
+	char		*llb_buf;
+	size_t		 llb_len;
+	size_t		 llb_bufsz;
+	size_t		 llb_msgoff;
+	size_t		 llb_msglen;
+	bool		 llb_heap;
+} lattutil_log_buf_t;
+
+const char *lattutil_log_level_tag(lattutil_log_level_t);
+const char *lattutil_log_level_prefix(lattutil_log_level_t);
+const char *lattutil_log_prefix(lattutil_log_t *, lattutil_log_level_t,
+    char *, size_t);
+void lattutil_log_prefix_free(lattutil_log_t *);
+void lattutil_log_apply_levels(lattutil_log_t *);
+
+bool lattutil_log_buf_vformat(lattutil_log_buf_t *, const char *,
+    const char *, const char *, va_list);
+bool lattutil_log_buf_begin(lattutil_log_buf_t *);
+bool lattutil_log_buf_reserve(lattutil_log_buf_t *, size_t);
+bool lattutil_log_buf_append(lattutil_log_buf_t *, const void *, size_t);
+void lattutil_log_buf_release(lattutil_log_buf_t *);
+ssize_t lattutil_log_write_all(int, const char *, size_t);
+
+bool lattutil_config_image_load(lattutil_config_path_t *, const char *);
+
+lattutil_sqlite_query_t *lattutil_sqlite_prepare_flags(
+    lattutil_sqlite_ctx_t *, const char *, unsigned int, const char **);
+
+ssize_t lattutil_log_async_debug(lattutil_log_t *, int,
+    const char *, ...);
+ssize_t lattutil_log_async_err(lattutil_log_t *, int,
+    const char *, ...);
+ssize_t lattutil_log_async_info(lattutil_log_t *, int,
+    const char *, ...);
+ssize_t lattutil_log_async_warn(lattutil_log_t *, int,
+    const char *, ...);
+ssize_t lattutil_log_async_emit(lattutil_log_t *, lattutil_log_level_t,
+    const char *, size_t);
+void lattutil_log_async_close(lattutil_log_t *);
+
+ssize_t lattutil_log_binary_debug(lattutil_log_t *, int,
+    const char *, ...);
+ssize_t lattutil_log_binary_err(lattutil_log_t *, int,
+    const char *, ...);
+ssize_t lattutil_log_binary_info(lattutil_log_t *, int,
+    const char *, ...);
+ssize_t lattutil_log_binary_warn(lattutil_log_t *, int,
+    const char *, ...);
+ssize_t lattutil_log_binary_emit(lattutil_log_t *, lattutil_log_level_t,
+    const char *, size_t);
+void lattutil_log_binary_close(lattutil_log_t *);
+
+ssize_t lattutil_log_mmap_debug(lattutil_log_t *, int,
+    const char *, ...);
+ssize_t lattutil_log_mmap_err(lattutil_log_t *, int,
+    const char *, ...);
+ssize_t lattutil_log_mmap_info(lattutil_log_t *, int,
+    const char *, ...);
+ssize_t lattutil_log_mmap_warn(lattutil_log_t *, int,
+    const char *, ...);
+ssize_t lattutil_log_mmap_emit(lattutil_log_t *, lattutil_log_level_t,
+    const char *, size_t);
+void lattutil_log_mmap_close(lattutil_log_t *);
+
+ssize_t lattutil_log_filter_debug(lattutil_log_t *, int,
+    const char *, ...);
+ssize_t lattutil_log_filter_err(lattutil_log_t *, int,
+    const char *, ...);
+ssize_t lattutil_log_filter_info(lattutil_log_t *, int,
+    const char *, ...);
+ssize_t lattutil_log_filter_warn(lattutil_log_t *, int,
+    const char *, ...);
+ssize_t lattutil_log_filter_emit(lattutil_log_t *, lattutil_log_level_t,
+    const char *, size_t);
+void lattutil_log_filter_close(lattutil_log_t *);
+
+ssize_t lattutil_log_tee_debug(lattutil_log_t *, int,
+    const char *, ...);
+ssize_t lattutil_log_tee_err(lattutil_log_t *, int,
+    const char *, ...);
+ssize_t lattutil_log_tee_info(lattutil_log_t *, int,
+    const char *, ...);
+ssize_t lattutil_log_tee_warn(lattutil_log_t *, int,
+    const char *, ...);
+ssize_t lattutil_log_tee_emit(lattutil_log_t *, lattutil_log_level_t,
+    const char *, size_t);
+void lattutil_log_tee_close(lattutil_log_t *);
+
+ssize_t lattutil_log_file_debug(lattutil_log_t *, int,
+    const char *, ...);
+ssize_t lattutil_log_file_err(lattutil_log_t *, int,
+    const char *, ...);
+ssize_t lattutil_log_file_info(lattutil_log_t *, int,
+    const char *, ...);
+ssize_t lattutil_log_file_warn(lattutil_log_t *, int,
+    const char *, ...);
+ssize_t lattutil_log_file_emit(lattutil_log_t *, lattutil_log_level_t,
+    const char *, size_t);
+void lattutil_log_file_close(lattutil_log_t *);
+
+ssize_t lattutil_log_shm_debug(lattutil_log_t *, int,
+    const char *, ...);
+ssize_t lattutil_log_shm_err(lattutil_log_t *, int,
+    const char *, ...);
+ssize_t lattutil_log_shm_info(lattutil_log_t *, int,
+    const char *, ...);
+ssize_t lattutil_log_shm_warn(lattutil_log_t *, int,
+    const char *, ...);
+ssize_t lattutil_log_shm_emit(lattutil_log_t *, lattutil_log_level_t,
+    const char *, size_t);
+void lattutil_log_shm_close(lattutil_log_t *);
+
+ssize_t lattutil_log_sqlite_debug(lattutil_log_t *, int,
+    const char *, ...);
+ssize_t lattutil_log_sqlite_err(lattutil_log_t *, int,
+    const char *, ...);
+ssize_t lattutil_log_sqlite_info(lattutil_log_t *, int,
+    const char *, ...);
+ssize_t lattutil_log_sqlite_warn(lattutil_log_t *, int,
+    const char *, ...);
+ssize_t lattutil_log_sqlite_emit(lattutil_log_t *, lattutil_log_level_t,
+    const char *, size_t);
+void lattutil_log_sqlite_close(lattutil_log_t *);
+
+typedef struct _lattutil_log_compressor lattutil_log_compressor_t;
+
+lattutil_log_compressor_t *lattutil_log_compressor_new(
+    const lattutil_log_codec_t *, int);
+void lattutil_log_compressor_free(lattutil_log_compressor_t **);
+bool lattutil_log_compressor_file(lattutil_log_compressor_t *,
+    const char *);
+bool lattutil_log_compressor_stream(lattutil_log_compressor_t *, int);
+bool lattutil_log_compressor_write(lattutil_log_compressor_t *,
+    const struct iovec *, int, bool);
+
 ssize_t lattutil_log_syslog_debug(lattutil_log_t *, int,
     const char *, ...);
 ssize_t lattutil_log_syslog_err(lattutil_log_t *, int,
@@ -509,8 +2183,22 @@ ssize_t lattutil_log_syslog_info(lattutil_log_t *, int,
     const char *, ...);
 ssize_t lattutil_log_syslog_warn(lattutil_log_t *, int,
     const char *, ...);
+ssize_t lattutil_log_syslog_emit(lattutil_log_t *, lattutil_log_level_t,
+    const char *, size_t);
 void lattutil_log_syslog_close(lattutil_log_t *);
 
+ssize_t lattutil_log_syslog_direct_debug(lattutil_log_t *, int,
+    const char *, ...);
+ssize_t lattutil_log_syslog_direct_err(lattutil_log_t *, int,
+    const char *, ...);
+ssize_t lattutil_log_syslog_direct_info(lattutil_log_t *, int,
+    const char *, ...);
+ssize_t lattutil_log_syslog_direct_warn(lattutil_log_t *, int,
+    const char *, ...);
+ssize_t lattutil_log_syslog_direct_emit(lattutil_log_t *,
+    lattutil_log_level_t, const char *, size_t);
+void lattutil_log_syslog_direct_close(lattutil_log_t *);
+
 ssize_t lattutil_log_dummy_debug(lattutil_log_t *, int,
     const char *, ...);
 ssize_t lattutil_log_dummy_err(lattutil_log_t *, int,
@@ -519,6 +2207,8 @@ ssize_t lattutil_log_dummy_info(lattutil_log_t *, int,
     const char *, ...);
 ssize_t lattutil_log_dummy_warn(lattutil_log_t *, int,
     const char *, ...);
+ssize_t lattutil_log_dummy_emit(lattutil_log_t *, lattutil_log_level_t,
+    const char *, size_t);
 void lattutil_log_dummy_close(lattutil_log_t *);
 
 ssize_t lattutil_log_stdio_debug(lattutil_log_t *, int,
@@ -529,6 +2219,8 @@ ssize_t lattutil_log_stdio_info(lattutil_log_t *, int,
     const char *, ...);
 ssize_t lattutil_log_stdio_warn(lattutil_log_t *, int,
     const char *, ...);
+ssize_t lattutil_log_stdio_emit(lattutil_log_t *, lattutil_log_level_t,
+    const char *, size_t);
 void lattutil_log_stdio_close(lattutil_log_t *);
 #endif /* _lattutil_internal */
 
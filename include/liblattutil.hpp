@@ -0,0 +1,470 @@
+/*-
+ * Copyright (c) 2021 Shawn Webb <shawn.webb@hardenedbsd.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _LIBLATTUTIL_HPP
+#define	_LIBLATTUTIL_HPP
+
+/*
+ * Type-safe C++ front-end to the logging API. Requires C++20.
+ *
+ * Each {} in a format string is replaced by the next argument. {:x}
+ * formats an integer or pointer in hexadecimal, {:.N} formats a
+ * floating point value with N digits after the decimal point, and {{
+ * and }} produce literal braces. Format strings are parsed and checked
+ * against the argument types at compile time, so a mismatch fails the
+ * build instead of the program.
+ *
+ * Messages are rendered into a stack buffer of LATTUTIL_LOG_CXX_BUFSZ
+ * bytes, truncated if longer, and handed to the backend's emit
+ * handler. Nothing is rendered unless the message passes the
+ * verbosity and level checks, and arguments wrapped in lattutil::lazy
+ * are not evaluated either:
+ *
+ *	lattutil::log_info(logp, 5, "{} bytes from {} in {:.3}s", len,
+ *	    peer, secs);
+ *	lattutil::log_debug(logp, 10, "state {}",
+ *	    lattutil::lazy([&] { return (dump_state()); }));
+ *
+ * Strings from a configuration index are available as
+ * std::string_view, borrowed from the index like their C counterpart:
+ *
+ *	std::string_view name = lattutil::config_string(idx, key, "none");
+ */
+
+#include <array>
+#include <charconv>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include "liblattutil.h"
+
+#ifndef LATTUTIL_LOG_CXX_BUFSZ
+#define	LATTUTIL_LOG_CXX_BUFSZ		1024
+#endif
+
+namespace lattutil {
+
+template <typename F>
+struct lazy_arg {
+	F	 la_fn;
+};
+
+/*
+ * Defer computing an argument until the message is known to be
+ * logged. The callable takes no arguments and returns any type that
+ * can be formatted.
+ */
+template <typename F>
+constexpr lazy_arg<std::decay_t<F>>
+lazy(F &&fn)
+{
+
+	return (lazy_arg<std::decay_t<F>>{std::forward<F>(fn)});
+}
+
+namespace detail {
+
+enum class arg_kind {
+	boolean,
+	character,
+	integer,
+	floating,
+	string,
+	pointer,
+	unsupported
+};
+
+template <typename T>
+struct is_lazy : std::false_type {};
+
+template <typename F>
+struct is_lazy<lazy_arg<F>> : std::true_type {};
+
+template <typename T>
+constexpr arg_kind
+kind_of(void)
+{
+	using U = std::remove_cvref_t<T>;
+
+	if constexpr (is_lazy<U>::value)
+		return (kind_of<std::invoke_result_t<
+		    const decltype(U::la_fn) &>>());
+	else if constexpr (std::is_same_v<U, bool>)
+		return (arg_kind::boolean);
+	else if constexpr (std::is_same_v<U, char>)
+		return (arg_kind::character);
+	else if constexpr (std::is_integral_v<U> || std::is_enum_v<U>)
+		return (arg_kind::integer);
+	else if constexpr (std::is_floating_point_v<U>)
+		return (arg_kind::floating);
+	else if constexpr (std::is_array_v<U> &&
+	    std::is_same_v<std::remove_cv_t<std::remove_extent_t<U>>, char>)
+		return (arg_kind::string);
+	else if constexpr (std::is_convertible_v<const U &, std::string_view>)
+		return (arg_kind::string);
+	else if constexpr (std::is_pointer_v<U> || std::is_null_pointer_v<U>)
+		return (arg_kind::pointer);
+	else
+		return (arg_kind::unsupported);
+}
+
+/*
+ * Deliberately never defined and not constexpr: reaching one of these
+ * while a format string is checked at compile time fails the build,
+ * and the diagnostic names the problem.
+ */
+void format_error_unmatched_brace(void);
+void format_error_bad_spec(void);
+void format_error_spec_needs_integer(void);
+void format_error_spec_needs_floating(void);
+void format_error_too_few_arguments(void);
+void format_error_too_many_arguments(void);
+
+struct field {
+	std::size_t	 f_lit = 0;	/* Start of the preceding literal */
+	std::size_t	 f_brace = 0;	/* Position of the opening brace */
+	char		 f_conv = 0;	/* 0, 'x', or 'f' */
+	int		 f_prec = 0;
+};
+
+} /* namespace detail */
+
+/*
+ * A format string checked against the types of its arguments. Only
+ * constructible from a constant expression; the replacement fields
+ * are located at compile time so rendering only copies.
+ */
+template <typename... Args>
+struct format_string {
+	static_assert(((detail::kind_of<Args>() !=
+	    detail::arg_kind::unsupported) && ...),
+	    "lattutil: argument type cannot be formatted");
+
+	static constexpr std::array<detail::arg_kind, sizeof...(Args)>
+	    fs_kinds = { detail::kind_of<Args>()... };
+
+	std::string_view	 fs_str;
+	std::array<detail::field, sizeof...(Args)> fs_fields{};
+	std::size_t		 fs_tail = 0;
+	bool			 fs_escaped = false;
+
+	template <typename S>
+	requires std::is_convertible_v<const S &, std::string_view>
+	consteval
+	format_string(const S &s) : fs_str(s)
+	{
+		detail::field f;
+		std::size_t i, lit, n;
+		char c;
+
+		lit = n = 0;
+		for (i = 0; i < fs_str.size(); i++) {
+			c = fs_str[i];
+			if (c == '}') {
+				if (i + 1 < fs_str.size() &&
+				    fs_str[i + 1] == '}') {
+					fs_escaped = true;
+					i++;
+					continue;
+				}
+				detail::format_error_unmatched_brace();
+			}
+			if (c != '{')
+				continue;
+			if (i + 1 < fs_str.size() && fs_str[i + 1] == '{') {
+				fs_escaped = true;
+				i++;
+				continue;
+			}
+
+			f = detail::field{};
+			f.f_lit = lit;
+			f.f_brace = i++;
+			if (i < fs_str.size() && fs_str[i] == ':') {
+				i++;
+				if (i < fs_str.size() && fs_str[i] == 'x') {
+					f.f_conv = 'x';
+					i++;
+				} else if (i < fs_str.size() &&
+				    fs_str[i] == '.') {
+					f.f_conv = 'f';
+					i++;
+					if (i >= fs_str.size() ||
+					    fs_str[i] < '0' || fs_str[i] > '9')
+						detail::format_error_bad_spec();
+					while (i < fs_str.size() &&
+					    fs_str[i] >= '0' &&
+					    fs_str[i] <= '9' &&
+					    f.f_prec < 100)
+						f.f_prec = f.f_prec * 10 +
+						    (fs_str[i++] - '0');
+				} else {
+					detail::format_error_bad_spec();
+				}
+			}
+			if (i >= fs_str.size() || fs_str[i] != '}')
+				detail::format_error_bad_spec();
+			if (n >= sizeof...(Args))
+				detail::format_error_too_few_arguments();
+
+			if (f.f_conv == 'x' &&
+			    fs_kinds[n] != detail::arg_kind::integer &&
+			    fs_kinds[n] != detail::arg_kind::pointer)
+				detail::format_error_spec_needs_integer();
+			if (f.f_conv == 'f' &&
+			    fs_kinds[n] != detail::arg_kind::floating)
+				detail::format_error_spec_needs_floating();
+
+			fs_fields[n++] = f;
+			lit = i + 1;
+		}
+
+		if (n != sizeof...(Args))
+			detail::format_error_too_many_arguments();
+		fs_tail = lit;
+	}
+};
+
+namespace detail {
+
+struct buffer {
+	char		*b_buf;
+	std::size_t	 b_len;
+	std::size_t	 b_size;
+
+	void
+	put(const char *s, std::size_t n)
+	{
+
+		if (n > b_size - b_len)
+			n = b_size - b_len;
+		std::memcpy(b_buf + b_len, s, n);
+		b_len += n;
+	}
+
+	void
+	put(char c)
+	{
+
+		if (b_len < b_size)
+			b_buf[b_len++] = c;
+	}
+};
+
+inline void
+put_literal(buffer &b, std::string_view str, bool escaped,
+    std::size_t start, std::size_t end)
+{
+	std::size_t i;
+
+	if (!escaped) {
+		b.put(str.data() + start, end - start);
+		return;
+	}
+
+	for (i = start; i < end; i++) {
+		b.put(str[i]);
+		if (str[i] == '{' || str[i] == '}')
+			i++;
+	}
+}
+
+template <typename T>
+inline void
+put_integer(buffer &b, T v, int base)
+{
+	char tmp[sizeof(T) * CHAR_BIT + 1];
+	std::to_chars_result r;
+
+	r = std::to_chars(tmp, tmp + sizeof(tmp), v, base);
+	b.put(tmp, r.ptr - tmp);
+}
+
+template <typename T>
+inline void
+put_floating(buffer &b, T v, const field &f)
+{
+	char tmp[128];
+	std::to_chars_result r;
+
+	if (f.f_conv == 'f') {
+		r = std::to_chars(tmp, tmp + sizeof(tmp), v,
+		    std::chars_format::fixed, f.f_prec);
+		if (r.ec != std::errc())
+			r = std::to_chars(tmp, tmp + sizeof(tmp), v,
+			    std::chars_format::scientific, f.f_prec);
+	} else {
+		r = std::to_chars(tmp, tmp + sizeof(tmp), v);
+	}
+
+	if (r.ec == std::errc())
+		b.put(tmp, r.ptr - tmp);
+}
+
+template <typename T>
+inline void
+put_arg(buffer &b, const field &f, const T &v)
+{
+	using U = std::remove_cvref_t<T>;
+
+	if constexpr (is_lazy<U>::value) {
+		put_arg(b, f, v.la_fn());
+	} else if constexpr (std::is_same_v<U, bool>) {
+		if (v)
+			b.put("true", 4);
+		else
+			b.put("false", 5);
+	} else if constexpr (std::is_same_v<U, char>) {
+		b.put(v);
+	} else if constexpr (std::is_enum_v<U>) {
+		put_integer(b, static_cast<std::underlying_type_t<U>>(v),
+		    f.f_conv == 'x' ? 16 : 10);
+	} else if constexpr (std::is_integral_v<U>) {
+		put_integer(b, v, f.f_conv == 'x' ? 16 : 10);
+	} else if constexpr (std::is_floating_point_v<U>) {
+		put_floating(b, v, f);
+	} else if constexpr (std::is_array_v<U>) {
+		b.put(v, strnlen(v, std::extent_v<U>));
+	} else if constexpr (std::is_convertible_v<const U &,
+	    const char *>) {
+		if (v == nullptr)
+			b.put("(null)", 6);
+		else
+			b.put(v, std::strlen(v));
+	} else if constexpr (std::is_convertible_v<const U &,
+	    std::string_view>) {
+		std::string_view sv(v);
+
+		b.put(sv.data(), sv.size());
+	} else {
+		b.put("0x", 2);
+		put_integer(b, reinterpret_cast<std::uintptr_t>(v), 16);
+	}
+}
+
+template <typename... Args>
+inline std::size_t
+render(char *buf, std::size_t bufsz, const format_string<Args...> &fmt,
+    const Args &...args)
+{
+	buffer b{buf, 0, bufsz};
+	std::size_t i;
+
+	i = 0;
+	((put_literal(b, fmt.fs_str, fmt.fs_escaped, fmt.fs_fields[i].f_lit,
+	    fmt.fs_fields[i].f_brace),
+	    put_arg(b, fmt.fs_fields[i], args), i++), ...);
+	put_literal(b, fmt.fs_str, fmt.fs_escaped, fmt.fs_tail,
+	    fmt.fs_str.size());
+
+	return (b.b_len);
+}
+
+} /* namespace detail */
+
+/**
+ * Log a message through the backend's emit handler
+ *
+ * @param Logging object
+ * @param Level of the message
+ * @param Verbosity of the message, or -1 to always log it
+ * @param Format string, checked at compile time
+ * @param Arguments
+ * @return The number of bytes logged, 0 if the message was filtered,
+ *         or -1 on error
+ */
+template <typename... Args>
+inline ssize_t
+log(lattutil_log_t *logp, lattutil_log_level_t level, int verbose,
+    format_string<std::type_identity_t<Args>...> fmt, const Args &...args)
+{
+	char buf[LATTUTIL_LOG_CXX_BUFSZ];
+	std::size_t len;
+
+	if (!LATTUTIL_LOG_WANTED(logp, level, verbose))
+		return (0);
+
+	len = detail::render(buf, sizeof(buf), fmt, args...);
+	return (logp->ll_log_emit(logp, level, buf, len));
+}
+
+template <typename... Args>
+inline ssize_t
+log_debug(lattutil_log_t *logp, int verbose,
+    format_string<std::type_identity_t<Args>...> fmt, const Args &...args)
+{
+
+	return (log(logp, LATTUTIL_LOG_LEVEL_DEBUG, verbose, fmt, args...));
+}
+
+template <typename... Args>
+inline ssize_t
+log_err(lattutil_log_t *logp, int verbose,
+    format_string<std::type_identity_t<Args>...> fmt, const Args &...args)
+{
+
+	return (log(logp, LATTUTIL_LOG_LEVEL_ERR, verbose, fmt, args...));
+}
+
+template <typename... Args>
+inline ssize_t
+log_info(lattutil_log_t *logp, int verbose,
+    format_string<std::type_identity_t<Args>...> fmt, const Args &...args)
+{
+
+	return (log(logp, LATTUTIL_LOG_LEVEL_INFO, verbose, fmt, args...));
+}
+
+template <typename... Args>
+inline ssize_t
+log_warn(lattutil_log_t *logp, int verbose,
+    format_string<std::type_identity_t<Args>...> fmt, const Args &...args)
+{
+
+	return (log(logp, LATTUTIL_LOG_LEVEL_WARN, verbose, fmt, args...));
+}
+
+inline std::string_view
+config_string(const lattutil_config_index_t *idx,
+    const lattutil_config_key_t &key, std::string_view def = {})
+{
+	const char *s;
+	std::size_t len;
+
+	s = lattutil_config_index_string(idx, &key, nullptr, &len);
+	if (s == nullptr) {
+		return (def);
+	}
+
+	return (std::string_view(s, len));
+}
+
+} /* namespace lattutil */
+
+#endif /* !_LIBLATTUTIL_HPP */
@@ -0,0 +1,198 @@
+/*-
+ * Copyright (c) 2021 Shawn Webb <shawn.webb@hardenedbsd.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Checks of the C++ front-end for "lattutil cxxcheck". Every kind of
+ * argument and format spec is rendered through a capturing emit
+ * handler and compared with the expected text.
+ *
+ * Defining LATTUTIL_CXXCHECK_FAIL to one of the numbers below adds a
+ * call that must not compile; "make cxxcheck-fail" builds each one and
+ * fails if the compiler accepts it.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <string_view>
+
+#include "liblattutil.hpp"
+
+extern "C" int cxx_check(int, char **);
+
+namespace {
+
+enum class cxxcheck_color : unsigned char {
+	red = 1,
+	blue = 0xab
+};
+
+struct cxxcheck_opaque {
+	int	 co_unused;
+};
+
+char		 cxxcheck_buf[LATTUTIL_LOG_CXX_BUFSZ];
+std::size_t	 cxxcheck_len;
+unsigned int	 cxxcheck_evals;
+
+ssize_t
+cxx_check_emit(lattutil_log_t *logp, lattutil_log_level_t level,
+    const char *msg, size_t len)
+{
+
+	(void)logp;
+	(void)level;
+
+	if (len > sizeof(cxxcheck_buf))
+		return (-1);
+	std::memcpy(cxxcheck_buf, msg, len);
+	cxxcheck_len = len;
+
+	return (len);
+}
+
+/*
+ * Check the message the last call emitted. res is what the call
+ * returned, which is the length of the message when it was logged.
+ */
+bool
+cxx_check_want(const char *name, ssize_t res, std::string_view want)
+{
+	std::string_view got(cxxcheck_buf, cxxcheck_len);
+
+	if (res != static_cast<ssize_t>(want.size()) || got != want) {
+		std::fprintf(stderr, "%s: returned %zd\n  got  %.*s\n"
+		    "  want %.*s\n", name, res, static_cast<int>(got.size()),
+		    got.data(), static_cast<int>(want.size()), want.data());
+		return (false);
+	}
+
+	return (true);
+}
+
+int
+cxx_check_arg(void)
+{
+
+	return (++cxxcheck_evals);
+}
+
+#ifdef LATTUTIL_CXXCHECK_FAIL
+[[maybe_unused]] void
+cxx_check_fail(lattutil_log_t *logp)
+{
+
+#if LATTUTIL_CXXCHECK_FAIL == 1
+	lattutil::log_info(logp, -1, "unmatched }");
+#elif LATTUTIL_CXXCHECK_FAIL == 2
+	lattutil::log_info(logp, -1, "unterminated {", 1);
+#elif LATTUTIL_CXXCHECK_FAIL == 3
+	lattutil::log_info(logp, -1, "unknown {:q}", 1);
+#elif LATTUTIL_CXXCHECK_FAIL == 4
+	lattutil::log_info(logp, -1, "hex float {:x}", 1.5);
+#elif LATTUTIL_CXXCHECK_FAIL == 5
+	lattutil::log_info(logp, -1, "precise int {:.2}", 1);
+#elif LATTUTIL_CXXCHECK_FAIL == 6
+	lattutil::log_info(logp, -1, "too few {} {}", 1);
+#elif LATTUTIL_CXXCHECK_FAIL == 7
+	lattutil::log_info(logp, -1, "too many {}", 1, 2);
+#elif LATTUTIL_CXXCHECK_FAIL == 8
+	lattutil::log_info(logp, -1, "opaque {}", cxxcheck_opaque{});
+#else
+#error "unknown LATTUTIL_CXXCHECK_FAIL case"
+#endif
+}
+#endif
+
+} /* namespace */
+
+int
+cxx_check(int argc, char **argv)
+{
+	char big[LATTUTIL_LOG_CXX_BUFSZ + 100];
+	const char abcd[4] = { 'a', 'b', 'c', 'd' };
+	const char *null;
+	lattutil_log_t *logp;
+	unsigned int nchecks, failed;
+
+	(void)argv;
+	if (argc != 1) {
+		std::fprintf(stderr, "usage: lattutil cxxcheck\n");
+		return (1);
+	}
+
+	logp = lattutil_log_init(NULL, 5);
+	if (logp == NULL) {
+		std::perror("cxxcheck");
+		return (1);
+	}
+	logp->ll_log_emit = cxx_check_emit;
+
+	null = nullptr;
+	std::memset(big, 'y', sizeof(big));
+
+	nchecks = failed = 0;
+#define	CXXCHECK(name, call, want) do {					\
+	nchecks++;							\
+	if (!cxx_check_want((name), (call), (want)))			\
+		failed++;						\
+} while (0)
+
+	CXXCHECK("literal", lattutil::log_info(logp, -1, "plain"), "plain");
+	CXXCHECK("scalars", lattutil::log_info(logp, -1, "{} {} {} {} {}",
+	    42, -7, 'c', true, false), "42 -7 c true false");
+	CXXCHECK("hex", lattutil::log_info(logp, -1, "{:x} {:x} {}", 255u,
+	    cxxcheck_color::blue, cxxcheck_color::red), "ff ab 1");
+	CXXCHECK("floating", lattutil::log_info(logp, -1, "{} {:.3} {:.2}",
+	    0.5, 3.14159, 1e300), "0.5 3.142 1.00e+300");
+	CXXCHECK("strings", lattutil::log_info(logp, -1, "{} {} {} {}",
+	    "literal", std::string_view("view"), null, abcd),
+	    "literal view (null) abcd");
+	CXXCHECK("braces", lattutil::log_info(logp, -1, "{{{}}} {{}}", 1),
+	    "{1} {}");
+	CXXCHECK("pointer", lattutil::log_info(logp, -1, "{}",
+	    reinterpret_cast<const void *>(0x1234)), "0x1234");
+	CXXCHECK("truncated", lattutil::log_info(logp, -1, "{}",
+	    std::string_view(big, sizeof(big))),
+	    std::string_view(big, LATTUTIL_LOG_CXX_BUFSZ));
+
+	/* Filtered messages are not rendered, nor lazy arguments run. */
+	cxxcheck_evals = 0;
+	cxxcheck_len = 0;
+	nchecks++;
+	if (lattutil::log_debug(logp, 4, "lazy {}",
+	    lattutil::lazy(cxx_check_arg)) != 0 || cxxcheck_len != 0 ||
+	    cxxcheck_evals != 0) {
+		std::fprintf(stderr, "filtered: message rendered\n");
+		failed++;
+	}
+	CXXCHECK("lazy", lattutil::log_debug(logp, 5, "lazy {}",
+	    lattutil::lazy(cxx_check_arg)), "lazy 1");
+#undef	CXXCHECK
+
+	lattutil_log_free(&logp);
+
+	std::printf("%u of %u checks failed\n", failed, nchecks);
+
+	return (failed > 0);
+}
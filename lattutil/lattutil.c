@@ -27,12 +27,273 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <sys/param.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
 #include <syslog.h>
 
+#include <fcntl.h>
 #include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include <zlib.h>
 
 #include "liblattutil.h"
 
+#define	STRESS_PAYLOAD	"abcdefghijklmnopqrstuvwxyz0123456789"
+
+#define	FMTCHECK_BUFSZ	512
+
+#define	KVCHECK_BUFSZ	1024
+
+#define	CONFBENCH_KEYS	64
+
+#define	ALLOCCHECK_STEADY	10000
+#define	ALLOCCHECK_MAXLEN	4000
+#define	ALLOCCHECK_HUGE		100000
+
+#define	SITECHECK_MODULES	64
+
+/* The message bytes a flight recorder slot keeps. */
+#define	TEECHECK_RECORDMAX	232
+#define	TEECHECK_HUGE		100000
+
+#define	SYSLOGCHECK_BUFSZ	2048
+#define	SYSLOGCHECK_NAME	STRESS_PAYLOAD "-" STRESS_PAYLOAD
+
+/*
+ * Time the same call through vsnprintf(3) and lattutil_log_vsnprintf.
+ * Both go through an identical varargs wrapper so the comparison only
+ * measures the formatters.
+ */
+#define	FMTBENCH(n, fmt, ...) do {					\
+	struct timespec _start, _mid, _end;				\
+	unsigned int _i;						\
+									\
+	clock_gettime(CLOCK_MONOTONIC, &_start);			\
+	for (_i = 0; _i < (n); _i++)					\
+		fmtbench_sink += fmtbench_libc(fmtbench_buf,		\
+		    sizeof(fmtbench_buf), (fmt), __VA_ARGS__);		\
+	clock_gettime(CLOCK_MONOTONIC, &_mid);				\
+	for (_i = 0; _i < (n); _i++)					\
+		fmtbench_sink += fmtbench_lattutil(fmtbench_buf,	\
+		    sizeof(fmtbench_buf), (fmt), __VA_ARGS__);		\
+	clock_gettime(CLOCK_MONOTONIC, &_end);				\
+	fmtbench_report((fmt), (n), &_start, &_mid, &_end);		\
+} while (0)
+
+struct stress_arg {
+	lattutil_log_t	*sa_logp;
+	unsigned int	 sa_id;
+	unsigned int	 sa_count;
+};
+
+struct confbind_backend {
+	const char	*cbb_host;
+	int		 cbb_port;
+	int		 cbb_weight;
+};
+
+struct confbind_limits {
+	int		 cbl_rate;
+	int		 cbl_burst;
+	double		 cbl_ratio;
+};
+
+struct confbind_config {
+	const char		*cbc_name;
+	int			 cbc_port;
+	int			 cbc_workers;
+	bool			 cbc_debug;
+	int64_t			 cbc_maxbody;
+	double			 cbc_timeout;
+	const char		*cbc_logfile;
+	struct confbind_limits	 cbc_limits;
+	const char		**cbc_listen;
+	size_t			 cbc_nlisten;
+	struct confbind_backend	*cbc_backends;
+	size_t			 cbc_nbackends;
+};
+
+struct confload_result {
+	uint32_t	 clr_crc;
+	size_t		 clr_paths;
+	double		 clr_secs;
+	long		 clr_maxrss;
+};
+
+struct syslogcheck_zone {
+	const char	*scz_tz;
+	long		 scz_off;
+	const char	*scz_offstr;
+};
+
+struct confwatch_arg {
+	lattutil_config_watch_t	*cwa_watch;
+	uint64_t		 cwa_reads;
+	int64_t			 cwa_last;
+	bool			 cwa_ok;
+};
+
+LATTUTIL_LOG_SITES_MODULE();
+
+static char alloccheck_fill[ALLOCCHECK_HUGE];
+static pthread_mutex_t asynccheck_gate = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic(bool) asynccheck_entered;
+static FILE *asynccheck_out;
+static unsigned int teecheck_evals;
+static _Atomic(bool) stress_done;
+static _Atomic(bool) confwatch_done;
+static pthread_mutex_t confwatch_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t confwatch_cv = PTHREAD_COND_INITIALIZER;
+static int64_t confwatch_seen;
+static volatile int fmtbench_sink;
+static char kvcheck_buf[KVCHECK_BUFSZ];
+static size_t kvcheck_len;
+static lattutil_log_level_t kvcheck_level;
+static char fmtbench_buf[256];
+
+struct sqlbench_arg {
+	lattutil_log_t	*sba_logp;
+	unsigned int	 sba_id;
+	unsigned int	 sba_count;
+};
+
+/* In cxxcheck.cc, which needs C++20. */
+int cxx_check(int, char **);
+
+static int async_check(int, char **);
+static bool async_check_run(const char *, int, size_t, unsigned int, bool,
+    long);
+static ssize_t async_check_emit(lattutil_log_t *, lattutil_log_level_t,
+    const char *, size_t);
+static int alloc_check(int, char **);
+static bool alloc_check_log(lattutil_log_t *, FILE *);
+static void *alloc_check_thread(void *);
+static int config_bench(int, char **);
+static ucl_object_t *config_bench_tree(unsigned int);
+static bool config_bench_verify(const ucl_object_t *,
+    const lattutil_config_index_t *, unsigned int);
+static double config_bench_ns(const struct timespec *,
+    const struct timespec *, unsigned int);
+static int config_bind_test(int, char **);
+static bool config_bind_port(const lattutil_config_field_t *, const void *);
+static void config_bind_report(const char *, const char *, void *);
+static bool config_bind_naive(const ucl_object_t *,
+    struct confbind_config *);
+static bool config_bind_expect(const char *, int, bool, unsigned int);
+static int config_image_test(int, char **);
+static bool config_image_compare(const char *, const char *);
+static int config_layer_test(int, char **);
+static bool config_layer_write(const char *, unsigned int, unsigned int,
+    unsigned int);
+static bool config_layer_check(const lattutil_config_path_t *,
+    unsigned int, unsigned int);
+static int config_load_test(int, char **);
+static lattutil_config_path_t *config_load_path(const char *, bool,
+    const char *);
+static bool config_load_child(const char *, bool, const char *,
+    struct confload_result *);
+static bool config_load_fork(const char *, bool, const char *,
+    const char *, struct confload_result *);
+static int config_watch_test(int, char **);
+static void *config_watch_reader(void *);
+static void config_watch_changed(lattutil_config_watch_t *,
+    lattutil_config_snapshot_t *, void *);
+static bool config_watch_write(const char *, unsigned int);
+static int decode_binary_log(int, char **);
+static int dump_flight_recorder(int, char **);
+static bool check_flight_records(const char *, const char *);
+static int format_check(int, char **);
+static bool format_check_one(const char *, size_t, const char *, int, long,
+    long long, size_t, unsigned int, void *, int);
+static int format_bench(int, char **);
+static int kv_check(int, char **);
+static ssize_t kv_check_emit(lattutil_log_t *, lattutil_log_level_t,
+    const char *, size_t);
+static bool kv_check_want(const char *, ssize_t, const char *);
+static int fmtbench_libc(char *, size_t, const char *, ...);
+static int fmtbench_lattutil(char *, size_t, const char *, ...);
+static void fmtbench_report(const char *, unsigned int,
+    const struct timespec *, const struct timespec *,
+    const struct timespec *);
+static int shm_test(int, char **);
+static int sqlite_bench(int, char **);
+static int sqlite_catalog_test(int, char **);
+static lattutil_sqlite_catalog_t *sqlite_catalog_load(
+    lattutil_sqlite_ctx_t *, const char *);
+static bool sqlite_catalog_naive(lattutil_sqlite_ctx_t *, unsigned int);
+static void *sqlite_bench_worker(void *);
+static bool sqlite_bench_naive(const char *, unsigned int);
+static int stress_log(int, char **);
+static int site_check(int, char **);
+static void site_check_emit(lattutil_log_t *, int);
+static bool site_check_set(const char *, int, ssize_t);
+static bool site_check_dump(const char *);
+static int syslog_check(int, char **);
+static int tee_check(int, char **);
+static int tee_check_arg(void);
+static bool syslog_check_one(int, const char *, int,
+    const struct syslogcheck_zone *);
+static void *stress_worker(void *);
+static void *stress_toggler(void *);
+static bool stress_verify(const char *, unsigned int, unsigned int);
+static void usage(void);
+
+static const lattutil_config_field_t confbind_backend_schema[] = {
+	LATTUTIL_CONFIG_FIELD_STRING(struct confbind_backend, cbb_host,
+	    "host", NULL, .lcf_flags = LATTUTIL_CONFIG_FIELD_REQUIRED),
+	LATTUTIL_CONFIG_FIELD_INT(struct confbind_backend, cbb_port, "port",
+	    80, .lcf_validate = config_bind_port),
+	LATTUTIL_CONFIG_FIELD_INT(struct confbind_backend, cbb_weight,
+	    "weight", 1),
+	LATTUTIL_CONFIG_FIELD_END
+};
+
+static const lattutil_config_field_t confbind_limits_schema[] = {
+	LATTUTIL_CONFIG_FIELD_INT(struct confbind_limits, cbl_rate, "rate",
+	    100),
+	LATTUTIL_CONFIG_FIELD_INT(struct confbind_limits, cbl_burst, "burst",
+	    200),
+	LATTUTIL_CONFIG_FIELD_DOUBLE(struct confbind_limits, cbl_ratio,
+	    "ratio", 0.5),
+	LATTUTIL_CONFIG_FIELD_END
+};
+
+static const lattutil_config_field_t confbind_schema[] = {
+	LATTUTIL_CONFIG_FIELD_STRING(struct confbind_config, cbc_name,
+	    "name", NULL, .lcf_flags = LATTUTIL_CONFIG_FIELD_REQUIRED),
+	LATTUTIL_CONFIG_FIELD_INT(struct confbind_config, cbc_port, "port",
+	    8080, .lcf_validate = config_bind_port),
+	LATTUTIL_CONFIG_FIELD_INT(struct confbind_config, cbc_workers,
+	    "workers", 4),
+	LATTUTIL_CONFIG_FIELD_BOOL(struct confbind_config, cbc_debug,
+	    "debug", false),
+	LATTUTIL_CONFIG_FIELD_INT64(struct confbind_config, cbc_maxbody,
+	    "max_body", 1024 * 1024),
+	LATTUTIL_CONFIG_FIELD_DOUBLE(struct confbind_config, cbc_timeout,
+	    "timeout", 30.0),
+	LATTUTIL_CONFIG_FIELD_STRING(struct confbind_config, cbc_logfile,
+	    "log_file", "/var/log/app.log"),
+	LATTUTIL_CONFIG_FIELD_OBJECT(struct confbind_config, cbc_limits,
+	    "limits", confbind_limits_schema),
+	LATTUTIL_CONFIG_FIELD_ARRAY(struct confbind_config, cbc_listen,
+	    cbc_nlisten, "listen", LATTUTIL_CONFIG_TYPE_STRING),
+	LATTUTIL_CONFIG_FIELD_ARRAY(struct confbind_config, cbc_backends,
+	    cbc_nbackends, "backends", LATTUTIL_CONFIG_TYPE_OBJECT,
+	    .lcf_elemsz = sizeof(struct confbind_backend),
+	    .lcf_fields = confbind_backend_schema),
+	LATTUTIL_CONFIG_FIELD_END
+};
+
 int
 main(int argc, char *argv[])
 {
@@ -45,6 +306,74 @@ main(int argc, char *argv[])
 	const char *val;
 	size_t i;
 
+	if (argc > 1) {
+		if (!strcmp(argv[1], "alloccheck")) {
+			return (alloc_check(argc - 1, argv + 1));
+		}
+		if (!strcmp(argv[1], "asynccheck")) {
+			return (async_check(argc - 1, argv + 1));
+		}
+		if (!strcmp(argv[1], "confbench")) {
+			return (config_bench(argc - 1, argv + 1));
+		}
+		if (!strcmp(argv[1], "confbind")) {
+			return (config_bind_test(argc - 1, argv + 1));
+		}
+		if (!strcmp(argv[1], "confimage")) {
+			return (config_image_test(argc - 1, argv + 1));
+		}
+		if (!strcmp(argv[1], "conflayer")) {
+			return (config_layer_test(argc - 1, argv + 1));
+		}
+		if (!strcmp(argv[1], "confload")) {
+			return (config_load_test(argc - 1, argv + 1));
+		}
+		if (!strcmp(argv[1], "confwatch")) {
+			return (config_watch_test(argc - 1, argv + 1));
+		}
+		if (!strcmp(argv[1], "cxxcheck")) {
+			return (cxx_check(argc - 1, argv + 1));
+		}
+		if (!strcmp(argv[1], "decode")) {
+			return (decode_binary_log(argc - 1, argv + 1));
+		}
+		if (!strcmp(argv[1], "dump")) {
+			return (dump_flight_recorder(argc - 1, argv + 1));
+		}
+		if (!strcmp(argv[1], "fmtbench")) {
+			return (format_bench(argc - 1, argv + 1));
+		}
+		if (!strcmp(argv[1], "fmtcheck")) {
+			return (format_check(argc - 1, argv + 1));
+		}
+		if (!strcmp(argv[1], "kvcheck")) {
+			return (kv_check(argc - 1, argv + 1));
+		}
+		if (!strcmp(argv[1], "sitecheck")) {
+			return (site_check(argc - 1, argv + 1));
+		}
+		if (!strcmp(argv[1], "shmtest")) {
+			return (shm_test(argc - 1, argv + 1));
+		}
+		if (!strcmp(argv[1], "sqlbench")) {
+			return (sqlite_bench(argc - 1, argv + 1));
+		}
+		if (!strcmp(argv[1], "sqlcatalog")) {
+			return (sqlite_catalog_test(argc - 1, argv + 1));
+		}
+		if (!strcmp(argv[1], "stress")) {
+			return (stress_log(argc - 1, argv + 1));
+		}
+		if (!strcmp(argv[1], "syslogcheck")) {
+			return (syslog_check(argc - 1, argv + 1));
+		}
+		if (!strcmp(argv[1], "teecheck")) {
+			return (tee_check(argc - 1, argv + 1));
+		}
+		usage();
+		return (1);
+	}
+
 	logp = lattutil_log_init(NULL, -1);
 
 	lattutil_log_stdio_init(logp);
@@ -162,3 +491,3111 @@ main(int argc, char *argv[])
 
 	return (0);
 }
+
+static int
+decode_binary_log(int argc, char **argv)
+{
+	int ch, flags;
+	FILE *fp;
+	bool res;
+
+	flags = 0;
+	while ((ch = getopt(argc, argv, "t")) != -1) {
+		switch (ch) {
+		case 't':
+			flags |= LATTUTIL_LOG_DECODE_TIMESTAMPS;
+			break;
+		default:
+			usage();
+			return (1);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1) {
+		usage();
+		return (1);
+	}
+
+	fp = fopen(argv[0], "r");
+	if (fp == NULL) {
+		perror(argv[0]);
+		return (1);
+	}
+
+	res = lattutil_log_binary_decode(fp, stdout, flags);
+	fclose(fp);
+
+	if (!res) {
+		fprintf(stderr, "%s: malformed or truncated binary log\n",
+		    argv[0]);
+		return (1);
+	}
+
+	return (0);
+}
+
+static int
+dump_flight_recorder(int argc, char **argv)
+{
+	int ch, flags;
+
+	flags = 0;
+	while ((ch = getopt(argc, argv, "t")) != -1) {
+		switch (ch) {
+		case 't':
+			flags |= LATTUTIL_LOG_DECODE_TIMESTAMPS;
+			break;
+		default:
+			usage();
+			return (1);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1) {
+		usage();
+		return (1);
+	}
+
+	if (!lattutil_log_mmap_dump(argv[0], stdout, flags)) {
+		fprintf(stderr, "%s: not a flight recorder file\n", argv[0]);
+		return (1);
+	}
+
+	return (0);
+}
+
+/*
+ * Hammer one shared logger from many threads while another thread
+ * keeps changing its verbosity and level mask, then check that every
+ * record made it to the file intact and in per-thread order. With -z
+ * the file is written as a gzip stream and read back through zlib.
+ */
+static int
+stress_log(int argc, char **argv)
+{
+	lattutil_log_file_opts_t opts;
+	struct stress_arg *args;
+	pthread_t *threads, toggler;
+	unsigned int i, nthreads, count;
+	lattutil_log_t *logp;
+	int ch;
+
+	nthreads = 32;
+	count = 10000;
+	lattutil_log_file_default_opts(&opts);
+	while ((ch = getopt(argc, argv, "n:t:z")) != -1) {
+		switch (ch) {
+		case 'n':
+			count = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			nthreads = strtoul(optarg, NULL, 10);
+			break;
+		case 'z':
+			opts.llfo_compress = LATTUTIL_LOG_COMPRESS_STREAM;
+			break;
+		default:
+			usage();
+			return (1);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1 || nthreads == 0) {
+		usage();
+		return (1);
+	}
+
+	unlink(argv[0]);
+
+	logp = lattutil_log_init(NULL, 0);
+	if (logp == NULL || !lattutil_log_file_init(logp, argv[0], &opts)) {
+		fprintf(stderr, "%s: unable to open log\n", argv[0]);
+		return (1);
+	}
+
+	threads = calloc(nthreads, sizeof(*threads));
+	args = calloc(nthreads, sizeof(*args));
+	if (threads == NULL || args == NULL) {
+		perror("calloc");
+		return (1);
+	}
+
+	atomic_store(&stress_done, false);
+	pthread_create(&toggler, NULL, stress_toggler, logp);
+	for (i = 0; i < nthreads; i++) {
+		args[i].sa_logp = logp;
+		args[i].sa_id = i;
+		args[i].sa_count = count;
+		pthread_create(&(threads[i]), NULL, stress_worker, &(args[i]));
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	atomic_store(&stress_done, true);
+	pthread_join(toggler, NULL);
+
+	lattutil_log_free(&logp);
+	free(threads);
+	free(args);
+
+	if (!stress_verify(argv[0], nthreads, count)) {
+		return (1);
+	}
+
+	printf("%u threads, %u records each: OK\n", nthreads, count);
+
+	return (0);
+}
+
+static void *
+stress_worker(void *arg)
+{
+	struct stress_arg *sa;
+	unsigned int i;
+
+	sa = arg;
+	for (i = 0; i < sa->sa_count; i++) {
+		sa->sa_logp->ll_log_info(sa->sa_logp, 5,
+		    "thread %u seq %u %s", sa->sa_id, i, STRESS_PAYLOAD);
+	}
+
+	return (NULL);
+}
+
+/*
+ * The verbosity flips between values that keep the workers' records
+ * and the mask only toggles the debug level, so no record is lost.
+ */
+static void *
+stress_toggler(void *arg)
+{
+	lattutil_log_t *logp;
+	unsigned int levels;
+
+	logp = arg;
+	levels = LATTUTIL_LOG_LEVELS_ALL;
+	while (!atomic_load(&stress_done)) {
+		lattutil_log_set_verbosity(logp,
+		    lattutil_log_verbosity(logp) == 0 ? 1 : 0);
+		levels ^= LATTUTIL_LOG_LEVEL_MASK(LATTUTIL_LOG_LEVEL_DEBUG);
+		lattutil_log_set_levels(logp, levels);
+		logp->ll_log_debug(logp, 5, "toggled");
+		usleep(100);
+	}
+
+	return (NULL);
+}
+
+static bool
+stress_verify(const char *path, unsigned int nthreads, unsigned int count)
+{
+	unsigned int *next, id, seq;
+	char line[256], payload[64];
+	gzFile fp;
+	bool ok;
+
+	/* zlib reads uncompressed files as they are. */
+	fp = gzopen(path, "r");
+	if (fp == NULL) {
+		perror(path);
+		return (false);
+	}
+
+	next = calloc(nthreads, sizeof(*next));
+	if (next == NULL) {
+		gzclose(fp);
+		return (false);
+	}
+
+	ok = true;
+	while (ok && gzgets(fp, line, sizeof(line)) != NULL) {
+		if (!strcmp(line, "DEBUG: toggled\n")) {
+			continue;
+		}
+		if (sscanf(line, "INFO: thread %u seq %u %63s", &id, &seq,
+		    payload) != 3 || id >= nthreads || seq != next[id] ||
+		    strcmp(payload, STRESS_PAYLOAD) ||
+		    line[strlen(line) - 1] != '\n') {
+			fprintf(stderr, "%s: torn or out of order record: %s",
+			    path, line);
+			ok = false;
+			break;
+		}
+		next[id]++;
+	}
+
+	for (id = 0; ok && id < nthreads; id++) {
+		if (next[id] != count) {
+			fprintf(stderr,
+			    "%s: thread %u logged %u of %u records\n",
+			    path, id, next[id], count);
+			ok = false;
+		}
+	}
+
+	free(next);
+	gzclose(fp);
+
+	return (ok);
+}
+
+/*
+ * Compare lattutil_log_snprintf against snprintf(3) on random format
+ * strings, values, and buffer sizes. The arguments always have the
+ * same types in the same order; each format picks a conversion that
+ * fits each argument it uses, including ones that take the vsnprintf
+ * fallback, and stops after a random number of them.
+ */
+static int
+format_check(int argc, char **argv)
+{
+	static const char *convs[][6] = {
+		{ "%s", "%s", "%s", "%.3s", "%10s", "%-4s" },
+		{ "%d", "%i", "%u", "%x", "%X", "%5d" },
+		{ "%ld", "%li", "%lu", "%lx", "%lX", "%+ld" },
+		{ "%lld", "%lli", "%llu", "%llx", "%llX", "%lld" },
+		{ "%zu", "%zd", "%zx", "%zX", "%zu", "%8zu" },
+		{ "%x", "%X", "%u", "%08x", "%#x", "%x" },
+		{ "%p", "%p", "%p", "%p", "%p", "%20p" },
+		{ "%c", "%c", "%c", "%c", "%c", "%-3c" },
+	};
+	static const char *strs[] = {
+		"", "a", "hello world", "%d is not a conversion here",
+		STRESS_PAYLOAD STRESS_PAYLOAD STRESS_PAYLOAD, NULL,
+	};
+	static const long long ints[] = {
+		0, 1, -1, 9, 10, 99, 100, INT_MAX, INT_MIN, UINT_MAX,
+		LLONG_MAX, LLONG_MIN,
+	};
+	char fmt[FMTCHECK_BUFSZ], *p;
+	unsigned int i, j, k, n, ncases, seed, failed;
+	size_t bufsz;
+	long long v[5];
+	void *ptr;
+	int ch;
+
+	ncases = 1000000;
+	seed = time(NULL);
+	while ((ch = getopt(argc, argv, "n:s:")) != -1) {
+		switch (ch) {
+		case 'n':
+			ncases = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+			return (1);
+		}
+	}
+
+	srandom(seed);
+	failed = 0;
+	for (i = 0; i < ncases; i++) {
+		p = fmt;
+		n = 1 + random() % nitems(convs);
+		for (j = 0; j < n; j++) {
+			for (k = random() % 6; k > 0; k--) {
+				if (random() % 8 == 0) {
+					*p++ = '%';
+					*p++ = '%';
+				} else {
+					*p++ = ' ' + random() % 94;
+					if (p[-1] == '%') {
+						*p++ = '%';
+					}
+				}
+			}
+			p = stpcpy(p, convs[j][random() % 6]);
+		}
+		*p = '\0';
+
+		for (j = 0; j < nitems(v); j++) {
+			v[j] = (random() % 2) ? ints[random() % nitems(ints)] :
+			    ((long long)random() << 32 | random()) >>
+			    (random() % 64);
+		}
+		ptr = (random() % 4 == 0) ? NULL : (void *)(uintptr_t)v[4];
+
+		switch (random() % 4) {
+		case 0:
+			bufsz = 0;
+			break;
+		case 1:
+			bufsz = 1 + random() % 32;
+			break;
+		default:
+			bufsz = FMTCHECK_BUFSZ;
+			break;
+		}
+
+		if (!format_check_one(fmt, bufsz,
+		    strs[random() % nitems(strs)], (int)v[0], (long)v[1],
+		    v[2], (size_t)v[3], (unsigned int)v[4], ptr,
+		    1 + random() % 255)) {
+			if (++failed == 10) {
+				break;
+			}
+		}
+	}
+
+	printf("seed %u: %u of %u cases differ from snprintf(3)\n", seed,
+	    failed, i);
+
+	return (failed > 0);
+}
+
+static bool
+format_check_one(const char *fmt, size_t bufsz, const char *s, int d,
+    long l, long long ll, size_t z, unsigned int x, void *p, int c)
+{
+	char want[FMTCHECK_BUFSZ], got[FMTCHECK_BUFSZ];
+	int wantres, gotres;
+
+	memset(want, '#', sizeof(want));
+	memset(got, '#', sizeof(got));
+
+	wantres = snprintf(want, bufsz, fmt, s, d, l, ll, z, x, p, c);
+	gotres = lattutil_log_snprintf(got, bufsz, fmt, s, d, l, ll, z, x,
+	    p, c);
+
+	if (wantres == gotres && !memcmp(want, got, sizeof(want))) {
+		return (true);
+	}
+
+	fprintf(stderr, "format \"%s\" size %zu: snprintf returned %d "
+	    "\"%.*s\", lattutil_log_snprintf returned %d \"%.*s\"\n", fmt,
+	    bufsz, wantres, (int)strnlen(want, bufsz), want, gotres,
+	    (int)strnlen(got, bufsz), got);
+
+	return (false);
+}
+
+/*
+ * Time the formats that make up most log messages, plus one that
+ * takes the fallback path, through both formatters.
+ */
+static int
+format_bench(int argc, char **argv)
+{
+	unsigned int n;
+	int ch;
+
+	n = 2000000;
+	while ((ch = getopt(argc, argv, "n:")) != -1) {
+		switch (ch) {
+		case 'n':
+			n = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+			return (1);
+		}
+	}
+
+	printf("%-32s %10s %10s %8s\n", "format", "libc ns", "lattutil ns",
+	    "speedup");
+	FMTBENCH(n, "%s", "hello world");
+	FMTBENCH(n, "%d", -1234567);
+	FMTBENCH(n, "%ld", 1234567890123L);
+	FMTBENCH(n, "%zu", (size_t)65536);
+	FMTBENCH(n, "%x", 0xdeadbeefU);
+	FMTBENCH(n, "%p", (void *)fmtbench_buf);
+	FMTBENCH(n, "thread %u seq %u %s", 17U, 123456U, STRESS_PAYLOAD);
+	FMTBENCH(n, "%s:%d: %s: %s (errno %d)", "log-file.c", 412,
+	    "_lattutil_log_file_flush", "No space left on device", 28);
+	FMTBENCH(n, "took %.3f seconds", 1.23456);
+
+	return (0);
+}
+
+static int
+fmtbench_libc(char *buf, size_t bufsz, const char *fmt, ...)
+{
+	va_list args;
+	int res;
+
+	va_start(args, fmt);
+	res = vsnprintf(buf, bufsz, fmt, args);
+	va_end(args);
+
+	return (res);
+}
+
+static int
+fmtbench_lattutil(char *buf, size_t bufsz, const char *fmt, ...)
+{
+	va_list args;
+	int res;
+
+	va_start(args, fmt);
+	res = lattutil_log_vsnprintf(buf, bufsz, fmt, args);
+	va_end(args);
+
+	return (res);
+}
+
+static void
+fmtbench_report(const char *fmt, unsigned int n,
+    const struct timespec *start, const struct timespec *mid,
+    const struct timespec *end)
+{
+	double libc, lattutil;
+
+	libc = ((mid->tv_sec - start->tv_sec) * 1e9 +
+	    (mid->tv_nsec - start->tv_nsec)) / n;
+	lattutil = ((end->tv_sec - mid->tv_sec) * 1e9 +
+	    (end->tv_nsec - mid->tv_nsec)) / n;
+
+	printf("%-32s %10.1f %10.1f %7.2fx\n", fmt, libc, lattutil,
+	    lattutil > 0 ? libc / lattutil : 0);
+}
+
+/*
+ * Fork producer processes that log through an anonymous shared-memory
+ * ring into one file, then check that every record arrived intact and
+ * in per-producer order. With -d, producers drop records when the ring
+ * is full instead of waiting, and the collector's loss count must
+ * account for every missing record.
+ */
+static int
+shm_test(int argc, char **argv)
+{
+	lattutil_log_shm_collector_t *lsc;
+	lattutil_log_shm_stats_t stats;
+	unsigned int i, n, nprocs, count;
+	lattutil_log_t *inner, *logp;
+	int ch, policy, status;
+	uint64_t total;
+	size_t nslots;
+	pid_t pid;
+
+	nprocs = 16;
+	count = 10000;
+	nslots = 4096;
+	policy = LATTUTIL_LOG_ASYNC_BLOCK;
+	while ((ch = getopt(argc, argv, "dn:p:s:")) != -1) {
+		switch (ch) {
+		case 'd':
+			policy = LATTUTIL_LOG_ASYNC_DROP_NEWEST;
+			break;
+		case 'n':
+			count = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			nprocs = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			nslots = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+			return (1);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1 || nprocs == 0) {
+		usage();
+		return (1);
+	}
+
+	unlink(argv[0]);
+
+	inner = lattutil_log_init(NULL, 0);
+	if (inner == NULL || !lattutil_log_file_init(inner, argv[0], NULL)) {
+		fprintf(stderr, "%s: unable to open log\n", argv[0]);
+		return (1);
+	}
+
+	lsc = lattutil_log_shm_collector_new(NULL, nslots, inner, 0);
+	if (lsc == NULL) {
+		fprintf(stderr, "unable to create shared-memory ring\n");
+		return (1);
+	}
+
+	for (i = 0; i < nprocs; i++) {
+		pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			return (1);
+		}
+		if (pid > 0) {
+			continue;
+		}
+
+		logp = lattutil_log_init(NULL, 0);
+		if (logp == NULL || !lattutil_log_shm_init_fd(logp,
+		    lattutil_log_shm_collector_fd(lsc), policy)) {
+			_exit(1);
+		}
+		for (n = 0; n < count; n++) {
+			logp->ll_log_info(logp, 5, "thread %u seq %u %s", i,
+			    n, STRESS_PAYLOAD);
+		}
+		lattutil_log_free(&logp);
+		_exit(0);
+	}
+
+	while (wait(&status) > 0) {
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "producer failed\n");
+			return (1);
+		}
+	}
+
+	/* Every producer has closed; wait for the collector to catch up. */
+	total = (uint64_t)nprocs * count;
+	for (n = 0; n < 1000; n++) {
+		lattutil_log_shm_collector_stats(lsc, &stats);
+		if (stats.llsh_received + stats.llsh_lost >= total) {
+			break;
+		}
+		usleep(10000);
+	}
+	lattutil_log_shm_collector_free(&lsc);
+
+	printf("%u producers, %u records each: %ju received, %ju lost, "
+	    "%ju reaped\n", nprocs, count, (uintmax_t)stats.llsh_received,
+	    (uintmax_t)stats.llsh_lost, (uintmax_t)stats.llsh_reaped);
+
+	if (policy == LATTUTIL_LOG_ASYNC_DROP_NEWEST) {
+		return (stats.llsh_received + stats.llsh_lost != total);
+	}
+
+	return (!stress_verify(argv[0], nprocs, count));
+}
+
+/*
+ * Compare config lookups through the tree, with
+ * lattutil_find_config_string and lattutil_find_config_int, against
+ * precompiled keys in a lattutil_config_index_t. Every path in the
+ * generated tree is first checked to resolve to the same object both
+ * ways.
+ */
+static int
+config_bench(int argc, char **argv)
+{
+	lattutil_config_key_t names[CONFBENCH_KEYS], rates[CONFBENCH_KEYS];
+	char *npaths[CONFBENCH_KEYS], *rpaths[CONFBENCH_KEYS];
+	struct timespec start, mid, end;
+	lattutil_config_index_t *lci;
+	unsigned int i, k, n, nsections;
+	volatile int64_t sink;
+	ucl_object_t *root;
+	const char *s;
+	char *dup;
+	int ch;
+
+	nsections = 200;
+	n = 2000000;
+	while ((ch = getopt(argc, argv, "k:n:")) != -1) {
+		switch (ch) {
+		case 'k':
+			nsections = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			n = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+			return (1);
+		}
+	}
+
+	if (nsections == 0) {
+		usage();
+		return (1);
+	}
+
+	root = config_bench_tree(nsections);
+	if (root == NULL) {
+		fprintf(stderr, "unable to build config tree\n");
+		return (1);
+	}
+
+	lci = lattutil_config_index_new(root);
+	if (lci == NULL) {
+		fprintf(stderr, "unable to index config tree\n");
+		return (1);
+	}
+
+	if (!config_bench_verify(root, lci, nsections)) {
+		return (1);
+	}
+	printf("%u sections, %zu paths indexed\n", nsections,
+	    lattutil_config_index_count(lci));
+
+	for (i = 0; i < CONFBENCH_KEYS; i++) {
+		k = (i * 7919) % nsections;
+		if (asprintf(&(npaths[i]), "section%u.name", k) < 0 ||
+		    asprintf(&(rpaths[i]), "section%u.limits.rate", k) < 0) {
+			return (1);
+		}
+		lattutil_config_key_init(&(names[i]), npaths[i]);
+		lattutil_config_key_init(&(rates[i]), rpaths[i]);
+	}
+
+	printf("%-24s %10s %10s %8s\n", "lookup", "tree ns", "index ns",
+	    "speedup");
+
+	sink = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n; i++) {
+		dup = lattutil_find_config_string(root,
+		    npaths[i % CONFBENCH_KEYS], NULL);
+		sink += dup[0];
+		free(dup);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &mid);
+	for (i = 0; i < n; i++) {
+		s = lattutil_config_index_string(lci,
+		    &(names[i % CONFBENCH_KEYS]), "", NULL);
+		sink += s[0];
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("%-24s %10.1f %10.1f %7.2fx\n", "string",
+	    config_bench_ns(&start, &mid, n), config_bench_ns(&mid, &end, n),
+	    config_bench_ns(&start, &mid, n) /
+	    config_bench_ns(&mid, &end, n));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n; i++) {
+		sink += lattutil_find_config_int(root,
+		    rpaths[i % CONFBENCH_KEYS], 0);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &mid);
+	for (i = 0; i < n; i++) {
+		sink += lattutil_config_index_int(lci,
+		    &(rates[i % CONFBENCH_KEYS]), 0);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("%-24s %10.1f %10.1f %7.2fx\n", "int",
+	    config_bench_ns(&start, &mid, n), config_bench_ns(&mid, &end, n),
+	    config_bench_ns(&start, &mid, n) /
+	    config_bench_ns(&mid, &end, n));
+
+	for (i = 0; i < CONFBENCH_KEYS; i++) {
+		free(npaths[i]);
+		free(rpaths[i]);
+	}
+	lattutil_config_index_free(&lci);
+	ucl_object_unref(root);
+
+	return (0);
+}
+
+static ucl_object_t *
+config_bench_tree(unsigned int nsections)
+{
+	struct ucl_parser *parser;
+	ucl_object_t *root;
+	unsigned int i;
+	size_t sz;
+	FILE *fp;
+	char *text;
+
+	fp = open_memstream(&text, &sz);
+	if (fp == NULL) {
+		return (NULL);
+	}
+	for (i = 0; i < nsections; i++) {
+		fprintf(fp, "section%u {\n\tname = \"service%u\";\n"
+		    "\tport = %u;\n\tlimits {\n\t\trate = %u;\n"
+		    "\t\tburst = %u;\n\t}\n\thosts = [ \"a%u\", \"b%u\" ];\n"
+		    "}\n", i, i, 1024 + i, i * 10, i * 20, i, i);
+	}
+	fclose(fp);
+
+	root = NULL;
+	parser = ucl_parser_new(UCL_PARSER_KEY_LOWERCASE);
+	if (parser != NULL) {
+		if (ucl_parser_add_chunk(parser, (unsigned char *)text, sz)) {
+			root = ucl_parser_get_object(parser);
+		}
+		ucl_parser_free(parser);
+	}
+
+	free(text);
+	return (root);
+}
+
+static bool
+config_bench_verify(const ucl_object_t *root,
+    const lattutil_config_index_t *lci, unsigned int nsections)
+{
+	const char *suffixes[] = { "", ".name", ".port", ".limits",
+	    ".limits.rate", ".limits.burst", ".hosts", ".hosts.0",
+	    ".hosts.1", ".missing", ".limits.rate.missing" };
+	char path[128], want[32];
+	lattutil_config_key_t key;
+	unsigned int i;
+	size_t j;
+
+	for (i = 0; i < nsections; i++) {
+		for (j = 0; j < nitems(suffixes); j++) {
+			snprintf(path, sizeof(path), "section%u%s", i,
+			    suffixes[j]);
+			lattutil_config_key_init(&key, path);
+			if (lattutil_config_index_lookup(lci, &key) !=
+			    ucl_object_lookup_path(root, path)) {
+				fprintf(stderr, "%s: index mismatch\n", path);
+				return (false);
+			}
+		}
+
+		snprintf(path, sizeof(path), "section%u.name", i);
+		snprintf(want, sizeof(want), "service%u", i);
+		lattutil_config_key_init(&key, path);
+		if (strcmp(lattutil_config_index_string(lci, &key, "", NULL),
+		    want)) {
+			fprintf(stderr, "section%u.name: wrong value\n", i);
+			return (false);
+		}
+	}
+
+	/* Every section contributes nine paths. */
+	if (lattutil_config_index_count(lci) != (size_t)nsections * 9) {
+		fprintf(stderr, "indexed %zu paths, expected %zu\n",
+		    lattutil_config_index_count(lci), (size_t)nsections * 9);
+		return (false);
+	}
+
+	return (true);
+}
+
+static double
+config_bench_ns(const struct timespec *start, const struct timespec *end,
+    unsigned int n)
+{
+
+	return (((end->tv_sec - start->tv_sec) * 1e9 +
+	    (end->tv_nsec - start->tv_nsec)) / n);
+}
+
+/*
+ * Bind a generated service configuration with a schema and compare
+ * the result, and the time taken, against looking every field up from
+ * the root with lattutil_find_config_string and
+ * lattutil_find_config_int. Then check that schema violations are
+ * reported and fail the bind.
+ */
+static int
+config_bind_test(int argc, char **argv)
+{
+	struct confbind_config bound, naive;
+	lattutil_config_binding_t *lcb;
+	struct timespec start, mid, end;
+	struct ucl_parser *parser;
+	unsigned int i, n, nbackends;
+	ucl_object_t *root;
+	unsigned int nreports;
+	FILE *fp;
+	char *text;
+	size_t sz;
+	int ch, res;
+
+	nbackends = 32;
+	n = 100000;
+	while ((ch = getopt(argc, argv, "b:n:")) != -1) {
+		switch (ch) {
+		case 'b':
+			nbackends = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			n = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+			return (1);
+		}
+	}
+
+	if (n == 0) {
+		usage();
+		return (1);
+	}
+
+	fp = open_memstream(&text, &sz);
+	if (fp == NULL) {
+		return (1);
+	}
+	fprintf(fp, "name = \"frontend\";\nport = 8443;\nworkers = 32;\n"
+	    "debug = true;\nmax_body = 10485760;\ntimeout = 2.5;\n"
+	    "log_file = \"/var/log/frontend.log\";\n"
+	    "limits { rate = 500; burst = 1000; ratio = 0.25; }\n"
+	    "listen = [ \"0.0.0.0:8443\", \"[::]:8443\" ];\n"
+	    "backends = [\n");
+	for (i = 0; i < nbackends; i++) {
+		fprintf(fp, "\t{ host = \"10.0.0.%u\"; port = %u; "
+		    "weight = %u; },\n", i, 9000 + i, 1 + i % 3);
+	}
+	fprintf(fp, "];\n");
+	fclose(fp);
+
+	root = NULL;
+	parser = ucl_parser_new(UCL_PARSER_KEY_LOWERCASE);
+	if (parser != NULL) {
+		if (ucl_parser_add_chunk(parser, (unsigned char *)text, sz)) {
+			root = ucl_parser_get_object(parser);
+		}
+		ucl_parser_free(parser);
+	}
+	free(text);
+	if (root == NULL) {
+		fprintf(stderr, "unable to parse generated config\n");
+		return (1);
+	}
+
+	nreports = 0;
+	lcb = lattutil_config_bind_object(root, confbind_schema, &bound, 0,
+	    config_bind_report, &nreports);
+	if (lcb == NULL || !config_bind_naive(root, &naive)) {
+		fprintf(stderr, "unable to bind generated config\n");
+		return (1);
+	}
+
+	res = 0;
+	if (strcmp(bound.cbc_name, naive.cbc_name) ||
+	    bound.cbc_port != naive.cbc_port ||
+	    bound.cbc_workers != naive.cbc_workers ||
+	    bound.cbc_maxbody != naive.cbc_maxbody ||
+	    strcmp(bound.cbc_logfile, naive.cbc_logfile) ||
+	    bound.cbc_limits.cbl_rate != naive.cbc_limits.cbl_rate ||
+	    bound.cbc_limits.cbl_burst != naive.cbc_limits.cbl_burst ||
+	    !bound.cbc_debug || bound.cbc_timeout != 2.5 ||
+	    bound.cbc_limits.cbl_ratio != 0.25 || bound.cbc_nlisten != 2 ||
+	    strcmp(bound.cbc_listen[1], "[::]:8443") ||
+	    bound.cbc_nbackends != nbackends) {
+		fprintf(stderr, "bound values differ\n");
+		res = 1;
+	}
+	for (i = 0; res == 0 && i < nbackends; i++) {
+		if (strcmp(bound.cbc_backends[i].cbb_host,
+		    naive.cbc_backends[i].cbb_host) ||
+		    bound.cbc_backends[i].cbb_port !=
+		    naive.cbc_backends[i].cbb_port ||
+		    bound.cbc_backends[i].cbb_weight !=
+		    naive.cbc_backends[i].cbb_weight) {
+			fprintf(stderr, "backend %u differs\n", i);
+			res = 1;
+		}
+		free((char *)naive.cbc_backends[i].cbb_host);
+	}
+	free((char *)naive.cbc_name);
+	free((char *)naive.cbc_logfile);
+	free(naive.cbc_backends);
+	lattutil_config_binding_free(&lcb);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n; i++) {
+		lcb = lattutil_config_bind_object(root, confbind_schema,
+		    &bound, 0, NULL, NULL);
+		lattutil_config_binding_free(&lcb);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &mid);
+	for (i = 0; i < n; i++) {
+		config_bind_naive(root, &naive);
+		for (sz = 0; sz < naive.cbc_nbackends; sz++) {
+			free((char *)naive.cbc_backends[sz].cbb_host);
+		}
+		free((char *)naive.cbc_name);
+		free((char *)naive.cbc_logfile);
+		free(naive.cbc_backends);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ucl_object_unref(root);
+
+	printf("%u backends: bind %.0f ns, per-key lookups %.0f ns, "
+	    "%.2fx\n", nbackends, config_bench_ns(&start, &mid, n),
+	    config_bench_ns(&mid, &end, n),
+	    config_bench_ns(&mid, &end, n) / config_bench_ns(&start, &mid, n));
+
+	if (!config_bind_expect("name = \"x\"; extra = 1;", 0, true, 1) ||
+	    !config_bind_expect("name = \"x\"; extra = 1;",
+	    LATTUTIL_CONFIG_BIND_STRICT, false, 1) ||
+	    !config_bind_expect("port = 8443;", 0, false, 1) ||
+	    !config_bind_expect("name = \"x\"; port = 70000;", 0, false, 1) ||
+	    !config_bind_expect("name = \"x\"; workers = \"many\"; "
+	    "limits { rate = true; }", 0, false, 2) ||
+	    !config_bind_expect("name = \"x\"; backends = [ { port = 1; }, "
+	    "{ host = \"h\"; port = 0; } ];", 0, false, 2) ||
+	    !config_bind_expect("name = \"x\"; backends { host = \"h\"; }",
+	    0, true, 0)) {
+		res = 1;
+	}
+
+	return (res);
+}
+
+static bool
+config_bind_port(const lattutil_config_field_t *field, const void *val)
+{
+	int port;
+
+	port = *(const int *)val;
+	return (port > 0 && port < 65536);
+}
+
+static void
+config_bind_report(const char *path, const char *problem, void *arg)
+{
+	unsigned int *nreports;
+
+	nreports = arg;
+	(*nreports)++;
+	if (getenv("CONFBIND_VERBOSE") != NULL) {
+		printf("  %s: %s\n", path, problem);
+	}
+}
+
+/* The same configuration, one lookup from the root per field. */
+static bool
+config_bind_naive(const ucl_object_t *root, struct confbind_config *cfg)
+{
+	const ucl_object_t *backends;
+	char path[64];
+	size_t i;
+
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->cbc_name = lattutil_find_config_string(root, "name", NULL);
+	cfg->cbc_port = lattutil_find_config_int(root, "port", 8080);
+	cfg->cbc_workers = lattutil_find_config_int(root, "workers", 4);
+	cfg->cbc_maxbody = lattutil_find_config_int(root, "max_body",
+	    1024 * 1024);
+	cfg->cbc_logfile = lattutil_find_config_string(root, "log_file",
+	    "/var/log/app.log");
+	cfg->cbc_limits.cbl_rate = lattutil_find_config_int(root,
+	    "limits.rate", 100);
+	cfg->cbc_limits.cbl_burst = lattutil_find_config_int(root,
+	    "limits.burst", 200);
+
+	backends = ucl_object_lookup_path(root, "backends");
+	cfg->cbc_nbackends = ucl_array_size(backends);
+	cfg->cbc_backends = calloc(cfg->cbc_nbackends + 1,
+	    sizeof(*(cfg->cbc_backends)));
+	if (cfg->cbc_backends == NULL) {
+		return (false);
+	}
+	for (i = 0; i < cfg->cbc_nbackends; i++) {
+		snprintf(path, sizeof(path), "backends.%zu.host", i);
+		cfg->cbc_backends[i].cbb_host =
+		    lattutil_find_config_string(root, path, NULL);
+		snprintf(path, sizeof(path), "backends.%zu.port", i);
+		cfg->cbc_backends[i].cbb_port =
+		    lattutil_find_config_int(root, path, 80);
+		snprintf(path, sizeof(path), "backends.%zu.weight", i);
+		cfg->cbc_backends[i].cbb_weight =
+		    lattutil_find_config_int(root, path, 1);
+	}
+
+	return (true);
+}
+
+/*
+ * Bind a small configuration and check whether it succeeds and how
+ * many problems were reported.
+ */
+static bool
+config_bind_expect(const char *text, int flags, bool ok,
+    unsigned int nexpected)
+{
+	struct confbind_config cfg;
+	lattutil_config_binding_t *lcb;
+	struct ucl_parser *parser;
+	unsigned int nreports;
+	ucl_object_t *root;
+	bool bound;
+
+	parser = ucl_parser_new(UCL_PARSER_KEY_LOWERCASE);
+	if (parser == NULL || !ucl_parser_add_chunk(parser,
+	    (const unsigned char *)text, strlen(text))) {
+		fprintf(stderr, "%s: parse failed\n", text);
+		return (false);
+	}
+	root = ucl_parser_get_object(parser);
+	ucl_parser_free(parser);
+
+	nreports = 0;
+	lcb = lattutil_config_bind_object(root, confbind_schema, &cfg, flags,
+	    config_bind_report, &nreports);
+	ucl_object_unref(root);
+
+	bound = lcb != NULL;
+	lattutil_config_binding_free(&lcb);
+
+	printf("%-60s %s, %u reported\n", text, bound ? "bound" :
+	    "rejected", nreports);
+	if (bound != ok || nreports != nexpected) {
+		fprintf(stderr, "expected %s with %u reported\n",
+		    ok ? "bound" : "rejected", nexpected);
+		return (false);
+	}
+
+	return (true);
+}
+
+/*
+ * Generate layers of config files with fragment directories, load
+ * them serially and in parallel, and check that both give the same
+ * tree with the documented override order.
+ */
+static int
+config_layer_test(int argc, char **argv)
+{
+	unsigned int i, nfrags, nlayers, nthreads, threads[2];
+	struct timespec start, end;
+	lattutil_config_path_t *cfg;
+	unsigned char *json[2];
+	const char **paths;
+	char **dirs;
+	size_t len[2];
+	int ch, res;
+
+	nfrags = 100;
+	nlayers = 3;
+	nthreads = 4;
+	while ((ch = getopt(argc, argv, "f:l:t:")) != -1) {
+		switch (ch) {
+		case 'f':
+			nfrags = strtoul(optarg, NULL, 10);
+			break;
+		case 'l':
+			nlayers = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			nthreads = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+			return (1);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1 || nlayers == 0) {
+		usage();
+		return (1);
+	}
+
+	dirs = calloc(nlayers, sizeof(*dirs));
+	paths = calloc(nlayers, sizeof(*paths));
+	if (dirs == NULL || paths == NULL) {
+		perror("calloc");
+		return (1);
+	}
+
+	mkdir(argv[0], 0755);
+	for (i = 0; i < nlayers; i++) {
+		if (asprintf(&(dirs[i]), "%s/layer%u", argv[0], i) < 0 ||
+		    !config_layer_write(dirs[i], i, nlayers, nfrags)) {
+			fprintf(stderr, "unable to write layer %u\n", i);
+			return (1);
+		}
+		paths[i] = dirs[i];
+	}
+
+	res = 0;
+	threads[0] = 1;
+	threads[1] = nthreads;
+	for (i = 0; i < 2; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		cfg = lattutil_find_config_layered(paths, nlayers, "app.conf",
+		    "conf.d", O_RDONLY, threads[i]);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if (cfg == NULL) {
+			fprintf(stderr, "%u threads: load failed\n",
+			    threads[i]);
+			return (1);
+		}
+
+		printf("%u threads: %u files in %.3f ms\n", threads[i],
+		    nlayers * (nfrags + 1),
+		    ((end.tv_sec - start.tv_sec) * 1e9 +
+		    (end.tv_nsec - start.tv_nsec)) / 1e6);
+
+		if (!config_layer_check(cfg, nlayers, nfrags)) {
+			res = 1;
+		}
+		json[i] = ucl_object_emit_len(cfg->l_rootobj,
+		    UCL_EMIT_JSON_COMPACT, &(len[i]));
+		lattutil_free_config_path(&cfg);
+	}
+
+	if (json[0] == NULL || json[1] == NULL || len[0] != len[1] ||
+	    memcmp(json[0], json[1], len[0])) {
+		fprintf(stderr, "serial and parallel trees differ\n");
+		res = 1;
+	}
+
+	free(json[0]);
+	free(json[1]);
+	for (i = 0; i < nlayers; i++) {
+		free(dirs[i]);
+	}
+	free(dirs);
+	free(paths);
+
+	return (res);
+}
+
+/*
+ * Write one layer: a main file and its fragments. Every file sets
+ * "owner" and "list", so the last file applied wins them. Each adds
+ * its own key under "files", so the merged object collects all of
+ * them.
+ */
+static bool
+config_layer_write(const char *dir, unsigned int layer,
+    unsigned int nlayers, unsigned int nfrags)
+{
+	char path[PATH_MAX];
+	unsigned int i, j;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/conf.d", dir);
+	if ((mkdir(dir, 0755) && errno != EEXIST) ||
+	    (mkdir(path, 0755) && errno != EEXIST)) {
+		return (false);
+	}
+
+	for (i = 0; i <= nfrags; i++) {
+		if (i == 0) {
+			snprintf(path, sizeof(path), "%s/app.conf", dir);
+		} else {
+			/* Reverse the creation order of the names. */
+			snprintf(path, sizeof(path), "%s/conf.d/%04u.conf",
+			    dir, nfrags + 1 - i);
+		}
+
+		fp = fopen(path, "w");
+		if (fp == NULL) {
+			return (false);
+		}
+		fprintf(fp, "owner = \"%u-%u\";\nlist = [ %u, %u ];\n"
+		    "files { l%uf%u = %u; }\n", layer, i == 0 ? 0 :
+		    nfrags + 1 - i, layer, i, layer, i, nlayers);
+		for (j = 0; j < 20; j++) {
+			fprintf(fp, "section%u { key%u = \"%s\"; }\n", j,
+			    layer * 1000 + i, STRESS_PAYLOAD);
+		}
+		if (fclose(fp)) {
+			return (false);
+		}
+	}
+
+	return (true);
+}
+
+static bool
+config_layer_check(const lattutil_config_path_t *cfg,
+    unsigned int nlayers, unsigned int nfrags)
+{
+	const ucl_object_t *files, *list;
+	char want[64];
+	const char *owner;
+	bool res;
+
+	res = true;
+
+	/* Layer 0 is the first path and applies last. */
+	snprintf(want, sizeof(want), "0-%u", nfrags);
+	owner = ucl_object_tostring(ucl_object_lookup(cfg->l_rootobj,
+	    "owner"));
+	if (owner == NULL || strcmp(owner, want)) {
+		fprintf(stderr, "owner is %s, expected %s\n",
+		    owner ? owner : "(null)", want);
+		res = false;
+	}
+
+	list = ucl_object_lookup(cfg->l_rootobj, "list");
+	if (ucl_array_size(list) != 2) {
+		fprintf(stderr, "list was appended to, not replaced\n");
+		res = false;
+	}
+
+	files = ucl_object_lookup(cfg->l_rootobj, "files");
+	if (files == NULL || files->len != nlayers * (nfrags + 1)) {
+		fprintf(stderr, "files has %u keys, expected %u\n",
+		    files ? files->len : 0, nlayers * (nfrags + 1));
+		res = false;
+	}
+
+	return (res);
+}
+
+/*
+ * Generate a large config file and load it in two fresh processes,
+ * once read into memory by libucl and once mapped and parsed in place,
+ * comparing load time, peak resident memory, and the parsed trees.
+ */
+static int
+config_load_test(int argc, char **argv)
+{
+	struct confload_result res[2];
+	unsigned int i, nsections;
+	FILE *fp;
+	int ch;
+
+	nsections = 20000;
+	while ((ch = getopt(argc, argv, "k:")) != -1) {
+		switch (ch) {
+		case 'k':
+			nsections = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+			return (1);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1) {
+		usage();
+		return (1);
+	}
+
+	fp = fopen(argv[0], "w");
+	if (fp == NULL) {
+		perror(argv[0]);
+		return (1);
+	}
+	for (i = 0; i < nsections; i++) {
+		fprintf(fp, "section%u {\n\tname = \"service%u\";\n"
+		    "\tdescription = \"%s %s\";\n\tport = %u;\n"
+		    "\tlimits { rate = %u; burst = %u; }\n"
+		    "\thosts = [ \"a%u.example.org\", \"b%u.example.org\" ];\n"
+		    "}\n", i, i, STRESS_PAYLOAD, STRESS_PAYLOAD, 1024 + i,
+		    i * 10, i * 20, i, i);
+	}
+	if (fclose(fp)) {
+		perror(argv[0]);
+		return (1);
+	}
+
+	if (!config_load_fork(argv[0], false, NULL, "read", &(res[0])) ||
+	    !config_load_fork(argv[0], true, NULL, "mapped", &(res[1]))) {
+		return (1);
+	}
+
+	if (res[0].clr_crc != res[1].clr_crc ||
+	    res[0].clr_paths != res[1].clr_paths) {
+		fprintf(stderr, "parsed trees differ\n");
+		return (1);
+	}
+
+	return (0);
+}
+
+static lattutil_config_path_t *
+config_load_path(const char *path, bool mapped, const char *image)
+{
+	lattutil_config_path_t *cfg;
+	const char *dir, *name;
+	char *copy, *p;
+
+	copy = strdup(path);
+	if (copy == NULL) {
+		return (NULL);
+	}
+	p = strrchr(copy, '/');
+	if (p != NULL) {
+		*p = '\0';
+		dir = copy;
+		name = p + 1;
+	} else {
+		dir = ".";
+		name = copy;
+	}
+
+	if (image != NULL) {
+		cfg = lattutil_find_config_image(&dir, 1, name, O_RDONLY,
+		    image);
+	} else if (mapped) {
+		cfg = lattutil_find_config_mapped(&dir, 1, name, O_RDONLY);
+	} else {
+		cfg = lattutil_find_config(&dir, 1, name, O_RDONLY);
+	}
+
+	free(copy);
+	return (cfg);
+}
+
+/*
+ * Load a config file in a fresh process, so that load time and peak
+ * memory are not skewed by earlier loads, and print the result.
+ */
+static bool
+config_load_fork(const char *path, bool mapped, const char *image,
+    const char *mode, struct confload_result *res)
+{
+	int fds[2], status;
+	pid_t pid;
+
+	if (pipe(fds)) {
+		perror("pipe");
+		return (false);
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		close(fds[0]);
+		close(fds[1]);
+		return (false);
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		if (!config_load_child(path, mapped, image, res) ||
+		    write(fds[1], res, sizeof(*res)) != sizeof(*res)) {
+			_exit(1);
+		}
+		_exit(0);
+	}
+
+	close(fds[1]);
+	if (read(fds[0], res, sizeof(*res)) != sizeof(*res) ||
+	    waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s load failed\n", mode);
+		close(fds[0]);
+		return (false);
+	}
+	close(fds[0]);
+
+	printf("%-8s %zu paths, %.3f sec, max rss %ld KB\n", mode,
+	    res->clr_paths, res->clr_secs, res->clr_maxrss);
+
+	return (true);
+}
+
+static bool
+config_load_child(const char *path, bool mapped, const char *image,
+    struct confload_result *res)
+{
+	struct timespec start, end;
+	lattutil_config_index_t *lci;
+	lattutil_config_path_t *cfg;
+	unsigned char *json;
+	struct rusage ru;
+	size_t len;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	cfg = config_load_path(path, mapped, image);
+	if (cfg == NULL) {
+		return (false);
+	}
+
+	/* Index the tree, which reads every value. */
+	lci = lattutil_config_index_new(cfg->l_rootobj);
+	if (lci == NULL) {
+		return (false);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	getrusage(RUSAGE_SELF, &ru);
+	res->clr_maxrss = ru.ru_maxrss;
+	res->clr_secs = (end.tv_sec - start.tv_sec) +
+	    (end.tv_nsec - start.tv_nsec) / 1e9;
+	res->clr_paths = lattutil_config_index_count(lci);
+
+	json = ucl_object_emit_len(cfg->l_rootobj, UCL_EMIT_JSON_COMPACT,
+	    &len);
+	if (json == NULL) {
+		return (false);
+	}
+	res->clr_crc = crc32(0, json, len);
+
+	free(json);
+	lattutil_config_index_free(&lci);
+	lattutil_free_config_path(&cfg);
+
+	return (true);
+}
+
+/*
+ * Compile a config file into an image, or check that an image is
+ * current and loads the same tree as the file, timing a cold load of
+ * each in a fresh process.
+ */
+static int
+config_image_test(int argc, char **argv)
+{
+	lattutil_config_path_t *cfg;
+	struct stat sb;
+
+	if (argc != 4) {
+		usage();
+		return (1);
+	}
+
+	if (!strcmp(argv[1], "build")) {
+		cfg = config_load_path(argv[2], false, NULL);
+		if (cfg == NULL) {
+			fprintf(stderr, "%s: unable to parse\n", argv[2]);
+			return (1);
+		}
+		if (!lattutil_config_image_write(cfg, argv[3])) {
+			perror(argv[3]);
+			lattutil_free_config_path(&cfg);
+			return (1);
+		}
+		lattutil_free_config_path(&cfg);
+		if (stat(argv[3], &sb) == 0) {
+			printf("%s: %jd bytes\n", argv[3],
+			    (intmax_t)sb.st_size);
+		}
+		return (0);
+	}
+
+	if (!strcmp(argv[1], "verify")) {
+		return (config_image_compare(argv[2], argv[3]) ? 0 : 1);
+	}
+
+	usage();
+	return (1);
+}
+
+static bool
+config_image_compare(const char *path, const char *image)
+{
+	struct confload_result res[2];
+	lattutil_config_path_t *cfg;
+	bool current;
+
+	cfg = config_load_path(path, false, NULL);
+	if (cfg == NULL) {
+		fprintf(stderr, "%s: unable to parse\n", path);
+		return (false);
+	}
+	current = lattutil_config_image_current(cfg, image);
+	lattutil_free_config_path(&cfg);
+	if (!current) {
+		fprintf(stderr, "%s: missing, stale, or damaged\n", image);
+		return (false);
+	}
+
+	if (!config_load_fork(path, false, NULL, "text", &(res[0])) ||
+	    !config_load_fork(path, false, image, "image", &(res[1]))) {
+		return (false);
+	}
+
+	if (res[0].clr_crc != res[1].clr_crc ||
+	    res[0].clr_paths != res[1].clr_paths) {
+		fprintf(stderr, "parsed trees differ\n");
+		return (false);
+	}
+
+	return (true);
+}
+
+/*
+ * Rewrite a config file while reader threads look up a value in the
+ * current snapshot as fast as they can. Each rewrite bumps the value
+ * and replaces the file by rename(2), as deployment tools do. The
+ * test checks that every reload is published and that no reader ever
+ * sees the value go backwards.
+ */
+static int
+config_watch_test(int argc, char **argv)
+{
+	struct timespec start, end, stop, deadline;
+	lattutil_config_path_t *cfg;
+	lattutil_config_watch_t *lcw;
+	struct confwatch_arg *args;
+	unsigned int i, nbursts, nreaders, nreloads;
+	const char *dir, *name;
+	char *path, *p;
+	pthread_t *tids;
+	uint64_t reads;
+	double secs;
+	int ch, res;
+
+	nbursts = 1000;
+	nreaders = 4;
+	nreloads = 20;
+	while ((ch = getopt(argc, argv, "b:n:r:")) != -1) {
+		switch (ch) {
+		case 'b':
+			nbursts = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			nreaders = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			nreloads = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+			return (1);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1 || nreaders == 0) {
+		usage();
+		return (1);
+	}
+
+	path = strdup(argv[0]);
+	if (path == NULL) {
+		return (1);
+	}
+	p = strrchr(path, '/');
+	if (p != NULL) {
+		*p = '\0';
+		dir = path;
+		name = p + 1;
+	} else {
+		dir = ".";
+		name = path;
+	}
+
+	if (!config_watch_write(argv[0], 0)) {
+		fprintf(stderr, "%s: unable to write config\n", argv[0]);
+		return (1);
+	}
+
+	cfg = lattutil_find_config(&dir, 1, name, O_RDONLY);
+	if (cfg == NULL) {
+		fprintf(stderr, "%s: unable to parse config\n", argv[0]);
+		return (1);
+	}
+
+	lcw = lattutil_config_watch_new(cfg);
+	if (lcw == NULL) {
+		fprintf(stderr, "%s: unable to watch config\n", argv[0]);
+		return (1);
+	}
+	lattutil_config_watch_add_cb(lcw, config_watch_changed, NULL);
+
+	args = calloc(nreaders, sizeof(*args));
+	tids = calloc(nreaders, sizeof(*tids));
+	if (args == NULL || tids == NULL) {
+		return (1);
+	}
+
+	for (i = 0; i < nreaders; i++) {
+		args[i].cwa_watch = lcw;
+		args[i].cwa_ok = true;
+		pthread_create(&(tids[i]), NULL, config_watch_reader,
+		    &(args[i]));
+	}
+
+	res = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 1; i <= nreloads; i++) {
+		if (!config_watch_write(argv[0], i)) {
+			fprintf(stderr, "%s: unable to write config\n",
+			    argv[0]);
+			res = 1;
+			break;
+		}
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += 5;
+		pthread_mutex_lock(&confwatch_mtx);
+		while (confwatch_seen < i) {
+			if (pthread_cond_timedwait(&confwatch_cv,
+			    &confwatch_mtx, &deadline)) {
+				break;
+			}
+		}
+		pthread_mutex_unlock(&confwatch_mtx);
+		if (confwatch_seen < i) {
+			fprintf(stderr, "reload %u was not picked up\n", i);
+			res = 1;
+			break;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	/* Back-to-back reloads, with no debounce, while readers run. */
+	for (i = 0; res == 0 && i < nbursts; i++) {
+		if (!lattutil_config_watch_reload(lcw)) {
+			fprintf(stderr, "burst reload %u failed\n", i);
+			res = 1;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+
+	atomic_store(&confwatch_done, true);
+	reads = 0;
+	for (i = 0; i < nreaders; i++) {
+		pthread_join(tids[i], NULL);
+		reads += args[i].cwa_reads;
+		if (!args[i].cwa_ok) {
+			fprintf(stderr, "reader %u saw a stale snapshot\n", i);
+			res = 1;
+		}
+		if (res == 0 && args[i].cwa_last != nreloads) {
+			fprintf(stderr, "reader %u ended at %jd\n", i,
+			    (intmax_t)args[i].cwa_last);
+			res = 1;
+		}
+	}
+
+	secs = (end.tv_sec - start.tv_sec) +
+	    (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%u reloads in %.2f sec (%.1f ms each), %ju errors\n",
+	    nreloads, secs, secs * 1000 / (nreloads ? nreloads : 1),
+	    (uintmax_t)lattutil_config_watch_errors(lcw));
+	secs = (stop.tv_sec - start.tv_sec) +
+	    (stop.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%u readers: %.0f snapshot reads/sec\n", nreaders,
+	    reads / secs);
+
+	lattutil_config_watch_free(&lcw);
+	lattutil_free_config_path(&cfg);
+	free(args);
+	free(tids);
+	free(path);
+
+	return (res);
+}
+
+static void *
+config_watch_reader(void *arg)
+{
+	lattutil_config_snapshot_t *snap;
+	struct confwatch_arg *cwa;
+	lattutil_config_key_t key;
+	int64_t val;
+	bool done;
+
+	lattutil_config_key_init(&key, "generation");
+
+	/* The read after done is set must see the final reload. */
+	cwa = arg;
+	do {
+		done = atomic_load(&confwatch_done);
+		snap = lattutil_config_watch_acquire(cwa->cwa_watch);
+		val = lattutil_config_index_int(
+		    lattutil_config_snapshot_index(snap), &key, -1);
+		lattutil_config_snapshot_release(&snap);
+
+		if (val < cwa->cwa_last) {
+			cwa->cwa_ok = false;
+		}
+		cwa->cwa_last = val;
+		cwa->cwa_reads++;
+	} while (!done);
+
+	return (NULL);
+}
+
+static void
+config_watch_changed(lattutil_config_watch_t *lcw,
+    lattutil_config_snapshot_t *snap, void *arg)
+{
+	int64_t val;
+
+	val = ucl_object_toint(ucl_object_lookup(
+	    lattutil_config_snapshot_root(snap), "generation"));
+
+	pthread_mutex_lock(&confwatch_mtx);
+	confwatch_seen = val;
+	pthread_cond_broadcast(&confwatch_cv);
+	pthread_mutex_unlock(&confwatch_mtx);
+}
+
+static bool
+config_watch_write(const char *path, unsigned int val)
+{
+	char tmp[PATH_MAX];
+	FILE *fp;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		return (false);
+	}
+
+	fprintf(fp, "generation = %u;\npayload = \"%s\";\n", val,
+	    STRESS_PAYLOAD);
+	if (fclose(fp)) {
+		unlink(tmp);
+		return (false);
+	}
+
+	return (rename(tmp, path) == 0);
+}
+
+/*
+ * Measure SQLite logging throughput: threads log records as fast as
+ * they can, and the clock stops once every record is committed. With
+ * -a, each record is instead inserted in its own implicit transaction
+ * through lattutil_sqlite_exec(), for comparison.
+ */
+static int
+sqlite_bench(int argc, char **argv)
+{
+	lattutil_log_sqlite_stats_t stats;
+	lattutil_log_sqlite_opts_t opts;
+	struct sqlbench_arg *args;
+	struct timespec start, end;
+	unsigned int i, nthreads, count;
+	lattutil_log_t *logp;
+	pthread_t *threads;
+	uint64_t total;
+	double secs;
+	bool naive;
+	int ch;
+
+	naive = false;
+	nthreads = 4;
+	count = 100000;
+	lattutil_log_sqlite_default_opts(&opts);
+	while ((ch = getopt(argc, argv, "ab:n:t:")) != -1) {
+		switch (ch) {
+		case 'a':
+			naive = true;
+			break;
+		case 'b':
+			opts.llso_batch = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			count = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			nthreads = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+			return (1);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1 || nthreads == 0) {
+		usage();
+		return (1);
+	}
+
+	unlink(argv[0]);
+
+	if (naive) {
+		nthreads = 1;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (!sqlite_bench_naive(argv[0], count)) {
+			return (1);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		memset(&stats, 0, sizeof(stats));
+		stats.llss_written = count;
+	} else {
+		logp = lattutil_log_init(NULL, 0);
+		if (logp == NULL ||
+		    !lattutil_log_sqlite_init(logp, argv[0], &opts)) {
+			fprintf(stderr, "%s: unable to open log\n", argv[0]);
+			return (1);
+		}
+
+		threads = calloc(nthreads, sizeof(*threads));
+		args = calloc(nthreads, sizeof(*args));
+		if (threads == NULL || args == NULL) {
+			perror("calloc");
+			return (1);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < nthreads; i++) {
+			args[i].sba_logp = logp;
+			args[i].sba_id = i;
+			args[i].sba_count = count;
+			pthread_create(&(threads[i]), NULL,
+			    sqlite_bench_worker, &(args[i]));
+		}
+		for (i = 0; i < nthreads; i++) {
+			pthread_join(threads[i], NULL);
+		}
+		lattutil_log_sqlite_flush(logp);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		lattutil_log_sqlite_stats(logp, &stats);
+		lattutil_log_free(&logp);
+		free(threads);
+		free(args);
+	}
+
+	total = (uint64_t)nthreads * count;
+	secs = (end.tv_sec - start.tv_sec) +
+	    (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%ju lines in %.3f s: %.0f lines/sec\n", (uintmax_t)total,
+	    secs, secs > 0 ? total / secs : 0);
+
+	if (stats.llss_written != total || stats.llss_errors != 0) {
+		fprintf(stderr, "%s: %ju of %ju lines written, %ju errors\n",
+		    argv[0], (uintmax_t)stats.llss_written, (uintmax_t)total,
+		    (uintmax_t)stats.llss_errors);
+		return (1);
+	}
+
+	return (0);
+}
+
+static void *
+sqlite_bench_worker(void *arg)
+{
+	struct sqlbench_arg *sba;
+	unsigned int i;
+
+	sba = arg;
+	for (i = 0; i < sba->sba_count; i++) {
+		sba->sba_logp->ll_log_info(sba->sba_logp, 5,
+		    "thread %u seq %u %s", sba->sba_id, i, STRESS_PAYLOAD);
+	}
+
+	return (NULL);
+}
+
+static bool
+sqlite_bench_naive(const char *path, unsigned int count)
+{
+	lattutil_sqlite_query_t *query;
+	lattutil_sqlite_ctx_t *sqlctx;
+	char msg[128];
+	unsigned int i;
+	bool ok;
+
+	sqlctx = lattutil_sqlite_ctx_new(path, NULL, 0);
+	if (sqlctx == NULL) {
+		fprintf(stderr, "%s: unable to open database\n", path);
+		return (false);
+	}
+
+	query = lattutil_sqlite_prepare(sqlctx,
+	    "CREATE TABLE IF NOT EXISTS log (id INTEGER PRIMARY KEY, "
+	    "ts INTEGER NOT NULL, level TEXT NOT NULL, msg TEXT NOT NULL)");
+	ok = query != NULL && lattutil_sqlite_exec(query);
+	lattutil_sqlite_query_free(&query);
+
+	for (i = 0; ok && i < count; i++) {
+		snprintf(msg, sizeof(msg), "thread 0 seq %u %s", i,
+		    STRESS_PAYLOAD);
+		query = lattutil_sqlite_prepare(sqlctx,
+		    "INSERT INTO log (ts, level, msg) VALUES (?, 'INFO', ?)");
+		ok = query != NULL &&
+		    lattutil_sqlite_bind_time(query, 1, time(NULL)) &&
+		    lattutil_sqlite_bind_string(query, 2, msg) &&
+		    lattutil_sqlite_exec(query);
+		lattutil_sqlite_query_free(&query);
+	}
+
+	lattutil_log_free(&(sqlctx->lsq_logger));
+	lattutil_sqlite_ctx_free(&sqlctx);
+
+	if (!ok) {
+		fprintf(stderr, "%s: insert failed\n", path);
+	}
+
+	return (ok);
+}
+
+#define	SQLCATALOG_SCHEMA						\
+	"CREATE TABLE users (id INTEGER PRIMARY KEY, name TEXT NOT NULL, "\
+	"created INTEGER NOT NULL, avatar BLOB)"
+
+#define	SQLCATALOG_STATEMENTS						\
+	"begin { sql = \"BEGIN\"; }\n"					\
+	"commit { sql = \"COMMIT\"; }\n"				\
+	"add_user {\n"							\
+	"  sql = \"INSERT INTO users (name, created, avatar) "		\
+	"VALUES (?, ?, ?)\";\n"						\
+	"  params = [ \"string\", \"time\", "				\
+	"\"blob\" ];\n"							\
+	"}\n"								\
+	"get_user {\n"							\
+	"  sql = \"SELECT name, created FROM users WHERE id = ?\";\n"	\
+	"  params = [ \"int\" ];\n"					\
+	"  columns = 2;\n"						\
+	"}\n"
+
+/*
+ * Catalogs that must fail: a missing column, a parameter count that
+ * does not match, an unknown type, two statements in one, and a
+ * result that does not match the declared columns.
+ */
+static const char *sqlcatalog_bad[] = {
+	"q { sql = \"SELECT email FROM users\"; }",
+	"q { sql = \"SELECT name FROM users WHERE id = ?\"; }",
+	"q { sql = \"SELECT name FROM users WHERE id = ?\"; "
+	    "params = [ \"uuid\" ]; }",
+	"q { sql = \"SELECT 1; SELECT 2\"; }",
+	"q { sql = \"SELECT * FROM users\"; columns = 3; }",
+	"q { sql = \"SELECT 1\"; } q { sql = \"SELECT 2\"; }",
+};
+
+/*
+ * Prepare a statement catalog, check that drifted catalogs fail, and
+ * compare executing from the catalog with preparing on every call.
+ * With -v, the catalog's log messages go to stdout and stderr.
+ */
+static int
+sqlite_catalog_test(int argc, char **argv)
+{
+	lattutil_sqlite_catalog_t *cat;
+	lattutil_sqlite_query_t *query;
+	struct timespec start, end;
+	lattutil_sqlite_ctx_t *ctx;
+	ssize_t add, begin, commit, get;
+	unsigned int i, count;
+	const ucl_object_t *row;
+	lattutil_log_t *logp;
+	const char *name;
+	char buf[64];
+	double secs;
+	int ch, res;
+
+	count = 10000;
+	logp = NULL;
+	while ((ch = getopt(argc, argv, "n:v")) != -1) {
+		switch (ch) {
+		case 'n':
+			count = strtoul(optarg, NULL, 10);
+			break;
+		case 'v':
+			if (logp == NULL) {
+				logp = lattutil_log_init(NULL, -1);
+				if (logp == NULL) {
+					return (1);
+				}
+				lattutil_log_stdio_init(logp);
+			}
+			break;
+		default:
+			usage();
+			return (1);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1) {
+		usage();
+		return (1);
+	}
+
+	unlink(argv[0]);
+	ctx = lattutil_sqlite_ctx_new(argv[0], logp, 0);
+	if (ctx == NULL) {
+		fprintf(stderr, "%s: unable to open database\n", argv[0]);
+		return (1);
+	}
+
+	query = lattutil_sqlite_prepare(ctx, SQLCATALOG_SCHEMA);
+	if (query == NULL || !lattutil_sqlite_exec(query)) {
+		fprintf(stderr, "%s: unable to create schema\n", argv[0]);
+		return (1);
+	}
+	lattutil_sqlite_query_free(&query);
+
+	res = 0;
+	for (i = 0; i < nitems(sqlcatalog_bad); i++) {
+		cat = sqlite_catalog_load(ctx, sqlcatalog_bad[i]);
+		if (cat != NULL) {
+			fprintf(stderr, "bad catalog %u accepted\n", i);
+			lattutil_sqlite_catalog_free(&cat);
+			res = 1;
+		}
+	}
+
+	cat = sqlite_catalog_load(ctx, SQLCATALOG_STATEMENTS);
+	if (cat == NULL) {
+		fprintf(stderr, "unable to prepare catalog\n");
+		return (1);
+	}
+	printf("catalog: %zu statements prepared in %.3f ms\n",
+	    lattutil_sqlite_catalog_count(cat),
+	    lattutil_sqlite_catalog_prepare_time(cat) / 1e6);
+
+	add = lattutil_sqlite_catalog_id(cat, "add_user");
+	begin = lattutil_sqlite_catalog_id(cat, "begin");
+	commit = lattutil_sqlite_catalog_id(cat, "commit");
+	get = lattutil_sqlite_catalog_id(cat, "get_user");
+	if (add < 0 || begin < 0 || commit < 0 || get < 0 ||
+	    lattutil_sqlite_catalog_id(cat, "missing") != -1) {
+		fprintf(stderr, "catalog lookup failed\n");
+		return (1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (!lattutil_sqlite_catalog_exec(cat, begin)) {
+		res = 1;
+	}
+	for (i = 0; res == 0 && i < count; i++) {
+		snprintf(buf, sizeof(buf), "user%u", i);
+		if (!lattutil_sqlite_catalog_exec(cat, add, buf,
+		    (time_t)i, (void *)buf, strlen(buf))) {
+			fprintf(stderr, "insert %u failed\n", i);
+			res = 1;
+		}
+	}
+	if (!lattutil_sqlite_catalog_exec(cat, commit)) {
+		res = 1;
+	}
+	for (i = 0; res == 0 && i < count; i++) {
+		if (!lattutil_sqlite_catalog_exec(cat, get,
+		    (int64_t)i + 1)) {
+			fprintf(stderr, "select %u failed\n", i);
+			res = 1;
+			break;
+		}
+		snprintf(buf, sizeof(buf), "user%u", i);
+		row = lattutil_sqlite_get_row(
+		    lattutil_sqlite_catalog_query(cat, get), 0);
+		name = lattutil_sqlite_get_column_string(row, 0);
+		if (name == NULL || strcmp(name, buf) ||
+		    lattutil_sqlite_get_row(
+		    lattutil_sqlite_catalog_query(cat, get), 1) != NULL) {
+			fprintf(stderr, "select %u returned %s\n", i,
+			    name ? name : "(null)");
+			res = 1;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = (end.tv_sec - start.tv_sec) +
+	    (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("catalog: %u inserts and selects in %.3f s\n", count, secs);
+
+	lattutil_sqlite_catalog_free(&cat);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (res == 0 && !sqlite_catalog_naive(ctx, count)) {
+		fprintf(stderr, "per-call prepare failed\n");
+		res = 1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = (end.tv_sec - start.tv_sec) +
+	    (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("prepare: %u inserts and selects in %.3f s\n", count, secs);
+
+	lattutil_log_free(&(ctx->lsq_logger));
+	lattutil_sqlite_ctx_free(&ctx);
+
+	return (res);
+}
+
+static lattutil_sqlite_catalog_t *
+sqlite_catalog_load(lattutil_sqlite_ctx_t *ctx, const char *conf)
+{
+	lattutil_sqlite_catalog_t *cat;
+	struct ucl_parser *parser;
+	ucl_object_t *root;
+
+	parser = ucl_parser_new(UCL_PARSER_KEY_LOWERCASE);
+	if (parser == NULL) {
+		return (NULL);
+	}
+	if (!ucl_parser_add_string(parser, conf, 0)) {
+		ucl_parser_free(parser);
+		return (NULL);
+	}
+	root = ucl_parser_get_object(parser);
+	ucl_parser_free(parser);
+
+	cat = lattutil_sqlite_catalog_new(ctx, root);
+	ucl_object_unref(root);
+
+	return (cat);
+}
+
+/*
+ * The same work as the catalog run, preparing each statement on every
+ * call, as callers of lattutil_sqlite_prepare do today.
+ */
+static bool
+sqlite_catalog_naive(lattutil_sqlite_ctx_t *ctx, unsigned int count)
+{
+	lattutil_sqlite_query_t *query;
+	const ucl_object_t *row;
+	const char *name;
+	unsigned int i;
+	char buf[64];
+	bool ok;
+
+	query = lattutil_sqlite_prepare(ctx, "BEGIN");
+	ok = query != NULL && lattutil_sqlite_exec(query);
+	lattutil_sqlite_query_free(&query);
+
+	for (i = 0; ok && i < count; i++) {
+		snprintf(buf, sizeof(buf), "user%u", i);
+		query = lattutil_sqlite_prepare(ctx, "INSERT INTO users "
+		    "(name, created, avatar) VALUES (?, ?, ?)");
+		ok = query != NULL &&
+		    lattutil_sqlite_bind_string(query, 1, buf) &&
+		    lattutil_sqlite_bind_time(query, 2, (time_t)i) &&
+		    lattutil_sqlite_bind_blob(query, 3, buf, strlen(buf)) &&
+		    lattutil_sqlite_exec(query);
+		lattutil_sqlite_query_free(&query);
+	}
+
+	query = lattutil_sqlite_prepare(ctx, "COMMIT");
+	ok = ok && query != NULL && lattutil_sqlite_exec(query);
+	lattutil_sqlite_query_free(&query);
+
+	for (i = 0; ok && i < count; i++) {
+		snprintf(buf, sizeof(buf), "user%u", i);
+		query = lattutil_sqlite_prepare(ctx,
+		    "SELECT name, created FROM users WHERE id = ?");
+		ok = query != NULL &&
+		    lattutil_sqlite_bind_int(query, 1,
+		    (int64_t)count + i + 1) &&
+		    lattutil_sqlite_exec(query);
+		if (ok) {
+			row = lattutil_sqlite_get_row(query, 0);
+			name = lattutil_sqlite_get_column_string(row, 0);
+			ok = name != NULL && !strcmp(name, buf);
+		}
+		lattutil_sqlite_query_free(&query);
+	}
+
+	return (ok);
+}
+
+/*
+ * Stand in for syslogd on a datagram socket of our own and check the
+ * frames a direct syslog logger sends, byte for byte, in both formats
+ * and in time zones east and west of UTC. The logger name is longer
+ * than RFC 5424 allows for APP-NAME.
+ */
+static int
+syslog_check(int argc, char **argv)
+{
+	static const struct syslogcheck_zone zones[] = {
+		{ "UTC0", 0, "+00:00" },
+		{ "LLT-5:30", 5 * 3600 + 30 * 60, "+05:30" },
+		{ "LLT3:15", -(3 * 3600 + 15 * 60), "-03:15" },
+	};
+	static const int formats[] = {
+		LATTUTIL_SYSLOG_RFC3164,
+		LATTUTIL_SYSLOG_RFC5424,
+	};
+	char dir[] = "/tmp/lattutil.XXXXXX";
+	struct sockaddr_un sun;
+	unsigned int i, j, failed;
+	int fd;
+
+	if (argc != 1) {
+		usage();
+		return (1);
+	}
+
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return (1);
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	snprintf(sun.sun_path, sizeof(sun.sun_path), "%s/log", dir);
+
+	fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&sun, sizeof(sun))) {
+		perror(sun.sun_path);
+		if (fd >= 0) {
+			close(fd);
+		}
+		rmdir(dir);
+		return (1);
+	}
+
+	failed = 0;
+	for (i = 0; i < nitems(formats); i++) {
+		for (j = 0; j < nitems(zones); j++) {
+			if (!syslog_check_one(fd, sun.sun_path, formats[i],
+			    &(zones[j]))) {
+				failed++;
+			}
+		}
+	}
+
+	close(fd);
+	unlink(sun.sun_path);
+	rmdir(dir);
+
+	printf("%u of %zu frames differ\n", failed,
+	    nitems(formats) * nitems(zones));
+
+	return (failed > 0);
+}
+
+static bool
+syslog_check_one(int fd, const char *path, int format,
+    const struct syslogcheck_zone *zone)
+{
+	char want[2][SYSLOGCHECK_BUFSZ], got[SYSLOGCHECK_BUFSZ];
+	char host[256], stamp[64];
+	lattutil_log_t *logp;
+	time_t now[2], secs;
+	struct tm tm;
+	ssize_t len;
+	int i, prio;
+
+	setenv("TZ", zone->scz_tz, 1);
+	tzset();
+
+	logp = lattutil_log_init(SYSLOGCHECK_NAME, -1);
+	if (logp == NULL ||
+	    !lattutil_log_syslog_direct_init(logp, path, LOG_USER, format)) {
+		fprintf(stderr, "%s: cannot set up the logger\n", path);
+		lattutil_log_free(&logp);
+		return (false);
+	}
+
+	/* The frame carries whichever second the logger saw. */
+	now[0] = time(NULL);
+	logp->ll_log_info(logp, -1, "hello %d", 42);
+	now[1] = time(NULL);
+	lattutil_log_free(&logp);
+
+	len = recv(fd, got, sizeof(got), MSG_DONTWAIT);
+	if (len < 0) {
+		perror("recv");
+		return (false);
+	}
+
+	if (gethostname(host, sizeof(host)) || host[0] == '\0') {
+		strlcpy(host, "-", sizeof(host));
+	}
+	host[sizeof(host) - 1] = '\0';
+
+	prio = LOG_USER | LOG_INFO;
+	for (i = 0; i < 2; i++) {
+		secs = now[i] + zone->scz_off;
+		gmtime_r(&secs, &tm);
+		if (format == LATTUTIL_SYSLOG_RFC5424) {
+			strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S",
+			    &tm);
+			snprintf(want[i], sizeof(want[i]),
+			    "<%d>1 %s%s %s %.48s %d - - %shello 42", prio,
+			    stamp, zone->scz_offstr, host, SYSLOGCHECK_NAME,
+			    (int)getpid(),
+			    lattutil_log_level_prefix(LATTUTIL_LOG_LEVEL_INFO));
+		} else {
+			strftime(stamp, sizeof(stamp), "%b %e %H:%M:%S", &tm);
+			snprintf(want[i], sizeof(want[i]),
+			    "<%d>%s %s[%d]: %shello 42", prio, stamp,
+			    SYSLOGCHECK_NAME, (int)getpid(),
+			    lattutil_log_level_prefix(LATTUTIL_LOG_LEVEL_INFO));
+		}
+
+		if ((size_t)len == strlen(want[i]) &&
+		    !memcmp(got, want[i], len)) {
+			return (true);
+		}
+	}
+
+	fprintf(stderr, "RFC %s, TZ=%s:\n  got  \"%.*s\"\n  want \"%s\"\n",
+	    format == LATTUTIL_SYSLOG_RFC5424 ? "5424" : "3164",
+	    zone->scz_tz, (int)len, got, want[1]);
+
+	return (false);
+}
+
+/*
+ * Switch the call sites in site_check_emit at runtime and check what
+ * they log, through a flight recorder, and what the registry dumps.
+ * Then fill the registry with fake modules until it refuses one, and
+ * unregister them again.
+ */
+static int
+site_check(int argc, char **argv)
+{
+	static lattutil_log_site_t fake[SITECHECK_MODULES][1];
+	char dir[] = "/tmp/lattutil.XXXXXX";
+	unsigned int i, nfake, nchecks, failed;
+	char path[PATH_MAX];
+	lattutil_log_t *logp;
+
+	if (argc != 1) {
+		usage();
+		return (1);
+	}
+
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return (1);
+	}
+	snprintf(path, sizeof(path), "%s/ring", dir);
+
+	/* Verbosity 10 keeps the debug site quiet unless forced. */
+	logp = lattutil_log_init(NULL, 10);
+	if (logp == NULL || !lattutil_log_mmap_init(logp, path, 64 * 1024)) {
+		perror(path);
+		lattutil_log_free(&logp);
+		rmdir(dir);
+		return (1);
+	}
+
+	nchecks = failed = 0;
+#define	SITECHECK(expr)	do {						\
+	nchecks++;							\
+	if (!(expr))							\
+		failed++;						\
+} while (0)
+
+	SITECHECK(site_check_dump("debug off info on"));
+	site_check_emit(logp, 1);
+	SITECHECK(site_check_set("func=site_check_emit level=debug",
+	    LATTUTIL_LOG_SITE_FORCE, 1));
+	site_check_emit(logp, 2);
+	SITECHECK(site_check_set("func=site_check_emit fmt=info",
+	    LATTUTIL_LOG_SITE_OFF, 1));
+	site_check_emit(logp, 3);
+	SITECHECK(site_check_dump("debug force info off"));
+	SITECHECK(site_check_set("file=nonexistent.c",
+	    LATTUTIL_LOG_SITE_ON, 0));
+	SITECHECK(site_check_set("bogus", LATTUTIL_LOG_SITE_ON, -1));
+
+	lattutil_log_free(&logp);
+	SITECHECK(check_flight_records(path, "INFO: info site 1\n"
+	    "DEBUG: debug site 2\nINFO: info site 2\nDEBUG: debug site 3\n"));
+	unlink(path);
+	rmdir(dir);
+
+	/* This program is already one module, so the last one is refused. */
+	for (nfake = 0; nfake < nitems(fake); nfake++) {
+		fake[nfake][0].lls_file = "fake.c";
+		fake[nfake][0].lls_func = "fake";
+		fake[nfake][0].lls_fmt = "fake";
+		fake[nfake][0].lls_line = nfake + 1;
+		fake[nfake][0].lls_level = LATTUTIL_LOG_LEVEL_INFO;
+		fake[nfake][0].lls_state = LATTUTIL_LOG_SITE_ON;
+		if (!lattutil_log_sites_register(fake[nfake],
+		    fake[nfake] + 1)) {
+			break;
+		}
+	}
+	SITECHECK(nfake == nitems(fake) - 1);
+	SITECHECK(site_check_set("file=fake.c", LATTUTIL_LOG_SITE_OFF,
+	    nfake));
+
+	for (i = 0; i < nfake; i++) {
+		SITECHECK(lattutil_log_sites_unregister(fake[i]));
+	}
+	SITECHECK(!lattutil_log_sites_unregister(fake[0]));
+	SITECHECK(site_check_set("file=fake.c", LATTUTIL_LOG_SITE_ON, 0));
+	SITECHECK(site_check_set("func=site_check_emit",
+	    LATTUTIL_LOG_SITE_ON, 2));
+#undef	SITECHECK
+
+	printf("%u of %u checks failed\n", failed, nchecks);
+
+	return (failed > 0);
+}
+
+static void
+site_check_emit(lattutil_log_t *logp, int n)
+{
+
+	LATTUTIL_LOG_SITE_DEBUG(logp, 5, "debug site %d", n);
+	LATTUTIL_LOG_SITE_INFO(logp, -1, "info site %d", n);
+}
+
+static bool
+site_check_set(const char *query, int state, ssize_t want)
+{
+	ssize_t got;
+
+	got = lattutil_log_sites_set(query, state);
+	if (got != want) {
+		fprintf(stderr, "query \"%s\" matched %zd sites, want %zd\n",
+		    query, got, want);
+		return (false);
+	}
+
+	return (true);
+}
+
+/*
+ * Check the dump lines of the sites in site_check_emit, without their
+ * line numbers. want is "debug STATE info STATE".
+ */
+static bool
+site_check_dump(const char *want)
+{
+	char debug[16], info[16], line[256], *text, *p, *end;
+	size_t sz, len, prefixlen;
+	unsigned int found;
+	FILE *fp;
+
+	sscanf(want, "debug %15s info %15s", debug, info);
+
+	fp = open_memstream(&text, &sz);
+	if (fp == NULL) {
+		return (false);
+	}
+	lattutil_log_sites_dump(fp);
+	fclose(fp);
+
+	found = 0;
+	prefixlen = strlen(__FILE__ ":");
+	for (p = text; *p != '\0'; p = end + 1) {
+		end = strchr(p, '\n');
+		if (end == NULL) {
+			break;
+		}
+		if (strncmp(p, __FILE__ ":", prefixlen)) {
+			continue;
+		}
+
+		/* Drop the line number, then compare the rest. */
+		strtoul(p + prefixlen, &p, 10);
+		if (strncmp(p, " [site_check_emit] ", 19)) {
+			continue;
+		}
+		len = end - p;
+		snprintf(line, sizeof(line), " [site_check_emit] DEBUG %s "
+		    "\"debug site %%d\"", debug);
+		if (len == strlen(line) && !memcmp(p, line, len)) {
+			found |= 1;
+			continue;
+		}
+		snprintf(line, sizeof(line), " [site_check_emit] INFO %s "
+		    "\"info site %%d\"", info);
+		if (len == strlen(line) && !memcmp(p, line, len)) {
+			found |= 2;
+			continue;
+		}
+		fprintf(stderr, "unexpected dump line: %.*s\n", (int)len, p);
+	}
+
+	if (found != 3) {
+		fprintf(stderr, "dump does not show %s:\n%s", want, text);
+	}
+	free(text);
+
+	return (found == 3);
+}
+
+/*
+ * Check that the flight recorder at path dumps exactly want.
+ */
+static bool
+check_flight_records(const char *path, const char *want)
+{
+	size_t sz;
+	char *text;
+	FILE *fp;
+	bool ok;
+
+	fp = open_memstream(&text, &sz);
+	if (fp == NULL) {
+		return (false);
+	}
+	ok = lattutil_log_mmap_dump(path, fp, 0);
+	fclose(fp);
+
+	if (!ok || strcmp(text, want)) {
+		fprintf(stderr, "logged:\n%swant:\n%s", text, want);
+		ok = false;
+	}
+	free(text);
+
+	return (ok);
+}
+
+/*
+ * Run the asynchronous backend through each overflow policy. The
+ * inner logger records into a memory stream and can be held up
+ * inside its emit handler, which pins the drain thread on the first
+ * message while the ring fills; that makes the dropped messages
+ * predictable. The unpinned bursts only check that every message is
+ * either written, in order, or counted as dropped.
+ */
+static int
+async_check(int argc, char **argv)
+{
+	unsigned int failed;
+
+	if (argc != 1) {
+		usage();
+		return (1);
+	}
+
+	failed = 0;
+	if (!async_check_run("block", LATTUTIL_LOG_ASYNC_BLOCK, 8, 1000,
+	    false, 1000)) {
+		failed++;
+	}
+	if (!async_check_run("drop newest, pinned",
+	    LATTUTIL_LOG_ASYNC_DROP_NEWEST, 4, 10, true, 4)) {
+		failed++;
+	}
+	if (!async_check_run("drop oldest, pinned",
+	    LATTUTIL_LOG_ASYNC_DROP_OLDEST, 4, 10, true, 4)) {
+		failed++;
+	}
+	if (!async_check_run("drop newest, burst",
+	    LATTUTIL_LOG_ASYNC_DROP_NEWEST, 4, 100000, false, -1)) {
+		failed++;
+	}
+	if (!async_check_run("drop oldest, burst",
+	    LATTUTIL_LOG_ASYNC_DROP_OLDEST, 4, 100000, false, -1)) {
+		failed++;
+	}
+
+	return (failed > 0);
+}
+
+/*
+ * Log count messages and check what reached the inner logger. If
+ * pinned, the survivors must be the first wantlines messages.
+ */
+static bool
+async_check_run(const char *name, int policy, size_t capacity,
+    unsigned int count, bool pinned, long wantlines)
+{
+	lattutil_log_t *inner, *logp;
+	unsigned long n, prev;
+	uint64_t dropped;
+	char *text, *p;
+	long lines;
+	unsigned int i;
+	size_t sz;
+	bool ok;
+
+	inner = lattutil_log_init(NULL, -1);
+	logp = lattutil_log_init(NULL, -1);
+	asynccheck_out = open_memstream(&text, &sz);
+	if (inner == NULL || logp == NULL || asynccheck_out == NULL) {
+		perror(name);
+		return (false);
+	}
+	inner->ll_log_emit = async_check_emit;
+
+	if (!lattutil_log_async_init(logp, inner, capacity, policy)) {
+		fprintf(stderr, "%s: unable to start the logger\n", name);
+		return (false);
+	}
+
+	if (pinned) {
+		atomic_store(&asynccheck_entered, false);
+		pthread_mutex_lock(&asynccheck_gate);
+	}
+	for (i = 0; i < count; i++) {
+		logp->ll_log_info(logp, -1, "message %u", i);
+		while (pinned && i == 0 && !atomic_load(&asynccheck_entered)) {
+			usleep(100);
+		}
+	}
+	dropped = lattutil_log_async_dropped(logp);
+	if (pinned) {
+		pthread_mutex_unlock(&asynccheck_gate);
+	}
+
+	/* Freeing has to flush whatever is still queued. */
+	lattutil_log_free(&logp);
+	fclose(asynccheck_out);
+
+	ok = true;
+	lines = 0;
+	prev = ULONG_MAX;
+	for (p = text; ok && *p != '\0'; lines++) {
+		if (strncmp(p, "INFO: message ", 14)) {
+			ok = false;
+			break;
+		}
+		n = strtoul(p + 14, &p, 10);
+		if (*p++ != '\n' || n >= count ||
+		    (prev != ULONG_MAX && n <= prev) ||
+		    (pinned && n != (unsigned long)lines)) {
+			ok = false;
+		}
+		prev = n;
+	}
+	free(text);
+
+	if (ok && (lines + dropped != count ||
+	    (wantlines >= 0 && lines != wantlines))) {
+		ok = false;
+	}
+
+	printf("%s: %ld written, %ju dropped of %u%s\n", name, lines,
+	    (uintmax_t)dropped, count, ok ? "" : ": FAILED");
+
+	return (ok);
+}
+
+static ssize_t
+async_check_emit(lattutil_log_t *logp, lattutil_log_level_t level,
+    const char *msg, size_t len)
+{
+
+	atomic_store(&asynccheck_entered, true);
+	pthread_mutex_lock(&asynccheck_gate);
+	pthread_mutex_unlock(&asynccheck_gate);
+
+	fprintf(asynccheck_out, "%s%.*s\n", lattutil_log_level_prefix(level),
+	    (int)len, msg);
+
+	return (len);
+}
+
+/*
+ * Log through the stdio backend, with stdout pointed at a temporary
+ * file, and watch the allocation counters: warming up the scratch
+ * buffer allocates, the steady state must not, a message past the
+ * scratch limit takes one fallback allocation, and a new thread gets
+ * its own scratch buffer. The file must hold exactly what snprintf(3)
+ * makes of the same messages.
+ */
+static int
+alloc_check(int argc, char **argv)
+{
+	lattutil_log_alloc_stats_t before, after;
+	char path[] = "/tmp/lattutil.XXXXXX";
+	char *want, *got;
+	size_t wantsz;
+	lattutil_log_t *logp;
+	FILE *expect;
+	bool ok;
+	int fd, saved;
+
+	if (argc != 1) {
+		usage();
+		return (1);
+	}
+
+	memset(alloccheck_fill, 'x', sizeof(alloccheck_fill));
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		perror(path);
+		return (1);
+	}
+	unlink(path);
+
+	logp = lattutil_log_init(NULL, -1);
+	expect = open_memstream(&want, &wantsz);
+	if (logp == NULL || expect == NULL || !lattutil_log_stdio_init(logp)) {
+		perror("alloccheck");
+		return (1);
+	}
+
+	fflush(stdout);
+	saved = dup(STDOUT_FILENO);
+	if (saved < 0 || dup2(fd, STDOUT_FILENO) < 0) {
+		perror("dup2");
+		return (1);
+	}
+
+	lattutil_log_get_alloc_stats(&before);
+	ok = alloc_check_log(logp, expect);
+	lattutil_log_get_alloc_stats(&after);
+
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+	lattutil_log_free(&logp);
+	fclose(expect);
+
+	got = malloc(wantsz + 1);
+	if (got == NULL || pread(fd, got, wantsz + 1, 0) != (ssize_t)wantsz ||
+	    memcmp(got, want, wantsz)) {
+		fprintf(stderr, "logged text differs from snprintf(3)\n");
+		ok = false;
+	}
+	free(got);
+	free(want);
+	close(fd);
+
+	printf("total: %ju scratch and %ju fallback allocations, "
+	    "%ju bytes\n",
+	    (uintmax_t)(after.llas_scratch_allocs - before.llas_scratch_allocs),
+	    (uintmax_t)(after.llas_fallback_allocs -
+	    before.llas_fallback_allocs),
+	    (uintmax_t)(after.llas_bytes - before.llas_bytes));
+
+	return (!ok);
+}
+
+/*
+ * Log each phase, recording the expected output in expect. Reports go
+ * to stderr, since stdout is the log.
+ */
+static bool
+alloc_check_log(lattutil_log_t *logp, FILE *expect)
+{
+	lattutil_log_alloc_stats_t a, b;
+	pthread_t thread;
+	unsigned int i, len;
+	bool ok;
+
+	ok = true;
+
+	lattutil_log_get_alloc_stats(&a);
+	logp->ll_log_info(logp, -1, "warm up %.*s", ALLOCCHECK_MAXLEN,
+	    alloccheck_fill);
+	fprintf(expect, "INFO: warm up %.*s\n", ALLOCCHECK_MAXLEN,
+	    alloccheck_fill);
+	lattutil_log_get_alloc_stats(&b);
+	if (b.llas_fallback_allocs != a.llas_fallback_allocs) {
+		fprintf(stderr, "warm up: unexpected fallback allocation\n");
+		ok = false;
+	}
+
+	a = b;
+	for (i = 0; i < ALLOCCHECK_STEADY; i++) {
+		len = (i * 7919) % ALLOCCHECK_MAXLEN;
+		logp->ll_log_info(logp, -1, "steady %u %.*s", i, (int)len,
+		    alloccheck_fill);
+		fprintf(expect, "INFO: steady %u %.*s\n", i, (int)len,
+		    alloccheck_fill);
+	}
+	lattutil_log_get_alloc_stats(&b);
+	if (memcmp(&a, &b, sizeof(a))) {
+		fprintf(stderr, "steady state: %ju scratch and %ju fallback "
+		    "allocations in %u messages\n",
+		    (uintmax_t)(b.llas_scratch_allocs - a.llas_scratch_allocs),
+		    (uintmax_t)(b.llas_fallback_allocs -
+		    a.llas_fallback_allocs), ALLOCCHECK_STEADY);
+		ok = false;
+	}
+
+	a = b;
+	logp->ll_log_info(logp, -1, "huge %.*s", ALLOCCHECK_HUGE - 1,
+	    alloccheck_fill);
+	fprintf(expect, "INFO: huge %.*s\n", ALLOCCHECK_HUGE - 1,
+	    alloccheck_fill);
+	lattutil_log_get_alloc_stats(&b);
+	if (b.llas_fallback_allocs != a.llas_fallback_allocs + 1 ||
+	    b.llas_bytes - a.llas_bytes < ALLOCCHECK_HUGE ||
+	    b.llas_scratch_allocs != a.llas_scratch_allocs) {
+		fprintf(stderr, "oversized message: want exactly one "
+		    "fallback allocation\n");
+		ok = false;
+	}
+
+	a = b;
+	if (pthread_create(&thread, NULL, alloc_check_thread, logp) ||
+	    pthread_join(thread, NULL)) {
+		fprintf(stderr, "unable to run the second thread\n");
+		return (false);
+	}
+	fprintf(expect, "INFO: from another thread\n");
+	lattutil_log_get_alloc_stats(&b);
+	if (b.llas_scratch_allocs == a.llas_scratch_allocs) {
+		fprintf(stderr, "new thread: no scratch allocation\n");
+		ok = false;
+	}
+
+	return (ok);
+}
+
+static void *
+alloc_check_thread(void *arg)
+{
+	lattutil_log_t *logp;
+
+	logp = arg;
+	logp->ll_log_info(logp, -1, "from another thread");
+
+	return (NULL);
+}
+
+/*
+ * Fan out to three flight recorders with different verbosities and
+ * level masks, logging through the wrapper macros, and check which
+ * records reach which sink. The macros must not evaluate the
+ * arguments of a message no sink wants, an oversized message must be
+ * formatted once for all sinks, and a tee whose only sink takes
+ * errors must drop the other levels without formatting them.
+ */
+static int
+tee_check(int argc, char **argv)
+{
+	static const char *names[] = { "file", "syslog", "alert", "quiet" };
+	static const int verbosity[] = { 1, 5, 1, 1 };
+	static const unsigned int levels[] = {
+		LATTUTIL_LOG_LEVELS_ALL,
+		LATTUTIL_LOG_LEVEL_MASK(LATTUTIL_LOG_LEVEL_INFO) |
+		    LATTUTIL_LOG_LEVEL_MASK(LATTUTIL_LOG_LEVEL_WARN) |
+		    LATTUTIL_LOG_LEVEL_MASK(LATTUTIL_LOG_LEVEL_ERR),
+		LATTUTIL_LOG_LEVEL_MASK(LATTUTIL_LOG_LEVEL_ERR),
+		LATTUTIL_LOG_LEVEL_MASK(LATTUTIL_LOG_LEVEL_ERR),
+	};
+	lattutil_log_alloc_stats_t a, b;
+	char dir[] = "/tmp/lattutil.XXXXXX";
+	char path[nitems(names)][PATH_MAX];
+	char huge[TEECHECK_RECORDMAX + 16], want[1024];
+	lattutil_log_t *sink[nitems(names)], *tee, *quiet;
+	unsigned int i, nchecks, failed;
+	char *fill;
+
+	if (argc != 1) {
+		usage();
+		return (1);
+	}
+
+	fill = malloc(TEECHECK_HUGE);
+	if (fill == NULL) {
+		perror("malloc");
+		return (1);
+	}
+	memset(fill, 'x', TEECHECK_HUGE);
+
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		free(fill);
+		return (1);
+	}
+
+	tee = lattutil_log_init(NULL, -1);
+	quiet = lattutil_log_init(NULL, -1);
+	if (!lattutil_log_tee_init(tee) || !lattutil_log_tee_init(quiet)) {
+		perror("teecheck");
+		return (1);
+	}
+	for (i = 0; i < nitems(names); i++) {
+		snprintf(path[i], sizeof(path[i]), "%s/%s", dir, names[i]);
+		sink[i] = lattutil_log_init(NULL, verbosity[i]);
+		if (sink[i] == NULL ||
+		    !lattutil_log_mmap_init(sink[i], path[i], 64 * 1024)) {
+			perror(path[i]);
+			return (1);
+		}
+		lattutil_log_set_levels(sink[i], levels[i]);
+		if (!lattutil_log_tee_add(i < 3 ? tee : quiet, sink[i])) {
+			fprintf(stderr, "unable to add the %s sink\n",
+			    names[i]);
+			return (1);
+		}
+	}
+
+	nchecks = failed = 0;
+#define	TEECHECK(expr)	do {						\
+	nchecks++;							\
+	if (!(expr))							\
+		failed++;						\
+} while (0)
+
+	teecheck_evals = 0;
+	LATTUTIL_LOG_DEBUG(tee, 3, "debug %d", tee_check_arg());
+	LATTUTIL_LOG_INFO(tee, 1, "info low %d", tee_check_arg());
+	LATTUTIL_LOG_INFO(tee, 7, "info high %d", tee_check_arg());
+	LATTUTIL_LOG_WARN(tee, 5, "warn %d", tee_check_arg());
+	LATTUTIL_LOG_ERR(tee, -1, "err %d", tee_check_arg());
+	LATTUTIL_LOG_DEBUG(tee, 0, "unwanted %d", tee_check_arg());
+	TEECHECK(teecheck_evals == 5);
+
+	lattutil_log_get_alloc_stats(&a);
+	tee->ll_log_err(tee, -1, "huge %.*s", TEECHECK_HUGE - 1, fill);
+	lattutil_log_get_alloc_stats(&b);
+	TEECHECK(b.llas_fallback_allocs == a.llas_fallback_allocs + 1);
+
+	LATTUTIL_LOG_INFO(quiet, -1, "unwanted %d", tee_check_arg());
+	TEECHECK(teecheck_evals == 5);
+	TEECHECK(quiet->ll_log_info(quiet, -1, "dropped") == 0);
+	quiet->ll_log_err(quiet, -1, "only this");
+#undef	TEECHECK
+
+	/* Freeing the tees frees and closes the sinks. */
+	lattutil_log_free(&tee);
+	lattutil_log_free(&quiet);
+
+	/* The flight recorder keeps the start of the oversized message. */
+	snprintf(huge, sizeof(huge), "ERROR: huge %.*s\n",
+	    TEECHECK_RECORDMAX - (int)strlen("huge "), fill);
+
+	nchecks += nitems(names);
+	snprintf(want, sizeof(want), "DEBUG: debug 1\nINFO: info low 2\n"
+	    "INFO: info high 3\nWARNING: warn 4\nERROR: err 5\n%s", huge);
+	failed += !check_flight_records(path[0], want);
+	snprintf(want, sizeof(want), "INFO: info high 3\nWARNING: warn 4\n"
+	    "ERROR: err 5\n%s", huge);
+	failed += !check_flight_records(path[1], want);
+	snprintf(want, sizeof(want), "ERROR: err 5\n%s", huge);
+	failed += !check_flight_records(path[2], want);
+	failed += !check_flight_records(path[3], "ERROR: only this\n");
+
+	for (i = 0; i < nitems(names); i++) {
+		unlink(path[i]);
+	}
+	rmdir(dir);
+	free(fill);
+
+	printf("%u of %u checks failed\n", failed, nchecks);
+
+	return (failed > 0);
+}
+
+static int
+tee_check_arg(void)
+{
+
+	return (++teecheck_evals);
+}
+
+/*
+ * Log structured records into a capturing emit handler and compare
+ * the JSON byte for byte: every value type, escapes on both sides of
+ * the word-at-a-time fast path, a missing message, values JSON cannot
+ * represent, an unknown type, and a record below the verbosity.
+ */
+static int
+kv_check(int argc, char **argv)
+{
+	lattutil_log_t *logp;
+	unsigned int failed;
+
+	if (argc != 1) {
+		usage();
+		return (1);
+	}
+
+	logp = lattutil_log_init(NULL, 5);
+	if (logp == NULL) {
+		perror("kvcheck");
+		return (1);
+	}
+	logp->ll_log_emit = kv_check_emit;
+
+	failed = 0;
+	if (!kv_check_want("types", lattutil_log_kv(logp,
+	    LATTUTIL_LOG_LEVEL_INFO, -1, "all types",
+	    "s", LATTUTIL_KV_STRING, "plain",
+	    "n", LATTUTIL_KV_STRING, (const char *)NULL,
+	    "i", LATTUTIL_KV_INT, -42,
+	    "i64", LATTUTIL_KV_INT64, INT64_MIN,
+	    "u64", LATTUTIL_KV_UINT64, UINT64_MAX,
+	    "d", LATTUTIL_KV_DOUBLE, 0.5,
+	    "t", LATTUTIL_KV_BOOL, 1,
+	    "f", LATTUTIL_KV_BOOL, 0, NULL),
+	    "{\"level\":\"INFO\",\"msg\":\"all types\",\"s\":\"plain\","
+	    "\"n\":null,\"i\":-42,\"i64\":-9223372036854775808,"
+	    "\"u64\":18446744073709551615,\"d\":0.5,\"t\":true,"
+	    "\"f\":false}")) {
+		failed++;
+	}
+	if (!kv_check_want("escapes", lattutil_log_kv(logp,
+	    LATTUTIL_LOG_LEVEL_WARN, -1, "a\"b\\c\nd\te\rf\bg\fh\001i\037j",
+	    "k\"ey", LATTUTIL_KV_STRING, "0123456789abcdef\"0123456789abcdef",
+	    "path", LATTUTIL_KV_STRING, "C:\\Windows\\System32",
+	    "utf8", LATTUTIL_KV_STRING, "h\303\251llo w\303\266rld\177", NULL),
+	    "{\"level\":\"WARNING\","
+	    "\"msg\":\"a\\\"b\\\\c\\nd\\te\\rf\\bg\\fh\\u0001i\\u001fj\","
+	    "\"k\\\"ey\":\"0123456789abcdef\\\"0123456789abcdef\","
+	    "\"path\":\"C:\\\\Windows\\\\System32\","
+	    "\"utf8\":\"h\303\251llo w\303\266rld\177\"}")) {
+		failed++;
+	}
+	if (!kv_check_want("no message", lattutil_log_kv(logp,
+	    LATTUTIL_LOG_LEVEL_ERR, 5, NULL,
+	    "inf", LATTUTIL_KV_DOUBLE, HUGE_VAL,
+	    "nan", LATTUTIL_KV_DOUBLE, NAN,
+	    "tenth", LATTUTIL_KV_DOUBLE, 0.1, NULL),
+	    "{\"level\":\"ERROR\",\"inf\":null,\"nan\":null,"
+	    "\"tenth\":0.10000000000000001}")) {
+		failed++;
+	}
+	if (!kv_check_want("unknown type", lattutil_log_kv(logp,
+	    LATTUTIL_LOG_LEVEL_DEBUG, 7, "bad",
+	    "x", 99, "ignored", "y", LATTUTIL_KV_INT, 1, NULL),
+	    "{\"level\":\"DEBUG\",\"msg\":\"bad\",\"x\":null}")) {
+		failed++;
+	}
+
+	kvcheck_len = 0;
+	if (lattutil_log_kv(logp, LATTUTIL_LOG_LEVEL_INFO, 4, "quiet",
+	    NULL) != 0 || kvcheck_len != 0) {
+		fprintf(stderr, "verbosity: record below the verbosity "
+		    "was logged\n");
+		failed++;
+	}
+
+	lattutil_log_free(&logp);
+
+	printf("%u of 5 checks failed\n", failed);
+
+	return (failed > 0);
+}
+
+static ssize_t
+kv_check_emit(lattutil_log_t *logp, lattutil_log_level_t level,
+    const char *msg, size_t len)
+{
+
+	if (len >= sizeof(kvcheck_buf)) {
+		return (-1);
+	}
+	memcpy(kvcheck_buf, msg, len);
+	kvcheck_buf[len] = '\0';
+	kvcheck_len = len;
+	kvcheck_level = level;
+
+	return (len);
+}
+
+/*
+ * Check the record the last lattutil_log_kv call emitted. It must be
+ * want exactly, marked raw so that no level prefix is added.
+ */
+static bool
+kv_check_want(const char *name, ssize_t res, const char *want)
+{
+
+	if (res != (ssize_t)strlen(want) || kvcheck_len != strlen(want) ||
+	    memcmp(kvcheck_buf, want, kvcheck_len)) {
+		fprintf(stderr, "%s: returned %zd\n  got  %.*s\n  want %s\n",
+		    name, res, (int)kvcheck_len, kvcheck_buf, want);
+		return (false);
+	}
+	if ((kvcheck_level & LATTUTIL_LOG_LEVEL_RAW) == 0) {
+		fprintf(stderr, "%s: record not marked raw\n", name);
+		return (false);
+	}
+
+	return (true);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: lattutil\n");
+	fprintf(stderr, "       lattutil alloccheck\n");
+	fprintf(stderr, "       lattutil asynccheck\n");
+	fprintf(stderr, "       lattutil confbench [-k sections] "
+	    "[-n iterations]\n");
+	fprintf(stderr, "       lattutil confbind [-b backends] "
+	    "[-n iterations]\n");
+	fprintf(stderr, "       lattutil confimage build|verify file "
+	    "image\n");
+	fprintf(stderr, "       lattutil conflayer [-f fragments] [-l layers] "
+	    "[-t threads] dir\n");
+	fprintf(stderr, "       lattutil confload [-k sections] file\n");
+	fprintf(stderr, "       lattutil confwatch [-b bursts] [-n readers] "
+	    "[-r reloads] file\n");
+	fprintf(stderr, "       lattutil cxxcheck\n");
+	fprintf(stderr, "       lattutil decode [-t] file\n");
+	fprintf(stderr, "       lattutil dump [-t] file\n");
+	fprintf(stderr, "       lattutil fmtbench [-n iterations]\n");
+	fprintf(stderr, "       lattutil fmtcheck [-n cases] [-s seed]\n");
+	fprintf(stderr, "       lattutil kvcheck\n");
+	fprintf(stderr, "       lattutil shmtest [-d] [-n count] [-p procs] "
+	    "[-s slots] file\n");
+	fprintf(stderr, "       lattutil sitecheck\n");
+	fprintf(stderr, "       lattutil sqlcatalog [-v] [-n count] file\n");
+	fprintf(stderr, "       lattutil sqlbench [-a] [-b batch] [-n count] "
+	    "[-t threads] file\n");
+	fprintf(stderr,
+	    "       lattutil stress [-n count] [-t threads] [-z] file\n");
+	fprintf(stderr, "       lattutil syslogcheck\n");
+	fprintf(stderr, "       lattutil teecheck\n");
+}
@@ -0,0 +1,551 @@
+/*-
+ * Copyright (c) 2021 Shawn Webb <shawn.webb@hardenedbsd.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <sys/param.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <limits.h>
+
+#include "liblattutil.h"
+
+#define	LATTUTIL_CONFIG_BIND_PATHSZ	256
+#define	LATTUTIL_CONFIG_BIND_DEPTH	32
+#define	LATTUTIL_CONFIG_BIND_SEENSZ	4
+
+/*
+ * Binding walks each UCL object once, matching its members against
+ * the field table for that level, instead of looking every field up
+ * from the root. Fields are usually written in the same order as the
+ * table, so the search for a member's field starts just after the
+ * previous match and tends to succeed on the first comparison.
+ *
+ * Defaults are applied to the whole struct before the walk. Strings
+ * are borrowed from the tree, and the binding keeps a reference to the
+ * tree so they stay valid; arrays are the only allocations, and the
+ * binding owns those too. Problems are reported with their full path
+ * and binding carries on, so a single call reports every problem in
+ * the file. The path is kept as a stack of borrowed components and
+ * only formatted when there is something to report.
+ */
+
+struct _lattutil_config_binding {
+	ucl_object_t	 *lcb_root;
+	void		**lcb_allocs;
+	size_t		  lcb_nallocs;
+	size_t		  lcb_allocsz;
+};
+
+/* A path component: an object key, or an array index if key is NULL. */
+typedef struct _lattutil_config_bind_frame {
+	const char	*lcbf_key;
+	size_t		 lcbf_keylen;
+	size_t		 lcbf_index;
+} lattutil_config_bind_frame_t;
+
+typedef struct _lattutil_config_bind_ctx {
+	lattutil_config_binding_t	*lcbc_binding;
+	int				 lcbc_flags;
+	lattutil_config_report_cb	 lcbc_report;
+	void				*lcbc_arg;
+	bool				 lcbc_failed;
+	size_t				 lcbc_depth;
+	lattutil_config_bind_frame_t	 lcbc_frames[
+	    LATTUTIL_CONFIG_BIND_DEPTH];
+} lattutil_config_bind_ctx_t;
+
+static size_t _lattutil_config_bind_nfields(const lattutil_config_field_t *);
+static size_t _lattutil_config_bind_elemsz(const lattutil_config_field_t *);
+static void _lattutil_config_bind_defaults(const lattutil_config_field_t *,
+    char *);
+static const lattutil_config_field_t *_lattutil_config_bind_find(
+    const lattutil_config_field_t *, size_t, const char *, size_t,
+    size_t *);
+static void _lattutil_config_bind_push(lattutil_config_bind_ctx_t *,
+    const char *, size_t, size_t);
+static void _lattutil_config_bind_report(lattutil_config_bind_ctx_t *,
+    const char *, bool);
+static void _lattutil_config_bind_object(lattutil_config_bind_ctx_t *,
+    const lattutil_config_field_t *, const ucl_object_t *, char *);
+static void _lattutil_config_bind_value(lattutil_config_bind_ctx_t *,
+    const lattutil_config_field_t *, lattutil_config_type_t,
+    const ucl_object_t *, char *, char *);
+static void _lattutil_config_bind_array(lattutil_config_bind_ctx_t *,
+    const lattutil_config_field_t *, const ucl_object_t *, char *, char *);
+
+EXPORTED_SYM
+lattutil_config_binding_t *
+lattutil_config_bind(const lattutil_config_path_t *cfg,
+    const lattutil_config_field_t *fields, void *dst, int flags,
+    lattutil_config_report_cb report, void *arg)
+{
+
+	if (cfg == NULL) {
+		return (NULL);
+	}
+
+	return (lattutil_config_bind_object(cfg->l_rootobj, fields, dst,
+	    flags, report, arg));
+}
+
+EXPORTED_SYM
+lattutil_config_binding_t *
+lattutil_config_bind_object(const ucl_object_t *root,
+    const lattutil_config_field_t *fields, void *dst, int flags,
+    lattutil_config_report_cb report, void *arg)
+{
+	lattutil_config_bind_ctx_t ctx;
+
+	if (root == NULL || fields == NULL || dst == NULL) {
+		return (NULL);
+	}
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.lcbc_flags = flags;
+	ctx.lcbc_report = report;
+	ctx.lcbc_arg = arg;
+
+	ctx.lcbc_binding = calloc(1, sizeof(*(ctx.lcbc_binding)));
+	if (ctx.lcbc_binding == NULL) {
+		return (NULL);
+	}
+	ctx.lcbc_binding->lcb_root = ucl_object_ref(root);
+
+	_lattutil_config_bind_defaults(fields, dst);
+	if (ucl_object_type(root) != UCL_OBJECT) {
+		_lattutil_config_bind_report(&ctx, "expected an object", true);
+	} else {
+		_lattutil_config_bind_object(&ctx, fields, root, dst);
+	}
+
+	if (ctx.lcbc_failed) {
+		lattutil_config_binding_free(&(ctx.lcbc_binding));
+		return (NULL);
+	}
+
+	return (ctx.lcbc_binding);
+}
+
+EXPORTED_SYM
+void
+lattutil_config_binding_free(lattutil_config_binding_t **lcbp)
+{
+	lattutil_config_binding_t *lcb;
+	size_t i;
+
+	if (lcbp == NULL || *lcbp == NULL) {
+		return;
+	}
+
+	lcb = *lcbp;
+	for (i = 0; i < lcb->lcb_nallocs; i++) {
+		free(lcb->lcb_allocs[i]);
+	}
+	free(lcb->lcb_allocs);
+	ucl_object_unref(lcb->lcb_root);
+	free(lcb);
+	*lcbp = NULL;
+}
+
+static size_t
+_lattutil_config_bind_nfields(const lattutil_config_field_t *fields)
+{
+	size_t n;
+
+	for (n = 0; fields[n].lcf_key != NULL; n++) {
+		continue;
+	}
+
+	return (n);
+}
+
+static size_t
+_lattutil_config_bind_elemsz(const lattutil_config_field_t *field)
+{
+
+	if (field->lcf_elemsz != 0) {
+		return (field->lcf_elemsz);
+	}
+
+	switch (field->lcf_elemtype) {
+	case LATTUTIL_CONFIG_TYPE_INT:
+		return (sizeof(int));
+	case LATTUTIL_CONFIG_TYPE_INT64:
+		return (sizeof(int64_t));
+	case LATTUTIL_CONFIG_TYPE_BOOL:
+		return (sizeof(bool));
+	case LATTUTIL_CONFIG_TYPE_DOUBLE:
+		return (sizeof(double));
+	case LATTUTIL_CONFIG_TYPE_STRING:
+		return (sizeof(const char *));
+	default:
+		return (0);
+	}
+}
+
+static void
+_lattutil_config_bind_defaults(const lattutil_config_field_t *fields,
+    char *base)
+{
+	const lattutil_config_field_t *field;
+	char *dst;
+
+	for (field = fields; field->lcf_key != NULL; field++) {
+		dst = base + field->lcf_offset;
+		switch (field->lcf_type) {
+		case LATTUTIL_CONFIG_TYPE_INT:
+			*(int *)dst = (int)field->lcf_def_int;
+			break;
+		case LATTUTIL_CONFIG_TYPE_INT64:
+			*(int64_t *)dst = field->lcf_def_int;
+			break;
+		case LATTUTIL_CONFIG_TYPE_BOOL:
+			*(bool *)dst = field->lcf_def_int != 0;
+			break;
+		case LATTUTIL_CONFIG_TYPE_DOUBLE:
+			*(double *)dst = field->lcf_def_double;
+			break;
+		case LATTUTIL_CONFIG_TYPE_STRING:
+			*(const char **)dst = field->lcf_def_string;
+			break;
+		case LATTUTIL_CONFIG_TYPE_OBJECT:
+			_lattutil_config_bind_defaults(field->lcf_fields, dst);
+			break;
+		case LATTUTIL_CONFIG_TYPE_ARRAY:
+			*(void **)dst = NULL;
+			*(size_t *)(base + field->lcf_countoff) = 0;
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+static const lattutil_config_field_t *
+_lattutil_config_bind_find(const lattutil_config_field_t *fields,
+    size_t nfields, const char *key, size_t keylen, size_t *cursor)
+{
+	const lattutil_config_field_t *field;
+	size_t i, j;
+
+	for (i = 0; i < nfields; i++) {
+		j = (*cursor + i) % nfields;
+		field = &(fields[j]);
+		if (field->lcf_key[0] == key[0] &&
+		    !strncmp(field->lcf_key, key, keylen) &&
+		    field->lcf_key[keylen] == '\0') {
+			*cursor = j + 1;
+			return (field);
+		}
+	}
+
+	return (NULL);
+}
+
+/*
+ * Enter a path component; the caller decrements lcbc_depth when done
+ * with it. Components nested deeper than LATTUTIL_CONFIG_BIND_DEPTH
+ * are counted but left out of reported paths.
+ */
+static void
+_lattutil_config_bind_push(lattutil_config_bind_ctx_t *ctx,
+    const char *key, size_t keylen, size_t index)
+{
+	lattutil_config_bind_frame_t *frame;
+
+	if (ctx->lcbc_depth < LATTUTIL_CONFIG_BIND_DEPTH) {
+		frame = &(ctx->lcbc_frames[ctx->lcbc_depth]);
+		frame->lcbf_key = key;
+		frame->lcbf_keylen = keylen;
+		frame->lcbf_index = index;
+	}
+	ctx->lcbc_depth++;
+}
+
+static void
+_lattutil_config_bind_report(lattutil_config_bind_ctx_t *ctx,
+    const char *problem, bool fatal)
+{
+	lattutil_config_bind_frame_t *frame;
+	char path[LATTUTIL_CONFIG_BIND_PATHSZ];
+	size_t i, len;
+	int n;
+
+	if (fatal) {
+		ctx->lcbc_failed = true;
+	}
+	if (ctx->lcbc_report == NULL) {
+		return;
+	}
+
+	len = 0;
+	path[0] = '\0';
+	for (i = 0; i < MIN(ctx->lcbc_depth, LATTUTIL_CONFIG_BIND_DEPTH) &&
+	    len < sizeof(path) - 1; i++) {
+		frame = &(ctx->lcbc_frames[i]);
+		if (frame->lcbf_key != NULL) {
+			n = snprintf(path + len, sizeof(path) - len, "%s%.*s",
+			    i > 0 ? "." : "", (int)frame->lcbf_keylen,
+			    frame->lcbf_key);
+		} else {
+			n = snprintf(path + len, sizeof(path) - len, "%s%zu",
+			    i > 0 ? "." : "", frame->lcbf_index);
+		}
+		if (n < 0) {
+			break;
+		}
+		len = MIN(len + n, sizeof(path) - 1);
+	}
+
+	ctx->lcbc_report(path, problem, ctx->lcbc_arg);
+}
+
+static void
+_lattutil_config_bind_object(lattutil_config_bind_ctx_t *ctx,
+    const lattutil_config_field_t *fields, const ucl_object_t *obj,
+    char *base)
+{
+	uint64_t seenbuf[LATTUTIL_CONFIG_BIND_SEENSZ], *seen;
+	const lattutil_config_field_t *field;
+	size_t cursor, i, keylen, nfields;
+	const ucl_object_t *cur;
+	ucl_object_iter_t it;
+	const char *key;
+
+	nfields = _lattutil_config_bind_nfields(fields);
+	if (nfields <= sizeof(seenbuf) * NBBY) {
+		memset(seenbuf, 0, sizeof(seenbuf));
+		seen = seenbuf;
+	} else {
+		seen = calloc(howmany(nfields, 64), sizeof(*seen));
+		if (seen == NULL) {
+			_lattutil_config_bind_report(ctx, "out of memory",
+			    true);
+			return;
+		}
+	}
+
+	it = NULL;
+	cursor = 0;
+	while ((cur = ucl_iterate_object(obj, &it, true)) != NULL) {
+		key = ucl_object_keyl(cur, &keylen);
+		if (key == NULL || keylen == 0) {
+			continue;
+		}
+
+		_lattutil_config_bind_push(ctx, key, keylen, 0);
+		field = _lattutil_config_bind_find(fields, nfields, key,
+		    keylen, &cursor);
+		if (field == NULL) {
+			_lattutil_config_bind_report(ctx, "unknown key",
+			    ctx->lcbc_flags & LATTUTIL_CONFIG_BIND_STRICT);
+		} else {
+			i = field - fields;
+			seen[i / 64] |= 1ULL << (i % 64);
+			_lattutil_config_bind_value(ctx, field,
+			    field->lcf_type, cur, base + field->lcf_offset,
+			    base);
+		}
+		ctx->lcbc_depth--;
+	}
+
+	for (i = 0; i < nfields; i++) {
+		if ((seen[i / 64] & (1ULL << (i % 64))) ||
+		    !(fields[i].lcf_flags & LATTUTIL_CONFIG_FIELD_REQUIRED)) {
+			continue;
+		}
+		_lattutil_config_bind_push(ctx, fields[i].lcf_key,
+		    strlen(fields[i].lcf_key), 0);
+		_lattutil_config_bind_report(ctx, "missing required key",
+		    true);
+		ctx->lcbc_depth--;
+	}
+
+	if (seen != seenbuf) {
+		free(seen);
+	}
+}
+
+/*
+ * Bind one value of the given type into dst. base is the struct that
+ * holds the field, where an array's count lives.
+ */
+static void
+_lattutil_config_bind_value(lattutil_config_bind_ctx_t *ctx,
+    const lattutil_config_field_t *field, lattutil_config_type_t type,
+    const ucl_object_t *obj, char *dst, char *base)
+{
+	ucl_type_t utype;
+	int64_t ival;
+	double dval;
+	bool bval;
+
+	utype = ucl_object_type(obj);
+	switch (type) {
+	case LATTUTIL_CONFIG_TYPE_INT:
+		if (utype != UCL_INT || !ucl_object_toint_safe(obj, &ival)) {
+			_lattutil_config_bind_report(ctx, "expected an integer",
+			    true);
+			return;
+		}
+		if (ival < INT_MIN || ival > INT_MAX) {
+			_lattutil_config_bind_report(ctx,
+			    "integer out of range", true);
+			return;
+		}
+		*(int *)dst = (int)ival;
+		break;
+	case LATTUTIL_CONFIG_TYPE_INT64:
+		if (utype != UCL_INT || !ucl_object_toint_safe(obj, &ival)) {
+			_lattutil_config_bind_report(ctx, "expected an integer",
+			    true);
+			return;
+		}
+		*(int64_t *)dst = ival;
+		break;
+	case LATTUTIL_CONFIG_TYPE_BOOL:
+		if (utype != UCL_BOOLEAN ||
+		    !ucl_object_toboolean_safe(obj, &bval)) {
+			_lattutil_config_bind_report(ctx, "expected a boolean",
+			    true);
+			return;
+		}
+		*(bool *)dst = bval;
+		break;
+	case LATTUTIL_CONFIG_TYPE_DOUBLE:
+		if ((utype != UCL_FLOAT && utype != UCL_INT &&
+		    utype != UCL_TIME) ||
+		    !ucl_object_todouble_safe(obj, &dval)) {
+			_lattutil_config_bind_report(ctx, "expected a number",
+			    true);
+			return;
+		}
+		*(double *)dst = dval;
+		break;
+	case LATTUTIL_CONFIG_TYPE_STRING:
+		if (utype != UCL_STRING) {
+			_lattutil_config_bind_report(ctx, "expected a string",
+			    true);
+			return;
+		}
+		*(const char **)dst = ucl_object_tostring(obj);
+		break;
+	case LATTUTIL_CONFIG_TYPE_OBJECT:
+		if (utype != UCL_OBJECT) {
+			_lattutil_config_bind_report(ctx, "expected an object",
+			    true);
+			return;
+		}
+		/* Array elements have had no defaults applied yet. */
+		_lattutil_config_bind_defaults(field->lcf_fields, dst);
+		_lattutil_config_bind_object(ctx, field->lcf_fields, obj, dst);
+		break;
+	case LATTUTIL_CONFIG_TYPE_ARRAY:
+		_lattutil_config_bind_array(ctx, field, obj, dst, base);
+		return;
+	default:
+		_lattutil_config_bind_report(ctx, "unsupported field type",
+		    true);
+		return;
+	}
+
+	if (field->lcf_validate != NULL && !field->lcf_validate(field, dst)) {
+		_lattutil_config_bind_report(ctx, "invalid value", true);
+	}
+}
+
+/*
+ * Explicit arrays are walked element by element. Anything else is
+ * walked as UCL's implicit array, which covers both a key repeated
+ * several times and a single value standing in for a one-element
+ * array.
+ */
+static void
+_lattutil_config_bind_array(lattutil_config_bind_ctx_t *ctx,
+    const lattutil_config_field_t *field, const ucl_object_t *obj,
+    char *dst, char *base)
+{
+	lattutil_config_binding_t *lcb;
+	const ucl_object_t *cur;
+	size_t elemsz, n, i;
+	ucl_object_iter_t it;
+	void **allocs;
+	bool expand;
+	char *elems;
+
+	elemsz = _lattutil_config_bind_elemsz(field);
+	if (elemsz == 0) {
+		_lattutil_config_bind_report(ctx, "unsupported element type",
+		    true);
+		return;
+	}
+
+	expand = ucl_object_type(obj) == UCL_ARRAY;
+	n = 0;
+	it = NULL;
+	while (ucl_iterate_object(obj, &it, expand) != NULL) {
+		n++;
+	}
+	if (n == 0) {
+		return;
+	}
+
+	lcb = ctx->lcbc_binding;
+	if (lcb->lcb_nallocs == lcb->lcb_allocsz) {
+		allocs = reallocarray(lcb->lcb_allocs,
+		    lcb->lcb_allocsz ? lcb->lcb_allocsz * 2 : 8,
+		    sizeof(*allocs));
+		if (allocs == NULL) {
+			_lattutil_config_bind_report(ctx, "out of memory",
+			    true);
+			return;
+		}
+		lcb->lcb_allocs = allocs;
+		lcb->lcb_allocsz = lcb->lcb_allocsz ? lcb->lcb_allocsz * 2 : 8;
+	}
+
+	elems = calloc(n, elemsz);
+	if (elems == NULL) {
+		_lattutil_config_bind_report(ctx, "out of memory", true);
+		return;
+	}
+	lcb->lcb_allocs[lcb->lcb_nallocs++] = elems;
+
+	i = 0;
+	it = NULL;
+	while ((cur = ucl_iterate_object(obj, &it, expand)) != NULL &&
+	    i < n) {
+		_lattutil_config_bind_push(ctx, NULL, 0, i);
+		_lattutil_config_bind_value(ctx, field, field->lcf_elemtype,
+		    cur, elems + i * elemsz, base);
+		ctx->lcbc_depth--;
+		i++;
+	}
+
+	*(void **)dst = elems;
+	*(size_t *)(base + field->lcf_countoff) = n;
+}
@@ -0,0 +1,292 @@
+/*-
+ * Copyright (c) 2021 Shawn Webb <shawn.webb@hardenedbsd.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <zlib.h>
+
+#include "liblattutil.h"
+
+#define	LATTUTIL_CONFIG_IMAGE_MAGIC	"LATTCIMG"
+#define	LATTUTIL_CONFIG_IMAGE_VERSION	1
+
+/*
+ * A config image is a fixed header followed by the parsed tree in
+ * msgpack, as emitted by libucl. The header records the identity of
+ * the source file the tree was parsed from, and an image is only used
+ * while the source still matches it. Loading maps the image read-only
+ * and parses it in zero-copy mode, so strings are read out of the
+ * page cache and every process using the image shares one copy of it.
+ *
+ * Images are written in host byte order and are meant to be built and
+ * used on one host.
+ */
+
+typedef struct _lattutil_config_image_hdr {
+	char		lcih_magic[8];
+	uint32_t	lcih_version;
+	uint32_t	lcih_hdrsz;
+	uint64_t	lcih_dev;
+	uint64_t	lcih_ino;
+	uint64_t	lcih_size;
+	int64_t		lcih_mtime_sec;
+	int64_t		lcih_mtime_nsec;
+	uint64_t	lcih_payloadsz;
+	uint32_t	lcih_crc;
+	uint32_t	lcih_pad;
+} lattutil_config_image_hdr_t;
+
+static void _lattutil_config_image_key(lattutil_config_image_hdr_t *,
+    const struct stat *);
+static uint32_t _lattutil_config_image_crc(const unsigned char *, size_t);
+static bool _lattutil_config_image_map(const char *, const struct stat *,
+    void **, size_t *);
+
+EXPORTED_SYM
+bool
+lattutil_config_image_write(const lattutil_config_path_t *cfg,
+    const char *path)
+{
+	lattutil_config_image_hdr_t hdr;
+	unsigned char *payload;
+	size_t len, sz;
+	char *tmp;
+	bool res;
+	int fd;
+
+	if (cfg == NULL || cfg->l_rootobj == NULL || path == NULL) {
+		return (false);
+	}
+
+	payload = ucl_object_emit_len(cfg->l_rootobj, UCL_EMIT_MSGPACK,
+	    &len);
+	if (payload == NULL) {
+		return (false);
+	}
+
+	_lattutil_config_image_key(&hdr, &(cfg->l_sb));
+	hdr.lcih_payloadsz = len;
+	hdr.lcih_crc = _lattutil_config_image_crc(payload, len);
+
+	sz = strlen(path) + sizeof(".XXXXXX");
+	tmp = malloc(sz);
+	if (tmp == NULL) {
+		free(payload);
+		return (false);
+	}
+	snprintf(tmp, sz, "%s.XXXXXX", path);
+
+	/*
+	 * Write a temporary file next to the image and rename it into
+	 * place, so a loader sees either the old image or the new one.
+	 * The image holds the same data as the source, so it gets the
+	 * source's permissions.
+	 */
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		free(tmp);
+		free(payload);
+		return (false);
+	}
+
+	res = fchmod(fd, cfg->l_sb.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO))
+	    == 0 &&
+	    lattutil_log_write_all(fd, (const char *)&hdr, sizeof(hdr)) ==
+	    sizeof(hdr) &&
+	    lattutil_log_write_all(fd, (const char *)payload, len) ==
+	    (ssize_t)len &&
+	    fsync(fd) == 0;
+	if (close(fd)) {
+		res = false;
+	}
+	if (res && rename(tmp, path)) {
+		res = false;
+	}
+	if (!res) {
+		unlink(tmp);
+	}
+
+	free(tmp);
+	free(payload);
+
+	return (res);
+}
+
+EXPORTED_SYM
+bool
+lattutil_config_image_current(const lattutil_config_path_t *cfg,
+    const char *path)
+{
+	size_t sz;
+	void *map;
+
+	if (cfg == NULL || path == NULL) {
+		return (false);
+	}
+
+	if (!_lattutil_config_image_map(path, &(cfg->l_sb), &map, &sz)) {
+		return (false);
+	}
+
+	munmap(map, sz);
+	return (true);
+}
+
+/*
+ * Parse the tree out of the image at path for the source already
+ * opened in res. On failure nothing in res is changed, and the caller
+ * falls back to parsing the source.
+ */
+bool
+lattutil_config_image_load(lattutil_config_path_t *res, const char *path)
+{
+	struct ucl_parser *parser;
+	size_t sz;
+	void *map;
+
+	if (!_lattutil_config_image_map(path, &(res->l_sb), &map, &sz)) {
+		return (false);
+	}
+
+	parser = ucl_parser_new(UCL_PARSER_KEY_LOWERCASE |
+	    UCL_PARSER_ZEROCOPY);
+	if (parser == NULL) {
+		munmap(map, sz);
+		return (false);
+	}
+
+	if (!ucl_parser_add_chunk_full(parser,
+	    (const unsigned char *)map + sizeof(lattutil_config_image_hdr_t),
+	    sz - sizeof(lattutil_config_image_hdr_t), 0, UCL_DUPLICATE_APPEND,
+	    UCL_PARSE_MSGPACK)) {
+		ucl_parser_free(parser);
+		munmap(map, sz);
+		return (false);
+	}
+
+	res->l_parser = parser;
+	res->l_map = map;
+	res->l_mapsz = sz;
+
+	return (true);
+}
+
+static void
+_lattutil_config_image_key(lattutil_config_image_hdr_t *hdr,
+    const struct stat *sb)
+{
+
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->lcih_magic, LATTUTIL_CONFIG_IMAGE_MAGIC,
+	    sizeof(hdr->lcih_magic));
+	hdr->lcih_version = LATTUTIL_CONFIG_IMAGE_VERSION;
+	hdr->lcih_hdrsz = sizeof(*hdr);
+	hdr->lcih_dev = sb->st_dev;
+	hdr->lcih_ino = sb->st_ino;
+	hdr->lcih_size = sb->st_size;
+	hdr->lcih_mtime_sec = sb->st_mtim.tv_sec;
+	hdr->lcih_mtime_nsec = sb->st_mtim.tv_nsec;
+}
+
+static uint32_t
+_lattutil_config_image_crc(const unsigned char *buf, size_t len)
+{
+	uLong crc;
+	uInt n;
+
+	crc = crc32(0, Z_NULL, 0);
+	while (len > 0) {
+		n = len > UINT_MAX ? UINT_MAX : (uInt)len;
+		crc = crc32(crc, buf, n);
+		buf += n;
+		len -= n;
+	}
+
+	return ((uint32_t)crc);
+}
+
+/*
+ * Map the image at path and check it against the source's identity
+ * and its own checksum. A missing, stale, or damaged image fails.
+ */
+static bool
+_lattutil_config_image_map(const char *path, const struct stat *src,
+    void **mapp, size_t *szp)
+{
+	const lattutil_config_image_hdr_t *hdr;
+	lattutil_config_image_hdr_t key;
+	struct stat sb;
+	size_t sz;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return (false);
+	}
+
+	if (fstat(fd, &sb) || !S_ISREG(sb.st_mode) ||
+	    (size_t)sb.st_size < sizeof(*hdr)) {
+		close(fd);
+		return (false);
+	}
+
+	sz = (size_t)sb.st_size;
+	map = mmap(NULL, sz, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return (false);
+	}
+
+	/*
+	 * Everything ahead of the payload size is fixed by the source,
+	 * and the fields are laid out without padding.
+	 */
+	hdr = map;
+	_lattutil_config_image_key(&key, src);
+	if (memcmp(hdr, &key,
+	    offsetof(lattutil_config_image_hdr_t, lcih_payloadsz)) ||
+	    hdr->lcih_payloadsz != sz - sizeof(*hdr) ||
+	    hdr->lcih_crc != _lattutil_config_image_crc(
+	    (const unsigned char *)map + sizeof(*hdr), sz - sizeof(*hdr))) {
+		munmap(map, sz);
+		return (false);
+	}
+
+	*mapp = map;
+	*szp = sz;
+
+	return (true);
+}
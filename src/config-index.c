@@ -0,0 +1,452 @@
+/*-
+ * Copyright (c) 2021 Shawn Webb <shawn.webb@hardenedbsd.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "liblattutil.h"
+
+#define	LATTUTIL_CONFIG_INDEX_MINSLOTS	64
+#define	LATTUTIL_CONFIG_INDEX_PATHSZ	256
+
+#define	LATTUTIL_CONFIG_FNV_OFFSET	0xcbf29ce484222325ULL
+#define	LATTUTIL_CONFIG_FNV_PRIME	0x100000001b3ULL
+
+/*
+ * The index maps every dotted path in a UCL tree, the same paths
+ * ucl_object_lookup_path accepts, to its object. It is an open
+ * addressing table with linear probing, kept at most half full, so a
+ * lookup is one hash of the path (done once, up front, for a key
+ * handle) and usually a single probe. Paths are stored in one arena
+ * and referenced by offset, so the table is three allocations in all.
+ *
+ * The index holds a reference to the tree, which keeps every borrowed
+ * object and string valid for as long as the index exists.
+ */
+
+typedef struct _lattutil_config_index_entry {
+	uint64_t		 lcie_hash;
+	size_t			 lcie_off;
+	size_t			 lcie_len;
+	const ucl_object_t	*lcie_obj;
+} lattutil_config_index_entry_t;
+
+struct _lattutil_config_index {
+	ucl_object_t			*lci_root;
+	lattutil_config_index_entry_t	*lci_slots;
+	size_t				 lci_mask;
+	size_t				 lci_count;
+	char				*lci_paths;
+	size_t				 lci_pathsz;
+	size_t				 lci_pathlen;
+};
+
+static uint64_t _lattutil_config_hash(const char *, size_t);
+static bool _lattutil_config_index_grow(lattutil_config_index_t *);
+static bool _lattutil_config_index_add(lattutil_config_index_t *,
+    const char *, size_t, const ucl_object_t *);
+static bool _lattutil_config_index_walk(lattutil_config_index_t *,
+    const ucl_object_t *, char **, size_t *, size_t);
+static const ucl_object_t *_lattutil_config_index_probe(
+    const lattutil_config_index_t *, const char *, size_t, uint64_t);
+
+EXPORTED_SYM
+lattutil_config_index_t *
+lattutil_config_index_new(const ucl_object_t *root)
+{
+	lattutil_config_index_t *lci;
+	size_t pathsz;
+	char *path;
+	bool ok;
+
+	if (root == NULL) {
+		return (NULL);
+	}
+
+	lci = calloc(1, sizeof(*lci));
+	if (lci == NULL) {
+		return (NULL);
+	}
+
+	pathsz = LATTUTIL_CONFIG_INDEX_PATHSZ;
+	path = malloc(pathsz);
+	if (path == NULL) {
+		free(lci);
+		return (NULL);
+	}
+
+	lci->lci_root = ucl_object_ref(root);
+	ok = _lattutil_config_index_grow(lci) &&
+	    _lattutil_config_index_walk(lci, root, &path, &pathsz, 0);
+	free(path);
+
+	if (!ok) {
+		lattutil_config_index_free(&lci);
+		return (NULL);
+	}
+
+	return (lci);
+}
+
+EXPORTED_SYM
+void
+lattutil_config_index_free(lattutil_config_index_t **lcip)
+{
+	lattutil_config_index_t *lci;
+
+	if (lcip == NULL || *lcip == NULL) {
+		return;
+	}
+
+	lci = *lcip;
+	ucl_object_unref(lci->lci_root);
+	free(lci->lci_slots);
+	free(lci->lci_paths);
+	free(lci);
+	*lcip = NULL;
+}
+
+EXPORTED_SYM
+size_t
+lattutil_config_index_count(const lattutil_config_index_t *lci)
+{
+
+	if (lci == NULL) {
+		return (0);
+	}
+
+	return (lci->lci_count);
+}
+
+EXPORTED_SYM
+void
+lattutil_config_key_init(lattutil_config_key_t *key, const char *path)
+{
+
+	if (key == NULL || path == NULL) {
+		return;
+	}
+
+	key->lck_path = path;
+	key->lck_len = strlen(path);
+	key->lck_hash = _lattutil_config_hash(path, key->lck_len);
+}
+
+EXPORTED_SYM
+const ucl_object_t *
+lattutil_config_index_lookup(const lattutil_config_index_t *lci,
+    const lattutil_config_key_t *key)
+{
+
+	if (lci == NULL || key == NULL || key->lck_path == NULL) {
+		return (NULL);
+	}
+
+	return (_lattutil_config_index_probe(lci, key->lck_path,
+	    key->lck_len, key->lck_hash));
+}
+
+EXPORTED_SYM
+const ucl_object_t *
+lattutil_config_index_find(const lattutil_config_index_t *lci,
+    const char *path)
+{
+	size_t len;
+
+	if (lci == NULL || path == NULL) {
+		return (NULL);
+	}
+
+	len = strlen(path);
+	return (_lattutil_config_index_probe(lci, path, len,
+	    _lattutil_config_hash(path, len)));
+}
+
+EXPORTED_SYM
+const char *
+lattutil_config_index_string(const lattutil_config_index_t *lci,
+    const lattutil_config_key_t *key, const char *def, size_t *lenp)
+{
+	const ucl_object_t *obj;
+	const char *res;
+	size_t len;
+
+	obj = lattutil_config_index_lookup(lci, key);
+	if (obj == NULL || ucl_object_type(obj) != UCL_STRING ||
+	    (res = ucl_object_tolstring(obj, &len)) == NULL) {
+		res = def;
+		len = def != NULL ? strlen(def) : 0;
+	}
+
+	if (lenp != NULL) {
+		*lenp = len;
+	}
+
+	return (res);
+}
+
+EXPORTED_SYM
+int64_t
+lattutil_config_index_int(const lattutil_config_index_t *lci,
+    const lattutil_config_key_t *key, int64_t def)
+{
+	const ucl_object_t *obj;
+	int64_t res;
+
+	obj = lattutil_config_index_lookup(lci, key);
+	if (obj == NULL || !ucl_object_toint_safe(obj, &res)) {
+		res = def;
+	}
+
+	return (res);
+}
+
+EXPORTED_SYM
+bool
+lattutil_config_index_bool(const lattutil_config_index_t *lci,
+    const lattutil_config_key_t *key, bool def)
+{
+	const ucl_object_t *obj;
+	bool res;
+
+	obj = lattutil_config_index_lookup(lci, key);
+	if (obj == NULL || !ucl_object_toboolean_safe(obj, &res)) {
+		res = def;
+	}
+
+	return (res);
+}
+
+EXPORTED_SYM
+double
+lattutil_config_index_double(const lattutil_config_index_t *lci,
+    const lattutil_config_key_t *key, double def)
+{
+	const ucl_object_t *obj;
+	double res;
+
+	obj = lattutil_config_index_lookup(lci, key);
+	if (obj == NULL || !ucl_object_todouble_safe(obj, &res)) {
+		res = def;
+	}
+
+	return (res);
+}
+
+/* FNV-1a: short keys, no setup, and good enough spread for paths. */
+static uint64_t
+_lattutil_config_hash(const char *path, size_t len)
+{
+	uint64_t hash;
+	size_t i;
+
+	hash = LATTUTIL_CONFIG_FNV_OFFSET;
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)path[i];
+		hash *= LATTUTIL_CONFIG_FNV_PRIME;
+	}
+
+	return (hash);
+}
+
+static bool
+_lattutil_config_index_grow(lattutil_config_index_t *lci)
+{
+	lattutil_config_index_entry_t *slots, *old;
+	size_t i, j, nslots, oldslots;
+
+	oldslots = lci->lci_slots != NULL ? lci->lci_mask + 1 : 0;
+	nslots = oldslots != 0 ? oldslots * 2 :
+	    LATTUTIL_CONFIG_INDEX_MINSLOTS;
+
+	slots = calloc(nslots, sizeof(*slots));
+	if (slots == NULL) {
+		return (false);
+	}
+
+	old = lci->lci_slots;
+	for (i = 0; i < oldslots; i++) {
+		if (old[i].lcie_obj == NULL) {
+			continue;
+		}
+		j = old[i].lcie_hash & (nslots - 1);
+		while (slots[j].lcie_obj != NULL) {
+			j = (j + 1) & (nslots - 1);
+		}
+		slots[j] = old[i];
+	}
+
+	free(old);
+	lci->lci_slots = slots;
+	lci->lci_mask = nslots - 1;
+
+	return (true);
+}
+
+/*
+ * A path that is already present keeps its first object, matching
+ * what ucl_object_lookup_path returns for repeated keys.
+ */
+static bool
+_lattutil_config_index_add(lattutil_config_index_t *lci, const char *path,
+    size_t len, const ucl_object_t *obj)
+{
+	lattutil_config_index_entry_t *ent;
+	uint64_t hash;
+	size_t i, sz;
+	char *p;
+
+	hash = _lattutil_config_hash(path, len);
+	if (_lattutil_config_index_probe(lci, path, len, hash) != NULL) {
+		return (true);
+	}
+
+	if ((lci->lci_count + 1) * 2 > lci->lci_mask + 1 &&
+	    !_lattutil_config_index_grow(lci)) {
+		return (false);
+	}
+
+	if (lci->lci_pathlen + len > lci->lci_pathsz) {
+		sz = lci->lci_pathsz != 0 ? lci->lci_pathsz : 1024;
+		while (lci->lci_pathlen + len > sz) {
+			sz *= 2;
+		}
+		p = realloc(lci->lci_paths, sz);
+		if (p == NULL) {
+			return (false);
+		}
+		lci->lci_paths = p;
+		lci->lci_pathsz = sz;
+	}
+
+	i = hash & lci->lci_mask;
+	while (lci->lci_slots[i].lcie_obj != NULL) {
+		i = (i + 1) & lci->lci_mask;
+	}
+
+	ent = &(lci->lci_slots[i]);
+	ent->lcie_hash = hash;
+	ent->lcie_off = lci->lci_pathlen;
+	ent->lcie_len = len;
+	ent->lcie_obj = obj;
+
+	memcpy(lci->lci_paths + lci->lci_pathlen, path, len);
+	lci->lci_pathlen += len;
+	lci->lci_count++;
+
+	return (true);
+}
+
+/*
+ * Index every member of obj, whose own path is the first len bytes of
+ * *pathp. Object members are named by key and array elements by
+ * position, as ucl_object_lookup_path names them.
+ */
+static bool
+_lattutil_config_index_walk(lattutil_config_index_t *lci,
+    const ucl_object_t *obj, char **pathp, size_t *pathszp, size_t len)
+{
+	const ucl_object_t *cur;
+	ucl_object_iter_t it;
+	size_t n, namelen, need, plen;
+	char num[24], *p;
+	const char *name;
+	ucl_type_t type;
+
+	type = ucl_object_type(obj);
+	if (type != UCL_OBJECT && type != UCL_ARRAY) {
+		return (true);
+	}
+
+	it = NULL;
+	n = 0;
+	while ((cur = ucl_iterate_object(obj, &it, true)) != NULL) {
+		if (type == UCL_OBJECT) {
+			name = ucl_object_keyl(cur, &namelen);
+			if (name == NULL) {
+				continue;
+			}
+		} else {
+			namelen = snprintf(num, sizeof(num), "%zu", n++);
+			name = num;
+		}
+
+		need = len + 1 + namelen;
+		if (need > *pathszp) {
+			p = realloc(*pathp, need * 2);
+			if (p == NULL) {
+				return (false);
+			}
+			*pathp = p;
+			*pathszp = need * 2;
+		}
+
+		p = *pathp + len;
+		if (len > 0) {
+			*p++ = '.';
+		}
+		memcpy(p, name, namelen);
+		plen = (p - *pathp) + namelen;
+
+		/*
+		 * A zero-copy parse leaves strings in the source buffer,
+		 * unterminated, until first read. Read them now, while
+		 * the index is private, so lookups never modify the tree.
+		 */
+		if (ucl_object_type(cur) == UCL_STRING) {
+			ucl_object_tostring(cur);
+		}
+
+		if (!_lattutil_config_index_add(lci, *pathp, plen, cur) ||
+		    !_lattutil_config_index_walk(lci, cur, pathp, pathszp,
+		    plen)) {
+			return (false);
+		}
+	}
+
+	return (true);
+}
+
+static const ucl_object_t *
+_lattutil_config_index_probe(const lattutil_config_index_t *lci,
+    const char *path, size_t len, uint64_t hash)
+{
+	const lattutil_config_index_entry_t *ent;
+	size_t i;
+
+	i = hash & lci->lci_mask;
+	for (;;) {
+		ent = &(lci->lci_slots[i]);
+		if (ent->lcie_obj == NULL) {
+			return (NULL);
+		}
+		if (ent->lcie_hash == hash && ent->lcie_len == len &&
+		    !memcmp(lci->lci_paths + ent->lcie_off, path, len)) {
+			return (ent->lcie_obj);
+		}
+		i = (i + 1) & lci->lci_mask;
+	}
+}
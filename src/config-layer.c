@@ -0,0 +1,434 @@
+/*-
+ * Copyright (c) 2021 Shawn Webb <shawn.webb@hardenedbsd.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "liblattutil.h"
+
+#define	LATTUTIL_CONFIG_LAYER_THREADS	4
+#define	LATTUTIL_CONFIG_LAYER_MINSZ	16
+#define	LATTUTIL_CONFIG_LAYER_SUFFIX	".conf"
+
+/*
+ * A layered config is every copy of the main file found along the
+ * search paths, each followed by the fragments in its fragment
+ * directory, ordered from the lowest priority layer (the last path)
+ * to the highest (the first path). The files are parsed into separate
+ * trees in parallel, then merged one at a time in that order, so the
+ * result does not depend on which parse finishes first.
+ */
+
+typedef struct _lattutil_config_layer {
+	char		*lcl_path;
+	ucl_object_t	*lcl_root;
+} lattutil_config_layer_t;
+
+typedef struct _lattutil_config_layers {
+	lattutil_config_layer_t	*lcls_layers;
+	size_t			 lcls_nlayers;
+	size_t			 lcls_layersz;
+	_Atomic(size_t)		 lcls_next;
+	_Atomic(bool)		 lcls_failed;
+} lattutil_config_layers_t;
+
+static bool _lattutil_config_layer_add(lattutil_config_layers_t *,
+    const char *, const char *);
+static bool _lattutil_config_layer_fragments(lattutil_config_layers_t *,
+    const char *, const char *);
+static int _lattutil_config_layer_cmp(const void *, const void *);
+static bool _lattutil_config_layer_parse(lattutil_config_layer_t *);
+static void *_lattutil_config_layer_worker(void *);
+static bool _lattutil_config_layer_merge(ucl_object_t *,
+    const ucl_object_t *);
+static void _lattutil_config_layers_free(lattutil_config_layers_t *);
+
+EXPORTED_SYM
+lattutil_config_path_t *
+lattutil_find_config_layered(const char **paths, size_t npaths,
+    const char *filename, const char *fragdir, int flags,
+    unsigned int nthreads)
+{
+	lattutil_config_layers_t layers;
+	lattutil_config_path_t *res;
+	pthread_t *tids;
+	size_t i, primary, sz;
+	unsigned int t, nstarted;
+	ucl_object_t *root;
+	struct stat sb;
+	char *path;
+	long ncpus;
+
+	if (paths == NULL || filename == NULL) {
+		return (NULL);
+	}
+
+	memset(&layers, 0, sizeof(layers));
+
+	/*
+	 * Collect the layers from the lowest priority path up, noting
+	 * the highest priority main file, which is the one
+	 * lattutil_find_config would have returned.
+	 */
+	primary = SIZE_MAX;
+	for (i = npaths; i > 0; i--) {
+		sz = strlen(paths[i - 1]) + strlen(filename) + 2;
+		path = malloc(sz);
+		if (path == NULL) {
+			_lattutil_config_layers_free(&layers);
+			return (NULL);
+		}
+		snprintf(path, sz, "%s/%s", paths[i - 1], filename);
+		if (stat(path, &sb) == 0 && S_ISREG(sb.st_mode)) {
+			if (!_lattutil_config_layer_add(&layers, path, NULL)) {
+				free(path);
+				_lattutil_config_layers_free(&layers);
+				return (NULL);
+			}
+			primary = layers.lcls_nlayers - 1;
+		}
+		free(path);
+
+		if (fragdir != NULL &&
+		    !_lattutil_config_layer_fragments(&layers, paths[i - 1],
+		    fragdir)) {
+			_lattutil_config_layers_free(&layers);
+			return (NULL);
+		}
+	}
+
+	if (primary == SIZE_MAX) {
+		_lattutil_config_layers_free(&layers);
+		return (NULL);
+	}
+
+	/*
+	 * Parse on a small pool. The calling thread takes part, so
+	 * a pool that fails to start still makes progress.
+	 */
+	if (nthreads == 0) {
+		ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = ncpus > 0 && ncpus < LATTUTIL_CONFIG_LAYER_THREADS ?
+		    ncpus : LATTUTIL_CONFIG_LAYER_THREADS;
+	}
+	if (nthreads > layers.lcls_nlayers) {
+		nthreads = layers.lcls_nlayers;
+	}
+
+	nstarted = 0;
+	tids = NULL;
+	if (nthreads > 1) {
+		tids = calloc(nthreads - 1, sizeof(*tids));
+	}
+	if (tids != NULL) {
+		for (t = 0; t < nthreads - 1; t++) {
+			if (pthread_create(&(tids[t]), NULL,
+			    _lattutil_config_layer_worker, &layers)) {
+				break;
+			}
+			nstarted++;
+		}
+	}
+	_lattutil_config_layer_worker(&layers);
+	for (t = 0; t < nstarted; t++) {
+		pthread_join(tids[t], NULL);
+	}
+	free(tids);
+
+	if (atomic_load(&(layers.lcls_failed))) {
+		_lattutil_config_layers_free(&layers);
+		return (NULL);
+	}
+
+	root = layers.lcls_layers[0].lcl_root;
+	layers.lcls_layers[0].lcl_root = NULL;
+	for (i = 1; i < layers.lcls_nlayers; i++) {
+		if (!_lattutil_config_layer_merge(root,
+		    layers.lcls_layers[i].lcl_root)) {
+			ucl_object_unref(root);
+			_lattutil_config_layers_free(&layers);
+			return (NULL);
+		}
+	}
+
+	res = calloc(1, sizeof(*res));
+	if (res == NULL) {
+		ucl_object_unref(root);
+		_lattutil_config_layers_free(&layers);
+		return (NULL);
+	}
+
+	res->l_version = LATTUTIL_VERSION;
+	res->l_rootobj = root;
+	res->l_path = layers.lcls_layers[primary].lcl_path;
+	layers.lcls_layers[primary].lcl_path = NULL;
+	_lattutil_config_layers_free(&layers);
+
+	res->l_fd = open(res->l_path, flags);
+	if (res->l_fd < 0 || fstat(res->l_fd, &(res->l_sb))) {
+		lattutil_free_config_path(&res);
+		return (NULL);
+	}
+
+	return (res);
+}
+
+static bool
+_lattutil_config_layer_add(lattutil_config_layers_t *layers,
+    const char *dir, const char *name)
+{
+	lattutil_config_layer_t *p;
+	size_t sz;
+	char *path;
+
+	if (layers->lcls_nlayers == layers->lcls_layersz) {
+		sz = layers->lcls_layersz ? layers->lcls_layersz * 2 :
+		    LATTUTIL_CONFIG_LAYER_MINSZ;
+		p = reallocarray(layers->lcls_layers, sz, sizeof(*p));
+		if (p == NULL) {
+			return (false);
+		}
+		layers->lcls_layers = p;
+		layers->lcls_layersz = sz;
+	}
+
+	if (name != NULL) {
+		sz = strlen(dir) + strlen(name) + 2;
+		path = malloc(sz);
+		if (path != NULL) {
+			snprintf(path, sz, "%s/%s", dir, name);
+		}
+	} else {
+		path = strdup(dir);
+	}
+	if (path == NULL) {
+		return (false);
+	}
+
+	p = &(layers->lcls_layers[layers->lcls_nlayers++]);
+	p->lcl_path = path;
+	p->lcl_root = NULL;
+
+	return (true);
+}
+
+/*
+ * Add the regular files named *.conf in a path's fragment directory,
+ * in byte order of their names. Dot files are skipped, and a missing
+ * directory adds nothing.
+ */
+static bool
+_lattutil_config_layer_fragments(lattutil_config_layers_t *layers,
+    const char *base, const char *fragdir)
+{
+	size_t first, len, sz, suffixlen;
+	struct dirent *ent;
+	struct stat sb;
+	char *dir;
+	DIR *dp;
+
+	sz = strlen(base) + strlen(fragdir) + 2;
+	dir = malloc(sz);
+	if (dir == NULL) {
+		return (false);
+	}
+	snprintf(dir, sz, "%s/%s", base, fragdir);
+
+	dp = opendir(dir);
+	if (dp == NULL) {
+		free(dir);
+		return (true);
+	}
+
+	first = layers->lcls_nlayers;
+	suffixlen = strlen(LATTUTIL_CONFIG_LAYER_SUFFIX);
+	while ((ent = readdir(dp)) != NULL) {
+		len = strlen(ent->d_name);
+		if (ent->d_name[0] == '.' || len <= suffixlen ||
+		    strcmp(ent->d_name + len - suffixlen,
+		    LATTUTIL_CONFIG_LAYER_SUFFIX)) {
+			continue;
+		}
+		if (fstatat(dirfd(dp), ent->d_name, &sb, 0) ||
+		    !S_ISREG(sb.st_mode)) {
+			continue;
+		}
+		if (!_lattutil_config_layer_add(layers, dir, ent->d_name)) {
+			closedir(dp);
+			free(dir);
+			return (false);
+		}
+	}
+	closedir(dp);
+	free(dir);
+
+	qsort(layers->lcls_layers + first, layers->lcls_nlayers - first,
+	    sizeof(*(layers->lcls_layers)), _lattutil_config_layer_cmp);
+
+	return (true);
+}
+
+static int
+_lattutil_config_layer_cmp(const void *a, const void *b)
+{
+	const lattutil_config_layer_t *la, *lb;
+
+	la = a;
+	lb = b;
+
+	return (strcmp(la->lcl_path, lb->lcl_path));
+}
+
+static bool
+_lattutil_config_layer_parse(lattutil_config_layer_t *layer)
+{
+	struct ucl_parser *parser;
+	int fd;
+
+	fd = open(layer->lcl_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return (false);
+	}
+
+	parser = ucl_parser_new(UCL_PARSER_KEY_LOWERCASE);
+	if (parser == NULL) {
+		close(fd);
+		return (false);
+	}
+
+	if (!ucl_parser_add_fd(parser, fd)) {
+		ucl_parser_free(parser);
+		close(fd);
+		return (false);
+	}
+
+	layer->lcl_root = ucl_parser_get_object(parser);
+	ucl_parser_free(parser);
+	close(fd);
+
+	return (layer->lcl_root != NULL);
+}
+
+static void *
+_lattutil_config_layer_worker(void *arg)
+{
+	lattutil_config_layers_t *layers;
+	size_t i;
+
+	layers = arg;
+	while (!atomic_load_explicit(&(layers->lcls_failed),
+	    memory_order_relaxed)) {
+		i = atomic_fetch_add_explicit(&(layers->lcls_next), 1,
+		    memory_order_relaxed);
+		if (i >= layers->lcls_nlayers) {
+			break;
+		}
+		if (!_lattutil_config_layer_parse(&(layers->lcls_layers[i]))) {
+			atomic_store(&(layers->lcls_failed), true);
+		}
+	}
+
+	return (NULL);
+}
+
+/*
+ * Merge src over dst. Where both have an object under the same key,
+ * the two objects are merged recursively. Any other value in src,
+ * including an array, replaces the value in dst outright.
+ */
+static bool
+_lattutil_config_layer_merge(ucl_object_t *dst, const ucl_object_t *src)
+{
+	const ucl_object_t *cur, *old;
+	ucl_object_iter_t it;
+	const char *key;
+	size_t keylen;
+	bool res;
+
+	if (ucl_object_type(dst) != UCL_OBJECT ||
+	    ucl_object_type(src) != UCL_OBJECT) {
+		return (false);
+	}
+
+	it = NULL;
+	while ((cur = ucl_iterate_object(src, &it, true)) != NULL) {
+		key = ucl_object_keyl(cur, &keylen);
+		old = ucl_object_lookup_len(dst, key, keylen);
+		if (old != NULL && ucl_object_type(old) == UCL_OBJECT &&
+		    ucl_object_type(cur) == UCL_OBJECT) {
+			if (!_lattutil_config_layer_merge((ucl_object_t *)old,
+			    cur)) {
+				return (false);
+			}
+			continue;
+		}
+
+		/*
+		 * The source tree is discarded after the merge, so its
+		 * objects move over by reference rather than by copy.
+		 * ucl_object_replace_key reports failure for a key that
+		 * was not there before, so new keys are inserted.
+		 */
+		if (old != NULL) {
+			res = ucl_object_replace_key(dst, ucl_object_ref(cur),
+			    key, keylen, false);
+		} else {
+			res = ucl_object_insert_key(dst, ucl_object_ref(cur),
+			    key, keylen, false);
+		}
+		if (!res) {
+			ucl_object_unref((ucl_object_t *)cur);
+			return (false);
+		}
+	}
+
+	return (true);
+}
+
+static void
+_lattutil_config_layers_free(lattutil_config_layers_t *layers)
+{
+	size_t i;
+
+	for (i = 0; i < layers->lcls_nlayers; i++) {
+		free(layers->lcls_layers[i].lcl_path);
+		if (layers->lcls_layers[i].lcl_root != NULL) {
+			ucl_object_unref(layers->lcls_layers[i].lcl_root);
+		}
+	}
+	free(layers->lcls_layers);
+	memset(layers, 0, sizeof(*layers));
+}
@@ -0,0 +1,711 @@
+/*-
+ * Copyright (c) 2021 Shawn Webb <shawn.webb@hardenedbsd.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/queue.h>
+#if defined(__linux__)
+#include <sys/inotify.h>
+#else
+#include <sys/event.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "liblattutil.h"
+
+#define	LATTUTIL_CONFIG_WATCH_SETTLE_MS	50
+#define	LATTUTIL_CONFIG_WATCH_EVBUFSZ	4096
+#define	LATTUTIL_CONFIG_WATCH_CACHELINE	64
+
+/*
+ * The current snapshot is published through a single atomic pointer.
+ * Readers take a reference without locking; the only hazard is a
+ * reader that has loaded the pointer but not yet bumped the count
+ * when a reload drops the watcher's reference to that snapshot. To
+ * rule that out, readers announce themselves in one of two counters
+ * selected by the low bit of lcw_epoch, and only count once the epoch
+ * still matches after they have announced themselves. A reload swaps
+ * the pointer, flips the epoch so that new readers use the other
+ * counter, and waits for the old counter to drain before releasing
+ * the previous snapshot. Reloads are serialized, so the first flip
+ * after a reader announces itself waits for that reader. The wait
+ * covers a handful of instructions per reader and is taken only by
+ * the reloading thread.
+ */
+
+struct _lattutil_config_snapshot {
+	_Atomic(uint64_t)	 lcs_refs;
+	uint64_t		 lcs_generation;
+	ucl_object_t		*lcs_root;
+	lattutil_config_index_t	*lcs_index;
+};
+
+typedef struct _lattutil_config_watch_hook {
+	lattutil_config_watch_cb			 lcwh_cb;
+	void						*lcwh_arg;
+	TAILQ_ENTRY(_lattutil_config_watch_hook)	 lcwh_entry;
+} lattutil_config_watch_hook_t;
+
+TAILQ_HEAD(_lattutil_config_watch_hooks, _lattutil_config_watch_hook);
+
+typedef struct _lattutil_config_watch_readers {
+	_Alignas(LATTUTIL_CONFIG_WATCH_CACHELINE)
+	    _Atomic(uint64_t)	 lcwr_count;
+} lattutil_config_watch_readers_t;
+
+struct _lattutil_config_watch {
+	_Atomic(lattutil_config_snapshot_t *)	 lcw_current;
+	_Atomic(unsigned int)			 lcw_epoch;
+	_Atomic(uint64_t)			 lcw_generation;
+	_Atomic(uint64_t)			 lcw_errors;
+	lattutil_config_watch_readers_t		 lcw_readers[2];
+	char					*lcw_path;
+	char					*lcw_dir;
+	const char				*lcw_name;
+	int					 lcw_notify;
+	int					 lcw_dirfd;
+	int					 lcw_file;
+	int					 lcw_wake[2];
+	struct _lattutil_config_watch_hooks	 lcw_hooks;
+	pthread_mutex_t				 lcw_mtx;
+	pthread_t				 lcw_thread;
+};
+
+static lattutil_config_snapshot_t *_lattutil_config_snapshot_new(
+    ucl_object_t *, uint64_t);
+static ucl_object_t *_lattutil_config_watch_parse(lattutil_config_watch_t *);
+static bool _lattutil_config_watch_publish(lattutil_config_watch_t *,
+    ucl_object_t *);
+static bool _lattutil_config_watch_arm(lattutil_config_watch_t *);
+static bool _lattutil_config_watch_changed(lattutil_config_watch_t *);
+static uint64_t _lattutil_config_watch_now_ms(void);
+static void *_lattutil_config_watch_thread(void *);
+static void _lattutil_config_watch_cleanup(lattutil_config_watch_t *);
+
+EXPORTED_SYM
+lattutil_config_watch_t *
+lattutil_config_watch_new(const lattutil_config_path_t *cfg)
+{
+	lattutil_config_watch_t *lcw;
+	ucl_object_t *root;
+	char *p;
+
+	if (cfg == NULL || cfg->l_path == NULL) {
+		return (NULL);
+	}
+
+	lcw = calloc(1, sizeof(*lcw));
+	if (lcw == NULL) {
+		return (NULL);
+	}
+
+	lcw->lcw_notify = -1;
+	lcw->lcw_dirfd = -1;
+	lcw->lcw_file = -1;
+	lcw->lcw_wake[0] = lcw->lcw_wake[1] = -1;
+	TAILQ_INIT(&(lcw->lcw_hooks));
+	pthread_mutex_init(&(lcw->lcw_mtx), NULL);
+
+	lcw->lcw_path = strdup(cfg->l_path);
+	lcw->lcw_dir = strdup(cfg->l_path);
+	if (lcw->lcw_path == NULL || lcw->lcw_dir == NULL) {
+		_lattutil_config_watch_cleanup(lcw);
+		return (NULL);
+	}
+
+	/* lattutil_find_config always joins a directory and a name. */
+	p = strrchr(lcw->lcw_dir, '/');
+	if (p == NULL) {
+		_lattutil_config_watch_cleanup(lcw);
+		return (NULL);
+	}
+	*p = '\0';
+	lcw->lcw_name = lcw->lcw_path + (p - lcw->lcw_dir) + 1;
+	if (lcw->lcw_dir[0] == '\0') {
+		lcw->lcw_dir[0] = '/';
+		lcw->lcw_dir[1] = '\0';
+	}
+
+	if (pipe(lcw->lcw_wake)) {
+		lcw->lcw_wake[0] = lcw->lcw_wake[1] = -1;
+		_lattutil_config_watch_cleanup(lcw);
+		return (NULL);
+	}
+
+	if (!_lattutil_config_watch_arm(lcw)) {
+		_lattutil_config_watch_cleanup(lcw);
+		return (NULL);
+	}
+
+	/*
+	 * Start from the tree the caller already parsed, so that
+	 * generation 1 is exactly what lattutil_find_config returned,
+	 * unless that tree lives in a mapping owned by the caller.
+	 */
+	if (cfg->l_rootobj != NULL && cfg->l_map == NULL) {
+		root = ucl_object_ref(cfg->l_rootobj);
+	} else {
+		root = _lattutil_config_watch_parse(lcw);
+	}
+	if (root == NULL || !_lattutil_config_watch_publish(lcw, root)) {
+		_lattutil_config_watch_cleanup(lcw);
+		return (NULL);
+	}
+
+	if (pthread_create(&(lcw->lcw_thread), NULL,
+	    _lattutil_config_watch_thread, lcw)) {
+		_lattutil_config_watch_cleanup(lcw);
+		return (NULL);
+	}
+
+	return (lcw);
+}
+
+EXPORTED_SYM
+bool
+lattutil_config_watch_add_cb(lattutil_config_watch_t *lcw,
+    lattutil_config_watch_cb cb, void *arg)
+{
+	lattutil_config_watch_hook_t *hook;
+
+	if (lcw == NULL || cb == NULL) {
+		return (false);
+	}
+
+	hook = calloc(1, sizeof(*hook));
+	if (hook == NULL) {
+		return (false);
+	}
+
+	hook->lcwh_cb = cb;
+	hook->lcwh_arg = arg;
+
+	pthread_mutex_lock(&(lcw->lcw_mtx));
+	TAILQ_INSERT_TAIL(&(lcw->lcw_hooks), hook, lcwh_entry);
+	pthread_mutex_unlock(&(lcw->lcw_mtx));
+
+	return (true);
+}
+
+EXPORTED_SYM
+bool
+lattutil_config_watch_reload(lattutil_config_watch_t *lcw)
+{
+	ucl_object_t *root;
+	bool res;
+
+	if (lcw == NULL) {
+		return (false);
+	}
+
+	res = false;
+	pthread_mutex_lock(&(lcw->lcw_mtx));
+	root = _lattutil_config_watch_parse(lcw);
+	if (root != NULL) {
+		res = _lattutil_config_watch_publish(lcw, root);
+	}
+	pthread_mutex_unlock(&(lcw->lcw_mtx));
+
+	return (res);
+}
+
+EXPORTED_SYM
+lattutil_config_snapshot_t *
+lattutil_config_watch_acquire(lattutil_config_watch_t *lcw)
+{
+	lattutil_config_snapshot_t *snap;
+	unsigned int epoch;
+
+	if (lcw == NULL) {
+		return (NULL);
+	}
+
+	/*
+	 * A reader that stalls between reading the epoch and announcing
+	 * itself may land in a counter a reload has already drained, so
+	 * confirm the epoch after announcing and start over if it moved.
+	 */
+	for (;;) {
+		epoch = atomic_load(&(lcw->lcw_epoch)) & 1;
+		atomic_fetch_add(&(lcw->lcw_readers[epoch].lcwr_count), 1);
+		if ((atomic_load(&(lcw->lcw_epoch)) & 1) == epoch) {
+			break;
+		}
+		atomic_fetch_sub(&(lcw->lcw_readers[epoch].lcwr_count), 1);
+	}
+	snap = atomic_load(&(lcw->lcw_current));
+	atomic_fetch_add_explicit(&(snap->lcs_refs), 1,
+	    memory_order_relaxed);
+	atomic_fetch_sub(&(lcw->lcw_readers[epoch].lcwr_count), 1);
+
+	return (snap);
+}
+
+EXPORTED_SYM
+uint64_t
+lattutil_config_watch_generation(lattutil_config_watch_t *lcw)
+{
+
+	if (lcw == NULL) {
+		return (0);
+	}
+
+	return (atomic_load_explicit(&(lcw->lcw_generation),
+	    memory_order_acquire));
+}
+
+EXPORTED_SYM
+uint64_t
+lattutil_config_watch_errors(lattutil_config_watch_t *lcw)
+{
+
+	if (lcw == NULL) {
+		return (0);
+	}
+
+	return (atomic_load_explicit(&(lcw->lcw_errors),
+	    memory_order_relaxed));
+}
+
+EXPORTED_SYM
+void
+lattutil_config_watch_free(lattutil_config_watch_t **lcwp)
+{
+	lattutil_config_watch_t *lcw;
+	char c;
+
+	if (lcwp == NULL || *lcwp == NULL) {
+		return;
+	}
+
+	lcw = *lcwp;
+	c = 0;
+	if (write(lcw->lcw_wake[1], &c, 1) == 1) {
+		pthread_join(lcw->lcw_thread, NULL);
+	}
+
+	_lattutil_config_watch_cleanup(lcw);
+	*lcwp = NULL;
+}
+
+EXPORTED_SYM
+const ucl_object_t *
+lattutil_config_snapshot_root(const lattutil_config_snapshot_t *snap)
+{
+
+	if (snap == NULL) {
+		return (NULL);
+	}
+
+	return (snap->lcs_root);
+}
+
+EXPORTED_SYM
+const lattutil_config_index_t *
+lattutil_config_snapshot_index(const lattutil_config_snapshot_t *snap)
+{
+
+	if (snap == NULL) {
+		return (NULL);
+	}
+
+	return (snap->lcs_index);
+}
+
+EXPORTED_SYM
+uint64_t
+lattutil_config_snapshot_generation(const lattutil_config_snapshot_t *snap)
+{
+
+	if (snap == NULL) {
+		return (0);
+	}
+
+	return (snap->lcs_generation);
+}
+
+EXPORTED_SYM
+void
+lattutil_config_snapshot_release(lattutil_config_snapshot_t **snapp)
+{
+	lattutil_config_snapshot_t *snap;
+
+	if (snapp == NULL || *snapp == NULL) {
+		return;
+	}
+
+	snap = *snapp;
+	*snapp = NULL;
+
+	if (atomic_fetch_sub_explicit(&(snap->lcs_refs), 1,
+	    memory_order_acq_rel) == 1) {
+		lattutil_config_index_free(&(snap->lcs_index));
+		ucl_object_unref(snap->lcs_root);
+		free(snap);
+	}
+}
+
+static lattutil_config_snapshot_t *
+_lattutil_config_snapshot_new(ucl_object_t *root, uint64_t generation)
+{
+	lattutil_config_snapshot_t *snap;
+
+	snap = calloc(1, sizeof(*snap));
+	if (snap == NULL) {
+		return (NULL);
+	}
+
+	snap->lcs_index = lattutil_config_index_new(root);
+	if (snap->lcs_index == NULL) {
+		free(snap);
+		return (NULL);
+	}
+
+	atomic_init(&(snap->lcs_refs), 1);
+	snap->lcs_generation = generation;
+	snap->lcs_root = root;
+
+	return (snap);
+}
+
+static ucl_object_t *
+_lattutil_config_watch_parse(lattutil_config_watch_t *lcw)
+{
+	struct ucl_parser *parser;
+	ucl_object_t *root;
+	int fd;
+
+	root = NULL;
+
+	fd = open(lcw->lcw_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		atomic_fetch_add(&(lcw->lcw_errors), 1);
+		return (NULL);
+	}
+
+	/* Same parser settings as lattutil_find_config. */
+	parser = ucl_parser_new(UCL_PARSER_KEY_LOWERCASE);
+	if (parser != NULL) {
+		if (ucl_parser_add_fd(parser, fd)) {
+			root = ucl_parser_get_object(parser);
+		}
+		ucl_parser_free(parser);
+	}
+	close(fd);
+
+	if (root == NULL) {
+		atomic_fetch_add(&(lcw->lcw_errors), 1);
+	}
+
+	return (root);
+}
+
+/*
+ * Called with lcw_mtx held, or before the watcher thread exists.
+ * Consumes the caller's reference to root. Hooks run with the lock
+ * held, so they see snapshots in generation order and must not call
+ * back into the watcher's reload or registration functions.
+ */
+static bool
+_lattutil_config_watch_publish(lattutil_config_watch_t *lcw,
+    ucl_object_t *root)
+{
+	lattutil_config_snapshot_t *old, *snap;
+	lattutil_config_watch_hook_t *hook;
+	uint64_t generation;
+	unsigned int epoch;
+
+	generation = atomic_load(&(lcw->lcw_generation)) + 1;
+	snap = _lattutil_config_snapshot_new(root, generation);
+	if (snap == NULL) {
+		ucl_object_unref(root);
+		atomic_fetch_add(&(lcw->lcw_errors), 1);
+		return (false);
+	}
+
+	old = atomic_exchange(&(lcw->lcw_current), snap);
+	atomic_store_explicit(&(lcw->lcw_generation), generation,
+	    memory_order_release);
+
+	if (old != NULL) {
+		epoch = atomic_fetch_add(&(lcw->lcw_epoch), 1) & 1;
+		while (atomic_load(&(lcw->lcw_readers[epoch].lcwr_count))
+		    != 0) {
+			sched_yield();
+		}
+		lattutil_config_snapshot_release(&old);
+	}
+
+	TAILQ_FOREACH(hook, &(lcw->lcw_hooks), lcwh_entry) {
+		hook->lcwh_cb(lcw, snap, hook->lcwh_arg);
+	}
+
+	return (true);
+}
+
+#if defined(__linux__)
+
+/*
+ * Watch the directory rather than the file: editors and deployment
+ * tools usually replace a config file by renaming a new one over it,
+ * which a watch on the old inode would never report.
+ */
+static bool
+_lattutil_config_watch_arm(lattutil_config_watch_t *lcw)
+{
+
+	if (lcw->lcw_notify >= 0) {
+		return (true);
+	}
+
+	lcw->lcw_notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (lcw->lcw_notify < 0) {
+		return (false);
+	}
+
+	if (inotify_add_watch(lcw->lcw_notify, lcw->lcw_dir,
+	    IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE) < 0) {
+		close(lcw->lcw_notify);
+		lcw->lcw_notify = -1;
+		return (false);
+	}
+
+	return (true);
+}
+
+static bool
+_lattutil_config_watch_changed(lattutil_config_watch_t *lcw)
+{
+	char buf[LATTUTIL_CONFIG_WATCH_EVBUFSZ]
+	    __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	bool changed;
+	ssize_t len;
+	char *p;
+
+	changed = false;
+	while ((len = read(lcw->lcw_notify, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + len;
+		    p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				changed = true;
+			} else if (ev->len > 0 &&
+			    !strcmp(ev->name, lcw->lcw_name)) {
+				changed = true;
+			}
+		}
+	}
+
+	return (changed);
+}
+
+#else
+
+/*
+ * kqueue reports changes per descriptor, so watch both the directory,
+ * for a file renamed or created in place of ours, and the file itself,
+ * for writes. The file descriptor is reopened after every reload to
+ * follow a replaced file.
+ */
+static bool
+_lattutil_config_watch_arm(lattutil_config_watch_t *lcw)
+{
+	struct kevent kev;
+
+	if (lcw->lcw_notify < 0) {
+		lcw->lcw_notify = kqueue();
+		if (lcw->lcw_notify < 0) {
+			return (false);
+		}
+
+		lcw->lcw_dirfd = open(lcw->lcw_dir,
+		    O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (lcw->lcw_dirfd < 0) {
+			return (false);
+		}
+
+		EV_SET(&kev, lcw->lcw_dirfd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+		    NOTE_WRITE, 0, NULL);
+		if (kevent(lcw->lcw_notify, &kev, 1, NULL, 0, NULL) < 0) {
+			return (false);
+		}
+	}
+
+	if (lcw->lcw_file >= 0) {
+		close(lcw->lcw_file);
+	}
+
+	/* A missing file is picked up through the directory watch. */
+	lcw->lcw_file = open(lcw->lcw_path, O_RDONLY | O_CLOEXEC);
+	if (lcw->lcw_file >= 0) {
+		EV_SET(&kev, lcw->lcw_file, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+		    NOTE_WRITE | NOTE_EXTEND | NOTE_DELETE | NOTE_RENAME |
+		    NOTE_ATTRIB, 0, NULL);
+		kevent(lcw->lcw_notify, &kev, 1, NULL, 0, NULL);
+	}
+
+	return (true);
+}
+
+static bool
+_lattutil_config_watch_changed(lattutil_config_watch_t *lcw)
+{
+	struct kevent kev[8];
+	struct timespec ts;
+	bool changed;
+
+	changed = false;
+	ts.tv_sec = 0;
+	ts.tv_nsec = 0;
+	while (kevent(lcw->lcw_notify, NULL, 0, kev, nitems(kev), &ts) > 0) {
+		changed = true;
+	}
+
+	return (changed);
+}
+
+#endif
+
+static uint64_t
+_lattutil_config_watch_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/*
+ * Reloads are debounced: a change only triggers a parse once the file
+ * has been quiet for LATTUTIL_CONFIG_WATCH_SETTLE_MS, so a writer that
+ * truncates and rewrites in several steps is not caught half way. The
+ * directory watch also wakes us for other files in the directory, so
+ * the deadline is taken from the last event that concerned our file
+ * rather than from the last wakeup; otherwise a busy directory could
+ * hold off a pending reload indefinitely.
+ */
+static void *
+_lattutil_config_watch_thread(void *arg)
+{
+	lattutil_config_watch_t *lcw;
+	struct pollfd pfd[2];
+	uint64_t deadline, now;
+	bool pending;
+	int n, timeout;
+
+	lcw = arg;
+	pending = false;
+	deadline = 0;
+
+	pfd[0].fd = lcw->lcw_wake[0];
+	pfd[0].events = POLLIN;
+	pfd[1].fd = lcw->lcw_notify;
+	pfd[1].events = POLLIN;
+
+	for (;;) {
+		timeout = -1;
+		if (pending) {
+			now = _lattutil_config_watch_now_ms();
+			timeout = deadline > now ? (int)(deadline - now) : 0;
+		}
+
+		n = poll(pfd, nitems(pfd), timeout);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		if (pfd[0].revents != 0) {
+			break;
+		}
+
+		if (n > 0 && _lattutil_config_watch_changed(lcw)) {
+			pending = true;
+			deadline = _lattutil_config_watch_now_ms() +
+			    LATTUTIL_CONFIG_WATCH_SETTLE_MS;
+			continue;
+		}
+
+		if (pending && _lattutil_config_watch_now_ms() >= deadline) {
+			pending = false;
+			pthread_mutex_lock(&(lcw->lcw_mtx));
+			_lattutil_config_watch_arm(lcw);
+			pthread_mutex_unlock(&(lcw->lcw_mtx));
+			lattutil_config_watch_reload(lcw);
+		}
+	}
+
+	return (NULL);
+}
+
+static void
+_lattutil_config_watch_cleanup(lattutil_config_watch_t *lcw)
+{
+	lattutil_config_watch_hook_t *hook;
+	lattutil_config_snapshot_t *snap;
+
+	while ((hook = TAILQ_FIRST(&(lcw->lcw_hooks))) != NULL) {
+		TAILQ_REMOVE(&(lcw->lcw_hooks), hook, lcwh_entry);
+		free(hook);
+	}
+
+	snap = atomic_load(&(lcw->lcw_current));
+	lattutil_config_snapshot_release(&snap);
+
+	if (lcw->lcw_notify >= 0) {
+		close(lcw->lcw_notify);
+	}
+	if (lcw->lcw_dirfd >= 0) {
+		close(lcw->lcw_dirfd);
+	}
+	if (lcw->lcw_file >= 0) {
+		close(lcw->lcw_file);
+	}
+	if (lcw->lcw_wake[0] >= 0) {
+		close(lcw->lcw_wake[0]);
+		close(lcw->lcw_wake[1]);
+	}
+
+	pthread_mutex_destroy(&(lcw->lcw_mtx));
+	free(lcw->lcw_dir);
+	free(lcw->lcw_path);
+	free(lcw);
+}
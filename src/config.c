@@ -28,15 +28,49 @@
 #include <unistd.h>
 
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include "liblattutil.h"
 
+static lattutil_config_path_t *_lattutil_find_config(const char **, size_t,
+    const char *, int, bool, const char *);
+static bool _lattutil_config_parse_mapped(lattutil_config_path_t *);
+
 EXPORTED_SYM
 lattutil_config_path_t *
 lattutil_find_config(const char **paths, size_t npaths,
     const char *filename, int flags)
 {
+
+	return (_lattutil_find_config(paths, npaths, filename, flags, false,
+	    NULL));
+}
+
+EXPORTED_SYM
+lattutil_config_path_t *
+lattutil_find_config_mapped(const char **paths, size_t npaths,
+    const char *filename, int flags)
+{
+
+	return (_lattutil_find_config(paths, npaths, filename, flags, true,
+	    NULL));
+}
+
+EXPORTED_SYM
+lattutil_config_path_t *
+lattutil_find_config_image(const char **paths, size_t npaths,
+    const char *filename, int flags, const char *image)
+{
+
+	return (_lattutil_find_config(paths, npaths, filename, flags, true,
+	    image));
+}
+
+static lattutil_config_path_t *
+_lattutil_find_config(const char **paths, size_t npaths,
+    const char *filename, int flags, bool mapped, const char *image)
+{
 	lattutil_config_path_t *res;
 	size_t i, sz;
 
@@ -70,7 +104,14 @@ lattutil_find_config(const char **paths, size_t npaths,
 			continue;
 		}
 
-		res->l_parser = ucl_parser_new(UCL_PARSER_KEY_LOWERCASE);
+		if (image != NULL && S_ISREG(res->l_sb.st_mode) &&
+		    lattutil_config_image_load(res, image)) {
+			res->l_rootobj = ucl_parser_get_object(res->l_parser);
+			break;
+		}
+
+		res->l_parser = ucl_parser_new(UCL_PARSER_KEY_LOWERCASE |
+		    (mapped ? UCL_PARSER_ZEROCOPY : 0));
 		if (res->l_parser == NULL) {
 			free(res->l_path);
 			close(res->l_fd);
@@ -78,7 +119,9 @@ lattutil_find_config(const char **paths, size_t npaths,
 			return (NULL);
 		}
 
-		if (!ucl_parser_add_fd(res->l_parser, res->l_fd)) {
+		if (mapped && S_ISREG(res->l_sb.st_mode) ?
+		    !_lattutil_config_parse_mapped(res) :
+		    !ucl_parser_add_fd(res->l_parser, res->l_fd)) {
 			close(res->l_fd);
 			free(res->l_path);
 			res->l_path = NULL;
@@ -109,10 +152,18 @@ lattutil_free_config_path(lattutil_config_path_t **obj)
 	}
 	free((*obj)->l_path);
 	(*obj)->l_path = NULL;
+	if ((*obj)->l_rootobj != NULL) {
+		ucl_object_unref((ucl_object_t *)(*obj)->l_rootobj);
+		(*obj)->l_rootobj = NULL;
+	}
 	if ((*obj)->l_parser != NULL) {
 		ucl_parser_free((*obj)->l_parser);
 		(*obj)->l_parser = NULL;
 	}
+	if ((*obj)->l_map != NULL) {
+		munmap((*obj)->l_map, (*obj)->l_mapsz);
+		(*obj)->l_map = NULL;
+	}
 	if ((*obj)->l_fd >= 0) {
 		close((*obj)->l_fd);
 		(*obj)->l_fd = -1;
@@ -123,6 +174,44 @@ lattutil_free_config_path(lattutil_config_path_t **obj)
 	*obj = NULL; /* Prevent UAF */
 }
 
+/*
+ * Parse straight out of a read-only mapping of the file. The parser
+ * runs in zero-copy mode, so the tree refers into the mapping rather
+ * than to a heap copy of the file, and the mapping lives as long as
+ * the config path object. MAP_PRIVATE does not make this a snapshot:
+ * pages not yet read still come from the file, and libucl keeps keys
+ * in place as well as values, so copying the strings out would not
+ * make an in-place rewrite safe either. Callers must replace the file
+ * by rename(2) while a tree is alive, as documented in the header.
+ */
+static bool
+_lattutil_config_parse_mapped(lattutil_config_path_t *res)
+{
+	void *map;
+	size_t sz;
+
+	sz = (size_t)res->l_sb.st_size;
+	if (sz == 0) {
+		return (ucl_parser_add_chunk(res->l_parser, NULL, 0));
+	}
+
+	map = mmap(NULL, sz, PROT_READ, MAP_PRIVATE, res->l_fd, 0);
+	if (map == MAP_FAILED) {
+		return (false);
+	}
+	posix_madvise(map, sz, POSIX_MADV_SEQUENTIAL);
+
+	if (!ucl_parser_add_chunk(res->l_parser, map, sz)) {
+		munmap(map, sz);
+		return (false);
+	}
+
+	res->l_map = map;
+	res->l_mapsz = sz;
+
+	return (true);
+}
+
 EXPORTED_SYM
 void
 lattutil_config_set_aux(lattutil_config_path_t *obj, void *aux, size_t sz)
@@ -204,7 +293,11 @@ lattutil_find_config_string(const ucl_object_t *root, const char *path,
 		return (strdup(""));
 	}
 
-	return (strdup(""));
+	if (ucl_object_type(obj) != UCL_STRING) {
+		return (strdup(def != NULL ? def : ""));
+	}
+
+	return (strdup(ucl_object_tostring(obj)));
 }
 
 EXPORTED_SYM
@@ -0,0 +1,587 @@
+/*-
+ * Copyright (c) 2021 Shawn Webb <shawn.webb@hardenedbsd.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "liblattutil.h"
+
+/*
+ * Bounded multi-producer ring based on Dmitry Vyukov's MPMC queue.
+ * Each slot carries a sequence number that tells producers and the
+ * consumer whether the slot is free or holds a published message.
+ * Producers only ever touch the mutex and condition variables when
+ * the ring is full (LATTUTIL_LOG_ASYNC_BLOCK) or the drain thread is
+ * asleep.
+ */
+
+typedef struct _lattutil_log_async_slot {
+	_Atomic(size_t)		 las_seq;
+	lattutil_log_level_t	 las_level;
+	size_t			 las_len;
+	char			 las_msg[LATTUTIL_LOG_ASYNC_MSGSZ];
+} lattutil_log_async_slot_t;
+
+typedef struct _lattutil_log_async {
+	lattutil_log_t			*la_inner;
+	lattutil_log_async_slot_t	*la_slots;
+	size_t				 la_mask;
+	int				 la_policy;
+	_Atomic(size_t)			 la_head;
+	_Atomic(size_t)			 la_tail;
+	_Atomic(uint64_t)		 la_dropped;
+	_Atomic(bool)			 la_stop;
+	_Atomic(bool)			 la_sleeping;
+	_Atomic(unsigned int)		 la_waiters;
+	pthread_t			 la_thread;
+	pthread_mutex_t			 la_mtx;
+	pthread_cond_t			 la_drain_cv;
+	pthread_cond_t			 la_space_cv;
+} lattutil_log_async_t;
+
+static lattutil_log_async_slot_t *_lattutil_log_async_claim(
+    lattutil_log_async_t *, size_t *);
+static lattutil_log_async_slot_t *_lattutil_log_async_take(
+    lattutil_log_async_t *, size_t *);
+static void _lattutil_log_async_release(lattutil_log_async_slot_t *,
+    size_t);
+static lattutil_log_async_slot_t *_lattutil_log_async_reserve(
+    lattutil_log_async_t *, size_t *);
+static void _lattutil_log_async_publish(lattutil_log_async_t *,
+    lattutil_log_async_slot_t *, size_t);
+static ssize_t _lattutil_log_async_vpush(lattutil_log_t *,
+    lattutil_log_level_t, const char *, va_list);
+static size_t _lattutil_log_async_drain(lattutil_log_async_t *);
+static void *_lattutil_log_async_thread(void *);
+static void _lattutil_log_async_timeout(struct timespec *, long);
+
+EXPORTED_SYM
+bool
+lattutil_log_async_init(lattutil_log_t *logp, lattutil_log_t *inner,
+    size_t capacity, int policy)
+{
+	lattutil_log_async_t *async;
+	size_t i, nslots;
+
+	if (logp == NULL || inner == NULL || logp == inner ||
+	    inner->ll_log_emit == NULL || capacity == 0) {
+		return (false);
+	}
+
+	switch (policy) {
+	case LATTUTIL_LOG_ASYNC_BLOCK:
+	case LATTUTIL_LOG_ASYNC_DROP_NEWEST:
+	case LATTUTIL_LOG_ASYNC_DROP_OLDEST:
+		break;
+	default:
+		return (false);
+	}
+
+	nslots = 2;
+	while (nslots < capacity) {
+		if (nslots > SIZE_MAX / 2) {
+			return (false);
+		}
+		nslots <<= 1;
+	}
+
+	async = calloc(1, sizeof(*async));
+	if (async == NULL) {
+		return (false);
+	}
+
+	async->la_slots = calloc(nslots, sizeof(*(async->la_slots)));
+	if (async->la_slots == NULL) {
+		free(async);
+		return (false);
+	}
+
+	for (i = 0; i < nslots; i++) {
+		atomic_init(&(async->la_slots[i].las_seq), i);
+	}
+
+	async->la_inner = inner;
+	async->la_mask = nslots - 1;
+	async->la_policy = policy;
+	atomic_init(&(async->la_head), 0);
+	atomic_init(&(async->la_tail), 0);
+	atomic_init(&(async->la_dropped), 0);
+	atomic_init(&(async->la_stop), false);
+	atomic_init(&(async->la_sleeping), false);
+	atomic_init(&(async->la_waiters), 0);
+
+	pthread_mutex_init(&(async->la_mtx), NULL);
+	pthread_cond_init(&(async->la_drain_cv), NULL);
+	pthread_cond_init(&(async->la_space_cv), NULL);
+
+	if (pthread_create(&(async->la_thread), NULL,
+	    _lattutil_log_async_thread, async)) {
+		pthread_cond_destroy(&(async->la_space_cv));
+		pthread_cond_destroy(&(async->la_drain_cv));
+		pthread_mutex_destroy(&(async->la_mtx));
+		free(async->la_slots);
+		free(async);
+		return (false);
+	}
+
+	if (logp->ll_log_close != NULL) {
+		logp->ll_log_close(logp);
+	}
+
+	logp->ll_internalaux = async;
+	logp->ll_internalauxsz = sizeof(*async);
+
+	logp->ll_log_close = lattutil_log_async_close;
+	logp->ll_log_debug = lattutil_log_async_debug;
+	logp->ll_log_err = lattutil_log_async_err;
+	logp->ll_log_info = lattutil_log_async_info;
+	logp->ll_log_warn = lattutil_log_async_warn;
+	logp->ll_log_emit = lattutil_log_async_emit;
+
+	lattutil_log_apply_levels(logp);
+
+	return (true);
+}
+
+EXPORTED_SYM
+uint64_t
+lattutil_log_async_dropped(lattutil_log_t *logp)
+{
+	lattutil_log_async_t *async;
+
+	if (logp == NULL || logp->ll_log_close != lattutil_log_async_close) {
+		return (0);
+	}
+
+	async = logp->ll_internalaux;
+
+	return (atomic_load_explicit(&(async->la_dropped),
+	    memory_order_relaxed));
+}
+
+ssize_t
+lattutil_log_async_debug(lattutil_log_t *logp, int verbose,
+    const char *fmt, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_async_vpush(logp, LATTUTIL_LOG_LEVEL_DEBUG,
+		    fmt, args);
+		va_end(args);
+	}
+
+	return (len);
+}
+
+ssize_t
+lattutil_log_async_err(lattutil_log_t *logp, int verbose,
+    const char *fmt, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_async_vpush(logp, LATTUTIL_LOG_LEVEL_ERR,
+		    fmt, args);
+		va_end(args);
+	}
+
+	return (len);
+}
+
+ssize_t
+lattutil_log_async_info(lattutil_log_t *logp, int verbose,
+    const char *fmt, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_async_vpush(logp, LATTUTIL_LOG_LEVEL_INFO,
+		    fmt, args);
+		va_end(args);
+	}
+
+	return (len);
+}
+
+ssize_t
+lattutil_log_async_warn(lattutil_log_t *logp, int verbose,
+    const char *fmt, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_async_vpush(logp, LATTUTIL_LOG_LEVEL_WARN,
+		    fmt, args);
+		va_end(args);
+	}
+
+	return (len);
+}
+
+ssize_t
+lattutil_log_async_emit(lattutil_log_t *logp, lattutil_log_level_t level,
+    const char *msg, size_t len)
+{
+	lattutil_log_async_slot_t *slot;
+	lattutil_log_async_t *async;
+	size_t pos;
+
+	async = logp->ll_internalaux;
+
+	slot = _lattutil_log_async_reserve(async, &pos);
+	if (slot == NULL) {
+		return (0);
+	}
+
+	slot->las_level = level;
+	slot->las_len = len;
+	if (slot->las_len >= sizeof(slot->las_msg)) {
+		slot->las_len = sizeof(slot->las_msg) - 1;
+	}
+	memcpy(slot->las_msg, msg, slot->las_len);
+	slot->las_msg[slot->las_len] = '\0';
+
+	_lattutil_log_async_publish(async, slot, pos);
+
+	return (len);
+}
+
+void
+lattutil_log_async_close(lattutil_log_t *logp)
+{
+	lattutil_log_async_t *async;
+
+	async = logp->ll_internalaux;
+	if (async == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&(async->la_mtx));
+	atomic_store(&(async->la_stop), true);
+	pthread_cond_signal(&(async->la_drain_cv));
+	pthread_mutex_unlock(&(async->la_mtx));
+
+	/* The drain thread empties the ring before exiting. */
+	pthread_join(async->la_thread, NULL);
+
+	lattutil_log_free(&(async->la_inner));
+
+	pthread_cond_destroy(&(async->la_space_cv));
+	pthread_cond_destroy(&(async->la_drain_cv));
+	pthread_mutex_destroy(&(async->la_mtx));
+	free(async->la_slots);
+	memset(async, 0, sizeof(*async));
+	free(async);
+
+	logp->ll_internalaux = NULL;
+	logp->ll_internalauxsz = 0;
+}
+
+/*
+ * Claim a free slot for a producer. Returns NULL when the ring is
+ * full. The slot is published by _lattutil_log_async_release().
+ */
+static lattutil_log_async_slot_t *
+_lattutil_log_async_claim(lattutil_log_async_t *async, size_t *posp)
+{
+	lattutil_log_async_slot_t *slot;
+	size_t pos, seq;
+	intptr_t diff;
+
+	pos = atomic_load_explicit(&(async->la_head), memory_order_relaxed);
+	for (;;) {
+		slot = &(async->la_slots[pos & async->la_mask]);
+		seq = atomic_load_explicit(&(slot->las_seq),
+		    memory_order_acquire);
+		diff = (intptr_t)seq - (intptr_t)pos;
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(
+			    &(async->la_head), &pos, pos + 1,
+			    memory_order_relaxed, memory_order_relaxed)) {
+				*posp = pos;
+				return (slot);
+			}
+		} else if (diff < 0) {
+			return (NULL);
+		} else {
+			pos = atomic_load_explicit(&(async->la_head),
+			    memory_order_relaxed);
+		}
+	}
+}
+
+/*
+ * Take the oldest published slot. Returns NULL when the ring is
+ * empty. The slot is handed back with _lattutil_log_async_release().
+ */
+static lattutil_log_async_slot_t *
+_lattutil_log_async_take(lattutil_log_async_t *async, size_t *posp)
+{
+	lattutil_log_async_slot_t *slot;
+	size_t pos, seq;
+	intptr_t diff;
+
+	pos = atomic_load_explicit(&(async->la_tail), memory_order_relaxed);
+	for (;;) {
+		slot = &(async->la_slots[pos & async->la_mask]);
+		seq = atomic_load_explicit(&(slot->las_seq),
+		    memory_order_acquire);
+		diff = (intptr_t)seq - (intptr_t)(pos + 1);
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(
+			    &(async->la_tail), &pos, pos + 1,
+			    memory_order_relaxed, memory_order_relaxed)) {
+				*posp = pos;
+				return (slot);
+			}
+		} else if (diff < 0) {
+			return (NULL);
+		} else {
+			pos = atomic_load_explicit(&(async->la_tail),
+			    memory_order_relaxed);
+		}
+	}
+}
+
+static void
+_lattutil_log_async_release(lattutil_log_async_slot_t *slot, size_t seq)
+{
+
+	atomic_store_explicit(&(slot->las_seq), seq, memory_order_release);
+}
+
+/*
+ * Reserve a slot for a new message, applying the overflow policy when
+ * the ring is full. Returns NULL if the message is to be dropped.
+ */
+static lattutil_log_async_slot_t *
+_lattutil_log_async_reserve(lattutil_log_async_t *async, size_t *posp)
+{
+	lattutil_log_async_slot_t *slot, *old;
+	size_t head, oldpos, tail;
+	struct timespec ts;
+
+	for (;;) {
+		slot = _lattutil_log_async_claim(async, posp);
+		if (slot != NULL) {
+			return (slot);
+		}
+
+		switch (async->la_policy) {
+		case LATTUTIL_LOG_ASYNC_DROP_NEWEST:
+			atomic_fetch_add_explicit(&(async->la_dropped), 1,
+			    memory_order_relaxed);
+			return (NULL);
+		case LATTUTIL_LOG_ASYNC_DROP_OLDEST:
+			/*
+			 * Evicting only frees the slot we need if the oldest
+			 * message is still queued. If the drain thread is
+			 * writing it out, evicting the others would empty
+			 * the ring and spin until the inner logger returns,
+			 * so drop the new message instead.
+			 */
+			head = atomic_load_explicit(&(async->la_head),
+			    memory_order_relaxed);
+			tail = atomic_load_explicit(&(async->la_tail),
+			    memory_order_relaxed);
+			old = NULL;
+			if (head - tail == async->la_mask + 1) {
+				old = _lattutil_log_async_take(async, &oldpos);
+			}
+			atomic_fetch_add_explicit(&(async->la_dropped), 1,
+			    memory_order_relaxed);
+			if (old == NULL) {
+				return (NULL);
+			}
+			_lattutil_log_async_release(old,
+			    oldpos + async->la_mask + 1);
+			break;
+		default:
+			/*
+			 * The timeout guards against a wakeup lost between
+			 * the failed claim and the wait.
+			 */
+			pthread_mutex_lock(&(async->la_mtx));
+			atomic_fetch_add(&(async->la_waiters), 1);
+			pthread_cond_signal(&(async->la_drain_cv));
+			_lattutil_log_async_timeout(&ts, 10);
+			pthread_cond_timedwait(&(async->la_space_cv),
+			    &(async->la_mtx), &ts);
+			atomic_fetch_sub(&(async->la_waiters), 1);
+			pthread_mutex_unlock(&(async->la_mtx));
+			break;
+		}
+	}
+}
+
+static void
+_lattutil_log_async_publish(lattutil_log_async_t *async,
+    lattutil_log_async_slot_t *slot, size_t pos)
+{
+
+	_lattutil_log_async_release(slot, pos + 1);
+
+	/* Pairs with the fence in the drain thread before it sleeps. */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&(async->la_sleeping),
+	    memory_order_relaxed)) {
+		pthread_mutex_lock(&(async->la_mtx));
+		pthread_cond_signal(&(async->la_drain_cv));
+		pthread_mutex_unlock(&(async->la_mtx));
+	}
+}
+
+static ssize_t
+_lattutil_log_async_vpush(lattutil_log_t *logp, lattutil_log_level_t level,
+    const char *fmt, va_list args)
+{
+	lattutil_log_async_slot_t *slot;
+	lattutil_log_async_t *async;
+	size_t pos;
+	int res;
+
+	async = logp->ll_internalaux;
+
+	slot = _lattutil_log_async_reserve(async, &pos);
+	if (slot == NULL) {
+		return (0);
+	}
+
+	res = lattutil_log_vsnprintf(slot->las_msg, sizeof(slot->las_msg), fmt,
+	    args);
+	if (res < 0) {
+		res = 0;
+		slot->las_msg[0] = '\0';
+	}
+
+	slot->las_level = level;
+	slot->las_len = res;
+	if (slot->las_len >= sizeof(slot->las_msg)) {
+		slot->las_len = sizeof(slot->las_msg) - 1;
+	}
+
+	_lattutil_log_async_publish(async, slot, pos);
+
+	return (res);
+}
+
+static size_t
+_lattutil_log_async_drain(lattutil_log_async_t *async)
+{
+	lattutil_log_async_slot_t *slot;
+	lattutil_log_t *inner;
+	size_t n, pos;
+
+	inner = async->la_inner;
+	n = 0;
+
+	while ((slot = _lattutil_log_async_take(async, &pos)) != NULL) {
+		inner->ll_log_emit(inner, slot->las_level, slot->las_msg,
+		    slot->las_len);
+		_lattutil_log_async_release(slot, pos + async->la_mask + 1);
+		n++;
+	}
+
+	if (n > 0 && atomic_load(&(async->la_waiters)) > 0) {
+		pthread_mutex_lock(&(async->la_mtx));
+		pthread_cond_broadcast(&(async->la_space_cv));
+		pthread_mutex_unlock(&(async->la_mtx));
+	}
+
+	return (n);
+}
+
+static void *
+_lattutil_log_async_thread(void *arg)
+{
+	lattutil_log_async_t *async;
+	struct timespec ts;
+
+	async = arg;
+
+	for (;;) {
+		if (_lattutil_log_async_drain(async) > 0) {
+			continue;
+		}
+
+		if (atomic_load(&(async->la_stop))) {
+			/* Pick up anything published during the last pass. */
+			_lattutil_log_async_drain(async);
+			break;
+		}
+
+		pthread_mutex_lock(&(async->la_mtx));
+		atomic_store_explicit(&(async->la_sleeping), true,
+		    memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+		if (atomic_load_explicit(&(async->la_head),
+		    memory_order_relaxed) ==
+		    atomic_load_explicit(&(async->la_tail),
+		    memory_order_relaxed) &&
+		    !atomic_load(&(async->la_stop))) {
+			_lattutil_log_async_timeout(&ts, 100);
+			pthread_cond_timedwait(&(async->la_drain_cv),
+			    &(async->la_mtx), &ts);
+		}
+		atomic_store_explicit(&(async->la_sleeping), false,
+		    memory_order_relaxed);
+		pthread_mutex_unlock(&(async->la_mtx));
+	}
+
+	return (NULL);
+}
+
+static void
+_lattutil_log_async_timeout(struct timespec *ts, long ms)
+{
+
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
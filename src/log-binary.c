@@ -0,0 +1,1182 @@
+/*-
+ * Copyright (c) 2021 Shawn Webb <shawn.webb@hardenedbsd.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "liblattutil.h"
+
+/*
+ * Binary log format
+ *
+ * The file starts with an 8-byte magic followed by a 32-bit byte
+ * order marker. Every record starts with a one-byte type:
+ *
+ *   FORMAT: u32 site id, u32 length, format string bytes
+ *   LOG:    u8 level, u32 site id, u64 timestamp (ns), u32 payload
+ *           length, payload
+ *   TEXT:   u8 level, u64 timestamp (ns), u32 length, message bytes
+ *
+ * A LOG payload holds the raw arguments in order: integers and
+ * pointers as 64-bit values, floating point values as doubles, and
+ * strings as a u32 length followed by the bytes. A FORMAT record is
+ * always written before the first LOG record that references it.
+ * TEXT records carry preformatted messages and messages whose format
+ * string cannot be deferred (%n, wide strings, too many arguments,
+ * conversions longer than LATTUTIL_LOG_BINARY_MAXSPEC). A message
+ * with a string argument longer than LATTUTIL_LOG_BINARY_MAXSTR is
+ * also stored as TEXT, so that it is never cut short. A TEXT message
+ * that does not fit in the buffer is cut to fit, and its level byte
+ * carries LATTUTIL_LOG_BINARY_TRUNCATED so the decoder can say so.
+ *
+ * Values are stored in host byte order.
+ */
+
+#define	LATTUTIL_LOG_BINARY_MAGIC	"LLBLOG\0\1"
+#define	LATTUTIL_LOG_BINARY_BOM		0x01020304U
+
+#define	LATTUTIL_LOG_BINARY_REC_FORMAT	1
+#define	LATTUTIL_LOG_BINARY_REC_LOG	2
+#define	LATTUTIL_LOG_BINARY_REC_TEXT	3
+
+#define	LATTUTIL_LOG_BINARY_MAXARGS	16
+#define	LATTUTIL_LOG_BINARY_MAXSTR	4096
+#define	LATTUTIL_LOG_BINARY_MAXSPEC	64
+#define	LATTUTIL_LOG_BINARY_MAXSITES	4096
+#define	LATTUTIL_LOG_BINARY_BUFSZ	(128 * 1024)
+#define	LATTUTIL_LOG_BINARY_FLUSH_NS	1000000000ULL
+
+#define	LATTUTIL_LOG_BINARY_HDRSZ	(1 + 1 + 4 + 8 + 4)
+
+#define	LATTUTIL_LOG_BINARY_TRUNCATED	0x40
+
+typedef enum _lattutil_log_binary_arg {
+	LLBA_INT = 1,
+	LLBA_UINT,
+	LLBA_LONG,
+	LLBA_ULONG,
+	LLBA_LLONG,
+	LLBA_ULLONG,
+	LLBA_SIZE,
+	LLBA_INTMAX,
+	LLBA_UINTMAX,
+	LLBA_PTRDIFF,
+	LLBA_DOUBLE,
+	LLBA_LDOUBLE,
+	LLBA_STR,
+	LLBA_PTR,
+} lattutil_log_binary_arg_t;
+
+typedef struct _lattutil_log_binary_spec {
+	lattutil_log_binary_arg_t	 lbsp_type;
+	int				 lbsp_nstars;
+	int				 lbsp_prec;	/* -1: none, -2: '*' */
+} lattutil_log_binary_spec_t;
+
+typedef struct _lattutil_log_binary_site {
+	_Atomic(const char *)		 lbs_fmt;
+	uint32_t			 lbs_id;
+	int				 lbs_nspecs;
+	lattutil_log_binary_spec_t	 lbs_specs[LATTUTIL_LOG_BINARY_MAXARGS];
+} lattutil_log_binary_site_t;
+
+typedef struct _lattutil_log_binary {
+	int				 lb_fd;
+	pthread_mutex_t			 lb_mtx;
+	char				*lb_buf;
+	size_t				 lb_len;
+	uint64_t			 lb_lastflush;
+	uint32_t			 lb_nextid;
+	lattutil_log_binary_site_t	*lb_sites;
+} lattutil_log_binary_t;
+
+static int _lattutil_log_binary_parse(const char *,
+    lattutil_log_binary_spec_t *, int);
+static const char *_lattutil_log_binary_next_spec(const char *, size_t *,
+    lattutil_log_binary_spec_t *, int *);
+static lattutil_log_binary_site_t *_lattutil_log_binary_site(
+    lattutil_log_binary_t *, const char *);
+static bool _lattutil_log_binary_reserve(lattutil_log_binary_t *, size_t);
+static void _lattutil_log_binary_put(lattutil_log_binary_t *, const void *,
+    size_t);
+static int _lattutil_log_binary_flush_locked(lattutil_log_binary_t *);
+static uint64_t _lattutil_log_binary_now(void);
+static ssize_t _lattutil_log_binary_text(lattutil_log_binary_t *,
+    lattutil_log_level_t, uint64_t, const char *, size_t);
+static ssize_t _lattutil_log_binary_vtext(lattutil_log_binary_t *,
+    lattutil_log_level_t, uint64_t, const char *, va_list);
+static ssize_t _lattutil_log_binary_vlog(lattutil_log_t *,
+    lattutil_log_level_t, const char *, va_list);
+static bool _lattutil_log_binary_read(FILE *, void *, size_t);
+static void _lattutil_log_binary_print(FILE *, const char *,
+    const unsigned char *, size_t);
+
+EXPORTED_SYM
+bool
+lattutil_log_binary_init(lattutil_log_t *logp, const char *path)
+{
+	lattutil_log_binary_t *lb;
+	uint32_t bom;
+
+	if (logp == NULL || path == NULL) {
+		return (false);
+	}
+
+	lb = calloc(1, sizeof(*lb));
+	if (lb == NULL) {
+		return (false);
+	}
+
+	lb->lb_buf = malloc(LATTUTIL_LOG_BINARY_BUFSZ);
+	lb->lb_sites = calloc(LATTUTIL_LOG_BINARY_MAXSITES,
+	    sizeof(*(lb->lb_sites)));
+	if (lb->lb_buf == NULL || lb->lb_sites == NULL) {
+		free(lb->lb_sites);
+		free(lb->lb_buf);
+		free(lb);
+		return (false);
+	}
+
+	lb->lb_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+	    0644);
+	if (lb->lb_fd < 0) {
+		free(lb->lb_sites);
+		free(lb->lb_buf);
+		free(lb);
+		return (false);
+	}
+
+	pthread_mutex_init(&(lb->lb_mtx), NULL);
+
+	bom = LATTUTIL_LOG_BINARY_BOM;
+	_lattutil_log_binary_put(lb, LATTUTIL_LOG_BINARY_MAGIC, 8);
+	_lattutil_log_binary_put(lb, &bom, sizeof(bom));
+	lb->lb_lastflush = _lattutil_log_binary_now();
+
+	if (logp->ll_log_close != NULL) {
+		logp->ll_log_close(logp);
+	}
+
+	logp->ll_internalaux = lb;
+	logp->ll_internalauxsz = sizeof(*lb);
+
+	logp->ll_log_close = lattutil_log_binary_close;
+	logp->ll_log_debug = lattutil_log_binary_debug;
+	logp->ll_log_err = lattutil_log_binary_err;
+	logp->ll_log_info = lattutil_log_binary_info;
+	logp->ll_log_warn = lattutil_log_binary_warn;
+	logp->ll_log_emit = lattutil_log_binary_emit;
+
+	lattutil_log_apply_levels(logp);
+
+	return (true);
+}
+
+EXPORTED_SYM
+bool
+lattutil_log_binary_flush(lattutil_log_t *logp)
+{
+	lattutil_log_binary_t *lb;
+	int res;
+
+	if (logp == NULL || logp->ll_log_close != lattutil_log_binary_close) {
+		return (false);
+	}
+
+	lb = logp->ll_internalaux;
+
+	pthread_mutex_lock(&(lb->lb_mtx));
+	res = _lattutil_log_binary_flush_locked(lb);
+	pthread_mutex_unlock(&(lb->lb_mtx));
+
+	return (res == 0);
+}
+
+ssize_t
+lattutil_log_binary_debug(lattutil_log_t *logp, int verbose,
+    const char *fmt, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_binary_vlog(logp,
+		    LATTUTIL_LOG_LEVEL_DEBUG, fmt, args);
+		va_end(args);
+	}
+
+	return (len);
+}
+
+ssize_t
+lattutil_log_binary_err(lattutil_log_t *logp, int verbose,
+    const char *fmt, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_binary_vlog(logp,
+		    LATTUTIL_LOG_LEVEL_ERR, fmt, args);
+		va_end(args);
+	}
+
+	return (len);
+}
+
+ssize_t
+lattutil_log_binary_info(lattutil_log_t *logp, int verbose,
+    const char *fmt, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_binary_vlog(logp,
+		    LATTUTIL_LOG_LEVEL_INFO, fmt, args);
+		va_end(args);
+	}
+
+	return (len);
+}
+
+ssize_t
+lattutil_log_binary_warn(lattutil_log_t *logp, int verbose,
+    const char *fmt, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_binary_vlog(logp,
+		    LATTUTIL_LOG_LEVEL_WARN, fmt, args);
+		va_end(args);
+	}
+
+	return (len);
+}
+
+ssize_t
+lattutil_log_binary_emit(lattutil_log_t *logp, lattutil_log_level_t level,
+    const char *msg, size_t len)
+{
+
+	return (_lattutil_log_binary_text(logp->ll_internalaux, level,
+	    _lattutil_log_binary_now(), msg, len));
+}
+
+void
+lattutil_log_binary_close(lattutil_log_t *logp)
+{
+	lattutil_log_binary_t *lb;
+
+	lb = logp->ll_internalaux;
+	if (lb == NULL) {
+		return;
+	}
+
+	_lattutil_log_binary_flush_locked(lb);
+	close(lb->lb_fd);
+
+	pthread_mutex_destroy(&(lb->lb_mtx));
+	free(lb->lb_sites);
+	free(lb->lb_buf);
+	memset(lb, 0, sizeof(*lb));
+	free(lb);
+
+	logp->ll_internalaux = NULL;
+	logp->ll_internalauxsz = 0;
+}
+
+EXPORTED_SYM
+bool
+lattutil_log_binary_decode(FILE *in, FILE *out, int flags)
+{
+	lattutil_log_binary_spec_t specs[LATTUTIL_LOG_BINARY_MAXARGS];
+	unsigned char *payload;
+	char magic[8], stamp[32];
+	uint32_t bom, id, len;
+	uint8_t type, level;
+	off_t insz, off;
+	struct stat sb;
+	uint64_t ts;
+	struct tm tm;
+	time_t secs;
+	char **fmts;
+	size_t i;
+	bool ret, truncated;
+
+	if (in == NULL || out == NULL) {
+		return (false);
+	}
+
+	if (!_lattutil_log_binary_read(in, magic, sizeof(magic)) ||
+	    memcmp(magic, LATTUTIL_LOG_BINARY_MAGIC, sizeof(magic)) ||
+	    !_lattutil_log_binary_read(in, &bom, sizeof(bom)) ||
+	    bom != LATTUTIL_LOG_BINARY_BOM) {
+		return (false);
+	}
+
+	/*
+	 * Record lengths come from the file, so bound them by what is
+	 * left of it when that is known. No writer emits a record larger
+	 * than its buffer either way.
+	 */
+	insz = -1;
+	if (fstat(fileno(in), &sb) == 0 && S_ISREG(sb.st_mode)) {
+		insz = sb.st_size;
+	}
+
+	ret = true;
+	fmts = NULL;
+	payload = NULL;
+
+	while (_lattutil_log_binary_read(in, &type, sizeof(type))) {
+		level = LATTUTIL_LOG_LEVEL_MAX;
+		ts = 0;
+		id = 0;
+		truncated = false;
+
+		switch (type) {
+		case LATTUTIL_LOG_BINARY_REC_FORMAT:
+			if (!_lattutil_log_binary_read(in, &id, sizeof(id)) ||
+			    !_lattutil_log_binary_read(in, &len, sizeof(len))) {
+				ret = false;
+				goto end;
+			}
+			break;
+		case LATTUTIL_LOG_BINARY_REC_LOG:
+			if (!_lattutil_log_binary_read(in, &level,
+			    sizeof(level)) ||
+			    !_lattutil_log_binary_read(in, &id, sizeof(id)) ||
+			    !_lattutil_log_binary_read(in, &ts, sizeof(ts)) ||
+			    !_lattutil_log_binary_read(in, &len, sizeof(len))) {
+				ret = false;
+				goto end;
+			}
+			break;
+		case LATTUTIL_LOG_BINARY_REC_TEXT:
+			if (!_lattutil_log_binary_read(in, &level,
+			    sizeof(level)) ||
+			    !_lattutil_log_binary_read(in, &ts, sizeof(ts)) ||
+			    !_lattutil_log_binary_read(in, &len, sizeof(len))) {
+				ret = false;
+				goto end;
+			}
+			truncated =
+			    (level & LATTUTIL_LOG_BINARY_TRUNCATED) != 0;
+			level &= ~LATTUTIL_LOG_BINARY_TRUNCATED;
+			break;
+		default:
+			ret = false;
+			goto end;
+		}
+
+		if (type != LATTUTIL_LOG_BINARY_REC_TEXT &&
+		    id >= LATTUTIL_LOG_BINARY_MAXSITES) {
+			ret = false;
+			goto end;
+		}
+		if (len > LATTUTIL_LOG_BINARY_BUFSZ) {
+			ret = false;
+			goto end;
+		}
+		if (insz >= 0) {
+			off = ftello(in);
+			if (off < 0 || len > insz - off) {
+				ret = false;
+				goto end;
+			}
+		}
+
+		payload = malloc((size_t)len + 1);
+		if (payload == NULL ||
+		    !_lattutil_log_binary_read(in, payload, len)) {
+			ret = false;
+			goto end;
+		}
+		payload[len] = '\0';
+
+		if (type == LATTUTIL_LOG_BINARY_REC_FORMAT) {
+			if (fmts == NULL) {
+				fmts = calloc(LATTUTIL_LOG_BINARY_MAXSITES,
+				    sizeof(*fmts));
+				if (fmts == NULL) {
+					ret = false;
+					goto end;
+				}
+			}
+			free(fmts[id]);
+			fmts[id] = (char *)payload;
+			payload = NULL;
+			continue;
+		}
+
+		if (LATTUTIL_LOG_LEVEL_BASE(level) >= LATTUTIL_LOG_LEVEL_MAX) {
+			ret = false;
+			goto end;
+		}
+
+		if ((flags & LATTUTIL_LOG_DECODE_TIMESTAMPS) != 0) {
+			secs = ts / 1000000000ULL;
+			localtime_r(&secs, &tm);
+			strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S",
+			    &tm);
+			fprintf(out, "%s.%06lu ", stamp,
+			    (unsigned long)((ts % 1000000000ULL) / 1000));
+		}
+
+		fputs(lattutil_log_level_prefix(level), out);
+		if (type == LATTUTIL_LOG_BINARY_REC_TEXT) {
+			fwrite(payload, 1, len, out);
+			if (truncated) {
+				fputs(" [truncated]", out);
+			}
+		} else {
+			if (fmts == NULL || fmts[id] == NULL ||
+			    _lattutil_log_binary_parse(fmts[id], specs,
+			    LATTUTIL_LOG_BINARY_MAXARGS) < 0) {
+				ret = false;
+				goto end;
+			}
+			_lattutil_log_binary_print(out, fmts[id], payload,
+			    len);
+		}
+		fputc('\n', out);
+
+		free(payload);
+		payload = NULL;
+	}
+
+end:
+	free(payload);
+	if (fmts != NULL) {
+		for (i = 0; i < LATTUTIL_LOG_BINARY_MAXSITES; i++) {
+			free(fmts[i]);
+		}
+		free(fmts);
+	}
+
+	return (ret);
+}
+
+/*
+ * Find the next conversion specification in a format string. Returns
+ * a pointer to the '%' starting it, or NULL at the end of the string.
+ * The length of the specification is stored in *lenp. *supported is
+ * cleared for conversions that cannot be deferred. "%%" is reported
+ * with a type of 0.
+ */
+static const char *
+_lattutil_log_binary_next_spec(const char *fmt, size_t *lenp,
+    lattutil_log_binary_spec_t *spec, int *supported)
+{
+	const char *p, *start;
+	int lmod;
+
+	start = strchr(fmt, '%');
+	if (start == NULL) {
+		return (NULL);
+	}
+
+	memset(spec, 0, sizeof(*spec));
+	spec->lbsp_prec = -1;
+	*supported = 1;
+
+	p = start + 1;
+	while (*p != '\0' && strchr("-+ #0'", *p) != NULL) {
+		p++;
+	}
+
+	if (*p == '*') {
+		spec->lbsp_nstars++;
+		p++;
+	} else {
+		while (*p >= '0' && *p <= '9') {
+			p++;
+		}
+	}
+
+	if (*p == '.') {
+		p++;
+		if (*p == '*') {
+			spec->lbsp_nstars++;
+			spec->lbsp_prec = -2;
+			p++;
+		} else {
+			spec->lbsp_prec = 0;
+			while (*p >= '0' && *p <= '9') {
+				spec->lbsp_prec = spec->lbsp_prec * 10 +
+				    (*p - '0');
+				p++;
+			}
+		}
+	}
+
+	/* 0: none, 1: l, 2: ll, 'j', 'z', 't', 'L', 'h' */
+	lmod = 0;
+	switch (*p) {
+	case 'h':
+		lmod = 'h';
+		p++;
+		if (*p == 'h') {
+			p++;
+		}
+		break;
+	case 'l':
+		lmod = 1;
+		p++;
+		if (*p == 'l') {
+			lmod = 2;
+			p++;
+		}
+		break;
+	case 'q':
+		lmod = 2;
+		p++;
+		break;
+	case 'j':
+	case 'z':
+	case 't':
+	case 'L':
+		lmod = *p;
+		p++;
+		break;
+	}
+
+	switch (*p) {
+	case '%':
+		spec->lbsp_type = 0;
+		break;
+	case 'd':
+	case 'i':
+	case 'o':
+	case 'u':
+	case 'x':
+	case 'X':
+	case 'c':
+		if (*p == 'c' && lmod != 0) {
+			*supported = 0;
+			break;
+		}
+		switch (lmod) {
+		case 1:
+			spec->lbsp_type = strchr("di", *p) ? LLBA_LONG :
+			    LLBA_ULONG;
+			break;
+		case 2:
+			spec->lbsp_type = strchr("di", *p) ? LLBA_LLONG :
+			    LLBA_ULLONG;
+			break;
+		case 'j':
+			spec->lbsp_type = strchr("di", *p) ? LLBA_INTMAX :
+			    LLBA_UINTMAX;
+			break;
+		case 'z':
+			spec->lbsp_type = LLBA_SIZE;
+			break;
+		case 't':
+			spec->lbsp_type = LLBA_PTRDIFF;
+			break;
+		case 'L':
+			*supported = 0;
+			break;
+		default:
+			spec->lbsp_type = strchr("di", *p) ? LLBA_INT :
+			    LLBA_UINT;
+			break;
+		}
+		break;
+	case 'e':
+	case 'E':
+	case 'f':
+	case 'F':
+	case 'g':
+	case 'G':
+	case 'a':
+	case 'A':
+		spec->lbsp_type = (lmod == 'L') ? LLBA_LDOUBLE : LLBA_DOUBLE;
+		break;
+	case 's':
+		if (lmod != 0) {
+			*supported = 0;
+		}
+		spec->lbsp_type = LLBA_STR;
+		break;
+	case 'p':
+		spec->lbsp_type = LLBA_PTR;
+		break;
+	default:
+		*supported = 0;
+		break;
+	}
+
+	if (*p != '\0') {
+		p++;
+	}
+
+	*lenp = p - start;
+
+	return (start);
+}
+
+/*
+ * Parse a format string into its conversions. Returns the number of
+ * conversions, or -1 if the format cannot be deferred.
+ */
+static int
+_lattutil_log_binary_parse(const char *fmt, lattutil_log_binary_spec_t *specs,
+    int maxspecs)
+{
+	lattutil_log_binary_spec_t spec;
+	int nspecs, supported;
+	const char *p;
+	size_t len;
+
+	nspecs = 0;
+	p = fmt;
+	while ((p = _lattutil_log_binary_next_spec(p, &len, &spec,
+	    &supported)) != NULL) {
+		p += len;
+		if (!supported || len >= LATTUTIL_LOG_BINARY_MAXSPEC) {
+			return (-1);
+		}
+		if (spec.lbsp_type == 0) {
+			continue;
+		}
+		if (nspecs == maxspecs) {
+			return (-1);
+		}
+		specs[nspecs++] = spec;
+	}
+
+	return (nspecs);
+}
+
+/*
+ * Look up the call site for a format string, registering it on first
+ * use. The format string's address identifies the call site.
+ * Lookups are lock-free; registration takes lb_mtx so that the
+ * FORMAT record is buffered before the site becomes visible.
+ */
+static lattutil_log_binary_site_t *
+_lattutil_log_binary_site(lattutil_log_binary_t *lb, const char *fmt)
+{
+	lattutil_log_binary_site_t *site;
+	const char *cur;
+	size_t h, i, len;
+	uint32_t len32;
+	uint8_t type;
+
+	h = ((uintptr_t)fmt >> 3) * 0x9e3779b97f4a7c15ULL;
+	for (i = 0; i < LATTUTIL_LOG_BINARY_MAXSITES; i++) {
+		site = &(lb->lb_sites[(h + i) &
+		    (LATTUTIL_LOG_BINARY_MAXSITES - 1)]);
+		cur = atomic_load_explicit(&(site->lbs_fmt),
+		    memory_order_acquire);
+		if (cur == fmt) {
+			return (site);
+		}
+		if (cur != NULL) {
+			continue;
+		}
+
+		pthread_mutex_lock(&(lb->lb_mtx));
+		cur = atomic_load_explicit(&(site->lbs_fmt),
+		    memory_order_relaxed);
+		if (cur != NULL) {
+			pthread_mutex_unlock(&(lb->lb_mtx));
+			if (cur == fmt) {
+				return (site);
+			}
+			continue;
+		}
+
+		site->lbs_nspecs = _lattutil_log_binary_parse(fmt,
+		    site->lbs_specs, LATTUTIL_LOG_BINARY_MAXARGS);
+		site->lbs_id = lb->lb_nextid++;
+
+		if (site->lbs_nspecs >= 0) {
+			len = strlen(fmt);
+			if (!_lattutil_log_binary_reserve(lb,
+			    1 + 4 + 4 + len)) {
+				site->lbs_nspecs = -1;
+			} else {
+				type = LATTUTIL_LOG_BINARY_REC_FORMAT;
+				len32 = len;
+				_lattutil_log_binary_put(lb, &type,
+				    sizeof(type));
+				_lattutil_log_binary_put(lb, &(site->lbs_id),
+				    sizeof(site->lbs_id));
+				_lattutil_log_binary_put(lb, &len32,
+				    sizeof(len32));
+				_lattutil_log_binary_put(lb, fmt, len);
+			}
+		}
+
+		atomic_store_explicit(&(site->lbs_fmt), fmt,
+		    memory_order_release);
+		pthread_mutex_unlock(&(lb->lb_mtx));
+
+		return (site);
+	}
+
+	return (NULL);
+}
+
+static ssize_t
+_lattutil_log_binary_vlog(lattutil_log_t *logp, lattutil_log_level_t level,
+    const char *fmt, va_list args)
+{
+	const char *strs[LATTUTIL_LOG_BINARY_MAXARGS];
+	uint32_t slens[LATTUTIL_LOG_BINARY_MAXARGS];
+	uint64_t vals[LATTUTIL_LOG_BINARY_MAXARGS];
+	uint64_t stars[LATTUTIL_LOG_BINARY_MAXARGS][2];
+	lattutil_log_binary_spec_t *spec;
+	lattutil_log_binary_site_t *site;
+	lattutil_log_binary_t *lb;
+	uint32_t id, payload;
+	uint64_t now;
+	uint8_t type, lvl;
+	size_t maxlen;
+	ssize_t len;
+	va_list cp;
+	double d;
+	int i, j;
+
+	lb = logp->ll_internalaux;
+	now = _lattutil_log_binary_now();
+
+	site = _lattutil_log_binary_site(lb, fmt);
+	if (site == NULL || site->lbs_nspecs < 0) {
+		return (_lattutil_log_binary_vtext(lb, level, now, fmt,
+		    args));
+	}
+
+	/*
+	 * Collect the arguments and size the record. The arguments are
+	 * kept in cp in case a string turns out too long to record.
+	 */
+	va_copy(cp, args);
+	payload = 0;
+	for (i = 0; i < site->lbs_nspecs; i++) {
+		spec = &(site->lbs_specs[i]);
+		for (j = 0; j < spec->lbsp_nstars; j++) {
+			stars[i][j] = (uint64_t)(int64_t)va_arg(args, int);
+			payload += sizeof(uint64_t);
+		}
+
+		strs[i] = NULL;
+		switch (spec->lbsp_type) {
+		case LLBA_INT:
+			vals[i] = (uint64_t)(int64_t)va_arg(args, int);
+			break;
+		case LLBA_UINT:
+			vals[i] = va_arg(args, unsigned int);
+			break;
+		case LLBA_LONG:
+			vals[i] = (uint64_t)(int64_t)va_arg(args, long);
+			break;
+		case LLBA_ULONG:
+			vals[i] = va_arg(args, unsigned long);
+			break;
+		case LLBA_LLONG:
+			vals[i] = (uint64_t)va_arg(args, long long);
+			break;
+		case LLBA_ULLONG:
+			vals[i] = va_arg(args, unsigned long long);
+			break;
+		case LLBA_SIZE:
+			vals[i] = va_arg(args, size_t);
+			break;
+		case LLBA_INTMAX:
+			vals[i] = (uint64_t)va_arg(args, intmax_t);
+			break;
+		case LLBA_UINTMAX:
+			vals[i] = va_arg(args, uintmax_t);
+			break;
+		case LLBA_PTRDIFF:
+			vals[i] = (uint64_t)va_arg(args, ptrdiff_t);
+			break;
+		case LLBA_DOUBLE:
+			d = va_arg(args, double);
+			memcpy(&(vals[i]), &d, sizeof(d));
+			break;
+		case LLBA_LDOUBLE:
+			d = (double)va_arg(args, long double);
+			memcpy(&(vals[i]), &d, sizeof(d));
+			break;
+		case LLBA_PTR:
+			vals[i] = (uintptr_t)va_arg(args, void *);
+			break;
+		case LLBA_STR:
+			strs[i] = va_arg(args, const char *);
+			if (strs[i] == NULL) {
+				strs[i] = "(null)";
+			}
+			maxlen = LATTUTIL_LOG_BINARY_MAXSTR + 1;
+			if (spec->lbsp_prec >= 0 &&
+			    (size_t)spec->lbsp_prec < maxlen) {
+				maxlen = spec->lbsp_prec;
+			} else if (spec->lbsp_prec == -2 &&
+			    (int64_t)stars[i][spec->lbsp_nstars - 1] >= 0 &&
+			    stars[i][spec->lbsp_nstars - 1] < maxlen) {
+				maxlen = stars[i][spec->lbsp_nstars - 1];
+			}
+			slens[i] = strnlen(strs[i], maxlen);
+			if (slens[i] > LATTUTIL_LOG_BINARY_MAXSTR) {
+				len = _lattutil_log_binary_vtext(lb, level,
+				    now, fmt, cp);
+				va_end(cp);
+				return (len);
+			}
+			payload += sizeof(uint32_t) + slens[i];
+			continue;
+		default:
+			vals[i] = 0;
+			break;
+		}
+		payload += sizeof(uint64_t);
+	}
+	va_end(cp);
+
+	type = LATTUTIL_LOG_BINARY_REC_LOG;
+	lvl = level;
+	id = site->lbs_id;
+
+	pthread_mutex_lock(&(lb->lb_mtx));
+	if (!_lattutil_log_binary_reserve(lb, LATTUTIL_LOG_BINARY_HDRSZ +
+	    payload)) {
+		pthread_mutex_unlock(&(lb->lb_mtx));
+		return (-1);
+	}
+
+	_lattutil_log_binary_put(lb, &type, sizeof(type));
+	_lattutil_log_binary_put(lb, &lvl, sizeof(lvl));
+	_lattutil_log_binary_put(lb, &id, sizeof(id));
+	_lattutil_log_binary_put(lb, &now, sizeof(now));
+	_lattutil_log_binary_put(lb, &payload, sizeof(payload));
+	for (i = 0; i < site->lbs_nspecs; i++) {
+		spec = &(site->lbs_specs[i]);
+		for (j = 0; j < spec->lbsp_nstars; j++) {
+			_lattutil_log_binary_put(lb, &(stars[i][j]),
+			    sizeof(stars[i][j]));
+		}
+		if (strs[i] != NULL) {
+			_lattutil_log_binary_put(lb, &(slens[i]),
+			    sizeof(slens[i]));
+			_lattutil_log_binary_put(lb, strs[i], slens[i]);
+		} else {
+			_lattutil_log_binary_put(lb, &(vals[i]),
+			    sizeof(vals[i]));
+		}
+	}
+
+	if (LATTUTIL_LOG_LEVEL_BASE(level) == LATTUTIL_LOG_LEVEL_ERR ||
+	    now - lb->lb_lastflush >= LATTUTIL_LOG_BINARY_FLUSH_NS) {
+		_lattutil_log_binary_flush_locked(lb);
+		lb->lb_lastflush = now;
+	}
+	pthread_mutex_unlock(&(lb->lb_mtx));
+
+	return (payload);
+}
+
+static ssize_t
+_lattutil_log_binary_text(lattutil_log_binary_t *lb,
+    lattutil_log_level_t level, uint64_t now, const char *msg, size_t len)
+{
+	uint32_t len32;
+	uint8_t type, lvl;
+
+	type = LATTUTIL_LOG_BINARY_REC_TEXT;
+	lvl = level;
+
+	if (len > LATTUTIL_LOG_BINARY_BUFSZ - LATTUTIL_LOG_BINARY_HDRSZ) {
+		len = LATTUTIL_LOG_BINARY_BUFSZ - LATTUTIL_LOG_BINARY_HDRSZ;
+		lvl |= LATTUTIL_LOG_BINARY_TRUNCATED;
+	}
+
+	len32 = len;
+
+	pthread_mutex_lock(&(lb->lb_mtx));
+	if (!_lattutil_log_binary_reserve(lb, 1 + 1 + 8 + 4 + len)) {
+		pthread_mutex_unlock(&(lb->lb_mtx));
+		return (-1);
+	}
+
+	_lattutil_log_binary_put(lb, &type, sizeof(type));
+	_lattutil_log_binary_put(lb, &lvl, sizeof(lvl));
+	_lattutil_log_binary_put(lb, &now, sizeof(now));
+	_lattutil_log_binary_put(lb, &len32, sizeof(len32));
+	_lattutil_log_binary_put(lb, msg, len);
+
+	if (LATTUTIL_LOG_LEVEL_BASE(level) == LATTUTIL_LOG_LEVEL_ERR ||
+	    now - lb->lb_lastflush >= LATTUTIL_LOG_BINARY_FLUSH_NS) {
+		_lattutil_log_binary_flush_locked(lb);
+		lb->lb_lastflush = now;
+	}
+	pthread_mutex_unlock(&(lb->lb_mtx));
+
+	return (len);
+}
+
+static ssize_t
+_lattutil_log_binary_vtext(lattutil_log_binary_t *lb,
+    lattutil_log_level_t level, uint64_t now, const char *fmt, va_list args)
+{
+	lattutil_log_buf_t buf;
+	ssize_t len;
+
+	if (!lattutil_log_buf_vformat(&buf, NULL, NULL, fmt, args)) {
+		return (-1);
+	}
+	len = _lattutil_log_binary_text(lb, level, now, buf.llb_buf,
+	    buf.llb_len);
+	lattutil_log_buf_release(&buf);
+
+	return (len);
+}
+
+/*
+ * Make room for sz bytes in the buffer. Called with lb_mtx held.
+ */
+static bool
+_lattutil_log_binary_reserve(lattutil_log_binary_t *lb, size_t sz)
+{
+
+	if (sz > LATTUTIL_LOG_BINARY_BUFSZ) {
+		return (false);
+	}
+
+	if (lb->lb_len + sz > LATTUTIL_LOG_BINARY_BUFSZ) {
+		_lattutil_log_binary_flush_locked(lb);
+	}
+
+	return (true);
+}
+
+static void
+_lattutil_log_binary_put(lattutil_log_binary_t *lb, const void *p, size_t sz)
+{
+
+	memcpy(lb->lb_buf + lb->lb_len, p, sz);
+	lb->lb_len += sz;
+}
+
+static int
+_lattutil_log_binary_flush_locked(lattutil_log_binary_t *lb)
+{
+	ssize_t res;
+
+	res = lattutil_log_write_all(lb->lb_fd, lb->lb_buf, lb->lb_len);
+	lb->lb_len = 0;
+
+	return (res < 0 ? -1 : 0);
+}
+
+static uint64_t
+_lattutil_log_binary_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static bool
+_lattutil_log_binary_read(FILE *in, void *p, size_t sz)
+{
+
+	return (sz == 0 || fread(p, sz, 1, in) == 1);
+}
+
+/*
+ * Render a LOG record by handing each conversion, with its recorded
+ * argument, back to printf.
+ */
+static void
+_lattutil_log_binary_print(FILE *out, const char *fmt,
+    const unsigned char *payload, size_t len)
+{
+	lattutil_log_binary_spec_t spec;
+	char specbuf[LATTUTIL_LOG_BINARY_MAXSPEC], *str;
+	const char *p, *start;
+	int64_t stars[2];
+	size_t off, speclen;
+	int i, supported;
+	uint32_t slen;
+	uint64_t v;
+	double d;
+
+	off = 0;
+	p = fmt;
+	while ((start = _lattutil_log_binary_next_spec(p, &speclen, &spec,
+	    &supported)) != NULL) {
+		fwrite(p, 1, start - p, out);
+		p = start + speclen;
+
+		if (spec.lbsp_type == 0) {
+			fputc('%', out);
+			continue;
+		}
+
+		if (speclen >= sizeof(specbuf)) {
+			return;
+		}
+		memcpy(specbuf, start, speclen);
+		specbuf[speclen] = '\0';
+
+		for (i = 0; i < spec.lbsp_nstars; i++) {
+			if (off + sizeof(v) > len) {
+				return;
+			}
+			memcpy(&v, payload + off, sizeof(v));
+			off += sizeof(v);
+			stars[i] = (int64_t)v;
+		}
+
+		if (spec.lbsp_type == LLBA_STR) {
+			if (off + sizeof(slen) > len) {
+				return;
+			}
+			memcpy(&slen, payload + off, sizeof(slen));
+			off += sizeof(slen);
+			if (off + slen > len) {
+				return;
+			}
+			str = strndup((const char *)payload + off, slen);
+			off += slen;
+			if (str == NULL) {
+				return;
+			}
+			switch (spec.lbsp_nstars) {
+			case 0:
+				fprintf(out, specbuf, str);
+				break;
+			case 1:
+				fprintf(out, specbuf, (int)stars[0], str);
+				break;
+			default:
+				fprintf(out, specbuf, (int)stars[0],
+				    (int)stars[1], str);
+				break;
+			}
+			free(str);
+			continue;
+		}
+
+		if (off + sizeof(v) > len) {
+			return;
+		}
+		memcpy(&v, payload + off, sizeof(v));
+		off += sizeof(v);
+
+#define	LLB_PRINT(val) do {						\
+	switch (spec.lbsp_nstars) {					\
+	case 0:								\
+		fprintf(out, specbuf, (val));				\
+		break;							\
+	case 1:								\
+		fprintf(out, specbuf, (int)stars[0], (val));		\
+		break;							\
+	default:							\
+		fprintf(out, specbuf, (int)stars[0], (int)stars[1],	\
+		    (val));						\
+		break;							\
+	}								\
+} while (0)
+
+		switch (spec.lbsp_type) {
+		case LLBA_INT:
+			LLB_PRINT((int)(int64_t)v);
+			break;
+		case LLBA_UINT:
+			LLB_PRINT((unsigned int)v);
+			break;
+		case LLBA_LONG:
+			LLB_PRINT((long)(int64_t)v);
+			break;
+		case LLBA_ULONG:
+			LLB_PRINT((unsigned long)v);
+			break;
+		case LLBA_LLONG:
+			LLB_PRINT((long long)(int64_t)v);
+			break;
+		case LLBA_ULLONG:
+			LLB_PRINT((unsigned long long)v);
+			break;
+		case LLBA_SIZE:
+			LLB_PRINT((size_t)v);
+			break;
+		case LLBA_INTMAX:
+			LLB_PRINT((intmax_t)(int64_t)v);
+			break;
+		case LLBA_UINTMAX:
+			LLB_PRINT((uintmax_t)v);
+			break;
+		case LLBA_PTRDIFF:
+			LLB_PRINT((ptrdiff_t)(int64_t)v);
+			break;
+		case LLBA_DOUBLE:
+			memcpy(&d, &v, sizeof(d));
+			LLB_PRINT(d);
+			break;
+		case LLBA_LDOUBLE:
+			memcpy(&d, &v, sizeof(d));
+			LLB_PRINT((long double)d);
+			break;
+		case LLBA_PTR:
+			LLB_PRINT((void *)(uintptr_t)v);
+			break;
+		default:
+			break;
+		}
+#undef	LLB_PRINT
+	}
+
+	fputs(p, out);
+}
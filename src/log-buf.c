@@ -0,0 +1,342 @@
+/*-
+ * Copyright (c) 2021 Shawn Webb <shawn.webb@hardenedbsd.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "liblattutil.h"
+
+/*
+ * Per-thread scratch buffer used by the text backends. The buffer
+ * grows on demand up to LATTUTIL_LOG_SCRATCH_MAX and is reused for
+ * every subsequent message on the thread, so a steady-state log call
+ * performs no heap allocation. Larger messages are formatted into a
+ * one-off heap buffer.
+ */
+
+#define	LATTUTIL_LOG_SCRATCH_MIN	512
+#define	LATTUTIL_LOG_SCRATCH_MAX	(64 * 1024)
+
+typedef struct _lattutil_log_scratch {
+	char	*lls_buf;
+	size_t	 lls_bufsz;
+} lattutil_log_scratch_t;
+
+static __thread lattutil_log_scratch_t _lattutil_log_scratch;
+static pthread_key_t _lattutil_log_scratch_key;
+static pthread_once_t _lattutil_log_scratch_once = PTHREAD_ONCE_INIT;
+
+static _Atomic(uint64_t) _lattutil_log_scratch_allocs;
+static _Atomic(uint64_t) _lattutil_log_fallback_allocs;
+static _Atomic(uint64_t) _lattutil_log_alloc_bytes;
+
+static void _lattutil_log_scratch_key_init(void);
+static void _lattutil_log_scratch_destroy(void *);
+static bool _lattutil_log_scratch_reserve(size_t);
+
+EXPORTED_SYM
+void
+lattutil_log_get_alloc_stats(lattutil_log_alloc_stats_t *stats)
+{
+
+	if (stats == NULL) {
+		return;
+	}
+
+	stats->llas_scratch_allocs = atomic_load_explicit(
+	    &_lattutil_log_scratch_allocs, memory_order_relaxed);
+	stats->llas_fallback_allocs = atomic_load_explicit(
+	    &_lattutil_log_fallback_allocs, memory_order_relaxed);
+	stats->llas_bytes = atomic_load_explicit(&_lattutil_log_alloc_bytes,
+	    memory_order_relaxed);
+}
+
+/*
+ * Format prefix, message, and suffix into one contiguous buffer.
+ * The buffer must be handed back with lattutil_log_buf_release().
+ */
+bool
+lattutil_log_buf_vformat(lattutil_log_buf_t *buf, const char *prefix,
+    const char *suffix, const char *fmt, va_list args)
+{
+	size_t avail, need, prefixlen, suffixlen;
+	va_list cp;
+	char *p;
+	int res;
+
+	memset(buf, 0, sizeof(*buf));
+
+	prefixlen = (prefix != NULL) ? strlen(prefix) : 0;
+	suffixlen = (suffix != NULL) ? strlen(suffix) : 0;
+
+	if (!_lattutil_log_scratch_reserve(prefixlen + suffixlen +
+	    LATTUTIL_LOG_SCRATCH_MIN)) {
+		return (false);
+	}
+
+	p = _lattutil_log_scratch.lls_buf;
+	avail = _lattutil_log_scratch.lls_bufsz - prefixlen - suffixlen;
+
+	va_copy(cp, args);
+	res = lattutil_log_vsnprintf(p + prefixlen, avail, fmt, cp);
+	va_end(cp);
+	if (res < 0) {
+		return (false);
+	}
+
+	if ((size_t)res >= avail) {
+		need = prefixlen + (size_t)res + suffixlen + 1;
+		if (need <= LATTUTIL_LOG_SCRATCH_MAX) {
+			if (!_lattutil_log_scratch_reserve(need)) {
+				return (false);
+			}
+			p = _lattutil_log_scratch.lls_buf;
+		} else {
+			p = malloc(need);
+			if (p == NULL) {
+				return (false);
+			}
+			atomic_fetch_add_explicit(
+			    &_lattutil_log_fallback_allocs, 1,
+			    memory_order_relaxed);
+			atomic_fetch_add_explicit(&_lattutil_log_alloc_bytes,
+			    need, memory_order_relaxed);
+			buf->llb_heap = true;
+			buf->llb_bufsz = need;
+		}
+
+		lattutil_log_vsnprintf(p + prefixlen, (size_t)res + 1, fmt,
+		    args);
+	}
+
+	if (prefixlen > 0) {
+		memcpy(p, prefix, prefixlen);
+	}
+	if (suffixlen > 0) {
+		memcpy(p + prefixlen + res, suffix, suffixlen);
+	}
+	p[prefixlen + res + suffixlen] = '\0';
+
+	buf->llb_buf = p;
+	buf->llb_len = prefixlen + (size_t)res + suffixlen;
+	if (!buf->llb_heap) {
+		buf->llb_bufsz = _lattutil_log_scratch.lls_bufsz;
+	}
+	buf->llb_msgoff = prefixlen;
+	buf->llb_msglen = (size_t)res;
+
+	return (true);
+}
+
+/*
+ * Start an empty record in the scratch buffer, to be built up with
+ * lattutil_log_buf_append(). The buffer is kept NUL terminated.
+ */
+bool
+lattutil_log_buf_begin(lattutil_log_buf_t *buf)
+{
+
+	memset(buf, 0, sizeof(*buf));
+
+	if (!_lattutil_log_scratch_reserve(LATTUTIL_LOG_SCRATCH_MIN)) {
+		return (false);
+	}
+
+	buf->llb_buf = _lattutil_log_scratch.lls_buf;
+	buf->llb_bufsz = _lattutil_log_scratch.lls_bufsz;
+	buf->llb_buf[0] = '\0';
+
+	return (true);
+}
+
+/*
+ * Make room for len more bytes plus the terminating NUL, moving the
+ * record to the heap once it outgrows the scratch buffer.
+ */
+bool
+lattutil_log_buf_reserve(lattutil_log_buf_t *buf, size_t len)
+{
+	size_t need, newsz;
+	char *p;
+
+	need = buf->llb_len + len + 1;
+	if (need <= buf->llb_bufsz) {
+		return (true);
+	}
+
+	if (!buf->llb_heap && need <= LATTUTIL_LOG_SCRATCH_MAX) {
+		if (!_lattutil_log_scratch_reserve(need)) {
+			return (false);
+		}
+		buf->llb_buf = _lattutil_log_scratch.lls_buf;
+		buf->llb_bufsz = _lattutil_log_scratch.lls_bufsz;
+		return (true);
+	}
+
+	newsz = buf->llb_bufsz;
+	while (newsz < need) {
+		newsz <<= 1;
+	}
+
+	if (buf->llb_heap) {
+		p = realloc(buf->llb_buf, newsz);
+		if (p == NULL) {
+			return (false);
+		}
+	} else {
+		p = malloc(newsz);
+		if (p == NULL) {
+			return (false);
+		}
+		memcpy(p, buf->llb_buf, buf->llb_len + 1);
+		buf->llb_heap = true;
+	}
+
+	atomic_fetch_add_explicit(&_lattutil_log_fallback_allocs, 1,
+	    memory_order_relaxed);
+	atomic_fetch_add_explicit(&_lattutil_log_alloc_bytes, newsz,
+	    memory_order_relaxed);
+
+	buf->llb_buf = p;
+	buf->llb_bufsz = newsz;
+
+	return (true);
+}
+
+bool
+lattutil_log_buf_append(lattutil_log_buf_t *buf, const void *data,
+    size_t len)
+{
+
+	if (!lattutil_log_buf_reserve(buf, len)) {
+		return (false);
+	}
+
+	memcpy(buf->llb_buf + buf->llb_len, data, len);
+	buf->llb_len += len;
+	buf->llb_buf[buf->llb_len] = '\0';
+
+	return (true);
+}
+
+void
+lattutil_log_buf_release(lattutil_log_buf_t *buf)
+{
+
+	if (buf->llb_heap) {
+		free(buf->llb_buf);
+	}
+
+	memset(buf, 0, sizeof(*buf));
+}
+
+/*
+ * Write the whole buffer, retrying on short writes and EINTR.
+ */
+ssize_t
+lattutil_log_write_all(int fd, const char *buf, size_t len)
+{
+	size_t off;
+	ssize_t res;
+
+	off = 0;
+	while (off < len) {
+		res = write(fd, buf + off, len - off);
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return (-1);
+		}
+		off += res;
+	}
+
+	return (len);
+}
+
+static void
+_lattutil_log_scratch_key_init(void)
+{
+
+	pthread_key_create(&_lattutil_log_scratch_key,
+	    _lattutil_log_scratch_destroy);
+}
+
+static void
+_lattutil_log_scratch_destroy(void *arg)
+{
+	lattutil_log_scratch_t *scratch;
+
+	scratch = arg;
+	free(scratch->lls_buf);
+	scratch->lls_buf = NULL;
+	scratch->lls_bufsz = 0;
+}
+
+static bool
+_lattutil_log_scratch_reserve(size_t sz)
+{
+	lattutil_log_scratch_t *scratch;
+	size_t newsz;
+	char *p;
+
+	scratch = &_lattutil_log_scratch;
+	if (scratch->lls_bufsz >= sz) {
+		return (true);
+	}
+
+	newsz = (scratch->lls_bufsz > 0) ? scratch->lls_bufsz :
+	    LATTUTIL_LOG_SCRATCH_MIN;
+	while (newsz < sz) {
+		newsz <<= 1;
+	}
+
+	p = realloc(scratch->lls_buf, newsz);
+	if (p == NULL) {
+		return (false);
+	}
+
+	if (scratch->lls_buf == NULL) {
+		/* Free the buffer when the thread exits. */
+		pthread_once(&_lattutil_log_scratch_once,
+		    _lattutil_log_scratch_key_init);
+		pthread_setspecific(_lattutil_log_scratch_key, scratch);
+	}
+
+	scratch->lls_buf = p;
+	scratch->lls_bufsz = newsz;
+
+	atomic_fetch_add_explicit(&_lattutil_log_scratch_allocs, 1,
+	    memory_order_relaxed);
+	atomic_fetch_add_explicit(&_lattutil_log_alloc_bytes, newsz,
+	    memory_order_relaxed);
+
+	return (true);
+}
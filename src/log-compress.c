@@ -0,0 +1,597 @@
+/*-
+ * Copyright (c) 2021 Shawn Webb <shawn.webb@hardenedbsd.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#include <zlib.h>
+
+#include "liblattutil.h"
+
+#define	LATTUTIL_LOG_COMPRESS_OUTSZ	(64 * 1024)
+#define	LATTUTIL_LOG_COMPRESS_MAXQUEUED	(4 * 1024 * 1024)
+
+/*
+ * Compression runs on its own thread at the lowest scheduling
+ * priority. It has two kinds of work, processed in order: whole
+ * rotated files, which are compressed next to the original and then
+ * unlinked, and blocks of a live stream, which are fed to the codec
+ * as the file backend flushes them. Producers only copy their block
+ * into the queue and wait if the compressor falls more than
+ * LATTUTIL_LOG_COMPRESS_MAXQUEUED bytes behind.
+ */
+
+typedef enum _lattutil_log_compress_op {
+	LLCO_FILE = 1,
+	LLCO_STREAM,
+	LLCO_BLOCK,
+} lattutil_log_compress_op_t;
+
+typedef struct _lattutil_log_compress_job {
+	lattutil_log_compress_op_t			 lcj_op;
+	char						*lcj_path;
+	int						 lcj_fd;
+	char						*lcj_buf;
+	size_t						 lcj_len;
+	size_t						 lcj_bufsz;
+	TAILQ_ENTRY(_lattutil_log_compress_job)		 lcj_entry;
+} lattutil_log_compress_job_t;
+
+TAILQ_HEAD(_lattutil_log_compress_queue, _lattutil_log_compress_job);
+
+struct _lattutil_log_compressor {
+	const lattutil_log_codec_t		*lc_codec;
+	int					 lc_level;
+	void					*lc_stream;
+	size_t					 lc_queued;
+	bool					 lc_sync;
+	bool					 lc_stop;
+	struct _lattutil_log_compress_queue	 lc_jobs;
+	struct _lattutil_log_compress_queue	 lc_free;
+	pthread_t				 lc_thread;
+	pthread_mutex_t				 lc_mtx;
+	pthread_cond_t				 lc_cv;
+	pthread_cond_t				 lc_space_cv;
+};
+
+typedef struct _lattutil_log_gzip {
+	z_stream	 lgz_z;
+	int		 lgz_fd;
+	unsigned char	 lgz_out[LATTUTIL_LOG_COMPRESS_OUTSZ];
+} lattutil_log_gzip_t;
+
+static void *_lattutil_log_gzip_open(int, int);
+static bool _lattutil_log_gzip_write(void *, const void *, size_t);
+static bool _lattutil_log_gzip_flush(void *);
+static bool _lattutil_log_gzip_close(void *);
+static bool _lattutil_log_gzip_deflate(lattutil_log_gzip_t *, int);
+
+static lattutil_log_compress_job_t *_lattutil_log_compressor_job(
+    lattutil_log_compressor_t *, size_t);
+static void _lattutil_log_compressor_enqueue(lattutil_log_compressor_t *,
+    lattutil_log_compress_job_t *);
+static void _lattutil_log_compressor_file(lattutil_log_compressor_t *,
+    const char *);
+static void _lattutil_log_compressor_lower_priority(void);
+static void *_lattutil_log_compressor_thread(void *);
+
+EXPORTED_SYM
+const lattutil_log_codec_t lattutil_log_codec_gzip = {
+	.llc_name = "gzip",
+	.llc_suffix = ".gz",
+	.llc_open = _lattutil_log_gzip_open,
+	.llc_write = _lattutil_log_gzip_write,
+	.llc_flush = _lattutil_log_gzip_flush,
+	.llc_close = _lattutil_log_gzip_close,
+};
+
+lattutil_log_compressor_t *
+lattutil_log_compressor_new(const lattutil_log_codec_t *codec, int level)
+{
+	lattutil_log_compressor_t *lc;
+
+	if (codec == NULL) {
+		return (NULL);
+	}
+
+	lc = calloc(1, sizeof(*lc));
+	if (lc == NULL) {
+		return (NULL);
+	}
+
+	lc->lc_codec = codec;
+	lc->lc_level = level;
+	TAILQ_INIT(&(lc->lc_jobs));
+	TAILQ_INIT(&(lc->lc_free));
+	pthread_mutex_init(&(lc->lc_mtx), NULL);
+	pthread_cond_init(&(lc->lc_cv), NULL);
+	pthread_cond_init(&(lc->lc_space_cv), NULL);
+
+	if (pthread_create(&(lc->lc_thread), NULL,
+	    _lattutil_log_compressor_thread, lc)) {
+		pthread_cond_destroy(&(lc->lc_space_cv));
+		pthread_cond_destroy(&(lc->lc_cv));
+		pthread_mutex_destroy(&(lc->lc_mtx));
+		free(lc);
+		return (NULL);
+	}
+
+	return (lc);
+}
+
+/*
+ * Finish all queued work, end the live stream, and stop the thread.
+ */
+void
+lattutil_log_compressor_free(lattutil_log_compressor_t **lcp)
+{
+	lattutil_log_compress_job_t *job;
+	lattutil_log_compressor_t *lc;
+
+	if (lcp == NULL || *lcp == NULL) {
+		return;
+	}
+
+	lc = *lcp;
+
+	pthread_mutex_lock(&(lc->lc_mtx));
+	lc->lc_stop = true;
+	pthread_cond_signal(&(lc->lc_cv));
+	pthread_mutex_unlock(&(lc->lc_mtx));
+
+	pthread_join(lc->lc_thread, NULL);
+
+	while ((job = TAILQ_FIRST(&(lc->lc_free))) != NULL) {
+		TAILQ_REMOVE(&(lc->lc_free), job, lcj_entry);
+		free(job->lcj_buf);
+		free(job);
+	}
+
+	pthread_cond_destroy(&(lc->lc_space_cv));
+	pthread_cond_destroy(&(lc->lc_cv));
+	pthread_mutex_destroy(&(lc->lc_mtx));
+	free(lc);
+	*lcp = NULL;
+}
+
+/*
+ * Queue a closed file for compression. The compressed copy gets the
+ * codec's suffix and the original is removed once it is complete.
+ */
+bool
+lattutil_log_compressor_file(lattutil_log_compressor_t *lc, const char *path)
+{
+	lattutil_log_compress_job_t *job;
+	char *p;
+
+	p = strdup(path);
+	if (p == NULL) {
+		return (false);
+	}
+
+	pthread_mutex_lock(&(lc->lc_mtx));
+	job = _lattutil_log_compressor_job(lc, 0);
+	if (job == NULL) {
+		pthread_mutex_unlock(&(lc->lc_mtx));
+		free(p);
+		return (false);
+	}
+	job->lcj_op = LLCO_FILE;
+	job->lcj_path = p;
+	_lattutil_log_compressor_enqueue(lc, job);
+	pthread_mutex_unlock(&(lc->lc_mtx));
+
+	return (true);
+}
+
+/*
+ * Switch the live stream to a new descriptor, which the compressor
+ * takes ownership of. The previous stream is finished first.
+ */
+bool
+lattutil_log_compressor_stream(lattutil_log_compressor_t *lc, int fd)
+{
+	lattutil_log_compress_job_t *job;
+
+	pthread_mutex_lock(&(lc->lc_mtx));
+	job = _lattutil_log_compressor_job(lc, 0);
+	if (job == NULL) {
+		pthread_mutex_unlock(&(lc->lc_mtx));
+		return (false);
+	}
+	job->lcj_op = LLCO_STREAM;
+	job->lcj_fd = fd;
+	_lattutil_log_compressor_enqueue(lc, job);
+	pthread_mutex_unlock(&(lc->lc_mtx));
+
+	return (true);
+}
+
+/*
+ * Copy the pieces into a block for the live stream. If sync is set,
+ * the stream is flushed to the descriptor once the block is written.
+ */
+bool
+lattutil_log_compressor_write(lattutil_log_compressor_t *lc,
+    const struct iovec *iov, int iovcnt, bool sync)
+{
+	lattutil_log_compress_job_t *job;
+	size_t len;
+	int i;
+
+	len = 0;
+	for (i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+
+	pthread_mutex_lock(&(lc->lc_mtx));
+	while (lc->lc_queued > LATTUTIL_LOG_COMPRESS_MAXQUEUED &&
+	    !lc->lc_stop) {
+		pthread_cond_wait(&(lc->lc_space_cv), &(lc->lc_mtx));
+	}
+
+	job = _lattutil_log_compressor_job(lc, len);
+	if (job == NULL) {
+		pthread_mutex_unlock(&(lc->lc_mtx));
+		return (false);
+	}
+	job->lcj_op = LLCO_BLOCK;
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(job->lcj_buf + job->lcj_len, iov[i].iov_base,
+		    iov[i].iov_len);
+		job->lcj_len += iov[i].iov_len;
+	}
+	lc->lc_queued += len;
+	if (sync) {
+		lc->lc_sync = true;
+	}
+	_lattutil_log_compressor_enqueue(lc, job);
+	pthread_mutex_unlock(&(lc->lc_mtx));
+
+	return (true);
+}
+
+/*
+ * Get a job from the free list, or allocate one, with room for len
+ * bytes. Called with lc_mtx held.
+ */
+static lattutil_log_compress_job_t *
+_lattutil_log_compressor_job(lattutil_log_compressor_t *lc, size_t len)
+{
+	lattutil_log_compress_job_t *job;
+	char *buf;
+
+	job = TAILQ_FIRST(&(lc->lc_free));
+	if (job != NULL) {
+		TAILQ_REMOVE(&(lc->lc_free), job, lcj_entry);
+	} else {
+		job = calloc(1, sizeof(*job));
+		if (job == NULL) {
+			return (NULL);
+		}
+	}
+
+	if (len > job->lcj_bufsz) {
+		buf = realloc(job->lcj_buf, len);
+		if (buf == NULL) {
+			TAILQ_INSERT_HEAD(&(lc->lc_free), job, lcj_entry);
+			return (NULL);
+		}
+		job->lcj_buf = buf;
+		job->lcj_bufsz = len;
+	}
+
+	job->lcj_path = NULL;
+	job->lcj_fd = -1;
+	job->lcj_len = 0;
+
+	return (job);
+}
+
+static void
+_lattutil_log_compressor_enqueue(lattutil_log_compressor_t *lc,
+    lattutil_log_compress_job_t *job)
+{
+
+	TAILQ_INSERT_TAIL(&(lc->lc_jobs), job, lcj_entry);
+	pthread_cond_signal(&(lc->lc_cv));
+}
+
+static void
+_lattutil_log_compressor_file(lattutil_log_compressor_t *lc,
+    const char *path)
+{
+	char dst[PATH_MAX], tmp[PATH_MAX];
+	unsigned char *buf;
+	struct stat sb;
+	int in, out;
+	ssize_t res;
+	void *stream;
+	bool ok;
+
+	/* Leave the file alone rather than write under a cut-off name. */
+	res = snprintf(dst, sizeof(dst), "%s%s", path,
+	    lc->lc_codec->llc_suffix);
+	if (res < 0 || (size_t)res >= sizeof(dst)) {
+		return;
+	}
+	res = snprintf(tmp, sizeof(tmp), "%s.tmp", dst);
+	if (res < 0 || (size_t)res >= sizeof(tmp)) {
+		return;
+	}
+
+	buf = malloc(LATTUTIL_LOG_COMPRESS_OUTSZ);
+	if (buf == NULL) {
+		return;
+	}
+
+	in = open(path, O_RDONLY | O_CLOEXEC);
+	if (in < 0) {
+		free(buf);
+		return;
+	}
+
+	if (fstat(in, &sb)) {
+		sb.st_mode = 0644;
+	}
+
+	out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+	    sb.st_mode & 0777);
+	if (out < 0) {
+		close(in);
+		free(buf);
+		return;
+	}
+
+	stream = lc->lc_codec->llc_open(out, lc->lc_level);
+	if (stream == NULL) {
+		close(out);
+		close(in);
+		unlink(tmp);
+		free(buf);
+		return;
+	}
+
+	ok = true;
+	while (ok && (res = read(in, buf, LATTUTIL_LOG_COMPRESS_OUTSZ)) != 0) {
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			ok = false;
+			break;
+		}
+		ok = lc->lc_codec->llc_write(stream, buf, res);
+	}
+
+	if (!lc->lc_codec->llc_close(stream)) {
+		ok = false;
+	}
+	close(in);
+	free(buf);
+
+	/* Only drop the original once the compressed copy is whole. */
+	if (ok && rename(tmp, dst) == 0) {
+		unlink(path);
+	} else {
+		unlink(tmp);
+	}
+}
+
+static void
+_lattutil_log_compressor_lower_priority(void)
+{
+#if defined(SCHED_IDLE)
+	struct sched_param param;
+
+	memset(&param, 0, sizeof(param));
+	if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) == 0) {
+		return;
+	}
+#endif
+#if defined(__linux__)
+	/* Linux applies a per-thread nice value to a thread id. */
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+#endif
+}
+
+static void *
+_lattutil_log_compressor_thread(void *arg)
+{
+	lattutil_log_compress_job_t *job;
+	lattutil_log_compressor_t *lc;
+	const lattutil_log_codec_t *codec;
+	bool sync;
+
+	lc = arg;
+	codec = lc->lc_codec;
+
+	_lattutil_log_compressor_lower_priority();
+
+	pthread_mutex_lock(&(lc->lc_mtx));
+	for (;;) {
+		job = TAILQ_FIRST(&(lc->lc_jobs));
+		if (job == NULL) {
+			sync = lc->lc_sync;
+			lc->lc_sync = false;
+			if (sync && lc->lc_stream != NULL) {
+				pthread_mutex_unlock(&(lc->lc_mtx));
+				codec->llc_flush(lc->lc_stream);
+				pthread_mutex_lock(&(lc->lc_mtx));
+				continue;
+			}
+			if (lc->lc_stop) {
+				break;
+			}
+			pthread_cond_wait(&(lc->lc_cv), &(lc->lc_mtx));
+			continue;
+		}
+		TAILQ_REMOVE(&(lc->lc_jobs), job, lcj_entry);
+		pthread_mutex_unlock(&(lc->lc_mtx));
+
+		switch (job->lcj_op) {
+		case LLCO_FILE:
+			_lattutil_log_compressor_file(lc, job->lcj_path);
+			free(job->lcj_path);
+			job->lcj_path = NULL;
+			break;
+		case LLCO_STREAM:
+			if (lc->lc_stream != NULL) {
+				codec->llc_close(lc->lc_stream);
+			}
+			lc->lc_stream = codec->llc_open(job->lcj_fd,
+			    lc->lc_level);
+			if (lc->lc_stream == NULL) {
+				close(job->lcj_fd);
+			}
+			break;
+		case LLCO_BLOCK:
+			if (lc->lc_stream != NULL) {
+				codec->llc_write(lc->lc_stream, job->lcj_buf,
+				    job->lcj_len);
+			}
+			break;
+		}
+
+		pthread_mutex_lock(&(lc->lc_mtx));
+		if (job->lcj_op == LLCO_BLOCK) {
+			lc->lc_queued -= job->lcj_len;
+			pthread_cond_broadcast(&(lc->lc_space_cv));
+		}
+		TAILQ_INSERT_HEAD(&(lc->lc_free), job, lcj_entry);
+	}
+	pthread_mutex_unlock(&(lc->lc_mtx));
+
+	if (lc->lc_stream != NULL) {
+		codec->llc_close(lc->lc_stream);
+		lc->lc_stream = NULL;
+	}
+
+	return (NULL);
+}
+
+static void *
+_lattutil_log_gzip_open(int fd, int level)
+{
+	lattutil_log_gzip_t *gz;
+
+	gz = calloc(1, sizeof(*gz));
+	if (gz == NULL) {
+		return (NULL);
+	}
+
+	if (level <= 0 || level > 9) {
+		level = Z_DEFAULT_COMPRESSION;
+	}
+
+	/* A window of 15 bits plus 16 selects the gzip wrapper. */
+	if (deflateInit2(&(gz->lgz_z), level, Z_DEFLATED, 15 + 16, 8,
+	    Z_DEFAULT_STRATEGY) != Z_OK) {
+		free(gz);
+		return (NULL);
+	}
+
+	gz->lgz_fd = fd;
+
+	return (gz);
+}
+
+static bool
+_lattutil_log_gzip_write(void *arg, const void *buf, size_t len)
+{
+	lattutil_log_gzip_t *gz;
+
+	gz = arg;
+	gz->lgz_z.next_in = (Bytef *)(uintptr_t)buf;
+	gz->lgz_z.avail_in = len;
+
+	return (_lattutil_log_gzip_deflate(gz, Z_NO_FLUSH));
+}
+
+static bool
+_lattutil_log_gzip_flush(void *arg)
+{
+
+	return (_lattutil_log_gzip_deflate(arg, Z_SYNC_FLUSH));
+}
+
+static bool
+_lattutil_log_gzip_close(void *arg)
+{
+	lattutil_log_gzip_t *gz;
+	bool ok;
+
+	gz = arg;
+	ok = _lattutil_log_gzip_deflate(gz, Z_FINISH);
+	deflateEnd(&(gz->lgz_z));
+	if (close(gz->lgz_fd)) {
+		ok = false;
+	}
+	free(gz);
+
+	return (ok);
+}
+
+static bool
+_lattutil_log_gzip_deflate(lattutil_log_gzip_t *gz, int flush)
+{
+	size_t have;
+	int res;
+
+	do {
+		gz->lgz_z.next_out = gz->lgz_out;
+		gz->lgz_z.avail_out = sizeof(gz->lgz_out);
+
+		res = deflate(&(gz->lgz_z), flush);
+		if (res == Z_STREAM_ERROR) {
+			return (false);
+		}
+
+		have = sizeof(gz->lgz_out) - gz->lgz_z.avail_out;
+		if (have > 0 && lattutil_log_write_all(gz->lgz_fd,
+		    (const char *)gz->lgz_out, have) < 0) {
+			return (false);
+		}
+	} while (gz->lgz_z.avail_out == 0 ||
+	    (flush == Z_FINISH && res != Z_STREAM_END));
+
+	return (true);
+}
@@ -39,6 +39,10 @@ lattutil_log_dummy_init(lattutil_log_t *res)
 	res->ll_log_err = lattutil_log_dummy_err;
 	res->ll_log_info = lattutil_log_dummy_info;
 	res->ll_log_warn = lattutil_log_dummy_warn;
+	res->ll_log_emit = lattutil_log_dummy_emit;
+
+	/* Nothing left to restore once the old backend is gone. */
+	memset(res->ll_log_saved, 0, sizeof(res->ll_log_saved));
 }
 
 ssize_t
@@ -73,6 +77,14 @@ lattutil_log_dummy_warn(lattutil_log_t *logp, int verbose,
 	return (0);
 }
 
+ssize_t
+lattutil_log_dummy_emit(lattutil_log_t *logp, lattutil_log_level_t level,
+    const char *msg, size_t len)
+{
+
+	return (0);
+}
+
 void
 lattutil_log_dummy_close(lattutil_log_t *logp)
 {
@@ -0,0 +1,795 @@
+/*-
+ * Copyright (c) 2021 Shawn Webb <shawn.webb@hardenedbsd.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "liblattutil.h"
+
+#define	LATTUTIL_LOG_FILE_BUFSZ		(64 * 1024)
+#define	LATTUTIL_LOG_FILE_FLUSH_MS	1000
+#define	LATTUTIL_LOG_FILE_MODE		0644
+#define	LATTUTIL_LOG_FILE_RETRY_SECS	30
+
+/*
+ * Records are appended to a user-space buffer under lf_mtx and
+ * written out when the buffer fills, when a record of a flush level
+ * arrives, or when the flusher thread's interval expires. Rotation and
+ * reopening are done by the flusher thread: the rename and open happen
+ * without the lock held, and producers are only blocked while the
+ * descriptors are swapped.
+ *
+ * With LATTUTIL_LOG_COMPRESS_STREAM, "writing out" the buffer means
+ * copying it to the compressor thread, which owns the descriptor.
+ * With LATTUTIL_LOG_COMPRESS_ROTATED, rotated files are handed to the
+ * compressor thread once closed. Either way no compression happens on
+ * a thread that logs.
+ *
+ * A rotation that fails, for example because the directory is not
+ * writable, is not retried for size or age until lf_retry, so that
+ * the flusher is not woken for every record in the meantime.
+ */
+typedef struct _lattutil_log_file {
+	char				*lf_path;
+	lattutil_log_file_opts_t	 lf_opts;
+	int				 lf_fd;
+	char				*lf_buf;
+	size_t				 lf_len;
+	uint64_t			 lf_size;
+	time_t				 lf_opened;
+	time_t				 lf_retry;
+	_Atomic(uint64_t)		 lf_rotate_failures;
+	lattutil_log_compressor_t	*lf_comp;
+	bool				 lf_stop;
+	_Atomic(bool)			 lf_reopen;
+	_Atomic(bool)			 lf_rotate;
+	pthread_t			 lf_thread;
+	pthread_mutex_t			 lf_mtx;
+	pthread_cond_t			 lf_cv;
+} lattutil_log_file_t;
+
+static int _lattutil_log_file_open(lattutil_log_file_t *, uint64_t *);
+static ssize_t _lattutil_log_file_append(lattutil_log_file_t *,
+    lattutil_log_level_t, struct iovec *, int);
+static int _lattutil_log_file_flush_locked(lattutil_log_file_t *,
+    struct iovec *, int);
+static ssize_t _lattutil_log_file_vlog(lattutil_log_t *,
+    lattutil_log_level_t, const char *, va_list);
+static bool _lattutil_log_file_rotated_path(lattutil_log_file_t *, char *,
+    size_t);
+static bool _lattutil_log_file_taken(lattutil_log_file_t *, const char *);
+static void _lattutil_log_file_swap(lattutil_log_file_t *, bool);
+static void _lattutil_log_file_backoff(lattutil_log_file_t *);
+static void *_lattutil_log_file_thread(void *);
+
+EXPORTED_SYM
+void
+lattutil_log_file_default_opts(lattutil_log_file_opts_t *opts)
+{
+
+	if (opts == NULL) {
+		return;
+	}
+
+	memset(opts, 0, sizeof(*opts));
+	opts->llfo_bufsz = LATTUTIL_LOG_FILE_BUFSZ;
+	opts->llfo_flush_ms = LATTUTIL_LOG_FILE_FLUSH_MS;
+	opts->llfo_flush_levels = LATTUTIL_LOG_LEVEL_MASK(
+	    LATTUTIL_LOG_LEVEL_ERR);
+	opts->llfo_mode = LATTUTIL_LOG_FILE_MODE;
+	opts->llfo_compress = LATTUTIL_LOG_COMPRESS_NONE;
+}
+
+EXPORTED_SYM
+bool
+lattutil_log_file_init(lattutil_log_t *logp, const char *path,
+    const lattutil_log_file_opts_t *opts)
+{
+	lattutil_log_file_t *lf;
+
+	if (logp == NULL || path == NULL) {
+		return (false);
+	}
+
+	lf = calloc(1, sizeof(*lf));
+	if (lf == NULL) {
+		return (false);
+	}
+
+	if (opts != NULL) {
+		memcpy(&(lf->lf_opts), opts, sizeof(lf->lf_opts));
+	} else {
+		lattutil_log_file_default_opts(&(lf->lf_opts));
+	}
+
+	if (lf->lf_opts.llfo_bufsz == 0) {
+		lf->lf_opts.llfo_bufsz = LATTUTIL_LOG_FILE_BUFSZ;
+	}
+	if (lf->lf_opts.llfo_flush_ms == 0) {
+		lf->lf_opts.llfo_flush_ms = LATTUTIL_LOG_FILE_FLUSH_MS;
+	}
+	if (lf->lf_opts.llfo_mode == 0) {
+		lf->lf_opts.llfo_mode = LATTUTIL_LOG_FILE_MODE;
+	}
+	if (lf->lf_opts.llfo_codec == NULL) {
+		lf->lf_opts.llfo_codec = &lattutil_log_codec_gzip;
+	}
+
+	lf->lf_path = strdup(path);
+	if (lf->lf_path == NULL) {
+		free(lf);
+		return (false);
+	}
+
+	lf->lf_buf = malloc(lf->lf_opts.llfo_bufsz);
+	if (lf->lf_buf == NULL) {
+		free(lf->lf_path);
+		free(lf);
+		return (false);
+	}
+
+	lf->lf_fd = _lattutil_log_file_open(lf, &(lf->lf_size));
+	if (lf->lf_fd < 0) {
+		free(lf->lf_buf);
+		free(lf->lf_path);
+		free(lf);
+		return (false);
+	}
+	lf->lf_opened = time(NULL);
+
+	if (lf->lf_opts.llfo_compress != LATTUTIL_LOG_COMPRESS_NONE) {
+		lf->lf_comp = lattutil_log_compressor_new(
+		    lf->lf_opts.llfo_codec, lf->lf_opts.llfo_codec_level);
+		if (lf->lf_comp == NULL) {
+			close(lf->lf_fd);
+			free(lf->lf_buf);
+			free(lf->lf_path);
+			free(lf);
+			return (false);
+		}
+	}
+
+	if (lf->lf_opts.llfo_compress == LATTUTIL_LOG_COMPRESS_STREAM) {
+		if (!lattutil_log_compressor_stream(lf->lf_comp, lf->lf_fd)) {
+			lattutil_log_compressor_free(&(lf->lf_comp));
+			close(lf->lf_fd);
+			free(lf->lf_buf);
+			free(lf->lf_path);
+			free(lf);
+			return (false);
+		}
+		lf->lf_fd = -1;
+	}
+
+	atomic_init(&(lf->lf_reopen), false);
+	atomic_init(&(lf->lf_rotate), false);
+	atomic_init(&(lf->lf_rotate_failures), 0);
+	pthread_mutex_init(&(lf->lf_mtx), NULL);
+	pthread_cond_init(&(lf->lf_cv), NULL);
+
+	if (pthread_create(&(lf->lf_thread), NULL, _lattutil_log_file_thread,
+	    lf)) {
+		pthread_cond_destroy(&(lf->lf_cv));
+		pthread_mutex_destroy(&(lf->lf_mtx));
+		lattutil_log_compressor_free(&(lf->lf_comp));
+		if (lf->lf_fd >= 0) {
+			close(lf->lf_fd);
+		}
+		free(lf->lf_buf);
+		free(lf->lf_path);
+		free(lf);
+		return (false);
+	}
+
+	if (logp->ll_log_close != NULL) {
+		logp->ll_log_close(logp);
+	}
+
+	logp->ll_internalaux = lf;
+	logp->ll_internalauxsz = sizeof(*lf);
+
+	logp->ll_log_close = lattutil_log_file_close;
+	logp->ll_log_debug = lattutil_log_file_debug;
+	logp->ll_log_err = lattutil_log_file_err;
+	logp->ll_log_info = lattutil_log_file_info;
+	logp->ll_log_warn = lattutil_log_file_warn;
+	logp->ll_log_emit = lattutil_log_file_emit;
+
+	lattutil_log_apply_levels(logp);
+
+	return (true);
+}
+
+EXPORTED_SYM
+bool
+lattutil_log_file_reopen(lattutil_log_t *logp)
+{
+	lattutil_log_file_t *lf;
+
+	if (logp == NULL || logp->ll_log_close != lattutil_log_file_close) {
+		return (false);
+	}
+
+	lf = logp->ll_internalaux;
+	atomic_store(&(lf->lf_reopen), true);
+
+	return (true);
+}
+
+EXPORTED_SYM
+bool
+lattutil_log_file_rotate(lattutil_log_t *logp)
+{
+	lattutil_log_file_t *lf;
+
+	if (logp == NULL || logp->ll_log_close != lattutil_log_file_close) {
+		return (false);
+	}
+
+	lf = logp->ll_internalaux;
+	atomic_store(&(lf->lf_rotate), true);
+
+	return (true);
+}
+
+EXPORTED_SYM
+bool
+lattutil_log_file_flush(lattutil_log_t *logp)
+{
+	lattutil_log_file_t *lf;
+	int res;
+
+	if (logp == NULL || logp->ll_log_close != lattutil_log_file_close) {
+		return (false);
+	}
+
+	lf = logp->ll_internalaux;
+
+	pthread_mutex_lock(&(lf->lf_mtx));
+	res = _lattutil_log_file_flush_locked(lf, NULL, 0);
+	pthread_mutex_unlock(&(lf->lf_mtx));
+
+	return (res == 0);
+}
+
+EXPORTED_SYM
+bool
+lattutil_log_file_stats(lattutil_log_t *logp, lattutil_log_file_stats_t *stats)
+{
+	lattutil_log_file_t *lf;
+
+	if (logp == NULL || stats == NULL ||
+	    logp->ll_log_close != lattutil_log_file_close) {
+		return (false);
+	}
+
+	lf = logp->ll_internalaux;
+
+	stats->llfst_rotate_failures = atomic_load_explicit(
+	    &(lf->lf_rotate_failures), memory_order_relaxed);
+
+	return (true);
+}
+
+ssize_t
+lattutil_log_file_debug(lattutil_log_t *logp, int verbose,
+    const char *fmt, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_file_vlog(logp,
+		    LATTUTIL_LOG_LEVEL_DEBUG, fmt, args);
+		va_end(args);
+	}
+
+	return (len);
+}
+
+ssize_t
+lattutil_log_file_err(lattutil_log_t *logp, int verbose,
+    const char *fmt, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_file_vlog(logp,
+		    LATTUTIL_LOG_LEVEL_ERR, fmt, args);
+		va_end(args);
+	}
+
+	return (len);
+}
+
+ssize_t
+lattutil_log_file_info(lattutil_log_t *logp, int verbose,
+    const char *fmt, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_file_vlog(logp,
+		    LATTUTIL_LOG_LEVEL_INFO, fmt, args);
+		va_end(args);
+	}
+
+	return (len);
+}
+
+ssize_t
+lattutil_log_file_warn(lattutil_log_t *logp, int verbose,
+    const char *fmt, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_file_vlog(logp,
+		    LATTUTIL_LOG_LEVEL_WARN, fmt, args);
+		va_end(args);
+	}
+
+	return (len);
+}
+
+ssize_t
+lattutil_log_file_emit(lattutil_log_t *logp, lattutil_log_level_t level,
+    const char *msg, size_t len)
+{
+	char prefixbuf[LATTUTIL_LOG_PREFIX_MAX];
+	struct iovec iov[3];
+	const char *prefix;
+
+	prefix = lattutil_log_prefix(logp, level, prefixbuf,
+	    sizeof(prefixbuf));
+
+	iov[0].iov_base = (void *)prefix;
+	iov[0].iov_len = strlen(prefix);
+	iov[1].iov_base = (void *)msg;
+	iov[1].iov_len = len;
+	iov[2].iov_base = "\n";
+	iov[2].iov_len = 1;
+
+	if (_lattutil_log_file_append(logp->ll_internalaux, level, iov,
+	    3) < 0) {
+		return (-1);
+	}
+
+	return (len);
+}
+
+void
+lattutil_log_file_close(lattutil_log_t *logp)
+{
+	lattutil_log_file_t *lf;
+
+	lf = logp->ll_internalaux;
+	if (lf == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&(lf->lf_mtx));
+	lf->lf_stop = true;
+	pthread_cond_signal(&(lf->lf_cv));
+	pthread_mutex_unlock(&(lf->lf_mtx));
+
+	pthread_join(lf->lf_thread, NULL);
+
+	_lattutil_log_file_flush_locked(lf, NULL, 0);
+	if (lf->lf_fd >= 0) {
+		close(lf->lf_fd);
+	}
+
+	/* Finishes the stream and any rotated files still queued. */
+	lattutil_log_compressor_free(&(lf->lf_comp));
+
+	pthread_cond_destroy(&(lf->lf_cv));
+	pthread_mutex_destroy(&(lf->lf_mtx));
+	free(lf->lf_buf);
+	free(lf->lf_path);
+	memset(lf, 0, sizeof(*lf));
+	free(lf);
+
+	logp->ll_internalaux = NULL;
+	logp->ll_internalauxsz = 0;
+}
+
+static int
+_lattutil_log_file_open(lattutil_log_file_t *lf, uint64_t *sizep)
+{
+	struct stat sb;
+	int fd;
+
+	fd = open(lf->lf_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+	    lf->lf_opts.llfo_mode);
+	if (fd < 0) {
+		return (-1);
+	}
+
+	*sizep = 0;
+	if (fstat(fd, &sb) == 0) {
+		*sizep = sb.st_size;
+	}
+
+	return (fd);
+}
+
+/*
+ * Append a record made of the given pieces to the buffer. If it does
+ * not fit, the buffer and the record are written together.
+ */
+static ssize_t
+_lattutil_log_file_append(lattutil_log_file_t *lf, lattutil_log_level_t level,
+    struct iovec *iov, int iovcnt)
+{
+	size_t len;
+	ssize_t res;
+	int i;
+
+	len = 0;
+	for (i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+
+	res = len;
+
+	pthread_mutex_lock(&(lf->lf_mtx));
+
+	if (lf->lf_len + len > lf->lf_opts.llfo_bufsz) {
+		if (_lattutil_log_file_flush_locked(lf, iov, iovcnt)) {
+			res = -1;
+		}
+	} else {
+		for (i = 0; i < iovcnt; i++) {
+			memcpy(lf->lf_buf + lf->lf_len, iov[i].iov_base,
+			    iov[i].iov_len);
+			lf->lf_len += iov[i].iov_len;
+		}
+
+		if (lf->lf_opts.llfo_flush_levels &
+		    LATTUTIL_LOG_LEVEL_MASK(level)) {
+			if (_lattutil_log_file_flush_locked(lf, NULL, 0)) {
+				res = -1;
+			}
+		}
+	}
+
+	if (lf->lf_opts.llfo_rotate_size > 0 &&
+	    lf->lf_size >= lf->lf_opts.llfo_rotate_size &&
+	    !atomic_load_explicit(&(lf->lf_rotate), memory_order_relaxed) &&
+	    (lf->lf_retry == 0 || time(NULL) >= lf->lf_retry)) {
+		atomic_store(&(lf->lf_rotate), true);
+		pthread_cond_signal(&(lf->lf_cv));
+	}
+
+	pthread_mutex_unlock(&(lf->lf_mtx));
+
+	return (res);
+}
+
+/*
+ * Write the buffered records, followed by any extra pieces, with a
+ * single writev(2) where possible. Called with lf_mtx held.
+ */
+static int
+_lattutil_log_file_flush_locked(lattutil_log_file_t *lf, struct iovec *extra,
+    int nextra)
+{
+	struct iovec iov[8], *cur;
+	size_t total;
+	ssize_t res;
+	int i, n;
+
+	n = 0;
+	if (lf->lf_len > 0) {
+		iov[n].iov_base = lf->lf_buf;
+		iov[n].iov_len = lf->lf_len;
+		n++;
+	}
+
+	for (i = 0; i < nextra && n < (int)(sizeof(iov) / sizeof(iov[0]));
+	    i++) {
+		iov[n++] = extra[i];
+	}
+
+	total = 0;
+	for (i = 0; i < n; i++) {
+		total += iov[i].iov_len;
+	}
+
+	/*
+	 * Explicit flushes also flush the compressed stream, so that
+	 * a reader sees the records. Overflowing the buffer does not.
+	 */
+	if (lf->lf_opts.llfo_compress == LATTUTIL_LOG_COMPRESS_STREAM) {
+		lf->lf_len = 0;
+		if (n == 0) {
+			return (0);
+		}
+		if (!lattutil_log_compressor_write(lf->lf_comp, iov, n,
+		    nextra == 0)) {
+			return (-1);
+		}
+		lf->lf_size += total;
+		return (0);
+	}
+
+	cur = iov;
+	while (n > 0) {
+		res = writev(lf->lf_fd, cur, n);
+		if (res < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			lf->lf_len = 0;
+			return (-1);
+		}
+
+		/* Skip over whatever a short write managed to get out. */
+		while (n > 0 && (size_t)res >= cur->iov_len) {
+			res -= cur->iov_len;
+			cur++;
+			n--;
+		}
+		if (n > 0) {
+			cur->iov_base = (char *)cur->iov_base + res;
+			cur->iov_len -= res;
+		}
+	}
+
+	lf->lf_len = 0;
+	lf->lf_size += total;
+
+	return (0);
+}
+
+static ssize_t
+_lattutil_log_file_vlog(lattutil_log_t *logp, lattutil_log_level_t level,
+    const char *fmt, va_list args)
+{
+	char prefixbuf[LATTUTIL_LOG_PREFIX_MAX];
+	lattutil_log_buf_t buf;
+	struct iovec iov;
+	ssize_t len;
+
+	if (!lattutil_log_buf_vformat(&buf, lattutil_log_prefix(logp, level,
+	    prefixbuf, sizeof(prefixbuf)), "\n", fmt, args)) {
+		return (-1);
+	}
+
+	iov.iov_base = buf.llb_buf;
+	iov.iov_len = buf.llb_len;
+
+	len = buf.llb_msglen;
+	if (_lattutil_log_file_append(logp->ll_internalaux, level, &iov,
+	    1) < 0) {
+		len = -1;
+	}
+
+	lattutil_log_buf_release(&buf);
+
+	return (len);
+}
+
+static bool
+_lattutil_log_file_rotated_path(lattutil_log_file_t *lf, char *path,
+    size_t pathsz)
+{
+	char stamp[32];
+	struct tm tm;
+	unsigned int i;
+	time_t now;
+	int res;
+
+	now = time(NULL);
+	localtime_r(&now, &tm);
+	strftime(stamp, sizeof(stamp), "%Y%m%d%H%M%S", &tm);
+
+	res = snprintf(path, pathsz, "%s.%s", lf->lf_path, stamp);
+	for (i = 1; res >= 0 && (size_t)res < pathsz &&
+	    _lattutil_log_file_taken(lf, path); i++) {
+		if (i == 1000) {
+			return (false);
+		}
+		res = snprintf(path, pathsz, "%s.%s.%u", lf->lf_path, stamp,
+		    i);
+	}
+
+	/* A truncated name could clobber some other file. */
+	if (res < 0 || (size_t)res >= pathsz) {
+		return (false);
+	}
+
+	return (true);
+}
+
+/*
+ * A rotated name is taken if the file exists, or if its compressed
+ * copy does when rotated files are compressed.
+ */
+static bool
+_lattutil_log_file_taken(lattutil_log_file_t *lf, const char *path)
+{
+	char compressed[PATH_MAX];
+	struct stat sb;
+	int res;
+
+	if (stat(path, &sb) == 0) {
+		return (true);
+	}
+
+	if (lf->lf_opts.llfo_compress != LATTUTIL_LOG_COMPRESS_ROTATED) {
+		return (false);
+	}
+
+	/*
+	 * A name whose compressed copy cannot be spelled out is no
+	 * use, since the compressor would refuse it.
+	 */
+	res = snprintf(compressed, sizeof(compressed), "%s%s", path,
+	    lf->lf_opts.llfo_codec->llc_suffix);
+	if (res < 0 || (size_t)res >= sizeof(compressed)) {
+		return (true);
+	}
+
+	return (stat(compressed, &sb) == 0);
+}
+
+/*
+ * Point the logger at a fresh file. If rotating, the current file is
+ * renamed out of the way first. Records written between the rename
+ * and the swap land in the rotated file, which is where they belong.
+ */
+static void
+_lattutil_log_file_swap(lattutil_log_file_t *lf, bool rotate)
+{
+	char rotated[PATH_MAX];
+	uint64_t size;
+	int fd, oldfd;
+
+	if (rotate) {
+		if (!_lattutil_log_file_rotated_path(lf, rotated,
+		    sizeof(rotated)) || rename(lf->lf_path, rotated)) {
+			_lattutil_log_file_backoff(lf);
+			return;
+		}
+	}
+
+	fd = _lattutil_log_file_open(lf, &size);
+	if (fd < 0) {
+		if (rotate) {
+			_lattutil_log_file_backoff(lf);
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&(lf->lf_mtx));
+	_lattutil_log_file_flush_locked(lf, NULL, 0);
+	if (lf->lf_opts.llfo_compress == LATTUTIL_LOG_COMPRESS_STREAM) {
+		/* Queued behind the flush above, so ordering is kept. */
+		if (!lattutil_log_compressor_stream(lf->lf_comp, fd)) {
+			close(fd);
+		}
+		oldfd = -1;
+	} else {
+		oldfd = lf->lf_fd;
+		lf->lf_fd = fd;
+	}
+	lf->lf_size = size;
+	lf->lf_opened = time(NULL);
+	lf->lf_retry = 0;
+	pthread_mutex_unlock(&(lf->lf_mtx));
+
+	if (oldfd >= 0) {
+		close(oldfd);
+	}
+
+	if (rotate &&
+	    lf->lf_opts.llfo_compress == LATTUTIL_LOG_COMPRESS_ROTATED) {
+		lattutil_log_compressor_file(lf->lf_comp, rotated);
+	}
+}
+
+/*
+ * Count a failed rotation and hold off the next one by size or age.
+ */
+static void
+_lattutil_log_file_backoff(lattutil_log_file_t *lf)
+{
+
+	atomic_fetch_add_explicit(&(lf->lf_rotate_failures), 1,
+	    memory_order_relaxed);
+
+	pthread_mutex_lock(&(lf->lf_mtx));
+	lf->lf_retry = time(NULL) + LATTUTIL_LOG_FILE_RETRY_SECS;
+	pthread_mutex_unlock(&(lf->lf_mtx));
+}
+
+static void *
+_lattutil_log_file_thread(void *arg)
+{
+	lattutil_log_file_t *lf;
+	struct timespec ts;
+	bool rotate;
+	time_t now;
+
+	lf = arg;
+
+	pthread_mutex_lock(&(lf->lf_mtx));
+	while (!lf->lf_stop) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += lf->lf_opts.llfo_flush_ms / 1000;
+		ts.tv_nsec += (lf->lf_opts.llfo_flush_ms % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+
+		pthread_cond_timedwait(&(lf->lf_cv), &(lf->lf_mtx), &ts);
+		if (lf->lf_stop) {
+			break;
+		}
+
+		_lattutil_log_file_flush_locked(lf, NULL, 0);
+
+		now = time(NULL);
+		if (lf->lf_opts.llfo_rotate_interval > 0 &&
+		    now - lf->lf_opened >= lf->lf_opts.llfo_rotate_interval &&
+		    now >= lf->lf_retry) {
+			atomic_store(&(lf->lf_rotate), true);
+		}
+
+		rotate = atomic_exchange(&(lf->lf_rotate), false);
+		if (rotate || atomic_exchange(&(lf->lf_reopen), false)) {
+			pthread_mutex_unlock(&(lf->lf_mtx));
+			_lattutil_log_file_swap(lf, rotate);
+			pthread_mutex_lock(&(lf->lf_mtx));
+		}
+	}
+	pthread_mutex_unlock(&(lf->lf_mtx));
+
+	return (NULL);
+}
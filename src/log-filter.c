@@ -0,0 +1,481 @@
+/*-
+ * Copyright (c) 2021 Shawn Webb <shawn.webb@hardenedbsd.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "liblattutil.h"
+
+#define	LATTUTIL_LOG_FILTER_SITES	1024
+#define	LATTUTIL_LOG_FILTER_LASTSZ	1024
+
+/*
+ * Rate limiting is done per call site, identified by the address of
+ * the format string, before the message is formatted. Each site has
+ * a token bucket implemented as a generic cell rate algorithm: a
+ * single theoretical arrival time that is advanced with one CAS per
+ * accepted message. Suppressed messages cost a hash probe and an
+ * atomic load.
+ *
+ * Duplicate coalescing needs the formatted text, so it runs after the
+ * rate limiter and takes lfl_mtx to compare against the last message.
+ */
+typedef struct _lattutil_log_filter_site {
+	_Atomic(const char *)	 lfs_fmt;
+	_Atomic(uint64_t)	 lfs_tat;
+	_Atomic(uint64_t)	 lfs_suppressed;
+} lattutil_log_filter_site_t;
+
+typedef struct _lattutil_log_filter {
+	lattutil_log_t			*lfl_inner;
+	lattutil_log_filter_opts_t	 lfl_opts;
+	uint64_t			 lfl_interval;
+	uint64_t			 lfl_tolerance;
+	lattutil_log_filter_site_t	 lfl_sites[LATTUTIL_LOG_FILTER_SITES];
+	_Atomic(uint64_t)		 lfl_ratelimited;
+	_Atomic(uint64_t)		 lfl_coalesced;
+	pthread_mutex_t			 lfl_mtx;
+	bool				 lfl_havelast;
+	lattutil_log_level_t		 lfl_lastlevel;
+	size_t				 lfl_lastlen;
+	uint64_t			 lfl_repeats;
+	char				 lfl_last[LATTUTIL_LOG_FILTER_LASTSZ];
+} lattutil_log_filter_t;
+
+static uint64_t _lattutil_log_filter_now(void);
+static lattutil_log_filter_site_t *_lattutil_log_filter_site(
+    lattutil_log_filter_t *, const char *);
+static bool _lattutil_log_filter_allow(lattutil_log_filter_t *,
+    lattutil_log_level_t, const char *, uint64_t *);
+static ssize_t _lattutil_log_filter_write(lattutil_log_filter_t *,
+    lattutil_log_level_t, const char *, size_t);
+static void _lattutil_log_filter_flush_repeats(lattutil_log_filter_t *);
+static ssize_t _lattutil_log_filter_vlog(lattutil_log_t *,
+    lattutil_log_level_t, const char *, va_list);
+
+EXPORTED_SYM
+void
+lattutil_log_filter_default_opts(lattutil_log_filter_opts_t *opts)
+{
+
+	if (opts == NULL) {
+		return;
+	}
+
+	memset(opts, 0, sizeof(*opts));
+	opts->llfl_rate = 10;
+	opts->llfl_burst = 20;
+	opts->llfl_levels = LATTUTIL_LOG_LEVELS_ALL;
+	opts->llfl_coalesce = true;
+}
+
+EXPORTED_SYM
+bool
+lattutil_log_filter_init(lattutil_log_t *logp, lattutil_log_t *inner,
+    const lattutil_log_filter_opts_t *opts)
+{
+	lattutil_log_filter_t *lfl;
+	size_t i;
+
+	if (logp == NULL || inner == NULL || logp == inner ||
+	    inner->ll_log_emit == NULL) {
+		return (false);
+	}
+
+	lfl = calloc(1, sizeof(*lfl));
+	if (lfl == NULL) {
+		return (false);
+	}
+
+	if (opts != NULL) {
+		memcpy(&(lfl->lfl_opts), opts, sizeof(lfl->lfl_opts));
+	} else {
+		lattutil_log_filter_default_opts(&(lfl->lfl_opts));
+	}
+
+	if (lfl->lfl_opts.llfl_rate > 0) {
+		lfl->lfl_interval = 1000000000ULL / lfl->lfl_opts.llfl_rate;
+		if (lfl->lfl_opts.llfl_burst == 0) {
+			lfl->lfl_opts.llfl_burst = 1;
+		}
+		lfl->lfl_tolerance = lfl->lfl_interval *
+		    (lfl->lfl_opts.llfl_burst - 1);
+	}
+
+	for (i = 0; i < LATTUTIL_LOG_FILTER_SITES; i++) {
+		atomic_init(&(lfl->lfl_sites[i].lfs_fmt), NULL);
+		atomic_init(&(lfl->lfl_sites[i].lfs_tat), 0);
+		atomic_init(&(lfl->lfl_sites[i].lfs_suppressed), 0);
+	}
+	atomic_init(&(lfl->lfl_ratelimited), 0);
+	atomic_init(&(lfl->lfl_coalesced), 0);
+	pthread_mutex_init(&(lfl->lfl_mtx), NULL);
+	lfl->lfl_inner = inner;
+
+	if (logp->ll_log_close != NULL) {
+		logp->ll_log_close(logp);
+	}
+
+	logp->ll_internalaux = lfl;
+	logp->ll_internalauxsz = sizeof(*lfl);
+
+	logp->ll_log_close = lattutil_log_filter_close;
+	logp->ll_log_debug = lattutil_log_filter_debug;
+	logp->ll_log_err = lattutil_log_filter_err;
+	logp->ll_log_info = lattutil_log_filter_info;
+	logp->ll_log_warn = lattutil_log_filter_warn;
+	logp->ll_log_emit = lattutil_log_filter_emit;
+
+	lattutil_log_apply_levels(logp);
+
+	return (true);
+}
+
+EXPORTED_SYM
+bool
+lattutil_log_filter_stats(lattutil_log_t *logp,
+    lattutil_log_filter_stats_t *stats)
+{
+	lattutil_log_filter_t *lfl;
+
+	if (logp == NULL || stats == NULL ||
+	    logp->ll_log_close != lattutil_log_filter_close) {
+		return (false);
+	}
+
+	lfl = logp->ll_internalaux;
+
+	stats->llfs_ratelimited = atomic_load_explicit(
+	    &(lfl->lfl_ratelimited), memory_order_relaxed);
+	stats->llfs_coalesced = atomic_load_explicit(&(lfl->lfl_coalesced),
+	    memory_order_relaxed);
+
+	return (true);
+}
+
+ssize_t
+lattutil_log_filter_debug(lattutil_log_t *logp, int verbose,
+    const char *fmt, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_filter_vlog(logp,
+		    LATTUTIL_LOG_LEVEL_DEBUG, fmt, args);
+		va_end(args);
+	}
+
+	return (len);
+}
+
+ssize_t
+lattutil_log_filter_err(lattutil_log_t *logp, int verbose,
+    const char *fmt, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_filter_vlog(logp,
+		    LATTUTIL_LOG_LEVEL_ERR, fmt, args);
+		va_end(args);
+	}
+
+	return (len);
+}
+
+ssize_t
+lattutil_log_filter_info(lattutil_log_t *logp, int verbose,
+    const char *fmt, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_filter_vlog(logp,
+		    LATTUTIL_LOG_LEVEL_INFO, fmt, args);
+		va_end(args);
+	}
+
+	return (len);
+}
+
+ssize_t
+lattutil_log_filter_warn(lattutil_log_t *logp, int verbose,
+    const char *fmt, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_filter_vlog(logp,
+		    LATTUTIL_LOG_LEVEL_WARN, fmt, args);
+		va_end(args);
+	}
+
+	return (len);
+}
+
+/*
+ * Preformatted messages have no call site, so they are only subject
+ * to duplicate coalescing.
+ */
+ssize_t
+lattutil_log_filter_emit(lattutil_log_t *logp, lattutil_log_level_t level,
+    const char *msg, size_t len)
+{
+
+	return (_lattutil_log_filter_write(logp->ll_internalaux, level, msg,
+	    len));
+}
+
+void
+lattutil_log_filter_close(lattutil_log_t *logp)
+{
+	lattutil_log_filter_t *lfl;
+
+	lfl = logp->ll_internalaux;
+	if (lfl == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&(lfl->lfl_mtx));
+	_lattutil_log_filter_flush_repeats(lfl);
+	pthread_mutex_unlock(&(lfl->lfl_mtx));
+
+	lattutil_log_free(&(lfl->lfl_inner));
+
+	pthread_mutex_destroy(&(lfl->lfl_mtx));
+	memset(lfl, 0, sizeof(*lfl));
+	free(lfl);
+
+	logp->ll_internalaux = NULL;
+	logp->ll_internalauxsz = 0;
+}
+
+static uint64_t
+_lattutil_log_filter_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/*
+ * Find or claim the bucket for a call site. Returns NULL when the
+ * table is full, in which case the site is not rate limited.
+ */
+static lattutil_log_filter_site_t *
+_lattutil_log_filter_site(lattutil_log_filter_t *lfl, const char *fmt)
+{
+	lattutil_log_filter_site_t *site;
+	const char *cur;
+	size_t h, i;
+
+	h = ((uintptr_t)fmt >> 3) * 0x9e3779b97f4a7c15ULL;
+	for (i = 0; i < LATTUTIL_LOG_FILTER_SITES; i++) {
+		site = &(lfl->lfl_sites[(h + i) &
+		    (LATTUTIL_LOG_FILTER_SITES - 1)]);
+		cur = atomic_load_explicit(&(site->lfs_fmt),
+		    memory_order_relaxed);
+		if (cur == fmt) {
+			return (site);
+		}
+		if (cur == NULL) {
+			if (atomic_compare_exchange_strong(&(site->lfs_fmt),
+			    &cur, fmt) || cur == fmt) {
+				return (site);
+			}
+		}
+	}
+
+	return (NULL);
+}
+
+/*
+ * Apply the token bucket of the call site. On success, *suppressedp
+ * holds the number of messages the site lost since it last got
+ * through.
+ */
+static bool
+_lattutil_log_filter_allow(lattutil_log_filter_t *lfl,
+    lattutil_log_level_t level, const char *fmt, uint64_t *suppressedp)
+{
+	lattutil_log_filter_site_t *site;
+	uint64_t now, tat, newtat;
+
+	*suppressedp = 0;
+
+	if (lfl->lfl_interval == 0 ||
+	    (lfl->lfl_opts.llfl_levels & LATTUTIL_LOG_LEVEL_MASK(level)) == 0) {
+		return (true);
+	}
+
+	site = _lattutil_log_filter_site(lfl, fmt);
+	if (site == NULL) {
+		return (true);
+	}
+
+	now = _lattutil_log_filter_now();
+	tat = atomic_load_explicit(&(site->lfs_tat), memory_order_relaxed);
+	do {
+		newtat = (tat > now) ? tat : now;
+		if (newtat - now > lfl->lfl_tolerance) {
+			atomic_fetch_add_explicit(&(site->lfs_suppressed), 1,
+			    memory_order_relaxed);
+			atomic_fetch_add_explicit(&(lfl->lfl_ratelimited), 1,
+			    memory_order_relaxed);
+			return (false);
+		}
+		newtat += lfl->lfl_interval;
+	} while (!atomic_compare_exchange_weak_explicit(&(site->lfs_tat),
+	    &tat, newtat, memory_order_relaxed, memory_order_relaxed));
+
+	if (atomic_load_explicit(&(site->lfs_suppressed),
+	    memory_order_relaxed) > 0) {
+		*suppressedp = atomic_exchange_explicit(
+		    &(site->lfs_suppressed), 0, memory_order_relaxed);
+	}
+
+	return (true);
+}
+
+/*
+ * Report any pending repeats of the last message. Called with
+ * lfl_mtx held.
+ */
+static void
+_lattutil_log_filter_flush_repeats(lattutil_log_filter_t *lfl)
+{
+	lattutil_log_t *inner;
+	char msg[128];
+	int len;
+
+	if (lfl->lfl_repeats == 0) {
+		return;
+	}
+
+	inner = lfl->lfl_inner;
+	len = snprintf(msg, sizeof(msg), "last message repeated %ju times",
+	    (uintmax_t)lfl->lfl_repeats);
+	inner->ll_log_emit(inner, LATTUTIL_LOG_LEVEL_BASE(lfl->lfl_lastlevel),
+	    msg, len);
+	lfl->lfl_repeats = 0;
+}
+
+/*
+ * Hand a formatted message to the inner logger, collapsing it into a
+ * repeat count if it matches the previous one.
+ */
+static ssize_t
+_lattutil_log_filter_write(lattutil_log_filter_t *lfl,
+    lattutil_log_level_t level, const char *msg, size_t len)
+{
+	lattutil_log_t *inner;
+	ssize_t res;
+
+	inner = lfl->lfl_inner;
+
+	if (!lfl->lfl_opts.llfl_coalesce) {
+		return (inner->ll_log_emit(inner, level, msg, len));
+	}
+
+	pthread_mutex_lock(&(lfl->lfl_mtx));
+	if (lfl->lfl_havelast && level == lfl->lfl_lastlevel &&
+	    len == lfl->lfl_lastlen && len < sizeof(lfl->lfl_last) &&
+	    !memcmp(msg, lfl->lfl_last, len)) {
+		lfl->lfl_repeats++;
+		pthread_mutex_unlock(&(lfl->lfl_mtx));
+		atomic_fetch_add_explicit(&(lfl->lfl_coalesced), 1,
+		    memory_order_relaxed);
+		return (len);
+	}
+
+	_lattutil_log_filter_flush_repeats(lfl);
+
+	res = inner->ll_log_emit(inner, level, msg, len);
+
+	/* Messages too long for the buffer are never coalesced. */
+	lfl->lfl_havelast = true;
+	lfl->lfl_lastlevel = level;
+	lfl->lfl_lastlen = len;
+	if (len < sizeof(lfl->lfl_last)) {
+		memcpy(lfl->lfl_last, msg, len);
+	}
+	pthread_mutex_unlock(&(lfl->lfl_mtx));
+
+	return (res);
+}
+
+static ssize_t
+_lattutil_log_filter_vlog(lattutil_log_t *logp, lattutil_log_level_t level,
+    const char *fmt, va_list args)
+{
+	lattutil_log_filter_t *lfl;
+	lattutil_log_buf_t buf;
+	uint64_t suppressed;
+	char note[128];
+	ssize_t len;
+	int notelen;
+
+	lfl = logp->ll_internalaux;
+
+	if (!_lattutil_log_filter_allow(lfl, level, fmt, &suppressed)) {
+		return (0);
+	}
+
+	if (suppressed > 0) {
+		notelen = snprintf(note, sizeof(note),
+		    "%ju messages suppressed by rate limit",
+		    (uintmax_t)suppressed);
+		_lattutil_log_filter_write(lfl, level, note, notelen);
+	}
+
+	if (!lattutil_log_buf_vformat(&buf, NULL, NULL, fmt, args)) {
+		return (-1);
+	}
+
+	len = _lattutil_log_filter_write(lfl, level, buf.llb_buf, buf.llb_len);
+	lattutil_log_buf_release(&buf);
+
+	return (len);
+}
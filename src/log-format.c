@@ -0,0 +1,311 @@
+/*-
+ * Copyright (c) 2021 Shawn Webb <shawn.webb@hardenedbsd.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+
+#include "liblattutil.h"
+
+/*
+ * Formatter for the conversions that make up nearly every log
+ * message: %s, %c, %d, %i, %u, %x, %X, %p, and %%, with no length
+ * modifier or with l, ll, or z, and no flags, width, or precision.
+ * Literal text between conversions is copied in bulk and integers are
+ * converted two decimal digits at a time. The first conversion it
+ * does not handle sends the whole message to vsnprintf(3) instead, so
+ * the output is always what vsnprintf(3) would produce.
+ */
+
+#define	LATTUTIL_FMT_MOD_NONE	0
+#define	LATTUTIL_FMT_MOD_L	1
+#define	LATTUTIL_FMT_MOD_LL	2
+#define	LATTUTIL_FMT_MOD_Z	3
+
+typedef struct _lattutil_fmt_out {
+	char	*lfo_buf;
+	size_t	 lfo_bufsz;
+	size_t	 lfo_len;
+} lattutil_fmt_out_t;
+
+static const char _lattutil_fmt_digits[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static const char _lattutil_fmt_lhex[] = "0123456789abcdef";
+static const char _lattutil_fmt_uhex[] = "0123456789ABCDEF";
+
+static inline void _lattutil_fmt_put(lattutil_fmt_out_t *, const char *,
+    size_t);
+static inline char *_lattutil_fmt_dec(char *, uint64_t);
+static inline char *_lattutil_fmt_hex(char *, uint64_t, const char *);
+static bool _lattutil_fmt_fast(lattutil_fmt_out_t *, const char *,
+    va_list);
+
+EXPORTED_SYM
+int
+lattutil_log_vsnprintf(char *buf, size_t bufsz, const char *fmt,
+    va_list args)
+{
+	lattutil_fmt_out_t out;
+	va_list cp;
+	bool fast;
+
+	out.lfo_buf = buf;
+	out.lfo_bufsz = bufsz;
+	out.lfo_len = 0;
+
+	va_copy(cp, args);
+	fast = _lattutil_fmt_fast(&out, fmt, cp);
+	va_end(cp);
+
+	if (!fast) {
+		return (vsnprintf(buf, bufsz, fmt, args));
+	}
+
+	if (out.lfo_len > INT_MAX) {
+		errno = EOVERFLOW;
+		return (-1);
+	}
+
+	if (bufsz > 0) {
+		buf[out.lfo_len < bufsz ? out.lfo_len : bufsz - 1] = '\0';
+	}
+
+	return ((int)out.lfo_len);
+}
+
+EXPORTED_SYM
+int
+lattutil_log_snprintf(char *buf, size_t bufsz, const char *fmt, ...)
+{
+	va_list args;
+	int res;
+
+	va_start(args, fmt);
+	res = lattutil_log_vsnprintf(buf, bufsz, fmt, args);
+	va_end(args);
+
+	return (res);
+}
+
+/*
+ * Append len bytes, keeping count of the full length even once the
+ * buffer is full, as vsnprintf(3) does.
+ */
+static inline void
+_lattutil_fmt_put(lattutil_fmt_out_t *out, const char *s, size_t len)
+{
+	size_t avail;
+
+	if (out->lfo_len < out->lfo_bufsz) {
+		avail = out->lfo_bufsz - out->lfo_len;
+		memcpy(out->lfo_buf + out->lfo_len, s,
+		    len < avail ? len : avail);
+	}
+	out->lfo_len += len;
+}
+
+/*
+ * Write the digits of v ending just before end and return a pointer
+ * to the first digit.
+ */
+static inline char *
+_lattutil_fmt_dec(char *end, uint64_t v)
+{
+	unsigned int i;
+
+	while (v >= 100) {
+		i = (unsigned int)(v % 100) * 2;
+		v /= 100;
+		*--end = _lattutil_fmt_digits[i + 1];
+		*--end = _lattutil_fmt_digits[i];
+	}
+
+	if (v >= 10) {
+		i = (unsigned int)v * 2;
+		*--end = _lattutil_fmt_digits[i + 1];
+		*--end = _lattutil_fmt_digits[i];
+	} else {
+		*--end = '0' + (char)v;
+	}
+
+	return (end);
+}
+
+static inline char *
+_lattutil_fmt_hex(char *end, uint64_t v, const char *digits)
+{
+
+	do {
+		*--end = digits[v & 0xf];
+		v >>= 4;
+	} while (v != 0);
+
+	return (end);
+}
+
+static bool
+_lattutil_fmt_fast(lattutil_fmt_out_t *out, const char *fmt, va_list args)
+{
+	char num[24], *end, *p;
+	const char *pct, *s;
+	uint64_t uval;
+	int64_t sval;
+	void *ptr;
+	int mod;
+	char c;
+
+	end = num + sizeof(num);
+
+	for (;;) {
+		pct = strchr(fmt, '%');
+		if (pct == NULL) {
+			_lattutil_fmt_put(out, fmt, strlen(fmt));
+			return (true);
+		}
+		_lattutil_fmt_put(out, fmt, pct - fmt);
+
+		fmt = pct + 1;
+		mod = LATTUTIL_FMT_MOD_NONE;
+		if (*fmt == 'l') {
+			fmt++;
+			mod = LATTUTIL_FMT_MOD_L;
+			if (*fmt == 'l') {
+				fmt++;
+				mod = LATTUTIL_FMT_MOD_LL;
+			}
+		} else if (*fmt == 'z') {
+			fmt++;
+			mod = LATTUTIL_FMT_MOD_Z;
+		}
+
+		switch (*fmt) {
+		case '%':
+			if (mod != LATTUTIL_FMT_MOD_NONE) {
+				return (false);
+			}
+			_lattutil_fmt_put(out, "%", 1);
+			break;
+		case 's':
+			if (mod != LATTUTIL_FMT_MOD_NONE) {
+				return (false);
+			}
+			s = va_arg(args, const char *);
+			if (s == NULL) {
+				s = "(null)";
+			}
+			_lattutil_fmt_put(out, s, strlen(s));
+			break;
+		case 'c':
+			if (mod != LATTUTIL_FMT_MOD_NONE) {
+				return (false);
+			}
+			c = (char)va_arg(args, int);
+			_lattutil_fmt_put(out, &c, 1);
+			break;
+		case 'd':
+		case 'i':
+			switch (mod) {
+			case LATTUTIL_FMT_MOD_L:
+				sval = va_arg(args, long);
+				break;
+			case LATTUTIL_FMT_MOD_LL:
+				sval = va_arg(args, long long);
+				break;
+			case LATTUTIL_FMT_MOD_Z:
+				sval = va_arg(args, ssize_t);
+				break;
+			default:
+				sval = va_arg(args, int);
+				break;
+			}
+			if (sval < 0) {
+				p = _lattutil_fmt_dec(end, -(uint64_t)sval);
+				*--p = '-';
+			} else {
+				p = _lattutil_fmt_dec(end, (uint64_t)sval);
+			}
+			_lattutil_fmt_put(out, p, end - p);
+			break;
+		case 'u':
+		case 'x':
+		case 'X':
+			switch (mod) {
+			case LATTUTIL_FMT_MOD_L:
+				uval = va_arg(args, unsigned long);
+				break;
+			case LATTUTIL_FMT_MOD_LL:
+				uval = va_arg(args, unsigned long long);
+				break;
+			case LATTUTIL_FMT_MOD_Z:
+				uval = va_arg(args, size_t);
+				break;
+			default:
+				uval = va_arg(args, unsigned int);
+				break;
+			}
+			if (*fmt == 'u') {
+				p = _lattutil_fmt_dec(end, uval);
+			} else {
+				p = _lattutil_fmt_hex(end, uval, *fmt == 'x' ?
+				    _lattutil_fmt_lhex : _lattutil_fmt_uhex);
+			}
+			_lattutil_fmt_put(out, p, end - p);
+			break;
+		case 'p':
+			if (mod != LATTUTIL_FMT_MOD_NONE) {
+				return (false);
+			}
+			/* libcs disagree on how to print NULL. */
+			ptr = va_arg(args, void *);
+			if (ptr == NULL) {
+				return (false);
+			}
+			p = _lattutil_fmt_hex(end, (uintptr_t)ptr,
+			    _lattutil_fmt_lhex);
+			*--p = 'x';
+			*--p = '0';
+			_lattutil_fmt_put(out, p, end - p);
+			break;
+		default:
+			return (false);
+		}
+
+		fmt++;
+	}
+}
@@ -0,0 +1,320 @@
+/*-
+ * Copyright (c) 2021 Shawn Webb <shawn.webb@hardenedbsd.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <stdint.h>
+
+#include "liblattutil.h"
+
+/*
+ * Structured records are encoded as one JSON object per line and
+ * handed to the backend's emit handler with LATTUTIL_LOG_LEVEL_RAW,
+ * so no level prefix is added in front of the object.
+ *
+ * Strings are escaped a word at a time: eight bytes are loaded at
+ * once and checked for control characters, quotes, and backslashes
+ * with the usual SWAR zero-byte tricks. Clean words are copied as is;
+ * only words containing a byte that needs escaping take the slow
+ * path.
+ */
+
+#define	LATTUTIL_KV_ONES	0x0101010101010101ULL
+#define	LATTUTIL_KV_HIGHS	0x8080808080808080ULL
+
+#define	LATTUTIL_KV_HASZERO(w)						\
+    (((w) - LATTUTIL_KV_ONES) & ~(w) & LATTUTIL_KV_HIGHS)
+#define	LATTUTIL_KV_HASLESS(w, n)					\
+    (((w) - LATTUTIL_KV_ONES * (n)) & ~(w) & LATTUTIL_KV_HIGHS)
+#define	LATTUTIL_KV_HASBYTE(w, c)					\
+    LATTUTIL_KV_HASZERO((w) ^ (LATTUTIL_KV_ONES * (c)))
+
+static bool _lattutil_log_kv_escape(lattutil_log_buf_t *, const char *);
+static void _lattutil_log_kv_escape_byte(lattutil_log_buf_t *,
+    unsigned char);
+static bool _lattutil_log_kv_key(lattutil_log_buf_t *, const char *);
+static bool _lattutil_log_kv_uint(lattutil_log_buf_t *, uint64_t, bool);
+static bool _lattutil_log_kv_double(lattutil_log_buf_t *, double);
+
+EXPORTED_SYM
+ssize_t
+lattutil_log_kv(lattutil_log_t *logp, lattutil_log_level_t level,
+    int verbose, const char *msg, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	va_start(args, msg);
+	len = lattutil_log_vkv(logp, level, verbose, msg, args);
+	va_end(args);
+
+	return (len);
+}
+
+EXPORTED_SYM
+ssize_t
+lattutil_log_vkv(lattutil_log_t *logp, lattutil_log_level_t level,
+    int verbose, const char *msg, va_list args)
+{
+	lattutil_log_buf_t buf;
+	const char *key, *str;
+	int64_t i64;
+	ssize_t len;
+	bool ok;
+	int type;
+
+	if (logp == NULL || logp->ll_log_emit == NULL ||
+	    level >= LATTUTIL_LOG_LEVEL_MAX ||
+	    !LATTUTIL_LOG_WANTED(logp, level, verbose)) {
+		return (0);
+	}
+
+	if (!lattutil_log_buf_begin(&buf)) {
+		return (-1);
+	}
+
+	ok = lattutil_log_buf_append(&buf, "{\"level\":\"", 10) &&
+	    lattutil_log_buf_append(&buf, lattutil_log_level_tag(level),
+	    strlen(lattutil_log_level_tag(level))) &&
+	    lattutil_log_buf_append(&buf, "\"", 1);
+
+	if (ok && msg != NULL) {
+		ok = _lattutil_log_kv_key(&buf, "msg") &&
+		    _lattutil_log_kv_escape(&buf, msg);
+	}
+
+	while (ok && (key = va_arg(args, const char *)) != NULL) {
+		type = va_arg(args, int);
+		ok = _lattutil_log_kv_key(&buf, key);
+		if (!ok) {
+			break;
+		}
+
+		switch (type) {
+		case LATTUTIL_KV_STRING:
+			str = va_arg(args, const char *);
+			if (str == NULL) {
+				ok = lattutil_log_buf_append(&buf, "null", 4);
+			} else {
+				ok = _lattutil_log_kv_escape(&buf, str);
+			}
+			break;
+		case LATTUTIL_KV_INT:
+			i64 = va_arg(args, int);
+			ok = _lattutil_log_kv_uint(&buf, i64 < 0 ?
+			    -(uint64_t)i64 : (uint64_t)i64, i64 < 0);
+			break;
+		case LATTUTIL_KV_INT64:
+			i64 = va_arg(args, int64_t);
+			ok = _lattutil_log_kv_uint(&buf, i64 < 0 ?
+			    -(uint64_t)i64 : (uint64_t)i64, i64 < 0);
+			break;
+		case LATTUTIL_KV_UINT64:
+			ok = _lattutil_log_kv_uint(&buf,
+			    va_arg(args, uint64_t), false);
+			break;
+		case LATTUTIL_KV_DOUBLE:
+			ok = _lattutil_log_kv_double(&buf,
+			    va_arg(args, double));
+			break;
+		case LATTUTIL_KV_BOOL:
+			if (va_arg(args, int)) {
+				ok = lattutil_log_buf_append(&buf, "true", 4);
+			} else {
+				ok = lattutil_log_buf_append(&buf, "false", 5);
+			}
+			break;
+		default:
+			/* The remaining arguments cannot be walked. */
+			ok = lattutil_log_buf_append(&buf, "null", 4);
+			goto done;
+		}
+	}
+
+done:
+	if (ok) {
+		ok = lattutil_log_buf_append(&buf, "}", 1);
+	}
+
+	if (!ok) {
+		lattutil_log_buf_release(&buf);
+		return (-1);
+	}
+
+	len = logp->ll_log_emit(logp, level | LATTUTIL_LOG_LEVEL_RAW,
+	    buf.llb_buf, buf.llb_len);
+	lattutil_log_buf_release(&buf);
+
+	return (len);
+}
+
+static bool
+_lattutil_log_kv_key(lattutil_log_buf_t *buf, const char *key)
+{
+
+	return (lattutil_log_buf_append(buf, ",", 1) &&
+	    _lattutil_log_kv_escape(buf, key) &&
+	    lattutil_log_buf_append(buf, ":", 1));
+}
+
+/*
+ * Append str as a quoted JSON string.
+ */
+static bool
+_lattutil_log_kv_escape(lattutil_log_buf_t *buf, const char *str)
+{
+	const unsigned char *p, *end;
+	uint64_t w;
+	size_t len;
+	char *out;
+
+	len = strlen(str);
+
+	/* Worst case every byte becomes a six byte \uXXXX escape. */
+	if (!lattutil_log_buf_reserve(buf, len * 6 + 2)) {
+		return (false);
+	}
+
+	out = buf->llb_buf + buf->llb_len;
+	*out++ = '"';
+
+	p = (const unsigned char *)str;
+	end = p + len;
+	while (p < end) {
+		if ((size_t)(end - p) >= sizeof(w)) {
+			memcpy(&w, p, sizeof(w));
+			if ((LATTUTIL_KV_HASLESS(w, 0x20) |
+			    LATTUTIL_KV_HASBYTE(w, '"') |
+			    LATTUTIL_KV_HASBYTE(w, '\\')) == 0) {
+				memcpy(out, &w, sizeof(w));
+				out += sizeof(w);
+				p += sizeof(w);
+				continue;
+			}
+		}
+
+		if (*p >= 0x20 && *p != '"' && *p != '\\') {
+			*out++ = *p++;
+			continue;
+		}
+
+		buf->llb_len = out - buf->llb_buf;
+		_lattutil_log_kv_escape_byte(buf, *p++);
+		out = buf->llb_buf + buf->llb_len;
+	}
+
+	*out++ = '"';
+	*out = '\0';
+	buf->llb_len = out - buf->llb_buf;
+
+	return (true);
+}
+
+/*
+ * Room for the escape has already been reserved by the caller.
+ */
+static void
+_lattutil_log_kv_escape_byte(lattutil_log_buf_t *buf, unsigned char c)
+{
+	static const char hex[] = "0123456789abcdef";
+	char esc[6];
+	size_t len;
+
+	esc[0] = '\\';
+	len = 2;
+	switch (c) {
+	case '"':
+		esc[1] = '"';
+		break;
+	case '\\':
+		esc[1] = '\\';
+		break;
+	case '\b':
+		esc[1] = 'b';
+		break;
+	case '\f':
+		esc[1] = 'f';
+		break;
+	case '\n':
+		esc[1] = 'n';
+		break;
+	case '\r':
+		esc[1] = 'r';
+		break;
+	case '\t':
+		esc[1] = 't';
+		break;
+	default:
+		esc[1] = 'u';
+		esc[2] = '0';
+		esc[3] = '0';
+		esc[4] = hex[c >> 4];
+		esc[5] = hex[c & 0xf];
+		len = 6;
+		break;
+	}
+
+	memcpy(buf->llb_buf + buf->llb_len, esc, len);
+	buf->llb_len += len;
+}
+
+static bool
+_lattutil_log_kv_uint(lattutil_log_buf_t *buf, uint64_t val, bool neg)
+{
+	char num[24], *p;
+
+	p = num + sizeof(num);
+	do {
+		*--p = '0' + (val % 10);
+		val /= 10;
+	} while (val > 0);
+
+	if (neg) {
+		*--p = '-';
+	}
+
+	return (lattutil_log_buf_append(buf, p, num + sizeof(num) - p));
+}
+
+static bool
+_lattutil_log_kv_double(lattutil_log_buf_t *buf, double val)
+{
+	char num[32];
+	int len;
+
+	/* JSON has no representation for NaN or infinity. */
+	if (!isfinite(val)) {
+		return (lattutil_log_buf_append(buf, "null", 4));
+	}
+
+	len = snprintf(num, sizeof(num), "%.17g", val);
+	if (len < 0 || (size_t)len >= sizeof(num)) {
+		return (false);
+	}
+
+	return (lattutil_log_buf_append(buf, num, len));
+}
@@ -27,10 +27,17 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <pthread.h>
 #include <syslog.h>
 
 #include "liblattutil.h"
 
+static pthread_mutex_t _lattutil_log_levels_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static log_cb *_lattutil_log_level_cb(lattutil_log_t *,
+    lattutil_log_level_t);
+static log_cb _lattutil_log_dummy_cb(lattutil_log_level_t);
+
 EXPORTED_SYM
 lattutil_log_t *
 lattutil_log_init(char *path, int verbosity)
@@ -46,6 +53,7 @@ lattutil_log_init(char *path, int verbosity)
 
 	res->ll_verbosity = (verbosity == -1) ? LATTUTIL_LOG_VERBOSITY_DEFAULT :
 	    verbosity;
+	res->ll_levels = LATTUTIL_LOG_LEVELS_ALL;
 	if (path != NULL) {
 		res->ll_path = strdup(path);
 		if (res->ll_path == NULL) {
@@ -75,8 +83,10 @@ lattutil_log_free(lattutil_log_t **logp)
 		logp2->ll_log_close(logp2);
 	}
 
+	lattutil_log_prefix_free(logp2);
 	free(logp2->ll_path);
 	memset(logp2, 0, sizeof(*logp2));
+	free(logp2);
 	*logp = NULL;
 }
 
@@ -120,7 +130,7 @@ lattutil_log_verbosity(lattutil_log_t *logp)
 		return (-1);
 	}
 
-	return (logp->ll_verbosity);
+	return (LATTUTIL_LOG_VERBOSITY(logp));
 }
 
 EXPORTED_SYM
@@ -133,13 +143,45 @@ lattutil_log_set_verbosity(lattutil_log_t *logp, int verbosity)
 		return (-1);
 	}
 
-	old = logp->ll_verbosity;
-
 	if (verbosity == -1) {
 		verbosity = LATTUTIL_LOG_VERBOSITY_DEFAULT;
 	}
 
-	logp->ll_verbosity = verbosity;
+	old = __atomic_exchange_n(&(logp->ll_verbosity), verbosity,
+	    __ATOMIC_RELAXED);
+
+	return (old);
+}
+
+EXPORTED_SYM
+unsigned int
+lattutil_log_levels(lattutil_log_t *logp)
+{
+
+	if (logp == NULL) {
+		return (0);
+	}
+
+	return (LATTUTIL_LOG_LEVELS(logp));
+}
+
+EXPORTED_SYM
+unsigned int
+lattutil_log_set_levels(lattutil_log_t *logp, unsigned int levels)
+{
+	unsigned int old;
+
+	if (logp == NULL) {
+		return (0);
+	}
+
+	/* Serialize concurrent callers around the stashed handlers. */
+	pthread_mutex_lock(&_lattutil_log_levels_mtx);
+	old = __atomic_exchange_n(&(logp->ll_levels),
+	    levels & LATTUTIL_LOG_LEVELS_ALL, __ATOMIC_RELAXED);
+
+	lattutil_log_apply_levels(logp);
+	pthread_mutex_unlock(&_lattutil_log_levels_mtx);
 
 	return (old);
 }
@@ -172,3 +214,110 @@ lattutil_log_get_aux(lattutil_log_t *logp, size_t *auxsz)
 
 	return (logp->ll_aux);
 }
+
+const char *
+lattutil_log_level_prefix(lattutil_log_level_t level)
+{
+
+	if (level & LATTUTIL_LOG_LEVEL_RAW) {
+		return ("");
+	}
+
+	switch (level) {
+	case LATTUTIL_LOG_LEVEL_DEBUG:
+		return ("DEBUG: ");
+	case LATTUTIL_LOG_LEVEL_ERR:
+		return ("ERROR: ");
+	case LATTUTIL_LOG_LEVEL_INFO:
+		return ("INFO: ");
+	case LATTUTIL_LOG_LEVEL_WARN:
+		return ("WARNING: ");
+	default:
+		return ("UNKNOWN: ");
+	}
+}
+
+const char *
+lattutil_log_level_tag(lattutil_log_level_t level)
+{
+
+	switch (LATTUTIL_LOG_LEVEL_BASE(level)) {
+	case LATTUTIL_LOG_LEVEL_DEBUG:
+		return ("DEBUG");
+	case LATTUTIL_LOG_LEVEL_ERR:
+		return ("ERROR");
+	case LATTUTIL_LOG_LEVEL_INFO:
+		return ("INFO");
+	case LATTUTIL_LOG_LEVEL_WARN:
+		return ("WARNING");
+	default:
+		return ("UNKNOWN");
+	}
+}
+
+/*
+ * Swap the handlers of disabled levels for the dummy handlers and
+ * restore the stashed handlers of enabled levels. Backends call this
+ * after installing their handlers so that the level mask survives
+ * switching backends. Handlers are replaced with atomic stores since
+ * other threads may be calling through them.
+ */
+void
+lattutil_log_apply_levels(lattutil_log_t *logp)
+{
+	lattutil_log_level_t level;
+	log_cb *cbp, dummy;
+
+	for (level = 0; level < LATTUTIL_LOG_LEVEL_MAX; level++) {
+		cbp = _lattutil_log_level_cb(logp, level);
+		dummy = _lattutil_log_dummy_cb(level);
+
+		if (LATTUTIL_LOG_LEVELS(logp) &
+		    LATTUTIL_LOG_LEVEL_MASK(level)) {
+			if (*cbp == dummy &&
+			    logp->ll_log_saved[level] != NULL) {
+				__atomic_store_n(cbp, logp->ll_log_saved[level],
+				    __ATOMIC_RELEASE);
+			}
+			logp->ll_log_saved[level] = NULL;
+			continue;
+		}
+
+		if (*cbp != dummy) {
+			logp->ll_log_saved[level] = *cbp;
+			__atomic_store_n(cbp, dummy, __ATOMIC_RELEASE);
+		}
+	}
+}
+
+static log_cb *
+_lattutil_log_level_cb(lattutil_log_t *logp, lattutil_log_level_t level)
+{
+
+	switch (level) {
+	case LATTUTIL_LOG_LEVEL_DEBUG:
+		return (&(logp->ll_log_debug));
+	case LATTUTIL_LOG_LEVEL_ERR:
+		return (&(logp->ll_log_err));
+	case LATTUTIL_LOG_LEVEL_INFO:
+		return (&(logp->ll_log_info));
+	default:
+		return (&(logp->ll_log_warn));
+	}
+}
+
+static log_cb
+_lattutil_log_dummy_cb(lattutil_log_level_t level)
+{
+
+	switch (level) {
+	case LATTUTIL_LOG_LEVEL_DEBUG:
+		return (lattutil_log_dummy_debug);
+	case LATTUTIL_LOG_LEVEL_ERR:
+		return (lattutil_log_dummy_err);
+	case LATTUTIL_LOG_LEVEL_INFO:
+		return (lattutil_log_dummy_info);
+	default:
+		return (lattutil_log_dummy_warn);
+	}
+}
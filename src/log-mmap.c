@@ -0,0 +1,504 @@
+/*-
+ * Copyright (c) 2021 Shawn Webb <shawn.webb@hardenedbsd.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "liblattutil.h"
+
+/*
+ * Flight recorder format
+ *
+ * The file is a 64-byte header followed by an array of fixed-size
+ * slots used as a ring. The header holds a magic, the slot size, the
+ * number of slots, and the sequence number of the next record. Each
+ * slot holds the sequence number of its record plus one (zero means
+ * empty), a timestamp in nanoseconds, the level, the message length,
+ * and the message truncated to fit the slot.
+ *
+ * A writer claims a sequence number with one atomic increment, marks
+ * the slot busy, copies the message in, and publishes the slot by
+ * storing its sequence number. Nothing is written with write(2); the
+ * kernel keeps the dirty pages of the shared mapping, so the records
+ * survive the process being killed. If a writer finds its slot busy
+ * because the ring lapped a slow writer, the record is dropped.
+ *
+ * Values are stored in host byte order.
+ */
+
+#define	LATTUTIL_LOG_MMAP_MAGIC		"LLFREC\0\1"
+#define	LATTUTIL_LOG_MMAP_SLOTSZ	256
+#define	LATTUTIL_LOG_MMAP_BUSY		UINT64_MAX
+
+typedef struct _lattutil_log_mmap_hdr {
+	char			 lmh_magic[8];
+	uint32_t		 lmh_slotsz;
+	uint32_t		 lmh_pad;
+	uint64_t		 lmh_nslots;
+	_Atomic(uint64_t)	 lmh_head;
+	char			 lmh_reserved[32];
+} lattutil_log_mmap_hdr_t;
+
+typedef struct _lattutil_log_mmap_slot {
+	_Atomic(uint64_t)	 lms_seq;
+	uint64_t		 lms_ts;
+	uint16_t		 lms_len;
+	uint8_t			 lms_level;
+	uint8_t			 lms_pad[5];
+	char			 lms_msg[LATTUTIL_LOG_MMAP_SLOTSZ - 24];
+} lattutil_log_mmap_slot_t;
+
+typedef struct _lattutil_log_mmap {
+	lattutil_log_mmap_hdr_t		*lm_hdr;
+	lattutil_log_mmap_slot_t	*lm_slots;
+	uint64_t			 lm_nslots;
+	size_t				 lm_mapsz;
+	_Atomic(uint64_t)		 lm_dropped;
+} lattutil_log_mmap_t;
+
+static bool _lattutil_log_mmap_valid(const lattutil_log_mmap_hdr_t *,
+    size_t);
+static lattutil_log_mmap_slot_t *_lattutil_log_mmap_claim(
+    lattutil_log_mmap_t *, uint64_t *);
+static void _lattutil_log_mmap_publish(lattutil_log_mmap_slot_t *,
+    lattutil_log_level_t, uint64_t, size_t);
+static ssize_t _lattutil_log_mmap_vlog(lattutil_log_t *,
+    lattutil_log_level_t, const char *, va_list);
+
+EXPORTED_SYM
+bool
+lattutil_log_mmap_init(lattutil_log_t *logp, const char *path, size_t size)
+{
+	lattutil_log_mmap_slot_t *slots;
+	lattutil_log_mmap_hdr_t *hdr;
+	lattutil_log_mmap_t *lm;
+	struct stat sb;
+	uint64_t i, nslots;
+	size_t mapsz;
+	void *map;
+	int fd;
+
+	if (logp == NULL || path == NULL) {
+		return (false);
+	}
+
+	nslots = size / LATTUTIL_LOG_MMAP_SLOTSZ;
+	if (nslots == 0) {
+		return (false);
+	}
+	mapsz = sizeof(*hdr) + nslots * LATTUTIL_LOG_MMAP_SLOTSZ;
+
+	lm = calloc(1, sizeof(*lm));
+	if (lm == NULL) {
+		return (false);
+	}
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		free(lm);
+		return (false);
+	}
+
+	if (fstat(fd, &sb) || (sb.st_size != (off_t)mapsz &&
+	    ftruncate(fd, mapsz))) {
+		close(fd);
+		free(lm);
+		return (false);
+	}
+
+	map = mmap(NULL, mapsz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		free(lm);
+		return (false);
+	}
+
+	/*
+	 * Keep the records of a previous run if the ring has the same
+	 * geometry, so they are not lost to an automatic restart.
+	 */
+	hdr = map;
+	if (!_lattutil_log_mmap_valid(hdr, mapsz)) {
+		memset(map, 0, mapsz);
+		memcpy(hdr->lmh_magic, LATTUTIL_LOG_MMAP_MAGIC,
+		    sizeof(hdr->lmh_magic));
+		hdr->lmh_slotsz = LATTUTIL_LOG_MMAP_SLOTSZ;
+		hdr->lmh_nslots = nslots;
+		atomic_init(&(hdr->lmh_head), 0);
+	} else {
+		/*
+		 * A writer that died between claiming a slot and
+		 * publishing it leaves the slot busy, and every later
+		 * lap would drop its record. Nothing else has the ring
+		 * mapped for writing yet, so mark such slots empty.
+		 */
+		slots = (lattutil_log_mmap_slot_t *)(hdr + 1);
+		for (i = 0; i < nslots; i++) {
+			if (atomic_load_explicit(&(slots[i].lms_seq),
+			    memory_order_relaxed) ==
+			    LATTUTIL_LOG_MMAP_BUSY) {
+				atomic_store_explicit(&(slots[i].lms_seq), 0,
+				    memory_order_relaxed);
+			}
+		}
+	}
+
+	lm->lm_hdr = hdr;
+	lm->lm_slots = (lattutil_log_mmap_slot_t *)(hdr + 1);
+	lm->lm_nslots = nslots;
+	lm->lm_mapsz = mapsz;
+	atomic_init(&(lm->lm_dropped), 0);
+
+	if (logp->ll_log_close != NULL) {
+		logp->ll_log_close(logp);
+	}
+
+	logp->ll_internalaux = lm;
+	logp->ll_internalauxsz = sizeof(*lm);
+
+	logp->ll_log_close = lattutil_log_mmap_close;
+	logp->ll_log_debug = lattutil_log_mmap_debug;
+	logp->ll_log_err = lattutil_log_mmap_err;
+	logp->ll_log_info = lattutil_log_mmap_info;
+	logp->ll_log_warn = lattutil_log_mmap_warn;
+	logp->ll_log_emit = lattutil_log_mmap_emit;
+
+	lattutil_log_apply_levels(logp);
+
+	return (true);
+}
+
+EXPORTED_SYM
+uint64_t
+lattutil_log_mmap_dropped(lattutil_log_t *logp)
+{
+	lattutil_log_mmap_t *lm;
+
+	if (logp == NULL || logp->ll_log_close != lattutil_log_mmap_close) {
+		return (0);
+	}
+
+	lm = logp->ll_internalaux;
+
+	return (atomic_load_explicit(&(lm->lm_dropped),
+	    memory_order_relaxed));
+}
+
+/*
+ * Print the records of a flight recorder file, oldest first.
+ */
+EXPORTED_SYM
+bool
+lattutil_log_mmap_dump(const char *path, FILE *out, int flags)
+{
+	const lattutil_log_mmap_slot_t *slot;
+	const lattutil_log_mmap_hdr_t *hdr;
+	uint64_t head, seq, nslots;
+	char stamp[32];
+	size_t len;
+	struct stat sb;
+	struct tm tm;
+	time_t secs;
+	void *map;
+	int fd;
+
+	if (path == NULL || out == NULL) {
+		return (false);
+	}
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return (false);
+	}
+
+	if (fstat(fd, &sb) || (size_t)sb.st_size < sizeof(*hdr)) {
+		close(fd);
+		return (false);
+	}
+
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return (false);
+	}
+
+	hdr = map;
+	if (!_lattutil_log_mmap_valid(hdr, sb.st_size)) {
+		munmap(map, sb.st_size);
+		return (false);
+	}
+
+	nslots = hdr->lmh_nslots;
+	head = atomic_load_explicit(&(hdr->lmh_head), memory_order_acquire);
+	seq = (head > nslots) ? head - nslots : 0;
+
+	for (; seq < head; seq++) {
+		slot = (const lattutil_log_mmap_slot_t *)(hdr + 1) +
+		    (seq % nslots);
+
+		/* Skip slots that were lapped or never published. */
+		if (atomic_load_explicit(&(slot->lms_seq),
+		    memory_order_acquire) != seq + 1 ||
+		    slot->lms_level >= LATTUTIL_LOG_LEVEL_MAX) {
+			continue;
+		}
+
+		if ((flags & LATTUTIL_LOG_DECODE_TIMESTAMPS) != 0) {
+			secs = slot->lms_ts / 1000000000ULL;
+			localtime_r(&secs, &tm);
+			strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S",
+			    &tm);
+			fprintf(out, "%s.%06lu ", stamp,
+			    (unsigned long)((slot->lms_ts % 1000000000ULL) /
+			    1000));
+		}
+
+		/* The length comes from the file; never trust it. */
+		len = slot->lms_len;
+		if (len > sizeof(slot->lms_msg)) {
+			len = sizeof(slot->lms_msg);
+		}
+
+		fprintf(out, "%s%.*s\n",
+		    lattutil_log_level_prefix(slot->lms_level),
+		    (int)len, slot->lms_msg);
+	}
+
+	munmap(map, sb.st_size);
+
+	return (true);
+}
+
+ssize_t
+lattutil_log_mmap_debug(lattutil_log_t *logp, int verbose,
+    const char *fmt, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_mmap_vlog(logp,
+		    LATTUTIL_LOG_LEVEL_DEBUG, fmt, args);
+		va_end(args);
+	}
+
+	return (len);
+}
+
+ssize_t
+lattutil_log_mmap_err(lattutil_log_t *logp, int verbose,
+    const char *fmt, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_mmap_vlog(logp,
+		    LATTUTIL_LOG_LEVEL_ERR, fmt, args);
+		va_end(args);
+	}
+
+	return (len);
+}
+
+ssize_t
+lattutil_log_mmap_info(lattutil_log_t *logp, int verbose,
+    const char *fmt, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_mmap_vlog(logp,
+		    LATTUTIL_LOG_LEVEL_INFO, fmt, args);
+		va_end(args);
+	}
+
+	return (len);
+}
+
+ssize_t
+lattutil_log_mmap_warn(lattutil_log_t *logp, int verbose,
+    const char *fmt, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_mmap_vlog(logp,
+		    LATTUTIL_LOG_LEVEL_WARN, fmt, args);
+		va_end(args);
+	}
+
+	return (len);
+}
+
+ssize_t
+lattutil_log_mmap_emit(lattutil_log_t *logp, lattutil_log_level_t level,
+    const char *msg, size_t len)
+{
+	lattutil_log_mmap_slot_t *slot;
+	uint64_t seq;
+
+	slot = _lattutil_log_mmap_claim(logp->ll_internalaux, &seq);
+	if (slot == NULL) {
+		return (0);
+	}
+
+	if (len > sizeof(slot->lms_msg)) {
+		len = sizeof(slot->lms_msg);
+	}
+	memcpy(slot->lms_msg, msg, len);
+	_lattutil_log_mmap_publish(slot, level, seq, len);
+
+	return (len);
+}
+
+void
+lattutil_log_mmap_close(lattutil_log_t *logp)
+{
+	lattutil_log_mmap_t *lm;
+
+	lm = logp->ll_internalaux;
+	if (lm == NULL) {
+		return;
+	}
+
+	msync(lm->lm_hdr, lm->lm_mapsz, MS_SYNC);
+	munmap(lm->lm_hdr, lm->lm_mapsz);
+
+	memset(lm, 0, sizeof(*lm));
+	free(lm);
+
+	logp->ll_internalaux = NULL;
+	logp->ll_internalauxsz = 0;
+}
+
+static bool
+_lattutil_log_mmap_valid(const lattutil_log_mmap_hdr_t *hdr, size_t mapsz)
+{
+
+	/* Bound the slot count first so that the size cannot wrap. */
+	return (mapsz >= sizeof(*hdr) &&
+	    !memcmp(hdr->lmh_magic, LATTUTIL_LOG_MMAP_MAGIC,
+	    sizeof(hdr->lmh_magic)) &&
+	    hdr->lmh_slotsz == LATTUTIL_LOG_MMAP_SLOTSZ &&
+	    hdr->lmh_nslots > 0 &&
+	    hdr->lmh_nslots <= (mapsz - sizeof(*hdr)) /
+	    LATTUTIL_LOG_MMAP_SLOTSZ &&
+	    sizeof(*hdr) + hdr->lmh_nslots * LATTUTIL_LOG_MMAP_SLOTSZ ==
+	    mapsz);
+}
+
+/*
+ * Claim the slot for the next sequence number and mark it busy.
+ */
+static lattutil_log_mmap_slot_t *
+_lattutil_log_mmap_claim(lattutil_log_mmap_t *lm, uint64_t *seqp)
+{
+	lattutil_log_mmap_slot_t *slot;
+	uint64_t seq, cur;
+
+	seq = atomic_fetch_add_explicit(&(lm->lm_hdr->lmh_head), 1,
+	    memory_order_relaxed);
+	slot = &(lm->lm_slots[seq % lm->lm_nslots]);
+
+	cur = atomic_load_explicit(&(slot->lms_seq), memory_order_relaxed);
+	if (cur == LATTUTIL_LOG_MMAP_BUSY ||
+	    !atomic_compare_exchange_strong_explicit(&(slot->lms_seq), &cur,
+	    LATTUTIL_LOG_MMAP_BUSY, memory_order_acquire,
+	    memory_order_relaxed)) {
+		atomic_fetch_add_explicit(&(lm->lm_dropped), 1,
+		    memory_order_relaxed);
+		return (NULL);
+	}
+
+	*seqp = seq;
+
+	return (slot);
+}
+
+static void
+_lattutil_log_mmap_publish(lattutil_log_mmap_slot_t *slot,
+    lattutil_log_level_t level, uint64_t seq, size_t len)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	slot->lms_ts = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	slot->lms_level = LATTUTIL_LOG_LEVEL_BASE(level);
+	slot->lms_len = len;
+	atomic_store_explicit(&(slot->lms_seq), seq + 1,
+	    memory_order_release);
+}
+
+/*
+ * Format straight into the slot. Messages that do not fit are
+ * truncated.
+ */
+static ssize_t
+_lattutil_log_mmap_vlog(lattutil_log_t *logp, lattutil_log_level_t level,
+    const char *fmt, va_list args)
+{
+	lattutil_log_mmap_slot_t *slot;
+	uint64_t seq;
+	int res;
+
+	slot = _lattutil_log_mmap_claim(logp->ll_internalaux, &seq);
+	if (slot == NULL) {
+		return (0);
+	}
+
+	res = lattutil_log_vsnprintf(slot->lms_msg, sizeof(slot->lms_msg), fmt,
+	    args);
+	if (res < 0) {
+		res = 0;
+	} else if ((size_t)res >= sizeof(slot->lms_msg)) {
+		res = sizeof(slot->lms_msg) - 1;
+	}
+	_lattutil_log_mmap_publish(slot, level, seq, res);
+
+	return (res);
+}
@@ -0,0 +1,222 @@
+/*-
+ * Copyright (c) 2021 Shawn Webb <shawn.webb@hardenedbsd.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/param.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <time.h>
+
+#include "liblattutil.h"
+
+/*
+ * Line prefixes for the text backends. The parts that never change
+ * (host name, program name, pid, level tag) are rendered once per
+ * level by lattutil_log_set_prefix(). The timestamp is rendered into
+ * a per-thread cache and only redone when the second changes, so a
+ * timestamped line costs a coarse clock read and two small copies.
+ */
+
+#if defined(CLOCK_REALTIME_COARSE)
+#define	LATTUTIL_LOG_PREFIX_CLOCK	CLOCK_REALTIME_COARSE
+#elif defined(CLOCK_REALTIME_FAST)
+#define	LATTUTIL_LOG_PREFIX_CLOCK	CLOCK_REALTIME_FAST
+#else
+#define	LATTUTIL_LOG_PREFIX_CLOCK	CLOCK_REALTIME
+#endif
+
+typedef struct _lattutil_log_timecache {
+	time_t	 ltc_sec;
+	size_t	 ltc_len;
+	char	 ltc_str[32];
+} lattutil_log_timecache_t;
+
+static __thread lattutil_log_timecache_t _lattutil_log_timecache = {
+	.ltc_sec = -1,
+};
+
+static size_t _lattutil_log_prefix_time(char *, unsigned int);
+
+EXPORTED_SYM
+bool
+lattutil_log_set_prefix(lattutil_log_t *logp, unsigned int flags)
+{
+	char *prefixes[LATTUTIL_LOG_LEVEL_MAX];
+	char host[MAXHOSTNAMELEN];
+	char fixed[LATTUTIL_LOG_PREFIX_MAX];
+	lattutil_log_level_t level;
+	const char *name, *p;
+	size_t len;
+
+	if (logp == NULL) {
+		return (false);
+	}
+
+	if (flags & LATTUTIL_LOG_PREFIX_MSEC) {
+		flags |= LATTUTIL_LOG_PREFIX_TIME;
+	}
+
+	len = 0;
+	fixed[0] = '\0';
+	if (flags & LATTUTIL_LOG_PREFIX_HOSTNAME) {
+		if (gethostname(host, sizeof(host))) {
+			strlcpy(host, "localhost", sizeof(host));
+		}
+		host[sizeof(host) - 1] = '\0';
+		len = strlcat(fixed, host, sizeof(fixed));
+	}
+
+	if (flags & LATTUTIL_LOG_PREFIX_PROGNAME) {
+		name = logp->ll_path;
+		if (name == NULL) {
+			name = getprogname();
+		} else if ((p = strrchr(name, '/')) != NULL) {
+			name = p + 1;
+		}
+		if (len > 0) {
+			strlcat(fixed, " ", sizeof(fixed));
+		}
+		len = strlcat(fixed, name, sizeof(fixed));
+	}
+
+	if (flags & LATTUTIL_LOG_PREFIX_PID) {
+		if (len > 0 && !(flags & LATTUTIL_LOG_PREFIX_PROGNAME)) {
+			strlcat(fixed, " ", sizeof(fixed));
+		}
+		len = strlen(fixed);
+		snprintf(fixed + len, sizeof(fixed) - len, "[%d]",
+		    (int)getpid());
+		len = strlen(fixed);
+	}
+
+	if (len > 0) {
+		strlcat(fixed, ": ", sizeof(fixed));
+	}
+
+	memset(prefixes, 0, sizeof(prefixes));
+	if (flags != 0) {
+		for (level = 0; level < LATTUTIL_LOG_LEVEL_MAX; level++) {
+			if (asprintf(&(prefixes[level]), "%s%s", fixed,
+			    lattutil_log_level_prefix(level)) < 0) {
+				while (level-- > 0) {
+					free(prefixes[level]);
+				}
+				return (false);
+			}
+		}
+	}
+
+	for (level = 0; level < LATTUTIL_LOG_LEVEL_MAX; level++) {
+		free(logp->ll_prefixes[level]);
+		logp->ll_prefixes[level] = prefixes[level];
+	}
+	logp->ll_prefix_flags = flags;
+
+	return (true);
+}
+
+/*
+ * Return the prefix for a line of the given level. Without prefix
+ * flags this is the plain level prefix and buf is left untouched.
+ */
+const char *
+lattutil_log_prefix(lattutil_log_t *logp, lattutil_log_level_t level,
+    char *buf, size_t bufsz)
+{
+	const char *fixed;
+	size_t len, fixedlen;
+
+	if (logp->ll_prefix_flags == 0 || (level & LATTUTIL_LOG_LEVEL_RAW)) {
+		return (lattutil_log_level_prefix(level));
+	}
+
+	fixed = logp->ll_prefixes[LATTUTIL_LOG_LEVEL_BASE(level)];
+	fixedlen = strlen(fixed);
+
+	len = 0;
+	if (logp->ll_prefix_flags & LATTUTIL_LOG_PREFIX_TIME) {
+		len = _lattutil_log_prefix_time(buf, logp->ll_prefix_flags);
+	}
+
+	if (len + fixedlen >= bufsz) {
+		fixedlen = bufsz - len - 1;
+	}
+	memcpy(buf + len, fixed, fixedlen);
+	buf[len + fixedlen] = '\0';
+
+	return (buf);
+}
+
+void
+lattutil_log_prefix_free(lattutil_log_t *logp)
+{
+	lattutil_log_level_t level;
+
+	for (level = 0; level < LATTUTIL_LOG_LEVEL_MAX; level++) {
+		free(logp->ll_prefixes[level]);
+		logp->ll_prefixes[level] = NULL;
+	}
+	logp->ll_prefix_flags = 0;
+}
+
+/*
+ * Render the timestamp followed by a space into buf, which must hold
+ * at least 32 bytes.
+ */
+static size_t
+_lattutil_log_prefix_time(char *buf, unsigned int flags)
+{
+	lattutil_log_timecache_t *tc;
+	struct timespec ts;
+	unsigned int msec;
+	struct tm tm;
+	size_t len;
+
+	clock_gettime(LATTUTIL_LOG_PREFIX_CLOCK, &ts);
+
+	tc = &_lattutil_log_timecache;
+	if (tc->ltc_sec != ts.tv_sec) {
+		localtime_r(&(ts.tv_sec), &tm);
+		tc->ltc_len = strftime(tc->ltc_str, sizeof(tc->ltc_str),
+		    "%Y-%m-%dT%H:%M:%S", &tm);
+		tc->ltc_sec = ts.tv_sec;
+	}
+
+	memcpy(buf, tc->ltc_str, tc->ltc_len);
+	len = tc->ltc_len;
+
+	if (flags & LATTUTIL_LOG_PREFIX_MSEC) {
+		msec = ts.tv_nsec / 1000000;
+		buf[len++] = '.';
+		buf[len++] = '0' + msec / 100;
+		buf[len++] = '0' + (msec / 10) % 10;
+		buf[len++] = '0' + msec % 10;
+	}
+	buf[len++] = ' ';
+
+	return (len);
+}
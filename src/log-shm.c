@@ -0,0 +1,952 @@
+/*-
+ * Copyright (c) 2021 Shawn Webb <shawn.webb@hardenedbsd.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "liblattutil.h"
+
+/*
+ * Cross-process transport
+ *
+ * A shared mapping holds a 128-byte header and a ring of fixed-size
+ * slots, used as a bounded multi-producer queue in the manner of the
+ * asynchronous backend: each slot's sequence number says whether it
+ * is free for the producer at a given position or holds a published
+ * record. Producers in any number of processes claim slots with a
+ * compare-and-swap on the shared head and never make a system call
+ * unless the ring is full. One collector thread, in the process that
+ * created the ring, drains it in order into the real backend. There is
+ * nothing for producers to wake it with, so it polls, backing off from
+ * LATTUTIL_LOG_SHM_POLL_MIN_US to LATTUTIL_LOG_SHM_POLL_MAX_US while
+ * the ring stays empty.
+ *
+ * Each record carries the producer's pid and a per-producer sequence
+ * number. Sequence numbers are consumed by dropped records too, so the
+ * collector can count the records each producer lost. A producer that
+ * closes publishes a marker holding its final sequence number, which
+ * settles its count and frees its entry in the collector's table.
+ *
+ * A producer that dies between claiming a slot and publishing it
+ * would stall the ring. Claimed slots record the producer's pid, and
+ * the collector skips a slot whose producer no longer exists. A slot
+ * whose pid was never stamped is skipped after a longer grace period,
+ * which a producer stalled right after claiming can outlast, so
+ * producers publish with a compare-and-swap from the claimed sequence
+ * number and drop the record if the collector has moved the slot on.
+ */
+
+#define	LATTUTIL_LOG_SHM_MAGIC		"LLSHMQ\0\1"
+#define	LATTUTIL_LOG_SHM_SLOTSZ		512
+#define	LATTUTIL_LOG_SHM_PRODUCERS	256
+#define	LATTUTIL_LOG_SHM_POLL_MIN_US	50
+#define	LATTUTIL_LOG_SHM_POLL_MAX_US	5000
+#define	LATTUTIL_LOG_SHM_STUCK_MS	10
+#define	LATTUTIL_LOG_SHM_ORPHAN_MS	1000
+#define	LATTUTIL_LOG_SHM_BACKOFF_US	50
+#define	LATTUTIL_LOG_SHM_CLOSE_US	1000000
+#define	LATTUTIL_LOG_SHM_CLOSE		0xff
+#define	LATTUTIL_LOG_SHM_FREE		0
+#define	LATTUTIL_LOG_SHM_DEAD		-1
+
+typedef struct _lattutil_log_shm_hdr {
+	char			 lsh_magic[8];
+	uint32_t		 lsh_slotsz;
+	uint32_t		 lsh_pad;
+	uint64_t		 lsh_nslots;
+	char			 lsh_reserved[40];
+	/* Producers hammer the head; keep it on its own cache line. */
+	_Atomic(uint64_t)	 lsh_head;
+	char			 lsh_reserved2[56];
+} lattutil_log_shm_hdr_t;
+
+typedef struct _lattutil_log_shm_slot {
+	_Atomic(uint64_t)	 lss_seq;
+	uint64_t		 lss_pseq;
+	_Atomic(int32_t)	 lss_pid;
+	uint16_t		 lss_len;
+	uint8_t			 lss_level;
+	uint8_t			 lss_pad;
+	char			 lss_msg[LATTUTIL_LOG_SHM_SLOTSZ - 24];
+} lattutil_log_shm_slot_t;
+
+typedef struct _lattutil_log_shm_producer {
+	pid_t			 lsp_pid;
+	uint64_t		 lsp_next;
+	uint64_t		 lsp_received;
+	uint64_t		 lsp_reported;
+} lattutil_log_shm_producer_t;
+
+struct _lattutil_log_shm_collector {
+	lattutil_log_shm_hdr_t		*lsc_hdr;
+	lattutil_log_shm_slot_t		*lsc_slots;
+	uint64_t			 lsc_nslots;
+	size_t				 lsc_mapsz;
+	int				 lsc_fd;
+	char				*lsc_name;
+	int				 lsc_flags;
+	lattutil_log_t			*lsc_inner;
+	uint64_t			 lsc_tail;
+	uint64_t			 lsc_stuck_pos;
+	uint64_t			 lsc_stuck_since;
+	lattutil_log_shm_producer_t	 lsc_procs[LATTUTIL_LOG_SHM_PRODUCERS];
+	_Atomic(uint64_t)		 lsc_received;
+	_Atomic(uint64_t)		 lsc_lost;
+	_Atomic(uint64_t)		 lsc_reaped;
+	_Atomic(bool)			 lsc_stop;
+	pthread_t			 lsc_thread;
+};
+
+typedef struct _lattutil_log_shm {
+	lattutil_log_shm_hdr_t		*ls_hdr;
+	lattutil_log_shm_slot_t		*ls_slots;
+	uint64_t			 ls_nslots;
+	size_t				 ls_mapsz;
+	pid_t				 ls_pid;
+	long				 ls_wait_us;
+	_Atomic(uint64_t)		 ls_pseq;
+	_Atomic(uint64_t)		 ls_dropped;
+} lattutil_log_shm_t;
+
+static bool _lattutil_log_shm_map(int, bool, uint64_t, void **, size_t *);
+static lattutil_log_shm_slot_t *_lattutil_log_shm_claim(
+    lattutil_log_shm_t *, long, uint64_t *);
+static bool _lattutil_log_shm_publish(lattutil_log_shm_t *,
+    lattutil_log_shm_slot_t *, uint64_t);
+static ssize_t _lattutil_log_shm_vlog(lattutil_log_t *,
+    lattutil_log_level_t, const char *, va_list);
+static lattutil_log_shm_producer_t *_lattutil_log_shm_producer(
+    lattutil_log_shm_collector_t *, pid_t);
+static void _lattutil_log_shm_settle(lattutil_log_shm_collector_t *,
+    lattutil_log_shm_producer_t *);
+static void _lattutil_log_shm_deliver(lattutil_log_shm_collector_t *,
+    lattutil_log_shm_slot_t *);
+static bool _lattutil_log_shm_orphaned(lattutil_log_shm_collector_t *,
+    lattutil_log_shm_slot_t *, uint64_t);
+static size_t _lattutil_log_shm_drain(lattutil_log_shm_collector_t *);
+static void _lattutil_log_shm_report(lattutil_log_shm_collector_t *);
+static void *_lattutil_log_shm_thread(void *);
+static uint64_t _lattutil_log_shm_now_ms(void);
+
+EXPORTED_SYM
+lattutil_log_shm_collector_t *
+lattutil_log_shm_collector_new(const char *name, size_t nslots,
+    lattutil_log_t *inner, int flags)
+{
+	lattutil_log_shm_collector_t *lsc;
+	lattutil_log_shm_hdr_t *hdr;
+	uint64_t i;
+	void *map;
+	int fd;
+
+	if (inner == NULL || inner->ll_log_emit == NULL || nslots < 2) {
+		return (NULL);
+	}
+
+	lsc = calloc(1, sizeof(*lsc));
+	if (lsc == NULL) {
+		return (NULL);
+	}
+
+	if (name != NULL) {
+		lsc->lsc_name = strdup(name);
+		if (lsc->lsc_name == NULL) {
+			free(lsc);
+			return (NULL);
+		}
+
+		/* The collector owns the name; replace a stale segment. */
+		shm_unlink(name);
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+		    0600);
+	} else {
+		fd = memfd_create("lattutil-shm", MFD_CLOEXEC);
+	}
+	if (fd < 0) {
+		free(lsc->lsc_name);
+		free(lsc);
+		return (NULL);
+	}
+
+	if (!_lattutil_log_shm_map(fd, true, nslots, &map,
+	    &(lsc->lsc_mapsz))) {
+		if (name != NULL) {
+			shm_unlink(name);
+		}
+		close(fd);
+		free(lsc->lsc_name);
+		free(lsc);
+		return (NULL);
+	}
+
+	hdr = map;
+	memcpy(hdr->lsh_magic, LATTUTIL_LOG_SHM_MAGIC,
+	    sizeof(hdr->lsh_magic));
+	hdr->lsh_slotsz = LATTUTIL_LOG_SHM_SLOTSZ;
+	hdr->lsh_nslots = nslots;
+	atomic_init(&(hdr->lsh_head), 0);
+
+	lsc->lsc_hdr = hdr;
+	lsc->lsc_slots = (lattutil_log_shm_slot_t *)(hdr + 1);
+	lsc->lsc_nslots = nslots;
+	for (i = 0; i < nslots; i++) {
+		atomic_init(&(lsc->lsc_slots[i].lss_seq), i);
+		atomic_init(&(lsc->lsc_slots[i].lss_pid), 0);
+	}
+
+	lsc->lsc_fd = fd;
+	lsc->lsc_flags = flags;
+	lsc->lsc_inner = inner;
+	atomic_init(&(lsc->lsc_received), 0);
+	atomic_init(&(lsc->lsc_lost), 0);
+	atomic_init(&(lsc->lsc_reaped), 0);
+	atomic_init(&(lsc->lsc_stop), false);
+
+	if (pthread_create(&(lsc->lsc_thread), NULL,
+	    _lattutil_log_shm_thread, lsc)) {
+		munmap(map, lsc->lsc_mapsz);
+		if (name != NULL) {
+			shm_unlink(name);
+		}
+		close(fd);
+		free(lsc->lsc_name);
+		free(lsc);
+		return (NULL);
+	}
+
+	return (lsc);
+}
+
+EXPORTED_SYM
+int
+lattutil_log_shm_collector_fd(lattutil_log_shm_collector_t *lsc)
+{
+
+	if (lsc == NULL) {
+		return (-1);
+	}
+
+	return (lsc->lsc_fd);
+}
+
+EXPORTED_SYM
+bool
+lattutil_log_shm_collector_stats(lattutil_log_shm_collector_t *lsc,
+    lattutil_log_shm_stats_t *stats)
+{
+
+	if (lsc == NULL || stats == NULL) {
+		return (false);
+	}
+
+	stats->llsh_received = atomic_load_explicit(&(lsc->lsc_received),
+	    memory_order_relaxed);
+	stats->llsh_lost = atomic_load_explicit(&(lsc->lsc_lost),
+	    memory_order_relaxed);
+	stats->llsh_reaped = atomic_load_explicit(&(lsc->lsc_reaped),
+	    memory_order_relaxed);
+
+	return (true);
+}
+
+EXPORTED_SYM
+void
+lattutil_log_shm_collector_free(lattutil_log_shm_collector_t **lscp)
+{
+	lattutil_log_shm_collector_t *lsc;
+
+	if (lscp == NULL || *lscp == NULL) {
+		return;
+	}
+
+	lsc = *lscp;
+
+	/* The collector thread empties the ring before exiting. */
+	atomic_store(&(lsc->lsc_stop), true);
+	pthread_join(lsc->lsc_thread, NULL);
+
+	munmap(lsc->lsc_hdr, lsc->lsc_mapsz);
+	if (lsc->lsc_name != NULL) {
+		shm_unlink(lsc->lsc_name);
+	}
+	close(lsc->lsc_fd);
+	lattutil_log_free(&(lsc->lsc_inner));
+
+	free(lsc->lsc_name);
+	memset(lsc, 0, sizeof(*lsc));
+	free(lsc);
+	*lscp = NULL;
+}
+
+EXPORTED_SYM
+bool
+lattutil_log_shm_init(lattutil_log_t *logp, const char *name, int policy)
+{
+	bool res;
+	int fd;
+
+	if (logp == NULL || name == NULL) {
+		return (false);
+	}
+
+	fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+	if (fd < 0) {
+		return (false);
+	}
+
+	res = lattutil_log_shm_init_fd(logp, fd, policy);
+	close(fd);
+
+	return (res);
+}
+
+EXPORTED_SYM
+bool
+lattutil_log_shm_init_fd(lattutil_log_t *logp, int fd, int policy)
+{
+	lattutil_log_shm_t *ls;
+	void *map;
+
+	if (logp == NULL || fd < 0) {
+		return (false);
+	}
+
+	switch (policy) {
+	case LATTUTIL_LOG_ASYNC_BLOCK:
+	case LATTUTIL_LOG_ASYNC_DROP_NEWEST:
+		break;
+	default:
+		return (false);
+	}
+
+	ls = calloc(1, sizeof(*ls));
+	if (ls == NULL) {
+		return (false);
+	}
+
+	if (!_lattutil_log_shm_map(fd, false, 0, &map, &(ls->ls_mapsz))) {
+		free(ls);
+		return (false);
+	}
+
+	ls->ls_hdr = map;
+	ls->ls_slots = (lattutil_log_shm_slot_t *)(ls->ls_hdr + 1);
+	ls->ls_nslots = ls->ls_hdr->lsh_nslots;
+	ls->ls_pid = getpid();
+	ls->ls_wait_us = (policy == LATTUTIL_LOG_ASYNC_BLOCK) ? -1 : 0;
+	atomic_init(&(ls->ls_pseq), 0);
+	atomic_init(&(ls->ls_dropped), 0);
+
+	if (logp->ll_log_close != NULL) {
+		logp->ll_log_close(logp);
+	}
+
+	logp->ll_internalaux = ls;
+	logp->ll_internalauxsz = sizeof(*ls);
+
+	logp->ll_log_close = lattutil_log_shm_close;
+	logp->ll_log_debug = lattutil_log_shm_debug;
+	logp->ll_log_err = lattutil_log_shm_err;
+	logp->ll_log_info = lattutil_log_shm_info;
+	logp->ll_log_warn = lattutil_log_shm_warn;
+	logp->ll_log_emit = lattutil_log_shm_emit;
+
+	lattutil_log_apply_levels(logp);
+
+	return (true);
+}
+
+EXPORTED_SYM
+uint64_t
+lattutil_log_shm_dropped(lattutil_log_t *logp)
+{
+	lattutil_log_shm_t *ls;
+
+	if (logp == NULL || logp->ll_log_close != lattutil_log_shm_close) {
+		return (0);
+	}
+
+	ls = logp->ll_internalaux;
+
+	return (atomic_load_explicit(&(ls->ls_dropped),
+	    memory_order_relaxed));
+}
+
+ssize_t
+lattutil_log_shm_debug(lattutil_log_t *logp, int verbose,
+    const char *fmt, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_shm_vlog(logp, LATTUTIL_LOG_LEVEL_DEBUG,
+		    fmt, args);
+		va_end(args);
+	}
+
+	return (len);
+}
+
+ssize_t
+lattutil_log_shm_err(lattutil_log_t *logp, int verbose,
+    const char *fmt, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_shm_vlog(logp, LATTUTIL_LOG_LEVEL_ERR,
+		    fmt, args);
+		va_end(args);
+	}
+
+	return (len);
+}
+
+ssize_t
+lattutil_log_shm_info(lattutil_log_t *logp, int verbose,
+    const char *fmt, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_shm_vlog(logp, LATTUTIL_LOG_LEVEL_INFO,
+		    fmt, args);
+		va_end(args);
+	}
+
+	return (len);
+}
+
+ssize_t
+lattutil_log_shm_warn(lattutil_log_t *logp, int verbose,
+    const char *fmt, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_shm_vlog(logp, LATTUTIL_LOG_LEVEL_WARN,
+		    fmt, args);
+		va_end(args);
+	}
+
+	return (len);
+}
+
+ssize_t
+lattutil_log_shm_emit(lattutil_log_t *logp, lattutil_log_level_t level,
+    const char *msg, size_t len)
+{
+	lattutil_log_shm_slot_t *slot;
+	lattutil_log_shm_t *ls;
+	uint64_t pos;
+
+	ls = logp->ll_internalaux;
+
+	slot = _lattutil_log_shm_claim(ls, ls->ls_wait_us, &pos);
+	if (slot == NULL) {
+		return (0);
+	}
+
+	slot->lss_pseq = atomic_fetch_add_explicit(&(ls->ls_pseq), 1,
+	    memory_order_relaxed);
+	slot->lss_level = level;
+	slot->lss_len = (len < sizeof(slot->lss_msg)) ? len :
+	    sizeof(slot->lss_msg);
+	memcpy(slot->lss_msg, msg, slot->lss_len);
+
+	if (!_lattutil_log_shm_publish(ls, slot, pos)) {
+		return (0);
+	}
+
+	return (len);
+}
+
+void
+lattutil_log_shm_close(lattutil_log_t *logp)
+{
+	lattutil_log_shm_slot_t *slot;
+	lattutil_log_shm_t *ls;
+	uint64_t pos;
+
+	ls = logp->ll_internalaux;
+	if (ls == NULL) {
+		return;
+	}
+
+	/* Even a dropping producer waits a while for its marker. */
+	slot = _lattutil_log_shm_claim(ls, LATTUTIL_LOG_SHM_CLOSE_US, &pos);
+	if (slot != NULL) {
+		slot->lss_pseq = atomic_load_explicit(&(ls->ls_pseq),
+		    memory_order_relaxed);
+		slot->lss_level = LATTUTIL_LOG_SHM_CLOSE;
+		slot->lss_len = 0;
+		_lattutil_log_shm_publish(ls, slot, pos);
+	}
+
+	munmap(ls->ls_hdr, ls->ls_mapsz);
+	memset(ls, 0, sizeof(*ls));
+	free(ls);
+
+	logp->ll_internalaux = NULL;
+	logp->ll_internalauxsz = 0;
+}
+
+/*
+ * Map the ring, sizing the object first when creating it, or checking
+ * its header when attaching to it.
+ */
+static bool
+_lattutil_log_shm_map(int fd, bool create, uint64_t nslots, void **mapp,
+    size_t *mapszp)
+{
+	lattutil_log_shm_hdr_t *hdr;
+	struct stat sb;
+	size_t mapsz;
+	void *map;
+
+	if (create) {
+		if (nslots > (SIZE_MAX - sizeof(*hdr)) /
+		    LATTUTIL_LOG_SHM_SLOTSZ) {
+			return (false);
+		}
+		mapsz = sizeof(*hdr) + nslots * LATTUTIL_LOG_SHM_SLOTSZ;
+		if (ftruncate(fd, mapsz)) {
+			return (false);
+		}
+	} else {
+		if (fstat(fd, &sb) || (size_t)sb.st_size < sizeof(*hdr)) {
+			return (false);
+		}
+		mapsz = sb.st_size;
+	}
+
+	map = mmap(NULL, mapsz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		return (false);
+	}
+
+	hdr = map;
+	if (!create && (memcmp(hdr->lsh_magic, LATTUTIL_LOG_SHM_MAGIC,
+	    sizeof(hdr->lsh_magic)) ||
+	    hdr->lsh_slotsz != LATTUTIL_LOG_SHM_SLOTSZ ||
+	    hdr->lsh_nslots == 0 ||
+	    hdr->lsh_nslots > (mapsz - sizeof(*hdr)) /
+	    LATTUTIL_LOG_SHM_SLOTSZ)) {
+		munmap(map, mapsz);
+		return (false);
+	}
+
+	*mapp = map;
+	*mapszp = mapsz;
+
+	return (true);
+}
+
+/*
+ * Claim the slot at the head of the ring and stamp it with our pid.
+ * When the ring is full, wait up to wait_us microseconds (forever if
+ * negative) for the collector, then drop the record, consuming a
+ * sequence number so the loss shows up.
+ */
+static lattutil_log_shm_slot_t *
+_lattutil_log_shm_claim(lattutil_log_shm_t *ls, long wait_us, uint64_t *posp)
+{
+	lattutil_log_shm_slot_t *slot;
+	struct timespec ts;
+	uint64_t pos, seq;
+	int64_t diff;
+	long waited;
+
+	waited = 0;
+	pos = atomic_load_explicit(&(ls->ls_hdr->lsh_head),
+	    memory_order_relaxed);
+	for (;;) {
+		slot = &(ls->ls_slots[pos % ls->ls_nslots]);
+		seq = atomic_load_explicit(&(slot->lss_seq),
+		    memory_order_acquire);
+		diff = (int64_t)(seq - pos);
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(
+			    &(ls->ls_hdr->lsh_head), &pos, pos + 1,
+			    memory_order_relaxed, memory_order_relaxed)) {
+				atomic_store_explicit(&(slot->lss_pid),
+				    ls->ls_pid, memory_order_relaxed);
+				*posp = pos;
+				return (slot);
+			}
+		} else if (diff < 0) {
+			if (wait_us >= 0 && waited >= wait_us) {
+				atomic_fetch_add_explicit(&(ls->ls_pseq), 1,
+				    memory_order_relaxed);
+				atomic_fetch_add_explicit(&(ls->ls_dropped), 1,
+				    memory_order_relaxed);
+				return (NULL);
+			}
+			ts.tv_sec = 0;
+			ts.tv_nsec = LATTUTIL_LOG_SHM_BACKOFF_US * 1000;
+			nanosleep(&ts, NULL);
+			waited += LATTUTIL_LOG_SHM_BACKOFF_US;
+			pos = atomic_load_explicit(&(ls->ls_hdr->lsh_head),
+			    memory_order_relaxed);
+		} else {
+			pos = atomic_load_explicit(&(ls->ls_hdr->lsh_head),
+			    memory_order_relaxed);
+		}
+	}
+}
+
+static ssize_t
+_lattutil_log_shm_vlog(lattutil_log_t *logp, lattutil_log_level_t level,
+    const char *fmt, va_list args)
+{
+	lattutil_log_shm_slot_t *slot;
+	lattutil_log_shm_t *ls;
+	uint64_t pos;
+	int res;
+
+	ls = logp->ll_internalaux;
+
+	slot = _lattutil_log_shm_claim(ls, ls->ls_wait_us, &pos);
+	if (slot == NULL) {
+		return (0);
+	}
+
+	/* Format straight into shared memory. */
+	res = lattutil_log_vsnprintf(slot->lss_msg, sizeof(slot->lss_msg),
+	    fmt, args);
+	if (res < 0) {
+		res = 0;
+	}
+
+	slot->lss_pseq = atomic_fetch_add_explicit(&(ls->ls_pseq), 1,
+	    memory_order_relaxed);
+	slot->lss_level = level;
+	slot->lss_len = ((size_t)res < sizeof(slot->lss_msg)) ? (size_t)res :
+	    sizeof(slot->lss_msg) - 1;
+
+	if (!_lattutil_log_shm_publish(ls, slot, pos)) {
+		return (0);
+	}
+
+	return (res);
+}
+
+/*
+ * Publish a claimed slot, unless the collector reaped it while we were
+ * stalled. The record is then lost; its sequence number was consumed,
+ * so the collector counts it.
+ */
+static bool
+_lattutil_log_shm_publish(lattutil_log_shm_t *ls,
+    lattutil_log_shm_slot_t *slot, uint64_t pos)
+{
+	uint64_t expected;
+
+	expected = pos;
+	if (!atomic_compare_exchange_strong_explicit(&(slot->lss_seq),
+	    &expected, pos + 1, memory_order_release, memory_order_relaxed)) {
+		atomic_fetch_add_explicit(&(ls->ls_dropped), 1,
+		    memory_order_relaxed);
+		return (false);
+	}
+
+	return (true);
+}
+
+/*
+ * Find or add the bookkeeping entry of a producer in the open
+ * addressing table. Entries of closed producers are marked dead so
+ * lookups keep probing past them. When the table is full, the entry
+ * the pid hashes to is recycled.
+ */
+static lattutil_log_shm_producer_t *
+_lattutil_log_shm_producer(lattutil_log_shm_collector_t *lsc, pid_t pid)
+{
+	lattutil_log_shm_producer_t *lsp, *reuse;
+	size_t i, start;
+
+	reuse = NULL;
+	start = (size_t)pid % LATTUTIL_LOG_SHM_PRODUCERS;
+	for (i = 0; i < LATTUTIL_LOG_SHM_PRODUCERS; i++) {
+		lsp = &(lsc->lsc_procs[(start + i) %
+		    LATTUTIL_LOG_SHM_PRODUCERS]);
+		if (lsp->lsp_pid == pid) {
+			return (lsp);
+		}
+		if (lsp->lsp_pid == LATTUTIL_LOG_SHM_DEAD && reuse == NULL) {
+			reuse = lsp;
+		}
+		if (lsp->lsp_pid == LATTUTIL_LOG_SHM_FREE) {
+			break;
+		}
+	}
+
+	if (reuse != NULL) {
+		lsp = reuse;
+	} else if (i == LATTUTIL_LOG_SHM_PRODUCERS) {
+		lsp = &(lsc->lsc_procs[start]);
+	}
+
+	memset(lsp, 0, sizeof(*lsp));
+	lsp->lsp_pid = pid;
+
+	return (lsp);
+}
+
+static void
+_lattutil_log_shm_deliver(lattutil_log_shm_collector_t *lsc,
+    lattutil_log_shm_slot_t *slot)
+{
+	char buf[LATTUTIL_LOG_SHM_SLOTSZ + 16];
+	lattutil_log_shm_producer_t *lsp;
+	size_t len;
+	pid_t pid;
+	int res;
+
+	pid = atomic_load_explicit(&(slot->lss_pid), memory_order_relaxed);
+	lsp = _lattutil_log_shm_producer(lsc, pid);
+
+	if (slot->lss_level == LATTUTIL_LOG_SHM_CLOSE) {
+		if (slot->lss_pseq > lsp->lsp_next) {
+			lsp->lsp_next = slot->lss_pseq;
+		}
+		_lattutil_log_shm_settle(lsc, lsp);
+		lsp->lsp_pid = LATTUTIL_LOG_SHM_DEAD;
+		return;
+	}
+
+	lsp->lsp_received++;
+	if (slot->lss_pseq >= lsp->lsp_next) {
+		lsp->lsp_next = slot->lss_pseq + 1;
+	}
+	atomic_fetch_add_explicit(&(lsc->lsc_received), 1,
+	    memory_order_relaxed);
+
+	len = slot->lss_len;
+	if (len > sizeof(slot->lss_msg)) {
+		len = sizeof(slot->lss_msg);
+	}
+
+	if (lsc->lsc_flags & LATTUTIL_LOG_SHM_PID) {
+		res = snprintf(buf, sizeof(buf), "[%d] %.*s", (int)pid,
+		    (int)len, slot->lss_msg);
+		if (res > 0) {
+			lsc->lsc_inner->ll_log_emit(lsc->lsc_inner,
+			    slot->lss_level, buf, (size_t)res);
+		}
+		return;
+	}
+
+	lsc->lsc_inner->ll_log_emit(lsc->lsc_inner, slot->lss_level,
+	    slot->lss_msg, len);
+}
+
+/*
+ * Decide whether the claimed but unpublished slot at the tail will
+ * never be published. A producer is given LATTUTIL_LOG_SHM_STUCK_MS
+ * before its pid is checked; a slot whose pid was never stamped is
+ * given LATTUTIL_LOG_SHM_ORPHAN_MS.
+ */
+static bool
+_lattutil_log_shm_orphaned(lattutil_log_shm_collector_t *lsc,
+    lattutil_log_shm_slot_t *slot, uint64_t since)
+{
+	uint64_t waited;
+	pid_t pid;
+
+	waited = _lattutil_log_shm_now_ms() - since;
+	if (waited < LATTUTIL_LOG_SHM_STUCK_MS) {
+		return (false);
+	}
+
+	pid = atomic_load_explicit(&(slot->lss_pid), memory_order_relaxed);
+	if (pid == 0) {
+		return (waited >= LATTUTIL_LOG_SHM_ORPHAN_MS);
+	}
+
+	return (kill(pid, 0) && errno == ESRCH);
+}
+
+static size_t
+_lattutil_log_shm_drain(lattutil_log_shm_collector_t *lsc)
+{
+	lattutil_log_shm_slot_t *slot;
+	uint64_t head, pos, seq;
+	size_t n;
+
+	n = 0;
+	for (;;) {
+		pos = lsc->lsc_tail;
+		slot = &(lsc->lsc_slots[pos % lsc->lsc_nslots]);
+		seq = atomic_load_explicit(&(slot->lss_seq),
+		    memory_order_acquire);
+
+		if (seq != pos + 1) {
+			head = atomic_load_explicit(&(lsc->lsc_hdr->lsh_head),
+			    memory_order_relaxed);
+			if (head == pos) {
+				break;
+			}
+
+			/* Claimed but not yet published. */
+			if (lsc->lsc_stuck_pos != pos + 1) {
+				lsc->lsc_stuck_pos = pos + 1;
+				lsc->lsc_stuck_since =
+				    _lattutil_log_shm_now_ms();
+			}
+			if (!_lattutil_log_shm_orphaned(lsc, slot,
+			    lsc->lsc_stuck_since)) {
+				break;
+			}
+			atomic_fetch_add_explicit(&(lsc->lsc_reaped), 1,
+			    memory_order_relaxed);
+		} else {
+			_lattutil_log_shm_deliver(lsc, slot);
+			n++;
+		}
+
+		atomic_store_explicit(&(slot->lss_pid), 0,
+		    memory_order_relaxed);
+		atomic_store_explicit(&(slot->lss_seq),
+		    pos + lsc->lsc_nslots, memory_order_release);
+		lsc->lsc_tail++;
+	}
+
+	return (n);
+}
+
+/*
+ * Log and count the records a producer lost since the last report.
+ */
+static void
+_lattutil_log_shm_settle(lattutil_log_shm_collector_t *lsc,
+    lattutil_log_shm_producer_t *lsp)
+{
+	uint64_t lost;
+	char msg[128];
+	int len;
+
+	lost = lsp->lsp_next - lsp->lsp_received;
+	if (lost <= lsp->lsp_reported) {
+		return;
+	}
+
+	len = snprintf(msg, sizeof(msg), "%ju records from pid %d lost",
+	    (uintmax_t)(lost - lsp->lsp_reported), (int)lsp->lsp_pid);
+	atomic_fetch_add_explicit(&(lsc->lsc_lost), lost - lsp->lsp_reported,
+	    memory_order_relaxed);
+	lsp->lsp_reported = lost;
+	lsc->lsc_inner->ll_log_emit(lsc->lsc_inner, LATTUTIL_LOG_LEVEL_WARN,
+	    msg, (size_t)len);
+}
+
+/*
+ * Once the ring is idle every sequence number handed out has been
+ * published or dropped, so gaps are final and can be reported.
+ */
+static void
+_lattutil_log_shm_report(lattutil_log_shm_collector_t *lsc)
+{
+	lattutil_log_shm_producer_t *lsp;
+	size_t i;
+
+	for (i = 0; i < LATTUTIL_LOG_SHM_PRODUCERS; i++) {
+		lsp = &(lsc->lsc_procs[i]);
+		if (lsp->lsp_pid != LATTUTIL_LOG_SHM_FREE &&
+		    lsp->lsp_pid != LATTUTIL_LOG_SHM_DEAD) {
+			_lattutil_log_shm_settle(lsc, lsp);
+		}
+	}
+}
+
+static void *
+_lattutil_log_shm_thread(void *arg)
+{
+	lattutil_log_shm_collector_t *lsc;
+	struct timespec ts;
+	long poll_us;
+	bool stop;
+
+	lsc = arg;
+	poll_us = LATTUTIL_LOG_SHM_POLL_MIN_US;
+
+	for (;;) {
+		stop = atomic_load(&(lsc->lsc_stop));
+		if (_lattutil_log_shm_drain(lsc) > 0) {
+			poll_us = LATTUTIL_LOG_SHM_POLL_MIN_US;
+			continue;
+		}
+
+		_lattutil_log_shm_report(lsc);
+		if (stop) {
+			break;
+		}
+
+		ts.tv_sec = 0;
+		ts.tv_nsec = poll_us * 1000;
+		nanosleep(&ts, NULL);
+		if (poll_us < LATTUTIL_LOG_SHM_POLL_MAX_US) {
+			poll_us *= 2;
+		}
+	}
+
+	return (NULL);
+}
+
+static uint64_t
+_lattutil_log_shm_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
@@ -0,0 +1,402 @@
+/*-
+ * Copyright (c) 2021 Shawn Webb <shawn.webb@hardenedbsd.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ctype.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <pthread.h>
+#include <strings.h>
+#include <syslog.h>
+
+#include "liblattutil.h"
+
+#define	LATTUTIL_LOG_SITES_MAXMODULES	64
+
+/*
+ * Every LATTUTIL_LOG_SITE_* call site places a descriptor in the
+ * lattutil_log_sites section of its module. The linker provides the
+ * bounds of that section, and LATTUTIL_LOG_SITES_MODULE() hands them
+ * to the registry from a constructor and takes them back from a
+ * destructor, so a shared object can be unloaded safely. The registry
+ * is a fixed table; modules beyond it are refused, and say so through
+ * syslog(3) since the constructor has no logger to report to, nor any
+ * caller to return to. Changing the state of a site is
+ * a relaxed atomic store that the call site picks up with a relaxed
+ * load; nothing else is shared with the logging path.
+ */
+
+typedef struct _lattutil_log_site_module {
+	lattutil_log_site_t	*lsm_start;
+	lattutil_log_site_t	*lsm_stop;
+} lattutil_log_site_module_t;
+
+typedef struct _lattutil_log_site_query {
+	char		*lsq_file;
+	char		*lsq_func;
+	char		*lsq_fmt;
+	unsigned int	 lsq_line_min;
+	unsigned int	 lsq_line_max;
+	int		 lsq_level;
+} lattutil_log_site_query_t;
+
+static lattutil_log_site_module_t
+    _lattutil_log_site_modules[LATTUTIL_LOG_SITES_MAXMODULES];
+static size_t _lattutil_log_site_nmodules;
+static pthread_mutex_t _lattutil_log_site_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static bool _lattutil_log_site_parse(char *, lattutil_log_site_query_t *);
+static bool _lattutil_log_site_match(const lattutil_log_site_t *,
+    const lattutil_log_site_query_t *);
+static const char *_lattutil_log_site_state_name(int);
+
+EXPORTED_SYM
+bool
+lattutil_log_sites_register(lattutil_log_site_t *start,
+    lattutil_log_site_t *stop)
+{
+	lattutil_log_site_module_t *mod;
+	size_t i;
+
+	/* A module without sites has nothing to register. */
+	if (start == NULL || stop == NULL || start >= stop) {
+		return (true);
+	}
+
+	pthread_mutex_lock(&_lattutil_log_site_mtx);
+	for (i = 0; i < _lattutil_log_site_nmodules; i++) {
+		if (_lattutil_log_site_modules[i].lsm_start == start) {
+			pthread_mutex_unlock(&_lattutil_log_site_mtx);
+			return (true);
+		}
+	}
+
+	if (_lattutil_log_site_nmodules == LATTUTIL_LOG_SITES_MAXMODULES) {
+		pthread_mutex_unlock(&_lattutil_log_site_mtx);
+		syslog(LOG_USER | LOG_WARNING, "lattutil: %s: more than %d "
+		    "modules with log sites; %s:%u and the rest of its module "
+		    "cannot be switched", __func__,
+		    LATTUTIL_LOG_SITES_MAXMODULES, start->lls_file,
+		    start->lls_line);
+		return (false);
+	}
+
+	mod = _lattutil_log_site_modules + _lattutil_log_site_nmodules;
+	mod->lsm_start = start;
+	mod->lsm_stop = stop;
+	_lattutil_log_site_nmodules++;
+	pthread_mutex_unlock(&_lattutil_log_site_mtx);
+
+	return (true);
+}
+
+/*
+ * Forget a module, keeping the others in registration order so that
+ * dumps stay stable.
+ */
+EXPORTED_SYM
+bool
+lattutil_log_sites_unregister(lattutil_log_site_t *start)
+{
+	size_t i;
+
+	if (start == NULL) {
+		return (false);
+	}
+
+	pthread_mutex_lock(&_lattutil_log_site_mtx);
+	for (i = 0; i < _lattutil_log_site_nmodules; i++) {
+		if (_lattutil_log_site_modules[i].lsm_start == start) {
+			break;
+		}
+	}
+
+	if (i == _lattutil_log_site_nmodules) {
+		pthread_mutex_unlock(&_lattutil_log_site_mtx);
+		return (false);
+	}
+
+	memmove(_lattutil_log_site_modules + i,
+	    _lattutil_log_site_modules + i + 1,
+	    (_lattutil_log_site_nmodules - i - 1) *
+	    sizeof(_lattutil_log_site_modules[0]));
+	_lattutil_log_site_nmodules--;
+	pthread_mutex_unlock(&_lattutil_log_site_mtx);
+
+	return (true);
+}
+
+/*
+ * Apply a state to every site matching the query. Returns the number
+ * of matching sites, or -1 if the query cannot be parsed.
+ */
+EXPORTED_SYM
+ssize_t
+lattutil_log_sites_set(const char *query, int state)
+{
+	lattutil_log_site_query_t q;
+	lattutil_log_site_t *site;
+	ssize_t nmatched;
+	char *copy;
+	size_t i;
+
+	if (query == NULL || state < LATTUTIL_LOG_SITE_OFF ||
+	    state > LATTUTIL_LOG_SITE_FORCE) {
+		return (-1);
+	}
+
+	copy = strdup(query);
+	if (copy == NULL) {
+		return (-1);
+	}
+
+	if (!_lattutil_log_site_parse(copy, &q)) {
+		free(copy);
+		return (-1);
+	}
+
+	nmatched = 0;
+	pthread_mutex_lock(&_lattutil_log_site_mtx);
+	for (i = 0; i < _lattutil_log_site_nmodules; i++) {
+		for (site = _lattutil_log_site_modules[i].lsm_start;
+		    site < _lattutil_log_site_modules[i].lsm_stop; site++) {
+			if (!_lattutil_log_site_match(site, &q)) {
+				continue;
+			}
+			__atomic_store_n(&(site->lls_state), state,
+			    __ATOMIC_RELAXED);
+			nmatched++;
+		}
+	}
+	pthread_mutex_unlock(&_lattutil_log_site_mtx);
+
+	free(copy);
+
+	return (nmatched);
+}
+
+/*
+ * Apply a control file. Each line holds a state (on, off, force) and
+ * a query; blank lines and lines starting with # are ignored. Lines
+ * are applied in order, so later lines override earlier ones.
+ */
+EXPORTED_SYM
+bool
+lattutil_log_sites_load(const char *path)
+{
+	char *line, *p, *word;
+	size_t linesz;
+	bool ret;
+	FILE *fp;
+	int state;
+
+	if (path == NULL) {
+		return (false);
+	}
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		return (false);
+	}
+
+	ret = true;
+	line = NULL;
+	linesz = 0;
+	while (getline(&line, &linesz, fp) > 0) {
+		p = line;
+		while (isspace((unsigned char)*p)) {
+			p++;
+		}
+		if (*p == '\0' || *p == '#') {
+			continue;
+		}
+
+		word = strsep(&p, " \t\n");
+		if (!strcmp(word, "off")) {
+			state = LATTUTIL_LOG_SITE_OFF;
+		} else if (!strcmp(word, "on")) {
+			state = LATTUTIL_LOG_SITE_ON;
+		} else if (!strcmp(word, "force")) {
+			state = LATTUTIL_LOG_SITE_FORCE;
+		} else {
+			ret = false;
+			continue;
+		}
+
+		if (lattutil_log_sites_set(p != NULL ? p : "", state) < 0) {
+			ret = false;
+		}
+	}
+
+	free(line);
+	fclose(fp);
+
+	return (ret);
+}
+
+EXPORTED_SYM
+void
+lattutil_log_sites_dump(FILE *out)
+{
+	lattutil_log_site_t *site;
+	size_t i;
+
+	if (out == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&_lattutil_log_site_mtx);
+	for (i = 0; i < _lattutil_log_site_nmodules; i++) {
+		for (site = _lattutil_log_site_modules[i].lsm_start;
+		    site < _lattutil_log_site_modules[i].lsm_stop; site++) {
+			fprintf(out, "%s:%u [%s] %s %s \"%s\"\n",
+			    site->lls_file, site->lls_line, site->lls_func,
+			    lattutil_log_level_tag(site->lls_level),
+			    _lattutil_log_site_state_name(__atomic_load_n(
+			    &(site->lls_state), __ATOMIC_RELAXED)),
+			    site->lls_fmt);
+		}
+	}
+	pthread_mutex_unlock(&_lattutil_log_site_mtx);
+}
+
+/*
+ * Parse "file=GLOB func=GLOB fmt=SUBSTRING line=N[-M] level=NAME",
+ * all terms optional. The query points into buf.
+ */
+static bool
+_lattutil_log_site_parse(char *buf, lattutil_log_site_query_t *q)
+{
+	char *term, *val, *end;
+
+	memset(q, 0, sizeof(*q));
+	q->lsq_line_max = UINT_MAX;
+	q->lsq_level = -1;
+
+	while ((term = strsep(&buf, " \t\n")) != NULL) {
+		if (*term == '\0') {
+			continue;
+		}
+
+		val = strchr(term, '=');
+		if (val == NULL) {
+			return (false);
+		}
+		*val++ = '\0';
+
+		if (!strcmp(term, "file")) {
+			q->lsq_file = val;
+		} else if (!strcmp(term, "func")) {
+			q->lsq_func = val;
+		} else if (!strcmp(term, "fmt")) {
+			q->lsq_fmt = val;
+		} else if (!strcmp(term, "line")) {
+			q->lsq_line_min = strtoul(val, &end, 10);
+			q->lsq_line_max = q->lsq_line_min;
+			if (*end == '-') {
+				q->lsq_line_max = strtoul(end + 1, &end, 10);
+			}
+			if (*end != '\0') {
+				return (false);
+			}
+		} else if (!strcmp(term, "level")) {
+			if (!strcasecmp(val, "debug")) {
+				q->lsq_level = LATTUTIL_LOG_LEVEL_DEBUG;
+			} else if (!strcasecmp(val, "err") ||
+			    !strcasecmp(val, "error")) {
+				q->lsq_level = LATTUTIL_LOG_LEVEL_ERR;
+			} else if (!strcasecmp(val, "info")) {
+				q->lsq_level = LATTUTIL_LOG_LEVEL_INFO;
+			} else if (!strcasecmp(val, "warn") ||
+			    !strcasecmp(val, "warning")) {
+				q->lsq_level = LATTUTIL_LOG_LEVEL_WARN;
+			} else {
+				return (false);
+			}
+		} else {
+			return (false);
+		}
+	}
+
+	return (true);
+}
+
+/*
+ * File patterns without a slash match the basename of the site's
+ * file, so "net*.c" matches regardless of the build directory.
+ */
+static bool
+_lattutil_log_site_match(const lattutil_log_site_t *site,
+    const lattutil_log_site_query_t *q)
+{
+	const char *file, *p;
+
+	if (q->lsq_file != NULL) {
+		file = site->lls_file;
+		if (strchr(q->lsq_file, '/') == NULL &&
+		    (p = strrchr(file, '/')) != NULL) {
+			file = p + 1;
+		}
+		if (fnmatch(q->lsq_file, file, 0)) {
+			return (false);
+		}
+	}
+
+	if (q->lsq_func != NULL && fnmatch(q->lsq_func, site->lls_func, 0)) {
+		return (false);
+	}
+
+	if (q->lsq_fmt != NULL && strstr(site->lls_fmt, q->lsq_fmt) == NULL) {
+		return (false);
+	}
+
+	if (site->lls_line < q->lsq_line_min ||
+	    site->lls_line > q->lsq_line_max) {
+		return (false);
+	}
+
+	if (q->lsq_level != -1 && (int)site->lls_level != q->lsq_level) {
+		return (false);
+	}
+
+	return (true);
+}
+
+static const char *
+_lattutil_log_site_state_name(int state)
+{
+
+	switch (state) {
+	case LATTUTIL_LOG_SITE_OFF:
+		return ("off");
+	case LATTUTIL_LOG_SITE_FORCE:
+		return ("force");
+	default:
+		return ("on");
+	}
+}
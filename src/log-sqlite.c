@@ -0,0 +1,671 @@
+/*-
+ * Copyright (c) 2021 Shawn Webb <shawn.webb@hardenedbsd.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "liblattutil.h"
+
+#define	LATTUTIL_LOG_SQLITE_TABLE		"log"
+#define	LATTUTIL_LOG_SQLITE_BATCH		1024
+#define	LATTUTIL_LOG_SQLITE_FLUSH_MS		250
+#define	LATTUTIL_LOG_SQLITE_MAX_PENDING		(64 * 1024)
+#define	LATTUTIL_LOG_SQLITE_BUSY_MS		5000
+
+/*
+ * Records are queued in a pending batch under a mutex and written by
+ * a background thread, which swaps the pending batch for an empty one
+ * and inserts it with a single prepared statement inside one
+ * transaction per llso_batch records. A transaction per record would
+ * cost an fsync each; this way a commit is amortized over the batch
+ * and logging threads never wait on the database.
+ */
+
+typedef struct _lattutil_log_sqlite_rec {
+	int64_t			 lsr_ts;
+	lattutil_log_level_t	 lsr_level;
+	size_t			 lsr_off;
+	size_t			 lsr_len;
+} lattutil_log_sqlite_rec_t;
+
+typedef struct _lattutil_log_sqlite_batch {
+	lattutil_log_sqlite_rec_t	*lsb_recs;
+	size_t				 lsb_nrecs;
+	size_t				 lsb_recsz;
+	char				*lsb_data;
+	size_t				 lsb_len;
+	size_t				 lsb_datasz;
+} lattutil_log_sqlite_batch_t;
+
+typedef struct _lattutil_log_sqlite {
+	lattutil_sqlite_ctx_t		*ls_ctx;
+	sqlite3_stmt			*ls_insert;
+	sqlite3_stmt			*ls_begin;
+	sqlite3_stmt			*ls_commit;
+	lattutil_log_sqlite_opts_t	 ls_opts;
+	lattutil_log_sqlite_batch_t	 ls_batches[2];
+	lattutil_log_sqlite_batch_t	*ls_pending;
+	uint64_t			 ls_queued;
+	uint64_t			 ls_processed;
+	uint64_t			 ls_dropped;
+	uint64_t			 ls_errors;
+	bool				 ls_stop;
+	bool				 ls_flush;
+	pthread_t			 ls_thread;
+	pthread_mutex_t			 ls_mtx;
+	pthread_cond_t			 ls_work_cv;
+	pthread_cond_t			 ls_space_cv;
+	pthread_cond_t			 ls_done_cv;
+} lattutil_log_sqlite_t;
+
+static bool _lattutil_log_sqlite_prepare(lattutil_log_sqlite_t *,
+    const char *);
+static bool _lattutil_log_sqlite_append(lattutil_log_sqlite_batch_t *,
+    lattutil_log_level_t, int64_t, const char *, size_t);
+static ssize_t _lattutil_log_sqlite_vlog(lattutil_log_t *,
+    lattutil_log_level_t, const char *, va_list);
+static size_t _lattutil_log_sqlite_write(lattutil_log_sqlite_t *,
+    lattutil_log_sqlite_batch_t *, size_t, size_t);
+static void *_lattutil_log_sqlite_thread(void *);
+static void _lattutil_log_sqlite_timeout(struct timespec *, long);
+
+EXPORTED_SYM
+void
+lattutil_log_sqlite_default_opts(lattutil_log_sqlite_opts_t *opts)
+{
+
+	if (opts == NULL) {
+		return;
+	}
+
+	memset(opts, 0, sizeof(*opts));
+	opts->llso_table = LATTUTIL_LOG_SQLITE_TABLE;
+	opts->llso_batch = LATTUTIL_LOG_SQLITE_BATCH;
+	opts->llso_flush_ms = LATTUTIL_LOG_SQLITE_FLUSH_MS;
+	opts->llso_max_pending = LATTUTIL_LOG_SQLITE_MAX_PENDING;
+	opts->llso_policy = LATTUTIL_LOG_ASYNC_BLOCK;
+}
+
+EXPORTED_SYM
+bool
+lattutil_log_sqlite_init(lattutil_log_t *logp, const char *path,
+    const lattutil_log_sqlite_opts_t *opts)
+{
+	lattutil_log_sqlite_t *sq;
+	const char *p;
+
+	if (logp == NULL || path == NULL) {
+		return (false);
+	}
+
+	sq = calloc(1, sizeof(*sq));
+	if (sq == NULL) {
+		return (false);
+	}
+
+	if (opts != NULL) {
+		sq->ls_opts = *opts;
+	} else {
+		lattutil_log_sqlite_default_opts(&(sq->ls_opts));
+	}
+
+	switch (sq->ls_opts.llso_policy) {
+	case LATTUTIL_LOG_ASYNC_BLOCK:
+	case LATTUTIL_LOG_ASYNC_DROP_NEWEST:
+		break;
+	default:
+		free(sq);
+		return (false);
+	}
+
+	/* The table name is pasted into SQL, so only allow identifiers. */
+	p = sq->ls_opts.llso_table;
+	if (p == NULL || !(isalpha((unsigned char)*p) || *p == '_')) {
+		free(sq);
+		return (false);
+	}
+	for (; *p != '\0'; p++) {
+		if (!isalnum((unsigned char)*p) && *p != '_') {
+			free(sq);
+			return (false);
+		}
+	}
+
+	if (sq->ls_opts.llso_batch == 0) {
+		sq->ls_opts.llso_batch = LATTUTIL_LOG_SQLITE_BATCH;
+	}
+	if (sq->ls_opts.llso_max_pending < sq->ls_opts.llso_batch) {
+		sq->ls_opts.llso_max_pending = sq->ls_opts.llso_batch;
+	}
+
+	sq->ls_ctx = lattutil_sqlite_ctx_new(path, NULL, 0);
+	if (sq->ls_ctx == NULL) {
+		free(sq);
+		return (false);
+	}
+
+	if (!_lattutil_log_sqlite_prepare(sq, sq->ls_opts.llso_table)) {
+		sqlite3_finalize(sq->ls_insert);
+		sqlite3_finalize(sq->ls_begin);
+		sqlite3_finalize(sq->ls_commit);
+		lattutil_log_free(&(sq->ls_ctx->lsq_logger));
+		lattutil_sqlite_ctx_free(&(sq->ls_ctx));
+		free(sq);
+		return (false);
+	}
+
+	sq->ls_pending = &(sq->ls_batches[0]);
+
+	pthread_mutex_init(&(sq->ls_mtx), NULL);
+	pthread_cond_init(&(sq->ls_work_cv), NULL);
+	pthread_cond_init(&(sq->ls_space_cv), NULL);
+	pthread_cond_init(&(sq->ls_done_cv), NULL);
+
+	if (pthread_create(&(sq->ls_thread), NULL,
+	    _lattutil_log_sqlite_thread, sq)) {
+		pthread_cond_destroy(&(sq->ls_done_cv));
+		pthread_cond_destroy(&(sq->ls_space_cv));
+		pthread_cond_destroy(&(sq->ls_work_cv));
+		pthread_mutex_destroy(&(sq->ls_mtx));
+		sqlite3_finalize(sq->ls_insert);
+		sqlite3_finalize(sq->ls_begin);
+		sqlite3_finalize(sq->ls_commit);
+		lattutil_log_free(&(sq->ls_ctx->lsq_logger));
+		lattutil_sqlite_ctx_free(&(sq->ls_ctx));
+		free(sq);
+		return (false);
+	}
+
+	if (logp->ll_log_close != NULL) {
+		logp->ll_log_close(logp);
+	}
+
+	logp->ll_internalaux = sq;
+	logp->ll_internalauxsz = sizeof(*sq);
+
+	logp->ll_log_close = lattutil_log_sqlite_close;
+	logp->ll_log_debug = lattutil_log_sqlite_debug;
+	logp->ll_log_err = lattutil_log_sqlite_err;
+	logp->ll_log_info = lattutil_log_sqlite_info;
+	logp->ll_log_warn = lattutil_log_sqlite_warn;
+	logp->ll_log_emit = lattutil_log_sqlite_emit;
+
+	lattutil_log_apply_levels(logp);
+
+	return (true);
+}
+
+EXPORTED_SYM
+bool
+lattutil_log_sqlite_flush(lattutil_log_t *logp)
+{
+	lattutil_log_sqlite_t *sq;
+	uint64_t target;
+
+	if (logp == NULL || logp->ll_log_close != lattutil_log_sqlite_close) {
+		return (false);
+	}
+
+	sq = logp->ll_internalaux;
+
+	pthread_mutex_lock(&(sq->ls_mtx));
+	target = sq->ls_queued;
+	sq->ls_flush = true;
+	pthread_cond_signal(&(sq->ls_work_cv));
+	while (sq->ls_processed < target) {
+		pthread_cond_wait(&(sq->ls_done_cv), &(sq->ls_mtx));
+	}
+	pthread_mutex_unlock(&(sq->ls_mtx));
+
+	return (true);
+}
+
+EXPORTED_SYM
+bool
+lattutil_log_sqlite_stats(lattutil_log_t *logp,
+    lattutil_log_sqlite_stats_t *stats)
+{
+	lattutil_log_sqlite_t *sq;
+
+	if (logp == NULL || stats == NULL ||
+	    logp->ll_log_close != lattutil_log_sqlite_close) {
+		return (false);
+	}
+
+	sq = logp->ll_internalaux;
+
+	pthread_mutex_lock(&(sq->ls_mtx));
+	stats->llss_written = sq->ls_processed - sq->ls_errors;
+	stats->llss_dropped = sq->ls_dropped;
+	stats->llss_errors = sq->ls_errors;
+	pthread_mutex_unlock(&(sq->ls_mtx));
+
+	return (true);
+}
+
+ssize_t
+lattutil_log_sqlite_debug(lattutil_log_t *logp, int verbose,
+    const char *fmt, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_sqlite_vlog(logp,
+		    LATTUTIL_LOG_LEVEL_DEBUG, fmt, args);
+		va_end(args);
+	}
+
+	return (len);
+}
+
+ssize_t
+lattutil_log_sqlite_err(lattutil_log_t *logp, int verbose,
+    const char *fmt, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_sqlite_vlog(logp,
+		    LATTUTIL_LOG_LEVEL_ERR, fmt, args);
+		va_end(args);
+	}
+
+	return (len);
+}
+
+ssize_t
+lattutil_log_sqlite_info(lattutil_log_t *logp, int verbose,
+    const char *fmt, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_sqlite_vlog(logp,
+		    LATTUTIL_LOG_LEVEL_INFO, fmt, args);
+		va_end(args);
+	}
+
+	return (len);
+}
+
+ssize_t
+lattutil_log_sqlite_warn(lattutil_log_t *logp, int verbose,
+    const char *fmt, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_sqlite_vlog(logp,
+		    LATTUTIL_LOG_LEVEL_WARN, fmt, args);
+		va_end(args);
+	}
+
+	return (len);
+}
+
+ssize_t
+lattutil_log_sqlite_emit(lattutil_log_t *logp, lattutil_log_level_t level,
+    const char *msg, size_t len)
+{
+	lattutil_log_sqlite_t *sq;
+	struct timespec ts;
+	ssize_t res;
+
+	sq = logp->ll_internalaux;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	pthread_mutex_lock(&(sq->ls_mtx));
+	while (sq->ls_pending->lsb_nrecs >= sq->ls_opts.llso_max_pending &&
+	    !sq->ls_stop) {
+		if (sq->ls_opts.llso_policy == LATTUTIL_LOG_ASYNC_DROP_NEWEST) {
+			sq->ls_dropped++;
+			pthread_mutex_unlock(&(sq->ls_mtx));
+			return (0);
+		}
+		pthread_cond_signal(&(sq->ls_work_cv));
+		pthread_cond_wait(&(sq->ls_space_cv), &(sq->ls_mtx));
+	}
+
+	res = -1;
+	if (_lattutil_log_sqlite_append(sq->ls_pending,
+	    LATTUTIL_LOG_LEVEL_BASE(level),
+	    (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000, msg, len)) {
+		sq->ls_queued++;
+		res = len;
+		if (sq->ls_pending->lsb_nrecs == 1 ||
+		    sq->ls_pending->lsb_nrecs == sq->ls_opts.llso_batch) {
+			pthread_cond_signal(&(sq->ls_work_cv));
+		}
+	}
+	pthread_mutex_unlock(&(sq->ls_mtx));
+
+	return (res);
+}
+
+void
+lattutil_log_sqlite_close(lattutil_log_t *logp)
+{
+	lattutil_log_sqlite_t *sq;
+	size_t i;
+
+	sq = logp->ll_internalaux;
+	if (sq == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&(sq->ls_mtx));
+	sq->ls_stop = true;
+	pthread_cond_signal(&(sq->ls_work_cv));
+	pthread_cond_broadcast(&(sq->ls_space_cv));
+	pthread_mutex_unlock(&(sq->ls_mtx));
+
+	/* The writer thread commits everything queued before exiting. */
+	pthread_join(sq->ls_thread, NULL);
+
+	sqlite3_finalize(sq->ls_insert);
+	sqlite3_finalize(sq->ls_begin);
+	sqlite3_finalize(sq->ls_commit);
+
+	/* lattutil_sqlite_ctx_free() leaves the context's logger alone. */
+	lattutil_log_free(&(sq->ls_ctx->lsq_logger));
+	lattutil_sqlite_ctx_free(&(sq->ls_ctx));
+
+	for (i = 0; i < 2; i++) {
+		free(sq->ls_batches[i].lsb_recs);
+		free(sq->ls_batches[i].lsb_data);
+	}
+
+	pthread_cond_destroy(&(sq->ls_done_cv));
+	pthread_cond_destroy(&(sq->ls_space_cv));
+	pthread_cond_destroy(&(sq->ls_work_cv));
+	pthread_mutex_destroy(&(sq->ls_mtx));
+	memset(sq, 0, sizeof(*sq));
+	free(sq);
+
+	logp->ll_internalaux = NULL;
+	logp->ll_internalauxsz = 0;
+}
+
+/*
+ * Create the table and prepare the statements that the writer thread
+ * reuses for the life of the logger. WAL with synchronous=NORMAL
+ * makes a commit an append to the log instead of two fsyncs, and lets
+ * readers query the table while records are being written.
+ */
+static bool
+_lattutil_log_sqlite_prepare(lattutil_log_sqlite_t *sq, const char *table)
+{
+	sqlite3 *db;
+	char *sql;
+	int res;
+
+	db = sq->ls_ctx->lsq_sqlctx;
+
+	sqlite3_busy_timeout(db, LATTUTIL_LOG_SQLITE_BUSY_MS);
+
+	if (sqlite3_exec(db, "PRAGMA journal_mode=WAL", NULL, NULL,
+	    NULL) != SQLITE_OK ||
+	    sqlite3_exec(db, "PRAGMA synchronous=NORMAL", NULL, NULL,
+	    NULL) != SQLITE_OK) {
+		return (false);
+	}
+
+	if (asprintf(&sql, "CREATE TABLE IF NOT EXISTS %s ("
+	    "id INTEGER PRIMARY KEY, "
+	    "ts INTEGER NOT NULL, "
+	    "level TEXT NOT NULL, "
+	    "msg TEXT NOT NULL)", table) < 0) {
+		return (false);
+	}
+	res = sqlite3_exec(db, sql, NULL, NULL, NULL);
+	free(sql);
+	if (res != SQLITE_OK) {
+		return (false);
+	}
+
+	if (asprintf(&sql, "INSERT INTO %s (ts, level, msg) VALUES (?, ?, ?)",
+	    table) < 0) {
+		return (false);
+	}
+	res = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT,
+	    &(sq->ls_insert), NULL);
+	free(sql);
+	if (res != SQLITE_OK) {
+		return (false);
+	}
+
+	if (sqlite3_prepare_v3(db, "BEGIN", -1, SQLITE_PREPARE_PERSISTENT,
+	    &(sq->ls_begin), NULL) != SQLITE_OK ||
+	    sqlite3_prepare_v3(db, "COMMIT", -1, SQLITE_PREPARE_PERSISTENT,
+	    &(sq->ls_commit), NULL) != SQLITE_OK) {
+		return (false);
+	}
+
+	return (true);
+}
+
+static bool
+_lattutil_log_sqlite_append(lattutil_log_sqlite_batch_t *batch,
+    lattutil_log_level_t level, int64_t ts, const char *msg, size_t len)
+{
+	lattutil_log_sqlite_rec_t *recs, *rec;
+	size_t sz;
+	char *data;
+
+	if (batch->lsb_nrecs == batch->lsb_recsz) {
+		sz = batch->lsb_recsz ? batch->lsb_recsz * 2 : 256;
+		recs = reallocarray(batch->lsb_recs, sz, sizeof(*recs));
+		if (recs == NULL) {
+			return (false);
+		}
+		batch->lsb_recs = recs;
+		batch->lsb_recsz = sz;
+	}
+
+	if (len > batch->lsb_datasz - batch->lsb_len) {
+		sz = batch->lsb_datasz ? batch->lsb_datasz : 16384;
+		while (len > sz - batch->lsb_len) {
+			sz *= 2;
+		}
+		data = realloc(batch->lsb_data, sz);
+		if (data == NULL) {
+			return (false);
+		}
+		batch->lsb_data = data;
+		batch->lsb_datasz = sz;
+	}
+
+	rec = &(batch->lsb_recs[batch->lsb_nrecs++]);
+	rec->lsr_ts = ts;
+	rec->lsr_level = level;
+	rec->lsr_off = batch->lsb_len;
+	rec->lsr_len = len;
+	memcpy(batch->lsb_data + batch->lsb_len, msg, len);
+	batch->lsb_len += len;
+
+	return (true);
+}
+
+static ssize_t
+_lattutil_log_sqlite_vlog(lattutil_log_t *logp, lattutil_log_level_t level,
+    const char *fmt, va_list args)
+{
+	lattutil_log_buf_t buf;
+	ssize_t len;
+
+	if (!lattutil_log_buf_vformat(&buf, "", "", fmt, args)) {
+		return (-1);
+	}
+
+	len = lattutil_log_sqlite_emit(logp, level,
+	    buf.llb_buf + buf.llb_msgoff, buf.llb_msglen);
+
+	lattutil_log_buf_release(&buf);
+
+	return (len);
+}
+
+/*
+ * Insert records [start, end) of a batch in one transaction and
+ * return the number of records lost. The message text is bound
+ * without a copy; producers do not touch the batch until the writer
+ * hands it back.
+ */
+static size_t
+_lattutil_log_sqlite_write(lattutil_log_sqlite_t *sq,
+    lattutil_log_sqlite_batch_t *batch, size_t start, size_t end)
+{
+	lattutil_log_sqlite_rec_t *rec;
+	sqlite3_stmt *stmt;
+	size_t errors, i;
+
+	stmt = sq->ls_insert;
+
+	if (sqlite3_step(sq->ls_begin) != SQLITE_DONE) {
+		sqlite3_reset(sq->ls_begin);
+		return (end - start);
+	}
+	sqlite3_reset(sq->ls_begin);
+
+	errors = 0;
+	for (i = start; i < end; i++) {
+		rec = &(batch->lsb_recs[i]);
+		sqlite3_bind_int64(stmt, 1, rec->lsr_ts);
+		sqlite3_bind_text(stmt, 2, lattutil_log_level_tag(
+		    rec->lsr_level), -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 3, batch->lsb_data + rec->lsr_off,
+		    (int)rec->lsr_len, SQLITE_STATIC);
+		if (sqlite3_step(stmt) != SQLITE_DONE) {
+			errors++;
+		}
+		sqlite3_reset(stmt);
+	}
+	sqlite3_clear_bindings(stmt);
+
+	if (sqlite3_step(sq->ls_commit) != SQLITE_DONE) {
+		sqlite3_reset(sq->ls_commit);
+		sqlite3_exec(sq->ls_ctx->lsq_sqlctx, "ROLLBACK", NULL, NULL,
+		    NULL);
+		return (end - start);
+	}
+	sqlite3_reset(sq->ls_commit);
+
+	return (errors);
+}
+
+static void *
+_lattutil_log_sqlite_thread(void *arg)
+{
+	lattutil_log_sqlite_batch_t *batch;
+	lattutil_log_sqlite_t *sq;
+	struct timespec ts;
+	size_t i, n, errors;
+	bool stop;
+
+	sq = arg;
+
+	pthread_mutex_lock(&(sq->ls_mtx));
+	for (;;) {
+		while (sq->ls_pending->lsb_nrecs == 0 && !sq->ls_flush &&
+		    !sq->ls_stop) {
+			pthread_cond_wait(&(sq->ls_work_cv), &(sq->ls_mtx));
+		}
+
+		/* Give the batch up to llso_flush_ms to fill. */
+		if (sq->ls_pending->lsb_nrecs < sq->ls_opts.llso_batch &&
+		    !sq->ls_flush && !sq->ls_stop) {
+			_lattutil_log_sqlite_timeout(&ts,
+			    sq->ls_opts.llso_flush_ms);
+			pthread_cond_timedwait(&(sq->ls_work_cv),
+			    &(sq->ls_mtx), &ts);
+		}
+
+		batch = sq->ls_pending;
+		sq->ls_pending = (batch == &(sq->ls_batches[0])) ?
+		    &(sq->ls_batches[1]) : &(sq->ls_batches[0]);
+		sq->ls_flush = false;
+		stop = sq->ls_stop;
+		pthread_cond_broadcast(&(sq->ls_space_cv));
+		pthread_mutex_unlock(&(sq->ls_mtx));
+
+		errors = 0;
+		for (i = 0; i < batch->lsb_nrecs; i += n) {
+			n = batch->lsb_nrecs - i;
+			if (n > sq->ls_opts.llso_batch) {
+				n = sq->ls_opts.llso_batch;
+			}
+			errors += _lattutil_log_sqlite_write(sq, batch, i,
+			    i + n);
+		}
+
+		pthread_mutex_lock(&(sq->ls_mtx));
+		sq->ls_processed += batch->lsb_nrecs;
+		sq->ls_errors += errors;
+		batch->lsb_nrecs = 0;
+		batch->lsb_len = 0;
+		pthread_cond_broadcast(&(sq->ls_done_cv));
+
+		if (stop && sq->ls_pending->lsb_nrecs == 0) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&(sq->ls_mtx));
+
+	return (NULL);
+}
+
+static void
+_lattutil_log_sqlite_timeout(struct timespec *ts, long ms)
+{
+
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
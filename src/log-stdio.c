@@ -27,8 +27,15 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <errno.h>
+#include <sys/uio.h>
+
 #include "liblattutil.h"
 
+static int _lattutil_log_stdio_fd(lattutil_log_level_t);
+static ssize_t _lattutil_log_stdio_vlog(lattutil_log_t *,
+    lattutil_log_level_t, const char *, va_list);
+
 EXPORTED_SYM
 bool
 lattutil_log_stdio_init(lattutil_log_t *logp)
@@ -39,6 +46,9 @@ lattutil_log_stdio_init(lattutil_log_t *logp)
 	logp->ll_log_err = lattutil_log_stdio_err;
 	logp->ll_log_info = lattutil_log_stdio_info;
 	logp->ll_log_warn = lattutil_log_stdio_warn;
+	logp->ll_log_emit = lattutil_log_stdio_emit;
+
+	lattutil_log_apply_levels(logp);
 
 	return (true);
 }
@@ -48,24 +58,16 @@ lattutil_log_stdio_debug(lattutil_log_t *logp, int verbose,
     const char *fmt, ...)
 {
 	va_list args;
-	size_t len;
-	char *msg;
-
-	va_start(args, fmt);
-	if (verbose == -1  || verbose >= logp->ll_verbosity) {
-		msg = NULL;
-		vasprintf(&msg, fmt, args);
-		if (msg == NULL) {
-			len = -1;
-			goto end;
-		}
-		len = strlen(msg);
-		fprintf(stderr, "DEBUG: %s\n", msg);
-		free(msg);
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_stdio_vlog(logp,
+		    LATTUTIL_LOG_LEVEL_DEBUG, fmt, args);
+		va_end(args);
 	}
-	va_end(args);
 
-end:
 	return (len);
 }
 
@@ -74,24 +76,16 @@ lattutil_log_stdio_err(lattutil_log_t *logp, int verbose,
     const char *fmt, ...)
 {
 	va_list args;
-	size_t len;
-	char *msg;
-
-	va_start(args, fmt);
-	if (verbose == -1  || verbose >= logp->ll_verbosity) {
-		msg = NULL;
-		vasprintf(&msg, fmt, args);
-		if (msg == NULL) {
-			len = -1;
-			goto end;
-		}
-		len = strlen(msg);
-		fprintf(stderr, "ERROR: %s\n", msg);
-		free(msg);
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_stdio_vlog(logp,
+		    LATTUTIL_LOG_LEVEL_ERR, fmt, args);
+		va_end(args);
 	}
-	va_end(args);
 
-end:
 	return (len);
 }
 
@@ -100,24 +94,16 @@ lattutil_log_stdio_info(lattutil_log_t *logp, int verbose,
     const char *fmt, ...)
 {
 	va_list args;
-	size_t len;
-	char *msg;
-
-	va_start(args, fmt);
-	if (verbose == -1  || verbose >= logp->ll_verbosity) {
-		msg = NULL;
-		vasprintf(&msg, fmt, args);
-		if (msg == NULL) {
-			len = -1;
-			goto end;
-		}
-		len = strlen(msg);
-		fprintf(stdout, "INFO: %s\n", msg);
-		free(msg);
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_stdio_vlog(logp,
+		    LATTUTIL_LOG_LEVEL_INFO, fmt, args);
+		va_end(args);
 	}
-	va_end(args);
 
-end:
 	return (len);
 }
 
@@ -126,29 +112,84 @@ lattutil_log_stdio_warn(lattutil_log_t *logp, int verbose,
     const char *fmt, ...)
 {
 	va_list args;
-	size_t len;
-	char *msg;
-
-	va_start(args, fmt);
-	if (verbose == -1  || verbose >= logp->ll_verbosity) {
-		msg = NULL;
-		vasprintf(&msg, fmt, args);
-		if (msg == NULL) {
-			len = -1;
-			goto end;
-		}
-		len = strlen(msg);
-		fprintf(stderr, "WARNING: %s\n", msg);
-		free(msg);
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_stdio_vlog(logp,
+		    LATTUTIL_LOG_LEVEL_WARN, fmt, args);
+		va_end(args);
 	}
-	va_end(args);
 
-end:
 	return (len);
 }
 
+ssize_t
+lattutil_log_stdio_emit(lattutil_log_t *logp, lattutil_log_level_t level,
+    const char *msg, size_t len)
+{
+	char prefixbuf[LATTUTIL_LOG_PREFIX_MAX];
+	struct iovec iov[3];
+	const char *prefix;
+	ssize_t res;
+
+	prefix = lattutil_log_prefix(logp, level, prefixbuf,
+	    sizeof(prefixbuf));
+
+	iov[0].iov_base = (void *)prefix;
+	iov[0].iov_len = strlen(prefix);
+	iov[1].iov_base = (void *)msg;
+	iov[1].iov_len = len;
+	iov[2].iov_base = "\n";
+	iov[2].iov_len = 1;
+
+	do {
+		res = writev(_lattutil_log_stdio_fd(level), iov, 3);
+	} while (res < 0 && errno == EINTR);
+
+	return (res < 0 ? -1 : (ssize_t)len);
+}
+
 void
 lattutil_log_stdio_close(lattutil_log_t *logp)
 {
 
 }
+
+/*
+ * Informational messages go to stdout, everything else to stderr.
+ * Messages are written straight to the descriptor, bypassing any
+ * data buffered in the stdio streams.
+ */
+static int
+_lattutil_log_stdio_fd(lattutil_log_level_t level)
+{
+
+	return (LATTUTIL_LOG_LEVEL_BASE(level) == LATTUTIL_LOG_LEVEL_INFO ?
+	    STDOUT_FILENO : STDERR_FILENO);
+}
+
+static ssize_t
+_lattutil_log_stdio_vlog(lattutil_log_t *logp, lattutil_log_level_t level,
+    const char *fmt, va_list args)
+{
+	char prefixbuf[LATTUTIL_LOG_PREFIX_MAX];
+	lattutil_log_buf_t buf;
+	ssize_t len;
+
+	if (!lattutil_log_buf_vformat(&buf, lattutil_log_prefix(logp, level,
+	    prefixbuf, sizeof(prefixbuf)), "\n", fmt, args)) {
+		return (-1);
+	}
+
+	len = buf.llb_msglen;
+	if (lattutil_log_write_all(_lattutil_log_stdio_fd(level), buf.llb_buf,
+	    buf.llb_len) < 0) {
+		len = -1;
+	}
+
+	lattutil_log_buf_release(&buf);
+
+	return (len);
+}
@@ -0,0 +1,645 @@
+/*-
+ * Copyright (c) 2021 Shawn Webb <shawn.webb@hardenedbsd.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define	_GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "liblattutil.h"
+
+#ifndef _PATH_LOG
+#define	_PATH_LOG	"/dev/log"
+#endif
+
+#define	LATTUTIL_SYSLOG_DIRECT_BATCH	32
+#define	LATTUTIL_SYSLOG_DIRECT_FRAMESZ	2048
+#define	LATTUTIL_SYSLOG_DIRECT_APPNAME	48	/* RFC 5424 APP-NAME */
+
+#if defined(__linux__) || defined(__FreeBSD__)
+#define	HAVE_SENDMMSG
+#endif
+
+/*
+ * Each caller formats its frame on its own stack, without a lock, and
+ * only takes lsd_mtx to copy it into a preallocated ring of
+ * LATTUTIL_SYSLOG_DIRECT_BATCH slots. Whichever caller then finds
+ * nobody sending becomes the sender: it drops the lock around each
+ * sendmmsg(2) over the non-blocking datagram socket and keeps going
+ * until the ring is empty, so frames queued by other threads in the
+ * meantime go out together in its next call. An idle logger sends
+ * each frame right away.
+ *
+ * When the socket pushes back with EAGAIN or ENOBUFS, frames stay
+ * queued for the next call. When the ring is full, the oldest frame
+ * is dropped and counted, or the new one if the oldest is being sent.
+ * The caller never blocks on syslogd.
+ */
+typedef struct _lattutil_syslog_direct_frame {
+	size_t	 lsdf_len;
+	char	 lsdf_buf[LATTUTIL_SYSLOG_DIRECT_FRAMESZ];
+} lattutil_syslog_direct_frame_t;
+
+typedef struct _lattutil_syslog_direct_stamp {
+	time_t		 lsds_sec;
+	uint64_t	 lsds_owner;
+	char		 lsds_str[64];
+} lattutil_syslog_direct_stamp_t;
+
+typedef struct _lattutil_syslog_direct {
+	uint64_t			 lsd_id;
+	int				 lsd_fd;
+	struct sockaddr_un		 lsd_addr;
+	int				 lsd_facility;
+	int				 lsd_format;
+	char				*lsd_tag;
+	char				 lsd_host[256];
+	pid_t				 lsd_pid;
+	size_t				 lsd_head;
+	size_t				 lsd_count;
+	size_t				 lsd_inflight;
+	bool				 lsd_sending;
+	uint64_t			 lsd_dropped;
+	pthread_mutex_t			 lsd_mtx;
+	lattutil_syslog_direct_frame_t	 lsd_frames[
+	    LATTUTIL_SYSLOG_DIRECT_BATCH];
+} lattutil_syslog_direct_t;
+
+static _Atomic(uint64_t) _lattutil_log_syslog_direct_ids;
+static __thread lattutil_syslog_direct_stamp_t
+    _lattutil_log_syslog_direct_stamp = {
+	.lsds_sec = -1,
+};
+
+static bool _lattutil_log_syslog_direct_connect(lattutil_syslog_direct_t *);
+static int _lattutil_log_syslog_direct_priority(lattutil_syslog_direct_t *,
+    lattutil_log_level_t);
+static lattutil_syslog_direct_frame_t *_lattutil_log_syslog_direct_slot(
+    lattutil_syslog_direct_t *);
+static size_t _lattutil_log_syslog_direct_header(lattutil_syslog_direct_t *,
+    lattutil_log_level_t, char *, size_t);
+static void _lattutil_log_syslog_direct_queue(lattutil_syslog_direct_t *,
+    const char *, size_t, const char *, size_t);
+static void _lattutil_log_syslog_direct_send(lattutil_syslog_direct_t *);
+static ssize_t _lattutil_log_syslog_direct_vlog(lattutil_log_t *,
+    lattutil_log_level_t, const char *, va_list);
+
+EXPORTED_SYM
+bool
+lattutil_log_syslog_direct_init(lattutil_log_t *logp, const char *sockpath,
+    int facility, int format)
+{
+	lattutil_syslog_direct_t *lsd;
+	const char *name;
+
+	if (logp == NULL) {
+		return (false);
+	}
+
+	if (format != LATTUTIL_SYSLOG_RFC3164 &&
+	    format != LATTUTIL_SYSLOG_RFC5424) {
+		return (false);
+	}
+
+	if (sockpath == NULL) {
+		sockpath = _PATH_LOG;
+	}
+
+	lsd = calloc(1, sizeof(*lsd));
+	if (lsd == NULL) {
+		return (false);
+	}
+
+	lsd->lsd_addr.sun_family = AF_UNIX;
+	if (strlcpy(lsd->lsd_addr.sun_path, sockpath,
+	    sizeof(lsd->lsd_addr.sun_path)) >=
+	    sizeof(lsd->lsd_addr.sun_path)) {
+		free(lsd);
+		return (false);
+	}
+
+	name = logp->ll_path;
+	if (name == NULL) {
+		name = getprogname();
+		if (name == NULL) {
+			name = LATTUTIL_LOG_DEFAULT_NAME;
+		}
+	}
+
+	if (format == LATTUTIL_SYSLOG_RFC5424) {
+		lsd->lsd_tag = strndup(name, LATTUTIL_SYSLOG_DIRECT_APPNAME);
+	} else {
+		lsd->lsd_tag = strdup(name);
+	}
+	if (lsd->lsd_tag == NULL) {
+		free(lsd);
+		return (false);
+	}
+
+	if (gethostname(lsd->lsd_host, sizeof(lsd->lsd_host)) ||
+	    lsd->lsd_host[0] == '\0') {
+		strlcpy(lsd->lsd_host, "-", sizeof(lsd->lsd_host));
+	}
+	lsd->lsd_host[sizeof(lsd->lsd_host) - 1] = '\0';
+
+	lsd->lsd_facility = facility;
+	lsd->lsd_format = format;
+	lsd->lsd_pid = getpid();
+	lsd->lsd_id = atomic_fetch_add(&_lattutil_log_syslog_direct_ids, 1);
+	lsd->lsd_fd = -1;
+
+	if (!_lattutil_log_syslog_direct_connect(lsd)) {
+		free(lsd->lsd_tag);
+		free(lsd);
+		return (false);
+	}
+
+	pthread_mutex_init(&(lsd->lsd_mtx), NULL);
+
+	if (logp->ll_log_close != NULL) {
+		logp->ll_log_close(logp);
+	}
+
+	logp->ll_internalaux = lsd;
+	logp->ll_internalauxsz = sizeof(*lsd);
+
+	logp->ll_log_close = lattutil_log_syslog_direct_close;
+	logp->ll_log_debug = lattutil_log_syslog_direct_debug;
+	logp->ll_log_err = lattutil_log_syslog_direct_err;
+	logp->ll_log_info = lattutil_log_syslog_direct_info;
+	logp->ll_log_warn = lattutil_log_syslog_direct_warn;
+	logp->ll_log_emit = lattutil_log_syslog_direct_emit;
+
+	lattutil_log_apply_levels(logp);
+
+	return (true);
+}
+
+EXPORTED_SYM
+uint64_t
+lattutil_log_syslog_direct_dropped(lattutil_log_t *logp)
+{
+	lattutil_syslog_direct_t *lsd;
+	uint64_t dropped;
+
+	if (logp == NULL ||
+	    logp->ll_log_close != lattutil_log_syslog_direct_close) {
+		return (0);
+	}
+
+	lsd = logp->ll_internalaux;
+
+	pthread_mutex_lock(&(lsd->lsd_mtx));
+	dropped = lsd->lsd_dropped;
+	pthread_mutex_unlock(&(lsd->lsd_mtx));
+
+	return (dropped);
+}
+
+ssize_t
+lattutil_log_syslog_direct_debug(lattutil_log_t *logp, int verbose,
+    const char *fmt, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_syslog_direct_vlog(logp,
+		    LATTUTIL_LOG_LEVEL_DEBUG, fmt, args);
+		va_end(args);
+	}
+
+	return (len);
+}
+
+ssize_t
+lattutil_log_syslog_direct_err(lattutil_log_t *logp, int verbose,
+    const char *fmt, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_syslog_direct_vlog(logp,
+		    LATTUTIL_LOG_LEVEL_ERR, fmt, args);
+		va_end(args);
+	}
+
+	return (len);
+}
+
+ssize_t
+lattutil_log_syslog_direct_info(lattutil_log_t *logp, int verbose,
+    const char *fmt, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_syslog_direct_vlog(logp,
+		    LATTUTIL_LOG_LEVEL_INFO, fmt, args);
+		va_end(args);
+	}
+
+	return (len);
+}
+
+ssize_t
+lattutil_log_syslog_direct_warn(lattutil_log_t *logp, int verbose,
+    const char *fmt, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_syslog_direct_vlog(logp,
+		    LATTUTIL_LOG_LEVEL_WARN, fmt, args);
+		va_end(args);
+	}
+
+	return (len);
+}
+
+ssize_t
+lattutil_log_syslog_direct_emit(lattutil_log_t *logp,
+    lattutil_log_level_t level, const char *msg, size_t len)
+{
+	char hdr[LATTUTIL_SYSLOG_DIRECT_FRAMESZ];
+	lattutil_syslog_direct_t *lsd;
+	size_t hdrlen;
+
+	lsd = logp->ll_internalaux;
+
+	hdrlen = _lattutil_log_syslog_direct_header(lsd, level, hdr,
+	    sizeof(hdr));
+	_lattutil_log_syslog_direct_queue(lsd, hdr, hdrlen, msg, len);
+
+	return (len);
+}
+
+void
+lattutil_log_syslog_direct_close(lattutil_log_t *logp)
+{
+	lattutil_syslog_direct_t *lsd;
+
+	lsd = logp->ll_internalaux;
+	if (lsd == NULL) {
+		return;
+	}
+
+	/* One last attempt at getting queued frames out. */
+	pthread_mutex_lock(&(lsd->lsd_mtx));
+	_lattutil_log_syslog_direct_send(lsd);
+	pthread_mutex_unlock(&(lsd->lsd_mtx));
+
+	if (lsd->lsd_fd >= 0) {
+		close(lsd->lsd_fd);
+	}
+
+	pthread_mutex_destroy(&(lsd->lsd_mtx));
+	free(lsd->lsd_tag);
+	memset(lsd, 0, sizeof(*lsd));
+	free(lsd);
+
+	logp->ll_internalaux = NULL;
+	logp->ll_internalauxsz = 0;
+}
+
+static bool
+_lattutil_log_syslog_direct_connect(lattutil_syslog_direct_t *lsd)
+{
+	int fd, flags;
+
+	if (lsd->lsd_fd >= 0) {
+		close(lsd->lsd_fd);
+		lsd->lsd_fd = -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		return (false);
+	}
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0 ||
+	    fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+		close(fd);
+		return (false);
+	}
+
+	if (connect(fd, (struct sockaddr *)&(lsd->lsd_addr),
+	    sizeof(lsd->lsd_addr))) {
+		close(fd);
+		return (false);
+	}
+
+	lsd->lsd_fd = fd;
+
+	return (true);
+}
+
+static int
+_lattutil_log_syslog_direct_priority(lattutil_syslog_direct_t *lsd,
+    lattutil_log_level_t level)
+{
+	int severity;
+
+	switch (LATTUTIL_LOG_LEVEL_BASE(level)) {
+	case LATTUTIL_LOG_LEVEL_DEBUG:
+		severity = LOG_DEBUG;
+		break;
+	case LATTUTIL_LOG_LEVEL_ERR:
+		severity = LOG_ERR;
+		break;
+	case LATTUTIL_LOG_LEVEL_WARN:
+		severity = LOG_WARNING;
+		break;
+	default:
+		severity = LOG_INFO;
+		break;
+	}
+
+	return (lsd->lsd_facility | severity);
+}
+
+/*
+ * Get the slot for a new frame, dropping the oldest queued frame if
+ * the ring is full. Frames being sent must stay put, so if the oldest
+ * is one of them, the new frame is dropped instead and NULL returned.
+ * Called with lsd_mtx held.
+ */
+static lattutil_syslog_direct_frame_t *
+_lattutil_log_syslog_direct_slot(lattutil_syslog_direct_t *lsd)
+{
+	size_t idx;
+
+	if (lsd->lsd_count == LATTUTIL_SYSLOG_DIRECT_BATCH) {
+		if (lsd->lsd_inflight > 0) {
+			lsd->lsd_dropped++;
+			return (NULL);
+		}
+		lsd->lsd_head = (lsd->lsd_head + 1) %
+		    LATTUTIL_SYSLOG_DIRECT_BATCH;
+		lsd->lsd_count--;
+		lsd->lsd_dropped++;
+	}
+
+	idx = (lsd->lsd_head + lsd->lsd_count) % LATTUTIL_SYSLOG_DIRECT_BATCH;
+	lsd->lsd_count++;
+
+	return (&(lsd->lsd_frames[idx]));
+}
+
+/*
+ * Render the frame header, including the level prefix the libc
+ * syslog backend uses, into buf. The timestamp is kept in a
+ * per-thread cache and only re-rendered when the second changes or
+ * the thread switches loggers, so no lock is needed.
+ */
+static size_t
+_lattutil_log_syslog_direct_header(lattutil_syslog_direct_t *lsd,
+    lattutil_log_level_t level, char *buf, size_t bufsz)
+{
+	lattutil_syslog_direct_stamp_t *stamp;
+	struct timespec ts;
+	struct tm tm;
+	size_t len;
+	long off;
+	int res;
+
+	stamp = &_lattutil_log_syslog_direct_stamp;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	if (ts.tv_sec != stamp->lsds_sec ||
+	    lsd->lsd_id != stamp->lsds_owner) {
+		localtime_r(&(ts.tv_sec), &tm);
+		if (lsd->lsd_format == LATTUTIL_SYSLOG_RFC5424) {
+			/* RFC 5424 wants the offset as +hh:mm, not %z. */
+			len = strftime(stamp->lsds_str,
+			    sizeof(stamp->lsds_str), "%Y-%m-%dT%H:%M:%S",
+			    &tm);
+			off = tm.tm_gmtoff / 60;
+			snprintf(stamp->lsds_str + len,
+			    sizeof(stamp->lsds_str) - len, "%c%02ld:%02ld",
+			    off < 0 ? '-' : '+', labs(off) / 60,
+			    labs(off) % 60);
+		} else {
+			strftime(stamp->lsds_str, sizeof(stamp->lsds_str),
+			    "%b %e %H:%M:%S", &tm);
+		}
+		stamp->lsds_sec = ts.tv_sec;
+		stamp->lsds_owner = lsd->lsd_id;
+	}
+
+	if (lsd->lsd_format == LATTUTIL_SYSLOG_RFC5424) {
+		res = snprintf(buf, bufsz, "<%d>1 %s %s %s %d - - %s",
+		    _lattutil_log_syslog_direct_priority(lsd, level),
+		    stamp->lsds_str, lsd->lsd_host, lsd->lsd_tag,
+		    (int)lsd->lsd_pid, lattutil_log_level_prefix(level));
+	} else {
+		res = snprintf(buf, bufsz, "<%d>%s %s[%d]: %s",
+		    _lattutil_log_syslog_direct_priority(lsd, level),
+		    stamp->lsds_str, lsd->lsd_tag, (int)lsd->lsd_pid,
+		    lattutil_log_level_prefix(level));
+	}
+
+	if (res < 0) {
+		return (0);
+	}
+
+	return ((size_t)res >= bufsz ? bufsz - 1 : (size_t)res);
+}
+
+/*
+ * Copy a frame, made of a header and a message, into the ring and
+ * send what is queued unless another thread is already doing so.
+ */
+static void
+_lattutil_log_syslog_direct_queue(lattutil_syslog_direct_t *lsd,
+    const char *hdr, size_t hdrlen, const char *msg, size_t msglen)
+{
+	lattutil_syslog_direct_frame_t *frame;
+
+	pthread_mutex_lock(&(lsd->lsd_mtx));
+	frame = _lattutil_log_syslog_direct_slot(lsd);
+	if (frame != NULL) {
+		if (msglen > sizeof(frame->lsdf_buf) - hdrlen) {
+			msglen = sizeof(frame->lsdf_buf) - hdrlen;
+		}
+		memcpy(frame->lsdf_buf, hdr, hdrlen);
+		if (msglen > 0) {
+			memcpy(frame->lsdf_buf + hdrlen, msg, msglen);
+		}
+		frame->lsdf_len = hdrlen + msglen;
+	}
+	_lattutil_log_syslog_direct_send(lsd);
+	pthread_mutex_unlock(&(lsd->lsd_mtx));
+}
+
+/*
+ * Send as many queued frames as the socket will take without
+ * blocking. Only one thread sends at a time; the lock is dropped
+ * around each system call, and frames queued meanwhile go out in the
+ * next one. Called with lsd_mtx held.
+ */
+static void
+_lattutil_log_syslog_direct_send(lattutil_syslog_direct_t *lsd)
+{
+	lattutil_syslog_direct_frame_t *frame;
+	struct iovec iov[LATTUTIL_SYSLOG_DIRECT_BATCH];
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr msgs[LATTUTIL_SYSLOG_DIRECT_BATCH];
+#endif
+	bool reconnected;
+	size_t i, n;
+	int error, res;
+
+	if (lsd->lsd_sending) {
+		return;
+	}
+	lsd->lsd_sending = true;
+
+	reconnected = false;
+	while (lsd->lsd_count > 0) {
+		n = 0;
+		for (i = 0; i < lsd->lsd_count; i++) {
+			frame = &(lsd->lsd_frames[(lsd->lsd_head + i) %
+			    LATTUTIL_SYSLOG_DIRECT_BATCH]);
+			iov[n].iov_base = frame->lsdf_buf;
+			iov[n].iov_len = frame->lsdf_len;
+			n++;
+		}
+		lsd->lsd_inflight = n;
+		pthread_mutex_unlock(&(lsd->lsd_mtx));
+
+#ifdef HAVE_SENDMMSG
+		memset(msgs, 0, sizeof(msgs[0]) * n);
+		for (i = 0; i < n; i++) {
+			msgs[i].msg_hdr.msg_iov = &(iov[i]);
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		res = sendmmsg(lsd->lsd_fd, msgs, n, MSG_DONTWAIT);
+#else
+		res = 0;
+		for (i = 0; i < n; i++) {
+			if (send(lsd->lsd_fd, iov[i].iov_base, iov[i].iov_len,
+			    MSG_DONTWAIT) < 0) {
+				if (i == 0) {
+					res = -1;
+				}
+				break;
+			}
+			res++;
+		}
+#endif
+		error = errno;
+
+		pthread_mutex_lock(&(lsd->lsd_mtx));
+		lsd->lsd_inflight = 0;
+		if (res > 0) {
+			lsd->lsd_head = (lsd->lsd_head + res) %
+			    LATTUTIL_SYSLOG_DIRECT_BATCH;
+			lsd->lsd_count -= res;
+			continue;
+		}
+
+		switch (error) {
+		case EINTR:
+			continue;
+		case EAGAIN:
+		case ENOBUFS:
+			/* Keep the frames queued for the next call. */
+			lsd->lsd_sending = false;
+			return;
+		case ECONNREFUSED:
+		case ENOTCONN:
+		case ENOENT:
+			/* syslogd may have been restarted. */
+			if (!reconnected) {
+				reconnected = true;
+				if (_lattutil_log_syslog_direct_connect(lsd)) {
+					continue;
+				}
+			}
+			/* FALLTHROUGH */
+		default:
+			/* Drop the frame the socket refuses. */
+			lsd->lsd_head = (lsd->lsd_head + 1) %
+			    LATTUTIL_SYSLOG_DIRECT_BATCH;
+			lsd->lsd_count--;
+			lsd->lsd_dropped++;
+			break;
+		}
+	}
+
+	lsd->lsd_sending = false;
+}
+
+static ssize_t
+_lattutil_log_syslog_direct_vlog(lattutil_log_t *logp,
+    lattutil_log_level_t level, const char *fmt, va_list args)
+{
+	char buf[LATTUTIL_SYSLOG_DIRECT_FRAMESZ];
+	lattutil_syslog_direct_t *lsd;
+	size_t hdrlen, len;
+	int res;
+
+	lsd = logp->ll_internalaux;
+
+	/* Format on the stack, so that callers only share the copy. */
+	hdrlen = _lattutil_log_syslog_direct_header(lsd, level, buf,
+	    sizeof(buf));
+	res = lattutil_log_vsnprintf(buf + hdrlen, sizeof(buf) - hdrlen, fmt,
+	    args);
+	if (res < 0) {
+		res = 0;
+	}
+	len = hdrlen + res;
+	if (len >= sizeof(buf)) {
+		len = sizeof(buf) - 1;
+	}
+	_lattutil_log_syslog_direct_queue(lsd, buf, len, NULL, 0);
+
+	return (res);
+}
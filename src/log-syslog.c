@@ -31,6 +31,10 @@
 
 #include "liblattutil.h"
 
+static int _lattutil_log_syslog_priority(lattutil_log_level_t);
+static ssize_t _lattutil_log_syslog_vlog(lattutil_log_t *,
+    lattutil_log_level_t, const char *, va_list);
+
 EXPORTED_SYM
 bool
 lattutil_log_syslog_init(lattutil_log_t *logp, int logopt, int facility)
@@ -42,6 +46,9 @@ lattutil_log_syslog_init(lattutil_log_t *logp, int logopt, int facility)
 	logp->ll_log_err = lattutil_log_syslog_err;
 	logp->ll_log_info = lattutil_log_syslog_info;
 	logp->ll_log_warn = lattutil_log_syslog_warn;
+	logp->ll_log_emit = lattutil_log_syslog_emit;
+
+	lattutil_log_apply_levels(logp);
 
 	name = logp->ll_path;
 	if (name == NULL) {
@@ -61,24 +68,16 @@ lattutil_log_syslog_debug(lattutil_log_t *logp, int verbose,
     const char *fmt, ...)
 {
 	va_list args;
-	size_t len;
-	char *msg;
-
-	va_start(args, fmt);
-	if (verbose == -1  || verbose >= logp->ll_verbosity) {
-		msg = NULL;
-		vasprintf(&msg, fmt, args);
-		if (msg == NULL) {
-			len = -1;
-			goto end;
-		}
-		len = strlen(msg);
-		syslog(LOG_DEBUG, "DEBUG: %s", msg);
-		free(msg);
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_syslog_vlog(logp,
+		    LATTUTIL_LOG_LEVEL_DEBUG, fmt, args);
+		va_end(args);
 	}
-	va_end(args);
 
-end:
 	return (len);
 }
 
@@ -87,24 +86,16 @@ lattutil_log_syslog_err(lattutil_log_t *logp, int verbose,
     const char *fmt, ...)
 {
 	va_list args;
-	size_t len;
-	char *msg;
-
-	va_start(args, fmt);
-	if (verbose == -1  || verbose >= logp->ll_verbosity) {
-		msg = NULL;
-		vasprintf(&msg, fmt, args);
-		if (msg == NULL) {
-			len = -1;
-			goto end;
-		}
-		len = strlen(msg);
-		syslog(LOG_ERR, "ERROR: %s", msg);
-		free(msg);
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_syslog_vlog(logp,
+		    LATTUTIL_LOG_LEVEL_ERR, fmt, args);
+		va_end(args);
 	}
-	va_end(args);
 
-end:
 	return (len);
 }
 
@@ -113,24 +104,16 @@ lattutil_log_syslog_info(lattutil_log_t *logp, int verbose,
     const char *fmt, ...)
 {
 	va_list args;
-	size_t len;
-	char *msg;
-
-	va_start(args, fmt);
-	if (verbose == -1  || verbose >= logp->ll_verbosity) {
-		msg = NULL;
-		vasprintf(&msg, fmt, args);
-		if (msg == NULL) {
-			len = -1;
-			goto end;
-		}
-		len = strlen(msg);
-		syslog(LOG_INFO, "INFO: %s", msg);
-		free(msg);
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_syslog_vlog(logp,
+		    LATTUTIL_LOG_LEVEL_INFO, fmt, args);
+		va_end(args);
 	}
-	va_end(args);
 
-end:
 	return (len);
 }
 
@@ -139,24 +122,33 @@ lattutil_log_syslog_warn(lattutil_log_t *logp, int verbose,
     const char *fmt, ...)
 {
 	va_list args;
-	size_t len;
-	char *msg;
-
-	va_start(args, fmt);
-	if (verbose == -1  || verbose >= logp->ll_verbosity) {
-		msg = NULL;
-		vasprintf(&msg, fmt, args);
-		if (msg == NULL) {
-			len = -1;
-			goto end;
-		}
-		len = strlen(msg);
-		syslog(LOG_WARNING, "WARNING: %s", msg);
-		free(msg);
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_syslog_vlog(logp,
+		    LATTUTIL_LOG_LEVEL_WARN, fmt, args);
+		va_end(args);
 	}
-	va_end(args);
 
-end:
+	return (len);
+}
+
+ssize_t
+lattutil_log_syslog_emit(lattutil_log_t *logp, lattutil_log_level_t level,
+    const char *msg, size_t len)
+{
+
+	if (level & LATTUTIL_LOG_LEVEL_RAW) {
+		syslog(_lattutil_log_syslog_priority(level), "%.*s",
+		    (int)len, msg);
+		return (len);
+	}
+
+	syslog(_lattutil_log_syslog_priority(level), "%s: %.*s",
+	    lattutil_log_level_tag(level), (int)len, msg);
+
 	return (len);
 }
 
@@ -166,3 +158,39 @@ lattutil_log_syslog_close(lattutil_log_t *logp)
 
 	closelog();
 }
+
+static int
+_lattutil_log_syslog_priority(lattutil_log_level_t level)
+{
+
+	switch (LATTUTIL_LOG_LEVEL_BASE(level)) {
+	case LATTUTIL_LOG_LEVEL_DEBUG:
+		return (LOG_DEBUG);
+	case LATTUTIL_LOG_LEVEL_ERR:
+		return (LOG_ERR);
+	case LATTUTIL_LOG_LEVEL_WARN:
+		return (LOG_WARNING);
+	default:
+		return (LOG_INFO);
+	}
+}
+
+static ssize_t
+_lattutil_log_syslog_vlog(lattutil_log_t *logp, lattutil_log_level_t level,
+    const char *fmt, va_list args)
+{
+	lattutil_log_buf_t buf;
+	ssize_t len;
+
+	if (!lattutil_log_buf_vformat(&buf, lattutil_log_level_prefix(level),
+	    NULL, fmt, args)) {
+		return (-1);
+	}
+
+	len = buf.llb_msglen;
+	syslog(_lattutil_log_syslog_priority(level), "%s", buf.llb_buf);
+
+	lattutil_log_buf_release(&buf);
+
+	return (len);
+}
@@ -0,0 +1,262 @@
+/*-
+ * Copyright (c) 2021 Shawn Webb <shawn.webb@hardenedbsd.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "liblattutil.h"
+
+#define	LATTUTIL_LOG_TEE_MAXSINKS	8
+
+/*
+ * Each sink keeps its own verbosity threshold and level mask. The tee
+ * advertises the lowest threshold and the union of the masks, so the
+ * usual verbosity check and the per-level handler swap reject a
+ * message before formatting when no sink would take it.
+ */
+typedef struct _lattutil_log_tee {
+	size_t		 lt_nsinks;
+	lattutil_log_t	*lt_sinks[LATTUTIL_LOG_TEE_MAXSINKS];
+} lattutil_log_tee_t;
+
+static ssize_t _lattutil_log_tee_write(lattutil_log_tee_t *,
+    lattutil_log_level_t, int, const char *, size_t);
+static ssize_t _lattutil_log_tee_vlog(lattutil_log_t *,
+    lattutil_log_level_t, int, const char *, va_list);
+
+EXPORTED_SYM
+bool
+lattutil_log_tee_init(lattutil_log_t *logp)
+{
+	lattutil_log_tee_t *lt;
+
+	if (logp == NULL) {
+		return (false);
+	}
+
+	lt = calloc(1, sizeof(*lt));
+	if (lt == NULL) {
+		return (false);
+	}
+
+	if (logp->ll_log_close != NULL) {
+		logp->ll_log_close(logp);
+	}
+
+	logp->ll_internalaux = lt;
+	logp->ll_internalauxsz = sizeof(*lt);
+
+	logp->ll_log_close = lattutil_log_tee_close;
+	logp->ll_log_debug = lattutil_log_tee_debug;
+	logp->ll_log_err = lattutil_log_tee_err;
+	logp->ll_log_info = lattutil_log_tee_info;
+	logp->ll_log_warn = lattutil_log_tee_warn;
+	logp->ll_log_emit = lattutil_log_tee_emit;
+
+	/* Nothing wants any level until a sink is added. */
+	logp->ll_verbosity = INT_MAX;
+	logp->ll_levels = 0;
+	lattutil_log_apply_levels(logp);
+
+	return (true);
+}
+
+EXPORTED_SYM
+bool
+lattutil_log_tee_add(lattutil_log_t *logp, lattutil_log_t *sink)
+{
+	lattutil_log_tee_t *lt;
+
+	if (logp == NULL || sink == NULL || logp == sink ||
+	    logp->ll_log_close != lattutil_log_tee_close ||
+	    sink->ll_log_emit == NULL) {
+		return (false);
+	}
+
+	lt = logp->ll_internalaux;
+	if (lt->lt_nsinks == LATTUTIL_LOG_TEE_MAXSINKS) {
+		return (false);
+	}
+
+	lt->lt_sinks[lt->lt_nsinks++] = sink;
+
+	if (sink->ll_verbosity < logp->ll_verbosity) {
+		logp->ll_verbosity = sink->ll_verbosity;
+	}
+	logp->ll_levels |= sink->ll_levels;
+	lattutil_log_apply_levels(logp);
+
+	return (true);
+}
+
+ssize_t
+lattutil_log_tee_debug(lattutil_log_t *logp, int verbose,
+    const char *fmt, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_tee_vlog(logp,
+		    LATTUTIL_LOG_LEVEL_DEBUG, verbose, fmt, args);
+		va_end(args);
+	}
+
+	return (len);
+}
+
+ssize_t
+lattutil_log_tee_err(lattutil_log_t *logp, int verbose,
+    const char *fmt, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_tee_vlog(logp,
+		    LATTUTIL_LOG_LEVEL_ERR, verbose, fmt, args);
+		va_end(args);
+	}
+
+	return (len);
+}
+
+ssize_t
+lattutil_log_tee_info(lattutil_log_t *logp, int verbose,
+    const char *fmt, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_tee_vlog(logp,
+		    LATTUTIL_LOG_LEVEL_INFO, verbose, fmt, args);
+		va_end(args);
+	}
+
+	return (len);
+}
+
+ssize_t
+lattutil_log_tee_warn(lattutil_log_t *logp, int verbose,
+    const char *fmt, ...)
+{
+	va_list args;
+	ssize_t len;
+
+	len = 0;
+	if (verbose == -1  || verbose >= LATTUTIL_LOG_VERBOSITY(logp)) {
+		va_start(args, fmt);
+		len = _lattutil_log_tee_vlog(logp,
+		    LATTUTIL_LOG_LEVEL_WARN, verbose, fmt, args);
+		va_end(args);
+	}
+
+	return (len);
+}
+
+/*
+ * Preformatted messages carry no verbosity, so they go to every sink
+ * that accepts the level.
+ */
+ssize_t
+lattutil_log_tee_emit(lattutil_log_t *logp, lattutil_log_level_t level,
+    const char *msg, size_t len)
+{
+
+	return (_lattutil_log_tee_write(logp->ll_internalaux, level, -1, msg,
+	    len));
+}
+
+void
+lattutil_log_tee_close(lattutil_log_t *logp)
+{
+	lattutil_log_tee_t *lt;
+	size_t i;
+
+	lt = logp->ll_internalaux;
+	if (lt == NULL) {
+		return;
+	}
+
+	for (i = 0; i < lt->lt_nsinks; i++) {
+		lattutil_log_free(&(lt->lt_sinks[i]));
+	}
+
+	memset(lt, 0, sizeof(*lt));
+	free(lt);
+
+	logp->ll_internalaux = NULL;
+	logp->ll_internalauxsz = 0;
+}
+
+static ssize_t
+_lattutil_log_tee_write(lattutil_log_tee_t *lt, lattutil_log_level_t level,
+    int verbose, const char *msg, size_t len)
+{
+	lattutil_log_t *sink;
+	ssize_t res, written;
+	size_t i;
+
+	res = 0;
+	for (i = 0; i < lt->lt_nsinks; i++) {
+		sink = lt->lt_sinks[i];
+		if (!LATTUTIL_LOG_WANTED(sink, level, verbose)) {
+			continue;
+		}
+		written = sink->ll_log_emit(sink, level, msg, len);
+		if (written < 0) {
+			res = written;
+		} else if (res >= 0 && written > res) {
+			res = written;
+		}
+	}
+
+	return (res);
+}
+
+static ssize_t
+_lattutil_log_tee_vlog(lattutil_log_t *logp, lattutil_log_level_t level,
+    int verbose, const char *fmt, va_list args)
+{
+	lattutil_log_buf_t buf;
+	ssize_t len;
+
+	if (!lattutil_log_buf_vformat(&buf, NULL, NULL, fmt, args)) {
+		return (-1);
+	}
+
+	len = _lattutil_log_tee_write(logp->ll_internalaux, level, verbose,
+	    buf.llb_buf, buf.llb_len);
+	lattutil_log_buf_release(&buf);
+
+	return (len);
+}
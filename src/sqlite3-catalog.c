@@ -0,0 +1,477 @@
+/*-
+ * Copyright (c) 2021 Shawn Webb <shawn.webb@hardenedbsd.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "liblattutil.h"
+
+/*
+ * A catalog holds every statement a service runs, prepared once with
+ * SQLITE_PREPARE_PERSISTENT and kept sorted by name. Executing a
+ * statement binds and steps the prepared statement and resets it, so
+ * no SQL is compiled after startup.
+ */
+
+typedef struct _lattutil_sqlite_stmt {
+	char				*lss_name;
+	const char			*lss_sql;
+	lattutil_sqlite_query_t		*lss_query;
+	lattutil_sqlite_param_type_t	*lss_params;
+	size_t				 lss_nparams;
+	int64_t				 lss_columns;
+} lattutil_sqlite_stmt_t;
+
+struct _lattutil_sqlite_catalog {
+	lattutil_sqlite_ctx_t	*lsc_ctx;
+	lattutil_sqlite_stmt_t	*lsc_stmts;
+	size_t			 lsc_nstmts;
+	uint64_t		 lsc_prepare_ns;
+};
+
+static bool _lattutil_sqlite_catalog_parse(lattutil_sqlite_catalog_t *,
+    const ucl_object_t *);
+static bool _lattutil_sqlite_catalog_params(lattutil_sqlite_stmt_t *,
+    const ucl_object_t *);
+static bool _lattutil_sqlite_catalog_prepare(lattutil_sqlite_catalog_t *,
+    lattutil_sqlite_stmt_t *);
+static bool _lattutil_sqlite_catalog_bind(lattutil_sqlite_stmt_t *,
+    va_list);
+static int _lattutil_sqlite_catalog_cmp(const void *, const void *);
+
+EXPORTED_SYM
+lattutil_sqlite_catalog_t *
+lattutil_sqlite_catalog_new(lattutil_sqlite_ctx_t *ctx,
+    const ucl_object_t *section)
+{
+	struct timespec start, end;
+	lattutil_sqlite_catalog_t *cat;
+	lattutil_log_t *logger;
+	bool ok;
+	size_t i;
+
+	if (ctx == NULL || section == NULL ||
+	    ucl_object_type(section) != UCL_OBJECT) {
+		return (NULL);
+	}
+
+	cat = calloc(1, sizeof(*cat));
+	if (cat == NULL) {
+		return (NULL);
+	}
+	cat->lsc_ctx = ctx;
+	logger = ctx->lsq_logger;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	ok = _lattutil_sqlite_catalog_parse(cat, section);
+	if (ok) {
+		qsort(cat->lsc_stmts, cat->lsc_nstmts,
+		    sizeof(*(cat->lsc_stmts)), _lattutil_sqlite_catalog_cmp);
+
+		/* Check every statement, so one run reports all drift. */
+		for (i = 0; i < cat->lsc_nstmts; i++) {
+			if (!_lattutil_sqlite_catalog_prepare(cat,
+			    &(cat->lsc_stmts[i]))) {
+				ok = false;
+			}
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	cat->lsc_prepare_ns = (uint64_t)(end.tv_sec - start.tv_sec) *
+	    1000000000 + end.tv_nsec - start.tv_nsec;
+
+	if (!ok) {
+		logger->ll_log_err(logger, -1,
+		    "Unable to prepare SQL statement catalog");
+		lattutil_sqlite_catalog_free(&cat);
+		return (NULL);
+	}
+
+	logger->ll_log_info(logger, -1,
+	    "Prepared %zu SQL statements in %ju us", cat->lsc_nstmts,
+	    (uintmax_t)(cat->lsc_prepare_ns / 1000));
+
+	return (cat);
+}
+
+EXPORTED_SYM
+void
+lattutil_sqlite_catalog_free(lattutil_sqlite_catalog_t **catp)
+{
+	lattutil_sqlite_catalog_t *cat;
+	size_t i;
+
+	if (catp == NULL || *catp == NULL) {
+		return;
+	}
+
+	cat = *catp;
+	for (i = 0; i < cat->lsc_nstmts; i++) {
+		lattutil_sqlite_query_free(&(cat->lsc_stmts[i].lss_query));
+		free(cat->lsc_stmts[i].lss_name);
+		free(cat->lsc_stmts[i].lss_params);
+	}
+	free(cat->lsc_stmts);
+
+	memset(cat, 0, sizeof(*cat));
+	free(cat);
+	*catp = NULL;
+}
+
+EXPORTED_SYM
+size_t
+lattutil_sqlite_catalog_count(const lattutil_sqlite_catalog_t *cat)
+{
+
+	if (cat == NULL) {
+		return (0);
+	}
+
+	return (cat->lsc_nstmts);
+}
+
+EXPORTED_SYM
+ssize_t
+lattutil_sqlite_catalog_id(const lattutil_sqlite_catalog_t *cat,
+    const char *name)
+{
+	lattutil_sqlite_stmt_t key;
+	lattutil_sqlite_stmt_t *stmt;
+
+	if (cat == NULL || name == NULL) {
+		return (-1);
+	}
+
+	key.lss_name = (char *)name;
+	stmt = bsearch(&key, cat->lsc_stmts, cat->lsc_nstmts,
+	    sizeof(*(cat->lsc_stmts)), _lattutil_sqlite_catalog_cmp);
+	if (stmt == NULL) {
+		return (-1);
+	}
+
+	return (stmt - cat->lsc_stmts);
+}
+
+EXPORTED_SYM
+lattutil_sqlite_query_t *
+lattutil_sqlite_catalog_query(const lattutil_sqlite_catalog_t *cat,
+    size_t id)
+{
+
+	if (cat == NULL || id >= cat->lsc_nstmts) {
+		return (NULL);
+	}
+
+	return (cat->lsc_stmts[id].lss_query);
+}
+
+EXPORTED_SYM
+bool
+lattutil_sqlite_catalog_exec(lattutil_sqlite_catalog_t *cat, size_t id,
+    ...)
+{
+	lattutil_sqlite_stmt_t *stmt;
+	va_list args;
+	bool res;
+
+	if (cat == NULL || id >= cat->lsc_nstmts) {
+		return (false);
+	}
+
+	stmt = &(cat->lsc_stmts[id]);
+
+	va_start(args, id);
+	res = _lattutil_sqlite_catalog_bind(stmt, args);
+	va_end(args);
+
+	if (!res) {
+		sqlite3_clear_bindings(stmt->lss_query->lsq_stmt);
+		return (false);
+	}
+
+	return (lattutil_sqlite_exec(stmt->lss_query));
+}
+
+EXPORTED_SYM
+uint64_t
+lattutil_sqlite_catalog_prepare_time(const lattutil_sqlite_catalog_t *cat)
+{
+
+	if (cat == NULL) {
+		return (0);
+	}
+
+	return (cat->lsc_prepare_ns);
+}
+
+/*
+ * Collect the declarations. The SQL text is borrowed from the
+ * section, which only needs to live until the statements are
+ * prepared.
+ */
+static bool
+_lattutil_sqlite_catalog_parse(lattutil_sqlite_catalog_t *cat,
+    const ucl_object_t *section)
+{
+	const ucl_object_t *cur, *obj;
+	lattutil_sqlite_stmt_t *stmt;
+	lattutil_log_t *logger;
+	ucl_object_iter_t it;
+	size_t n;
+	bool ok;
+
+	logger = cat->lsc_ctx->lsq_logger;
+
+	n = ucl_object_type(section) == UCL_OBJECT ? section->len : 0;
+	if (n == 0) {
+		return (true);
+	}
+
+	cat->lsc_stmts = calloc(n, sizeof(*(cat->lsc_stmts)));
+	if (cat->lsc_stmts == NULL) {
+		return (false);
+	}
+
+	ok = true;
+	it = NULL;
+	while ((cur = ucl_iterate_object(section, &it, true)) != NULL &&
+	    cat->lsc_nstmts < n) {
+		stmt = &(cat->lsc_stmts[cat->lsc_nstmts++]);
+		stmt->lss_columns = -1;
+		stmt->lss_name = strdup(ucl_object_key(cur));
+		if (stmt->lss_name == NULL) {
+			return (false);
+		}
+
+		/*
+		 * A name declared twice parses as an implicit array, and
+		 * only its first declaration would be used.
+		 */
+		if (cur->next != NULL) {
+			logger->ll_log_err(logger, -1,
+			    "SQL statement %s: declared more than once",
+			    stmt->lss_name);
+			ok = false;
+			continue;
+		}
+
+		obj = ucl_object_lookup(cur, "sql");
+		if (ucl_object_type(cur) != UCL_OBJECT ||
+		    ucl_object_type(obj) != UCL_STRING) {
+			logger->ll_log_err(logger, -1,
+			    "SQL statement %s: no sql string", stmt->lss_name);
+			ok = false;
+			continue;
+		}
+		stmt->lss_sql = ucl_object_tostring(obj);
+
+		if (!_lattutil_sqlite_catalog_params(stmt,
+		    ucl_object_lookup(cur, "params"))) {
+			logger->ll_log_err(logger, -1,
+			    "SQL statement %s: invalid params",
+			    stmt->lss_name);
+			ok = false;
+			continue;
+		}
+
+		obj = ucl_object_lookup(cur, "columns");
+		if (obj != NULL && (!ucl_object_toint_safe(obj,
+		    &(stmt->lss_columns)) || stmt->lss_columns < 0)) {
+			logger->ll_log_err(logger, -1,
+			    "SQL statement %s: invalid columns",
+			    stmt->lss_name);
+			ok = false;
+		}
+	}
+
+	return (ok);
+}
+
+static bool
+_lattutil_sqlite_catalog_params(lattutil_sqlite_stmt_t *stmt,
+    const ucl_object_t *params)
+{
+	const ucl_object_t *cur;
+	ucl_object_iter_t it;
+	const char *type;
+	size_t n;
+
+	if (params == NULL) {
+		return (true);
+	}
+	if (ucl_object_type(params) != UCL_ARRAY) {
+		return (false);
+	}
+
+	n = ucl_array_size(params);
+	if (n == 0) {
+		return (true);
+	}
+
+	stmt->lss_params = calloc(n, sizeof(*(stmt->lss_params)));
+	if (stmt->lss_params == NULL) {
+		return (false);
+	}
+
+	it = NULL;
+	while ((cur = ucl_iterate_object(params, &it, true)) != NULL &&
+	    stmt->lss_nparams < n) {
+		type = ucl_object_tostring(cur);
+		if (ucl_object_type(cur) != UCL_STRING) {
+			return (false);
+		} else if (!strcmp(type, "int")) {
+			stmt->lss_params[stmt->lss_nparams] =
+			    LATTUTIL_SQL_PARAM_INT;
+		} else if (!strcmp(type, "string")) {
+			stmt->lss_params[stmt->lss_nparams] =
+			    LATTUTIL_SQL_PARAM_STRING;
+		} else if (!strcmp(type, "blob")) {
+			stmt->lss_params[stmt->lss_nparams] =
+			    LATTUTIL_SQL_PARAM_BLOB;
+		} else if (!strcmp(type, "time")) {
+			stmt->lss_params[stmt->lss_nparams] =
+			    LATTUTIL_SQL_PARAM_TIME;
+		} else {
+			return (false);
+		}
+		stmt->lss_nparams++;
+	}
+
+	return (true);
+}
+
+static bool
+_lattutil_sqlite_catalog_prepare(lattutil_sqlite_catalog_t *cat,
+    lattutil_sqlite_stmt_t *stmt)
+{
+	lattutil_log_t *logger;
+	const char *tail;
+	sqlite3 *db;
+	int n;
+
+	logger = cat->lsc_ctx->lsq_logger;
+	db = cat->lsc_ctx->lsq_sqlctx;
+
+	tail = NULL;
+	stmt->lss_query = lattutil_sqlite_prepare_flags(cat->lsc_ctx,
+	    stmt->lss_sql, SQLITE_PREPARE_PERSISTENT, &tail);
+	if (stmt->lss_query == NULL) {
+		logger->ll_log_err(logger, -1, "SQL statement %s: %s",
+		    stmt->lss_name, sqlite3_errmsg(db));
+		return (false);
+	}
+	stmt->lss_query->lsq_flags |= LATTUTIL_SQL_QUERY_FLAG_REUSE;
+
+	while (tail != NULL && isspace((unsigned char)*tail)) {
+		tail++;
+	}
+	if (tail != NULL && *tail != '\0') {
+		logger->ll_log_err(logger, -1,
+		    "SQL statement %s: more than one statement",
+		    stmt->lss_name);
+		return (false);
+	}
+
+	n = sqlite3_bind_parameter_count(stmt->lss_query->lsq_stmt);
+	if ((size_t)n != stmt->lss_nparams) {
+		logger->ll_log_err(logger, -1,
+		    "SQL statement %s: takes %d parameters, %zu declared",
+		    stmt->lss_name, n, stmt->lss_nparams);
+		return (false);
+	}
+
+	n = sqlite3_column_count(stmt->lss_query->lsq_stmt);
+	if (stmt->lss_columns >= 0 && n != stmt->lss_columns) {
+		logger->ll_log_err(logger, -1,
+		    "SQL statement %s: returns %d columns, %jd declared",
+		    stmt->lss_name, n, (intmax_t)stmt->lss_columns);
+		return (false);
+	}
+
+	return (true);
+}
+
+static bool
+_lattutil_sqlite_catalog_bind(lattutil_sqlite_stmt_t *stmt, va_list args)
+{
+	lattutil_sqlite_query_t *query;
+	void *blob;
+	size_t i;
+	int paramno;
+
+	query = stmt->lss_query;
+	for (i = 0; i < stmt->lss_nparams; i++) {
+		paramno = (int)i + 1;
+		switch (stmt->lss_params[i]) {
+		case LATTUTIL_SQL_PARAM_INT:
+			if (!lattutil_sqlite_bind_int(query, paramno,
+			    va_arg(args, int64_t))) {
+				return (false);
+			}
+			break;
+		case LATTUTIL_SQL_PARAM_STRING:
+			if (!lattutil_sqlite_bind_string(query, paramno,
+			    va_arg(args, const char *))) {
+				return (false);
+			}
+			break;
+		case LATTUTIL_SQL_PARAM_BLOB:
+			blob = va_arg(args, void *);
+			if (!lattutil_sqlite_bind_blob(query, paramno, blob,
+			    va_arg(args, size_t))) {
+				return (false);
+			}
+			break;
+		case LATTUTIL_SQL_PARAM_TIME:
+			if (!lattutil_sqlite_bind_time(query, paramno,
+			    va_arg(args, time_t))) {
+				return (false);
+			}
+			break;
+		default:
+			return (false);
+		}
+	}
+
+	return (true);
+}
+
+static int
+_lattutil_sqlite_catalog_cmp(const void *a, const void *b)
+{
+	const lattutil_sqlite_stmt_t *sa, *sb;
+
+	sa = a;
+	sb = b;
+
+	return (strcmp(sa->lss_name, sb->lss_name));
+}
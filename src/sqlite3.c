@@ -207,13 +207,21 @@ lattutil_sqlite_get_version(lattutil_sqlite_ctx_t *ctx)
 EXPORTED_SYM
 lattutil_sqlite_query_t *
 lattutil_sqlite_prepare(lattutil_sqlite_ctx_t *ctx, const char *query_string)
+{
+
+	return (lattutil_sqlite_prepare_flags(ctx, query_string, 0, NULL));
+}
+
+/*
+ * Prepare a query with sqlite3_prepare_v3 flags. If tail is not NULL,
+ * it is pointed at whatever of the query string follows the first
+ * statement.
+ */
+lattutil_sqlite_query_t *
+lattutil_sqlite_prepare_flags(lattutil_sqlite_ctx_t *ctx,
+    const char *query_string, unsigned int prepflags, const char **tail)
 {
 	lattutil_sqlite_query_t *query;
-	bool bool_arg, sqlquery;
-	char *str_arg;
-	int int_arg;
-	va_list args;
-	size_t i;
 	int res;
 
 	if (ctx == NULL || query_string == NULL) {
@@ -240,9 +248,11 @@ lattutil_sqlite_prepare(lattutil_sqlite_ctx_t *ctx, const char *query_string)
 		return (NULL);
 	}
 
-	res = sqlite3_prepare(ctx->lsq_sqlctx, query_string, -1,
-	    &(query->lsq_stmt), NULL);
+	res = sqlite3_prepare_v3(ctx->lsq_sqlctx, query_string, -1,
+	    prepflags, &(query->lsq_stmt), tail);
 	if (res != SQLITE_OK || query->lsq_stmt == NULL) {
+		ucl_object_unref(query->lsq_result.lsr_rows);
+		free(query->lsq_querystr);
 		free(query);
 		return (NULL);
 	}
@@ -278,6 +288,13 @@ lattutil_sqlite_query_free(lattutil_sqlite_query_t **query)
 	queryp = *query;
 	free(queryp->lsq_querystr);
 
+	if (queryp->lsq_stmt != NULL) {
+		sqlite3_finalize(queryp->lsq_stmt);
+	}
+	if (queryp->lsq_result.lsr_rows != NULL) {
+		ucl_object_unref(queryp->lsq_result.lsr_rows);
+	}
+
 	if (queryp->lsq_result.lsr_column_names != NULL) {
 		for (i = 0; i < queryp->lsq_result.lsr_ncolumns; i++) {
 			free(queryp->lsq_result.lsr_column_names[i]);
@@ -365,6 +382,7 @@ bool
 lattutil_sqlite_exec(lattutil_sqlite_query_t *query)
 {
 	lattutil_log_t *logger;
+	ucl_object_t *rows;
 	bool ret;
 	int res;
 
@@ -374,6 +392,16 @@ lattutil_sqlite_exec(lattutil_sqlite_query_t *query)
 
 	logger = QUERY_GETLOGGER(query);
 
+	/* A reused query starts from an empty result. */
+	if (query->lsq_executed) {
+		rows = ucl_object_typed_new(UCL_ARRAY);
+		if (rows == NULL) {
+			return (false);
+		}
+		ucl_object_unref(query->lsq_result.lsr_rows);
+		query->lsq_result.lsr_rows = rows;
+	}
+
 	_lattutil_sqlite_log_query(query);
 
 	ret = true;
@@ -400,8 +428,14 @@ lattutil_sqlite_exec(lattutil_sqlite_query_t *query)
 	}
 
 end:
-	sqlite3_finalize(query->lsq_stmt);
-	query->lsq_stmt = NULL;
+	if (query->lsq_flags & LATTUTIL_SQL_QUERY_FLAG_REUSE) {
+		sqlite3_reset(query->lsq_stmt);
+		sqlite3_clear_bindings(query->lsq_stmt);
+	} else {
+		sqlite3_finalize(query->lsq_stmt);
+		query->lsq_stmt = NULL;
+	}
+	query->lsq_executed = true;
 
 	return (ret);
 }